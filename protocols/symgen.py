@@ -290,6 +290,21 @@ def load_msg_data(func_name, func, for_export):
     gap_ends.append(0)
     gap_codes = [str(g * 4 + e) for g, e in zip(gaps, gap_ends)]
 
+    # Precompute the size of messages without strings or arrays, and the
+    # position of a lone new_id that only fixed size arguments precede, so
+    # that the parser need not walk the gap codes for them
+    fixed_words = 0
+    new_id_pos = -1
+    for arg_name, arg_type, arg_interface in w_args:
+        if arg_type == "fd":
+            continue
+        if arg_type in ("string", "array"):
+            fixed_words = -1
+            break
+        if arg_type == "new_id" and len(new_objs) == 1:
+            new_id_pos = fixed_words
+        fixed_words += 1
+
     is_destructor = "type" in func.attrib and func.attrib["type"] == "destructor"
     is_request = item.tag == "request"
     short_name = func.attrib["name"]
@@ -303,6 +318,8 @@ def load_msg_data(func_name, func, for_export):
         is_destructor,
         num_fd_args,
         for_export,
+        fixed_words,
+        new_id_pos,
     )
 
 
@@ -332,6 +349,8 @@ def write_interface(
             is_destructor,
             num_fd_args,
             for_export,
+            fixed_words,
+            new_id_pos,
         ) = x
         msg_names.append(short_name)
 
@@ -349,6 +368,8 @@ def write_interface(
         mda.append(("call_" + func_name) if for_export else "NULL")
         mda.append(str(num_fd_args))
         mda.append("true" if is_destructor else "false")
+        mda.append(str(fixed_words))
+        mda.append(str(new_id_pos))
 
         W("\t{" + ", ".join(mda) + "},")
 
@@ -23,6 +23,12 @@ struct msg_data {
 	const int16_t n_fds;
 	/* Whether message destroys the object */
 	bool is_destructor;
+	/* If the message has no strings or arrays, the number of 4-byte
+	 * blocks in its payload; otherwise -1 */
+	const int16_t fixed_words;
+	/* If the message creates exactly one object, whose id is at a fixed
+	 * position in the payload, the index of the id; otherwise -1 */
+	const int16_t new_id_pos;
 };
 struct wp_interface {
 	/* msgs[0..nreq-1] are reqs; msgs[nreq..nreq+nevt-1] are evts */
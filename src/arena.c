@@ -0,0 +1,247 @@
+/*
+ * Copyright © 2019 Manuel Stoeckl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Blocks larger than a chunk get a chunk of their own, which can later be
+ * reused for smaller blocks */
+#define ARENA_CHUNK_SIZE ((size_t)1 << 20)
+#define ARENA_ALIGN 16
+/* How many empty chunks to keep around for reuse */
+#define ARENA_MAX_SPARE 4
+
+struct arena_chunk {
+	struct transfer_arena *arena;
+	struct arena_chunk *next;
+	/** Counts the live blocks, plus one while the chunk is being filled */
+	atomic_int refs;
+	/** Capacity, the space used, and the offset of the last block */
+	size_t size, used, last;
+	/* followed by the block data */
+};
+
+/* Each block is preceded by a pointer to its chunk, padded for alignment */
+#define BLOCK_HEADER_SIZE ARENA_ALIGN
+#define CHUNK_HEADER_SIZE alignz(sizeof(struct arena_chunk), ARENA_ALIGN)
+
+static char *chunk_data(struct arena_chunk *chunk)
+{
+	return (char *)chunk + CHUNK_HEADER_SIZE;
+}
+
+static void unref_arena(struct transfer_arena *arena)
+{
+	if (atomic_fetch_sub(&arena->refs, 1) == 1) {
+		free(arena);
+	}
+}
+
+static void free_chunk(struct arena_chunk *chunk)
+{
+	struct transfer_arena *arena = chunk->arena;
+	free(chunk);
+	unref_arena(arena);
+}
+
+/* Free every chunk on the returned list, after the owner has gone */
+static void drain_returned(struct transfer_arena *arena)
+{
+	struct arena_chunk *c = atomic_exchange(&arena->returned, NULL);
+	while (c) {
+		struct arena_chunk *next = c->next;
+		free_chunk(c);
+		c = next;
+	}
+}
+
+/* Called when the last reference to the chunk is gone */
+static void return_chunk(struct arena_chunk *chunk)
+{
+	struct transfer_arena *arena = chunk->arena;
+	/* The owner may release the arena while the chunk is pushed, so the
+	 * reference keeps the arena alive until it is checked */
+	atomic_fetch_add(&arena->refs, 1);
+	struct arena_chunk *head = atomic_load(&arena->returned);
+	do {
+		chunk->next = head;
+	} while (!atomic_compare_exchange_weak(
+			&arena->returned, &head, chunk));
+	if (atomic_load(&arena->orphaned)) {
+		drain_returned(arena);
+	}
+	unref_arena(arena);
+}
+
+struct transfer_arena *create_transfer_arena(void)
+{
+	struct transfer_arena *arena = calloc(1, sizeof(*arena));
+	if (!arena) {
+		return NULL;
+	}
+	atomic_init(&arena->returned, NULL);
+	atomic_init(&arena->orphaned, false);
+	atomic_init(&arena->refs, 1);
+	return arena;
+}
+
+void release_transfer_arena(struct transfer_arena *arena)
+{
+	if (!arena) {
+		return;
+	}
+	struct arena_chunk *cur = arena->current;
+	arena->current = NULL;
+	if (cur && atomic_fetch_sub(&cur->refs, 1) == 1) {
+		free_chunk(cur);
+	}
+	while (arena->spare) {
+		struct arena_chunk *next = arena->spare->next;
+		free_chunk(arena->spare);
+		arena->spare = next;
+	}
+	arena->nspare = 0;
+	/* Chunks returned after this point are freed by whoever returns
+	 * them */
+	atomic_store(&arena->orphaned, true);
+	drain_returned(arena);
+	unref_arena(arena);
+}
+
+/* Move the chunks whose blocks have been freed onto the spare list, freeing
+ * the ones beyond the limit */
+static void collect_returned(struct transfer_arena *arena)
+{
+	struct arena_chunk *c = atomic_exchange(&arena->returned, NULL);
+	while (c) {
+		struct arena_chunk *next = c->next;
+		if (arena->nspare < ARENA_MAX_SPARE) {
+			c->next = arena->spare;
+			arena->spare = c;
+			arena->nspare++;
+		} else {
+			free_chunk(c);
+		}
+		c = next;
+	}
+}
+
+/* Find or make a chunk with room for `size` bytes, and make it current */
+static struct arena_chunk *next_chunk(
+		struct transfer_arena *arena, size_t size)
+{
+	struct arena_chunk *cur = arena->current;
+	arena->current = NULL;
+	if (cur && atomic_fetch_sub(&cur->refs, 1) == 1) {
+		/* Every block was already freed */
+		cur->used = 0;
+		atomic_store(&cur->refs, 1);
+		if (cur->size >= size) {
+			arena->current = cur;
+			return cur;
+		}
+		cur->next = arena->spare;
+		arena->spare = cur;
+		arena->nspare++;
+	}
+	collect_returned(arena);
+
+	struct arena_chunk **best = NULL;
+	for (struct arena_chunk **c = &arena->spare; *c; c = &(*c)->next) {
+		if ((*c)->size >= size &&
+				(!best || (*c)->size < (*best)->size)) {
+			best = c;
+		}
+	}
+	struct arena_chunk *chunk;
+	if (best) {
+		chunk = *best;
+		*best = chunk->next;
+		arena->nspare--;
+	} else {
+		size_t csize = size > ARENA_CHUNK_SIZE ? size
+						       : ARENA_CHUNK_SIZE;
+		chunk = malloc(CHUNK_HEADER_SIZE + csize);
+		if (!chunk) {
+			return NULL;
+		}
+		chunk->arena = arena;
+		chunk->size = csize;
+		atomic_fetch_add(&arena->refs, 1);
+		arena->chunks_made++;
+	}
+	chunk->next = NULL;
+	chunk->used = 0;
+	atomic_init(&chunk->refs, 1);
+	arena->current = chunk;
+	return chunk;
+}
+
+void *arena_alloc(struct transfer_arena *arena, size_t size)
+{
+	size_t space = BLOCK_HEADER_SIZE + alignz(size, ARENA_ALIGN);
+	struct arena_chunk *chunk = arena->current;
+	if (!chunk || chunk->size - chunk->used < space) {
+		chunk = next_chunk(arena, space);
+		if (!chunk) {
+			return NULL;
+		}
+	}
+	char *block = chunk_data(chunk) + chunk->used;
+	chunk->last = chunk->used;
+	chunk->used += space;
+	atomic_fetch_add(&chunk->refs, 1);
+	memcpy(block, &chunk, sizeof(chunk));
+	return block + BLOCK_HEADER_SIZE;
+}
+
+void arena_shrink(struct transfer_arena *arena, void *block, size_t size)
+{
+	struct arena_chunk *chunk = arena->current;
+	if (!chunk || (char *)block != chunk_data(chunk) + chunk->last +
+						      BLOCK_HEADER_SIZE) {
+		return;
+	}
+	size_t end = chunk->last + BLOCK_HEADER_SIZE +
+		     alignz(size, ARENA_ALIGN);
+	if (end < chunk->used) {
+		chunk->used = end;
+	}
+}
+
+void arena_free(void *block)
+{
+	if (!block) {
+		return;
+	}
+	struct arena_chunk *chunk;
+	memcpy(&chunk, (char *)block - BLOCK_HEADER_SIZE, sizeof(chunk));
+	if (atomic_fetch_sub(&chunk->refs, 1) == 1) {
+		return_chunk(chunk);
+	}
+}
@@ -23,10 +23,12 @@
  * SOFTWARE.
  */
 
+#include "main.h"
 #include "shadow.h"
 #include "util.h"
 
 #include <fcntl.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -175,7 +177,8 @@ static int64_t timespec_sub(struct timespec a, struct timespec b)
 static struct bench_result run_sub_bench(bool first,
 		const struct compression_range *rng, int level,
 		float bandwidth_mBps, int n_worker_threads, unsigned int seed,
-		bool text_like, size_t test_size, void *image)
+		bool text_like, size_t test_size, void *image,
+		bool stream_diffs)
 {
 	/* Reset seed, so that all random image
 	 * perturbations are consistent between runs */
@@ -184,6 +187,7 @@ static struct bench_result run_sub_bench(bool first,
 	/* Setup a shadow structure */
 	struct thread_pool pool;
 	setup_thread_pool(&pool, rng->mode, level, n_worker_threads);
+	pool.stream_diffs = stream_diffs;
 	if (first) {
 		printf("Running compression level benchmarks, assuming bandwidth=%g MB/s, with %d threads\n",
 				bandwidth_mBps, pool.nthreads);
@@ -224,7 +228,6 @@ static struct bench_result run_sub_bench(bool first,
 		/* Create transfer queue */
 		struct transfer_queue transfer_data;
 		memset(&transfer_data, 0, sizeof(struct transfer_queue));
-		pthread_mutex_init(&transfer_data.async_recv_queue.lock, NULL);
 
 		struct timespec t0, t1;
 		clock_gettime(CLOCK_REALTIME, &t0);
@@ -247,10 +250,7 @@ static struct bench_result run_sub_bench(bool first,
 			bool has_task = request_work_task(&pool, &task, &done);
 			if (has_task) {
 				run_task(&task, &pool.threads[0]);
-
-				pthread_mutex_lock(&pool.work_mutex);
-				pool.tasks_in_progress--;
-				pthread_mutex_unlock(&pool.work_mutex);
+				finish_work_task(&pool);
 			}
 
 			struct timespec cur_time;
@@ -279,10 +279,9 @@ static struct bench_result run_sub_bench(bool first,
 				}
 			} else {
 				/* Very short delay, for poll loop */
-				bool tasks_remaining = false;
-				pthread_mutex_lock(&pool.work_mutex);
-				tasks_remaining = pool.stack_count > 0;
-				pthread_mutex_unlock(&pool.work_mutex);
+				bool tasks_remaining =
+						atomic_load(&pool.tasks_queued) >
+						0;
 
 				struct timespec delay_time;
 				delay_time.tv_sec = 0;
@@ -352,8 +351,160 @@ static struct bench_result run_sub_bench(bool first,
 	return res;
 }
 
+/* Measure the cost of shadow structure lookups, as the number of live
+ * shadow structures grows */
+static void run_lookup_bench(void)
+{
+	struct thread_pool pool;
+	setup_thread_pool(&pool, COMP_NONE, 0, 1);
+	struct fd_translation_map map;
+	setup_translation_map(&map, true);
+
+	/* With rendering disabled, DMABUF creation messages produce shadow
+	 * structures without any local file descriptors, so that many can be
+	 * made cheaply */
+	struct render_data render;
+	memset(&render, 0, sizeof(render));
+	render.disabled = true;
+	render.drm_fd = 1;
+	render.av_disabled = true;
+
+	struct {
+		struct wmsg_open_dmabuf header;
+		struct dmabuf_slice_data info;
+	} open_msg;
+	memset(&open_msg, 0, sizeof(open_msg));
+	open_msg.header.size_and_type =
+			transfer_header(sizeof(open_msg), WMSG_OPEN_DMABUF);
+	open_msg.info.width = 1;
+	open_msg.info.height = 1;
+	open_msg.info.strides[0] = 4;
+	open_msg.info.num_planes = 1;
+	struct bytebuf msg = {.size = sizeof(open_msg),
+			.data = (char *)&open_msg};
+
+	const int nlookups = 1 << 20;
+	int nshadows = 0;
+	for (int count = 16; !shutdown_flag && count <= 4096; count *= 4) {
+		for (; nshadows < count; nshadows++) {
+			open_msg.header.remote_id = nshadows + 1;
+			(void)apply_update(&map, &pool, &render,
+					WMSG_OPEN_DMABUF, nshadows + 1, &msg);
+		}
+		int nfound = 0;
+		struct timespec t0, t1, t2;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (int k = 0; k < nlookups; k++) {
+			nfound += get_shadow_for_rid(&map, (k % count) + 1) !=
+				  NULL;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		/* New fds from the program are always first looked up, and
+		 * not found */
+		for (int k = 0; k < nlookups; k++) {
+			nfound += get_shadow_for_local_fd(&map, 1000 + k) !=
+				  NULL;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+
+		double rid_ns = (double)timespec_sub(t1, t0) / nlookups;
+		double lfd_ns = (double)timespec_sub(t2, t1) / nlookups;
+		printf("Shadow lookups with %d live shadows: %.1f ns per RID lookup (load factor %.2f), %.1f ns per new fd lookup, %d found\n",
+				count, rid_ns,
+				(double)count / (double)map.rid_index.nslots,
+				lfd_ns, nfound);
+	}
+
+	cleanup_translation_map(&map);
+	cleanup_thread_pool(&pool);
+}
+
+/* Measure how quickly diffs are made over a large, mostly unchanged mirror,
+ * with and without huge pages for the mirror and the buffer it tracks */
+static void run_scan_bench(void)
+{
+	const size_t size = (size_t)64 << 20;
+	const int nrounds = 8;
+	int bits = 0;
+	interval_diff_fn_t diff_fn = get_diff_function(DIFF_FASTEST, &bits);
+	struct interval damage = {.start = 0, .end = (int32_t)size};
+	char *diff = malloc(size + 8);
+	if (!diff) {
+		return;
+	}
+	for (int k = 0; !shutdown_flag && k < 2; k++) {
+		bool huge = k == 1;
+		set_huge_page_policy(huge);
+		void *mirror_handle = NULL, *data_handle = NULL;
+		uint32_t *mirror = zeroed_aligned_alloc(
+				size, 64, &mirror_handle);
+		uint32_t *data = zeroed_aligned_alloc(size, 64, &data_handle);
+		if (!mirror || !data) {
+			zeroed_aligned_free(mirror, &mirror_handle);
+			zeroed_aligned_free(data, &data_handle);
+			break;
+		}
+		memset(mirror, 1, size);
+		memset(data, 1, size);
+
+		double best = 0.0;
+		for (int r = 0; r < nrounds; r++) {
+			/* One word changes per 64KB */
+			for (size_t i = 0; i < size / 4; i += 16384) {
+				data[i + (size_t)r]++;
+			}
+			struct timespec t0, t1;
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			(void)construct_diff_core(diff_fn, bits, &damage, 1,
+					mirror, data, diff);
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			double rate = (double)size / (double)timespec_sub(t1, t0);
+			best = rate > best ? rate : best;
+		}
+		printf("Diff scan over a %zu MB mirror, %s huge pages: %.2f GB/s\n",
+				size >> 20, huge ? "with" : "without", best);
+		zeroed_aligned_free(mirror, &mirror_handle);
+		zeroed_aligned_free(data, &data_handle);
+	}
+	set_huge_page_policy(true);
+	free(diff);
+}
+
+/* Compare making the whole diff before compressing it with compressing it in
+ * pieces as it is made, without a bandwidth limit */
+static void run_stream_diff_bench(int n_worker_threads, unsigned int seed,
+		size_t test_size, void *image)
+{
+	const struct compression_range *rng = NULL;
+	for (size_t c = 0; c < sizeof(comp_ranges) / sizeof(comp_ranges[0]);
+			c++) {
+		if (comp_ranges[c].mode == COMP_ZSTD) {
+			rng = &comp_ranges[c];
+		}
+	}
+	if (!rng) {
+		return;
+	}
+	const int levels[] = {-5, 1, 3};
+	for (size_t i = 0; !shutdown_flag && i < sizeof(levels) / sizeof(int);
+			i++) {
+		struct bench_result split = run_sub_bench(false, rng,
+				levels[i], 1e9f, n_worker_threads, seed, false,
+				test_size, image, false);
+		struct bench_result fused = run_sub_bench(false, rng,
+				levels[i], 1e9f, n_worker_threads, seed, false,
+				test_size, image, true);
+		printf("Diff compressed as it is made, %s=%d: %f sec, instead of %f sec\n",
+				rng->desc, levels[i], fused.comp_time,
+				split.comp_time);
+	}
+}
+
 int run_bench(float bandwidth_mBps, uint32_t test_size, int n_worker_threads)
 {
+	run_lookup_bench();
+	run_scan_bench();
+
 	/* 4MB test image - 1024x1024x4. Any smaller, and unrealistic caching
 	 * speedups may occur */
 	struct timespec tp;
@@ -403,7 +554,8 @@ int run_bench(float bandwidth_mBps, uint32_t test_size, int n_worker_threads)
 						(unsigned int)tp.tv_nsec,
 						text_like, test_size,
 						text_like ? text_image
-							  : vid_image);
+							  : vid_image,
+						true);
 				if (text_like) {
 					tresults[j++] = res;
 					ntres++;
@@ -414,6 +566,8 @@ int run_bench(float bandwidth_mBps, uint32_t test_size, int n_worker_threads)
 			}
 		}
 	}
+	run_stream_diff_bench(n_worker_threads, (unsigned int)tp.tv_nsec,
+			test_size, vid_image);
 	for (int k = 0; k < 2; k++) {
 		bool text_like = k == 0;
 		struct bench_result *results = text_like ? tresults : iresults;
@@ -440,3 +594,60 @@ int run_bench(float bandwidth_mBps, uint32_t test_size, int n_worker_threads)
 	free(text_image);
 	return EXIT_SUCCESS;
 }
+
+int run_bench_replay(float bandwidth_mBps, const char *path,
+		const struct main_config *config)
+{
+	struct replay_stats st;
+	if (replay_recording(path, config->compression,
+			    config->compression_level,
+			    config->n_worker_threads, &st) == -1) {
+		return EXIT_FAILURE;
+	}
+	printf("Replayed %d messages (%" PRIu64
+	       " bytes) spanning %.3f sec; %d for pipes and DMABUFs (%" PRIu64
+	       " bytes) were skipped\n",
+			st.nmessages, st.recorded_bytes,
+			(double)st.duration_ns * 1e-9, st.nskipped,
+			st.skipped_bytes);
+	struct parse_stats ps;
+	if (replay_protocol(path, config, 20, &ps) == -1) {
+		return EXIT_FAILURE;
+	}
+	if (ps.nmessages > 0) {
+		double parse_s = (double)ps.parse_ns * 1e-9;
+		printf("Parsed %d Wayland %s %d times: %.3f sec, %.3g messages/sec; %d groups sent with fds were skipped\n",
+				ps.nmessages,
+				ps.display_side ? "requests" : "events",
+				ps.npasses, parse_s,
+				(double)ps.nmessages * ps.npasses / parse_s,
+				ps.nskipped);
+	}
+	if (st.nframes == 0) {
+		printf("The recording contains no shared memory buffer updates\n");
+		return EXIT_SUCCESS;
+	}
+	double collect_s = (double)st.collect_ns * 1e-9;
+	double apply_s = (double)st.apply_ns * 1e-9;
+	double wire_s = (double)st.wire_bytes / ((double)bandwidth_mBps * 1e6);
+	printf("%s=%d: %d frames, %" PRIu64 " bytes changed, %" PRIu64
+	       " bytes on wire (%.3f sec at %g MB/s)\n",
+			compression_mode_to_str(config->compression),
+			config->compression_level, st.nframes, st.changed_bytes,
+			st.wire_bytes, wire_s, bandwidth_mBps);
+	printf("collect+compress: %.3f sec total, %.3f ms mean, %.3f ms max per frame\n",
+			collect_s, 1e3 * collect_s / st.nframes,
+			(double)st.max_collect_ns * 1e-6);
+	printf("decompress+apply: %.3f sec total, %.3f ms mean, %.3f ms max per frame\n",
+			apply_s, 1e3 * apply_s / st.nframes,
+			(double)st.max_apply_ns * 1e-6);
+	printf("Throughput: %.1f MB/s of changed buffer content\n",
+			(double)st.changed_bytes * 1e-6 /
+					(collect_s + apply_s + wire_s));
+	if (st.nmismatched > 0) {
+		wp_error("Copies did not match the originals after %d frames",
+				st.nmismatched);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -183,6 +183,12 @@ static inline bool key_match(
 {
 	return key1[0] == key2[0] && key1[1] == key2[1] && key1[2] == key2[2];
 }
+/** The number of extra channel connections announced by an initial token, or
+ * the index of the extra connection with a CONN_STRIPE_BIT token */
+static inline int conn_stream_field(uint32_t header)
+{
+	return (int)((header & CONN_STREAMS_MASK) >> CONN_STREAMS_SHIFT);
+}
 static int get_inherited_socket(const char *wayland_socket)
 {
 	uint32_t val;
@@ -236,6 +242,12 @@ static int run_single_client_reconnector(
 		int channelsock, int linkfd, struct connection_token conn_id)
 {
 	int retcode = EXIT_SUCCESS;
+	/* If the connection is not reconnectable, this only waits for the
+	 * extra channel connections */
+	bool reconnectable = conn_id.header & CONN_RECONNECTABLE_BIT;
+	int nstripes = conn_stream_field(conn_id.header);
+	uint32_t stripes_seen = 0;
+	int nstripes_seen = 0;
 	while (!shutdown_flag) {
 		struct pollfd pf[2];
 		pf[0].fd = channelsock;
@@ -295,6 +307,28 @@ static int run_single_client_reconnector(
 			wp_error("Connection attempt with unmatched key");
 			goto done;
 		}
+		if (new_conn.header & CONN_STRIPE_BIT) {
+			int index = conn_stream_field(new_conn.header);
+			if (index < 1 || index > nstripes ||
+					(stripes_seen & (1u << index))) {
+				wp_error("Unexpected extra channel connection %d",
+						index);
+				goto done;
+			}
+			stripes_seen |= 1u << index;
+			nstripes_seen++;
+			bool last = !reconnectable && nstripes_seen == nstripes;
+			if (send_stripe_fd(linkfd, newclient, index, last) ==
+					-1) {
+				wp_error("Failed to send extra channel connection: %s",
+						strerror(errno));
+			}
+			checked_close(newclient);
+			if (last) {
+				break;
+			}
+			continue;
+		}
 		bool update = new_conn.header & CONN_RECONNECTABLE_BIT;
 		if (!update) {
 			wp_error("Connection token is missing update flag");
@@ -395,7 +429,7 @@ static int run_single_client(int channelsock, pid_t *eol_pid,
 		checked_close(disp_fd);
 		return retcode;
 	}
-	if (conn_id.header & CONN_UPDATE_BIT) {
+	if (conn_id.header & (CONN_UPDATE_BIT | CONN_STRIPE_BIT)) {
 		wp_error("Initial connection token had update flag set");
 		checked_close(channelsock);
 		checked_close(disp_fd);
@@ -403,9 +437,11 @@ static int run_single_client(int channelsock, pid_t *eol_pid,
 	}
 
 	/* Fork a reconnection handler, only if the connection is
-	 * reconnectable/has a nonzero id */
+	 * reconnectable/has a nonzero id, or to accept the extra channel
+	 * connections */
 	int linkfds[2] = {-1, -1};
-	if (conn_id.header & CONN_RECONNECTABLE_BIT) {
+	if ((conn_id.header & CONN_RECONNECTABLE_BIT) ||
+			conn_stream_field(conn_id.header) > 0) {
 		if (socketpair(AF_UNIX, SOCK_STREAM, 0, linkfds) == -1) {
 			wp_error("Failed to create socketpair: %s",
 					strerror(errno));
@@ -434,8 +470,8 @@ static int run_single_client(int channelsock, pid_t *eol_pid,
 
 	struct main_config mod_config = *config;
 	apply_conn_header(conn_id.header, &mod_config);
-	return main_interface_loop(
-			chanclient, disp_fd, linkfds[0], &mod_config, true);
+	return main_interface_loop(chanclient, disp_fd, linkfds[0], NULL, 0,
+			&mod_config, true);
 }
 
 void send_new_connection_fd(
@@ -453,15 +489,144 @@ void send_new_connection_fd(
 	}
 }
 
+/** Forward an extra channel connection to the process handling the session
+ * with the same key. Returns false if there is no such process (yet). */
+static bool send_new_stripe_fd(struct conn_map *connmap,
+		const struct connection_token *token, int new_fd)
+{
+	for (int i = 0; i < connmap->count; i++) {
+		struct conn_addr *c = &connmap->data[i];
+		if (!key_match(c->token.key, token->key)) {
+			continue;
+		}
+		/* A threaded connection's link is kept until it ends */
+		bool reconnectable = c->token.header & CONN_RECONNECTABLE_BIT;
+		bool last = !reconnectable && !c->threaded &&
+			    c->stripes_left == 1;
+		if (send_stripe_fd(c->linkfd, new_fd,
+				    conn_stream_field(token->header),
+				    last) == -1) {
+			wp_error("Failed to send extra channel connection to subprocess: %s",
+					strerror(errno));
+		}
+		c->stripes_left--;
+		if (last) {
+			/* The link is no longer needed */
+			checked_close(c->linkfd);
+			memmove(connmap->data + i, connmap->data + i + 1,
+					sizeof(struct conn_addr) *
+							(size_t)(connmap->count -
+									i - 1));
+			connmap->count--;
+		}
+		return true;
+	}
+	return false;
+}
+
+/** Fork a process which prepares to handle the next connection; failures
+ * are only logged, since connections can still be handled without it */
+static void start_warm_process(struct warm_process *warm, int cwd_fd,
+		struct pollfd *other_fds, int n_other_fds,
+		const struct conn_map *connmap,
+		const struct main_config *config)
+{
+	int warmsocks[2] = {-1, -1};
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, warmsocks) == -1) {
+		wp_error("Failed to create socketpair: %s", strerror(errno));
+		return;
+	}
+	pid_t npid = fork();
+	if (npid == 0) {
+		checked_close(warmsocks[0]);
+		for (int i = 0; i < n_other_fds; i++) {
+			checked_close(other_fds[i].fd);
+		}
+		for (int i = 0; i < connmap->count; i++) {
+			checked_close(connmap->data[i].linkfd);
+		}
+		checked_close(cwd_fd);
+		int rc = warm_interface_loop(warmsocks[1], config, true);
+		check_unclosed_fds();
+		exit(rc);
+	} else if (npid == -1) {
+		wp_error("Fork failure: %s", strerror(errno));
+		checked_close(warmsocks[0]);
+		checked_close(warmsocks[1]);
+		return;
+	}
+	checked_close(warmsocks[1]);
+	warm->pid = npid;
+	warm->linkfd = warmsocks[0];
+}
+
+/** Run the connection on a thread of this process. The caller keeps
+ * `chanclient`, so the thread is given a duplicate of it */
+static void start_client_thread(int cwd_fd, int chanclient,
+		struct conn_map *connmap, struct conn_threads *threads,
+		const struct main_config *config,
+		const struct socket_path disp_path,
+		const struct connection_token *conn_id)
+{
+	if (buf_ensure_size(connmap->count + 1, sizeof(struct conn_addr),
+			    &connmap->size, (void **)&connmap->data) == -1) {
+		wp_error("Failed to allocate space to track connection");
+		return;
+	}
+	int linkfds[2] = {-1, -1};
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, linkfds) == -1) {
+		wp_error("Failed to create socketpair: %s", strerror(errno));
+		return;
+	}
+	int chanfd = dup(chanclient);
+	if (chanfd == -1) {
+		wp_error("Failed to duplicate connection fd: %s",
+				strerror(errno));
+		goto fail_link;
+	}
+	int display_fd = -1;
+	if (connect_to_socket(cwd_fd, disp_path, NULL, &display_fd) == -1) {
+		goto fail_chanfd;
+	}
+	struct main_config mod_config = *config;
+	apply_conn_header(conn_id->header, &mod_config);
+	if (start_connection_thread(threads, chanfd, display_fd, linkfds[1],
+			    NULL, 0, conn_id, &mod_config, true) == -1) {
+		checked_close(display_fd);
+		goto fail_chanfd;
+	}
+	connmap->data[connmap->count++] = (struct conn_addr){
+			.linkfd = linkfds[0],
+			.token = *conn_id,
+			.pid = 0,
+			.stripes_left = conn_stream_field(conn_id->header),
+			.threaded = true};
+	return;
+fail_chanfd:
+	checked_close(chanfd);
+fail_link:
+	checked_close(linkfds[0]);
+	checked_close(linkfds[1]);
+}
+
 static void handle_new_client_connection(int cwd_fd, struct pollfd *other_fds,
 		int n_other_fds, int chanclient, struct conn_map *connmap,
+		struct warm_process *warm, struct conn_threads *threads,
 		const struct main_config *config,
 		const struct socket_path disp_path,
 		const struct connection_token *conn_id)
 {
+	if (config->shared_workers) {
+		start_client_thread(cwd_fd, chanclient, connmap, threads,
+				config, disp_path, conn_id);
+		return;
+	}
 	bool reconnectable = conn_id->header & CONN_RECONNECTABLE_BIT;
+	/* A link is also needed to pass on the extra channel connections */
+	int nstripes = conn_stream_field(conn_id->header);
+	bool linked = reconnectable || nstripes > 0;
 
-	if (reconnectable && buf_ensure_size(connmap->count + 1,
+	if (linked && buf_ensure_size(connmap->count + 1,
 					     sizeof(struct conn_addr),
 					     &connmap->size,
 					     (void **)&connmap->data) == -1) {
@@ -469,14 +634,27 @@ static void handle_new_client_connection(int cwd_fd, struct pollfd *other_fds,
 		goto fail_cc;
 	}
 	int linkfds[2] = {-1, -1};
-	if (reconnectable) {
+	if (linked) {
 		if (socketpair(AF_UNIX, SOCK_STREAM, 0, linkfds) == -1) {
 			wp_error("Failed to create socketpair: %s",
 					strerror(errno));
 			goto fail_cc;
 		}
 	}
-	pid_t npid = fork();
+	pid_t npid = -1;
+	int display_fd = -1;
+	if (warm->pid != 0 && connect_to_socket(cwd_fd, disp_path, NULL,
+					      &display_fd) == 0) {
+		struct main_config mod_config = *config;
+		apply_conn_header(conn_id->header, &mod_config);
+		npid = hand_off_connection(warm,
+				mod_config.no_gpu ? WARM_NO_GPU : 0, chanclient,
+				display_fd, linkfds[1], NULL, 0);
+		checked_close(display_fd);
+	}
+	if (npid == -1) {
+		npid = fork();
+	}
 	if (npid == 0) {
 		// Run forked process, with the only shared
 		// state being the new channel socket
@@ -485,14 +663,16 @@ static void handle_new_client_connection(int cwd_fd, struct pollfd *other_fds,
 				checked_close(other_fds[i].fd);
 			}
 		}
-		if (reconnectable) {
+		if (linked) {
 			checked_close(linkfds[0]);
 		}
 		for (int i = 0; i < connmap->count; i++) {
 			checked_close(connmap->data[i].linkfd);
 		}
+		if (warm->linkfd != -1) {
+			checked_close(warm->linkfd);
+		}
 
-		int display_fd = -1;
 		if (connect_to_socket(cwd_fd, disp_path, NULL, &display_fd) ==
 				-1) {
 			exit(EXIT_FAILURE);
@@ -502,7 +682,7 @@ static void handle_new_client_connection(int cwd_fd, struct pollfd *other_fds,
 		struct main_config mod_config = *config;
 		apply_conn_header(conn_id->header, &mod_config);
 		int rc = main_interface_loop(chanclient, display_fd, linkfds[1],
-				&mod_config, true);
+				NULL, 0, &mod_config, true);
 		check_unclosed_fds();
 		exit(rc);
 	} else if (npid == -1) {
@@ -511,12 +691,13 @@ static void handle_new_client_connection(int cwd_fd, struct pollfd *other_fds,
 	}
 	// Remove connection from this process
 
-	if (reconnectable) {
+	if (linked) {
 		checked_close(linkfds[1]);
 		connmap->data[connmap->count++] =
 				(struct conn_addr){.linkfd = linkfds[0],
 						.token = *conn_id,
-						.pid = npid};
+						.pid = npid,
+						.stripes_left = nstripes};
 	}
 
 	return;
@@ -567,6 +748,13 @@ static int run_multi_client(int cwd_fd, int channelsock, pid_t *eol_pid,
 	fds[0].events = POLLIN;
 	fds[0].revents = 0;
 
+	struct warm_process warm = {.pid = 0, .linkfd = -1};
+	struct conn_threads threads = {.has_workers = false,
+			.list = NULL,
+			.count = 0,
+			.size = 0,
+			.nstarted = 0};
+
 	int retcode = EXIT_SUCCESS;
 	while (!shutdown_flag) {
 		int status = -1;
@@ -577,6 +765,11 @@ static int run_multi_client(int cwd_fd, int channelsock, pid_t *eol_pid,
 			retcode = WEXITSTATUS(status);
 			break;
 		}
+		reap_connection_threads(&threads, &connmap, false);
+		if (config->prewarm && warm.pid == 0) {
+			start_warm_process(&warm, cwd_fd, fds, 1 + incomplete,
+					&connmap, config);
+		}
 
 		int r = poll(fds, 1 + (nfds_t)incomplete, -1);
 		if (r == -1) {
@@ -644,17 +837,36 @@ static int run_multi_client(int cwd_fd, int channelsock, pid_t *eol_pid,
 				incomplete--;
 				continue;
 			}
+			if (tokens[i].header & CONN_STRIPE_BIT) {
+				/* Forwarded once the initial connection with
+				 * the same key has been handled, below */
+				fds[i + 1].events = 0;
+				continue;
+			}
 
 			/* Failures here are logged, but should not
 			 * affect this process' ability to e.g. handle
 			 * reconnections. */
 			handle_new_client_connection(cwd_fd, fds,
 					1 + incomplete, cur_fd, &connmap,
-					config, disp_path, &tokens[i]);
+					&warm, &threads, config, disp_path,
+					&tokens[i]);
 			drop_incoming_connection(fds + 1, tokens, bytes_read, i,
 					incomplete);
 			incomplete--;
 		}
+		for (int i = 0; i < incomplete;) {
+			if (bytes_read[i] == 16 &&
+					(tokens[i].header & CONN_STRIPE_BIT) &&
+					send_new_stripe_fd(&connmap, &tokens[i],
+							fds[i + 1].fd)) {
+				drop_incoming_connection(fds + 1, tokens,
+						bytes_read, i, incomplete);
+				incomplete--;
+			} else {
+				i++;
+			}
+		}
 
 		/* Process new connections second, to give incomplete
 		 * connections a chance to clear first */
@@ -700,9 +912,14 @@ static int run_multi_client(int cwd_fd, int channelsock, pid_t *eol_pid,
 		checked_close(fds[i + 1].fd);
 	}
 
+	reap_connection_threads(&threads, &connmap, true);
 	for (int i = 0; i < connmap.count; i++) {
 		checked_close(connmap.data[i].linkfd);
 	}
+	if (warm.linkfd != -1) {
+		/* the prepared process exits when this closes */
+		checked_close(warm.linkfd);
+	}
 	free(connmap.data);
 	checked_close(channelsock);
 	return retcode;
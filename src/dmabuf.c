@@ -28,6 +28,11 @@
 
 #ifndef HAS_DMABUF
 
+int open_render_node(struct render_data *data)
+{
+	data->disabled = true;
+	return -1;
+}
 int init_render_data(struct render_data *data)
 {
 	data->disabled = true;
@@ -74,6 +79,17 @@ void *map_dmabuf(struct gbm_bo *bo, bool write, void **map_handle,
 	(void)exp_stride;
 	return NULL;
 }
+void *map_dmabuf_rows(struct gbm_bo *bo, bool write, uint32_t row_start,
+		uint32_t row_end, void **map_handle, uint32_t *exp_stride)
+{
+	(void)bo;
+	(void)write;
+	(void)row_start;
+	(void)row_end;
+	(void)map_handle;
+	(void)exp_stride;
+	return NULL;
+}
 int unmap_dmabuf(struct gbm_bo *bo, void *map_handle)
 {
 	(void)bo;
@@ -105,7 +121,7 @@ uint32_t dmabuf_get_stride(struct gbm_bo *bo)
 
 #include <gbm.h>
 
-int init_render_data(struct render_data *data)
+int open_render_node(struct render_data *data)
 {
 	/* render node support can be disabled either by choice
 	 * or when a previous version fails */
@@ -128,18 +144,35 @@ int init_render_data(struct render_data *data)
 		return -1;
 	}
 
-	struct gbm_device *dev = gbm_create_device(drm_fd);
+	data->drm_fd = drm_fd;
+	/* Set the path to the card used for protocol handlers to see */
+	data->drm_node_path = card;
+	return 0;
+}
+int init_render_data(struct render_data *data)
+{
+	if (data->disabled) {
+		return -1;
+	}
+	if (data->dev) {
+		// Silent return, idempotent
+		return 0;
+	}
+	if (open_render_node(data) == -1) {
+		return -1;
+	}
+
+	/* This loads the driver, which is the slow part */
+	struct gbm_device *dev = gbm_create_device(data->drm_fd);
 	if (!dev) {
 		data->disabled = true;
-		checked_close(drm_fd);
+		checked_close(data->drm_fd);
+		data->drm_fd = -1;
 		wp_error("Failed to create gbm device from drm_fd");
 		return -1;
 	}
 
-	data->drm_fd = drm_fd;
 	data->dev = dev;
-	/* Set the path to the card used for protocol handlers to see */
-	data->drm_node_path = card;
 	/* Assume true initially, fall back to old buffer creation path
 	 * if the newer path errors out */
 	data->supports_modifiers = true;
@@ -148,7 +181,9 @@ int init_render_data(struct render_data *data)
 void cleanup_render_data(struct render_data *data)
 {
 	if (data->drm_fd != -1) {
-		gbm_device_destroy(data->dev);
+		if (data->dev) {
+			gbm_device_destroy(data->dev);
+		}
 		checked_close(data->drm_fd);
 		data->dev = NULL;
 		data->drm_fd = -1;
@@ -171,6 +206,10 @@ struct gbm_bo *import_dmabuf(struct render_data *rd, int fd, size_t *size,
 		const struct dmabuf_slice_data *info)
 {
 	struct gbm_bo *bo;
+	if (!rd->dev) {
+		wp_error("Render device was not set up");
+		return NULL;
+	}
 	if (!dmabuf_info_valid(info)) {
 		return NULL;
 	}
@@ -237,10 +276,62 @@ int get_unique_dmabuf_handle(
 	return handle;
 }
 
+/* If a linear buffer was made with a different stride than the one with
+ * which its contents are sent, then every update to it must be copied row by
+ * row. Padding the width to fill the sent stride often gets an allocation
+ * with exactly that stride; if not, the original buffer is kept. */
+static struct gbm_bo *match_linear_stride(struct render_data *rd,
+		const struct dmabuf_slice_data *info, struct gbm_bo *bo)
+{
+	uint32_t stride = gbm_bo_get_stride(bo);
+	uint32_t want = info->strides[0];
+	/* the linear modifier is zero */
+	uint64_t mod = gbm_bo_get_modifier(bo);
+	bool linear = mod == 0 ||
+		      (mod == DRM_FORMAT_MOD_INVALID && info->modifier == 0);
+	if (info->num_planes != 1 || stride == want || !linear) {
+		return bo;
+	}
+	int bpp = get_shm_bytes_per_pixel(info->format);
+	if (bpp <= 0 || want % (uint32_t)bpp != 0 ||
+			want / (uint32_t)bpp <= info->width ||
+			want / (uint32_t)bpp > (1u << 24)) {
+		return bo;
+	}
+	uint32_t simple_format =
+			dmabuf_get_simple_format_for_plane(info->format, 0);
+	struct gbm_bo *padded;
+	if (rd->supports_modifiers && info->modifier == 0) {
+		uint64_t modifiers[1] = {0};
+		padded = gbm_bo_create_with_modifiers(rd->dev,
+				want / (uint32_t)bpp, info->height,
+				simple_format, modifiers, 1);
+	} else {
+		padded = gbm_bo_create(rd->dev, want / (uint32_t)bpp,
+				info->height, simple_format,
+				GBM_BO_USE_RENDERING | GBM_BO_USE_LINEAR);
+	}
+	if (!padded) {
+		return bo;
+	}
+	if (gbm_bo_get_stride(padded) != want) {
+		gbm_bo_destroy(padded);
+		return bo;
+	}
+	wp_debug("Padded DMABUF width from %u to %u to match stride %u",
+			info->width, want / (uint32_t)bpp, want);
+	gbm_bo_destroy(bo);
+	return padded;
+}
+
 struct gbm_bo *make_dmabuf(
 		struct render_data *rd, const struct dmabuf_slice_data *info)
 {
 	struct gbm_bo *bo;
+	if (!rd->dev) {
+		wp_error("Render device was not set up");
+		return NULL;
+	}
 	if (!dmabuf_info_valid(info)) {
 		return NULL;
 	}
@@ -306,7 +397,7 @@ retry:
 			return NULL;
 		}
 	}
-	return bo;
+	return match_linear_stride(rd, info, bo);
 }
 int export_dmabuf(struct gbm_bo *bo)
 {
@@ -325,6 +416,12 @@ void destroy_dmabuf(struct gbm_bo *bo)
 
 void *map_dmabuf(struct gbm_bo *bo, bool write, void **map_handle,
 		uint32_t *exp_stride)
+{
+	return map_dmabuf_rows(bo, write, 0, UINT32_MAX, map_handle,
+			exp_stride);
+}
+void *map_dmabuf_rows(struct gbm_bo *bo, bool write, uint32_t row_start,
+		uint32_t row_end, void **map_handle, uint32_t *exp_stride)
 {
 	if (!bo) {
 		wp_error("Tried to map null gbm_bo");
@@ -339,6 +436,14 @@ void *map_dmabuf(struct gbm_bo *bo, bool write, void **map_handle,
 	uint32_t stride;
 	uint32_t width = gbm_bo_get_width(bo);
 	uint32_t height = gbm_bo_get_height(bo);
+	/* Only the rows mapped need to be copied from/to the GPU, for drivers
+	 * which do not map the buffer directly */
+	row_end = (uint32_t)minu(row_end, height);
+	if (row_start >= row_end) {
+		wp_error("Tried to map empty row range [%u, %u) of dmabuf",
+				row_start, row_end);
+		return NULL;
+	}
 	/* As of writing, with amdgpu, GBM_BO_TRANSFER_WRITE invalidates
 	 * regions not written to during the mapping, while iris preserves
 	 * the original buffer contents. GBM documentation does not say which
@@ -347,8 +452,8 @@ void *map_dmabuf(struct gbm_bo *bo, bool write, void **map_handle,
 	 * both drivers. */
 	uint32_t flags = write ? GBM_BO_TRANSFER_READ_WRITE
 			       : GBM_BO_TRANSFER_READ;
-	void *data = gbm_bo_map(
-			bo, 0, 0, width, height, flags, &stride, map_handle);
+	void *data = gbm_bo_map(bo, 0, row_start, width, row_end - row_start,
+			flags, &stride, map_handle);
 	if (!data) {
 		// errno is useless here
 		wp_error("Failed to map dmabuf");
@@ -68,6 +68,11 @@ struct dmabuf_slice_data {
 };
 static_assert(sizeof(struct dmabuf_slice_data) == 64, "size check");
 
+/** Open the render node, without yet loading its driver, so that it can be
+ * advertised and its device number read. Returns -1 on failure. */
+int open_render_node(struct render_data *);
+/** Open the render node if needed and create the GBM device with which
+ * DMABUFs are imported and made. Returns -1 on failure. */
 int init_render_data(struct render_data *);
 void cleanup_render_data(struct render_data *);
 struct gbm_bo *make_dmabuf(
@@ -80,6 +85,10 @@ void destroy_dmabuf(struct gbm_bo *bo);
 /** Map a DMABUF for reading or for writing */
 void *map_dmabuf(struct gbm_bo *bo, bool write, void **map_handle,
 		uint32_t *exp_stride);
+/** Map only rows [row_start, row_end) of a DMABUF, returning a pointer to the
+ * start of row `row_start`. `row_end` is clipped to the buffer height. */
+void *map_dmabuf_rows(struct gbm_bo *bo, bool write, uint32_t row_start,
+		uint32_t row_end, void **map_handle, uint32_t *exp_stride);
 int unmap_dmabuf(struct gbm_bo *bo, void *map_handle);
 /** The handle values are unique among the set of currently active buffer
  * objects. To compare a set of buffer objects, produce handles in a batch, and
@@ -94,6 +94,14 @@ struct obj_wl_surface {
 	uint32_t attached_buffer_id; /* protocol object id */
 	int32_t scale;
 	int32_t transform;
+	/* wp_presentation_feedback for the next commit, or 0 */
+	uint32_t feedback_id;
+};
+
+struct obj_wl_callback {
+	struct wp_object base;
+	/* Created by wl_surface.frame, rather than wl_display.sync */
+	bool is_frame;
 };
 
 struct obj_wlr_screencopy_frame {
@@ -116,6 +124,11 @@ struct obj_wp_presentation {
 struct obj_wp_presentation_feedback {
 	struct wp_object base;
 	int64_t clock_delta_nsec;
+	int clock_id;
+	uint32_t surface_id;
+	/* When the surface was committed, on the application side */
+	bool committed;
+	int64_t commit_nsec;
 };
 
 struct obj_zwp_linux_dmabuf_params {
@@ -318,6 +331,8 @@ struct wp_object *create_wp_object(uint32_t id, const struct wp_interface *type)
 		sz = sizeof(struct obj_wl_buffer);
 	} else if (type == &intf_wl_surface) {
 		sz = sizeof(struct obj_wl_surface);
+	} else if (type == &intf_wl_callback) {
+		sz = sizeof(struct obj_wl_callback);
 	} else if (type == &intf_zwlr_screencopy_frame_v1) {
 		sz = sizeof(struct obj_wlr_screencopy_frame);
 	} else if (type == &intf_wp_presentation) {
@@ -369,6 +384,12 @@ void do_wl_display_evt_error(struct context *ctx, struct wp_object *object_id,
 }
 void do_wl_display_evt_delete_id(struct context *ctx, uint32_t id)
 {
+	/* The id may not be reused until all held events for it are sent */
+	if (!ctx->on_display_side &&
+			pacing_hold_delete_id(&ctx->g->pacing, ctx->message,
+					ctx->message_length, id)) {
+		ctx->drop_this_msg = true;
+	}
 	struct wp_object *obj = tracker_get(ctx->tracker, id);
 	/* ensure this isn't miscalled to have wl_display delete itself */
 	if (obj && obj != ctx->obj) {
@@ -400,7 +421,9 @@ void do_wl_registry_evt_global(struct context *ctx, uint32_t name,
 	requires_rnode |= !strcmp(interface, "zwp_linux_dmabuf_v1");
 	requires_rnode |= !strcmp(interface, "zwlr_export_dmabuf_manager_v1");
 	if (requires_rnode) {
-		if (init_render_data(&ctx->g->render) == -1) {
+		/* The driver is only loaded once a DMABUF is used, so that
+		 * applications which never use one do not wait for it */
+		if (open_render_node(&ctx->g->render) == -1) {
 			/* A gpu connection supported by waypipe is required on
 			 * both sides, since data transfers may occur in both
 			 * directions, and
@@ -738,10 +761,99 @@ static void rotate_damage_lists(struct obj_wl_surface *surface)
 			(SURFACE_DAMAGE_BACKLOG - 1) * sizeof(uint64_t));
 	surface->attached_buffer_uids[0] = 0;
 }
+/** Replay all damage to the surface since the attached buffer was last
+ * committed, for a buffer whose image (of the given dimensions, with `bpp`
+ * bytes per pixel) starts at `offset` with rows `stride` bytes apart. Returns
+ * -1 if the damage could not be determined, in which case the caller should
+ * assume the entire buffer has changed. */
+static int replay_surface_damage(struct obj_wl_surface *surface,
+		struct shadow_fd *sfd, int32_t offset, int32_t width,
+		int32_t height, int32_t stride, int bpp, int alignment_bits)
+{
+	/* The damage specified as of wl_surface commit indicates which region
+	 * of the surface has changed between the last commit and the current
+	 * one. However, the last time the attached buffer was used may have
+	 * been several commits ago, so we need to replay all the damage up
+	 * to the current point. */
+	int age = -1;
+	int n_damaged_rects = surface->damage_lists[0].len;
+	for (int j = 1; j < SURFACE_DAMAGE_BACKLOG; j++) {
+		if (surface->attached_buffer_uids[0] ==
+				surface->attached_buffer_uids[j]) {
+			age = j;
+			break;
+		}
+		n_damaged_rects += surface->damage_lists[j].len;
+	}
+	if (age == -1) {
+		/* cannot find last time buffer+surface combo was used */
+		return -1;
+	}
+
+	struct ext_interval *damage_array = malloc(
+			sizeof(struct ext_interval) * (size_t)n_damaged_rects);
+	if (!damage_array) {
+		wp_error("Failed to allocate damage array");
+		return -1;
+	}
+	int i = 0;
+
+	// Translate damage stack into damage records for the fd buffer
+	for (int k = 0; k < age; k++) {
+		const struct damage_list *frame_damage =
+				&surface->damage_lists[k];
+		for (int j = 0; j < frame_damage->len; j++) {
+			int xlow, xhigh, ylow, yhigh;
+			compute_damage_coordinates(&xlow, &xhigh, &ylow, &yhigh,
+					&frame_damage->list[j], width, height,
+					surface->transform, surface->scale);
+
+			/* Clip the damage rectangle to the containing
+			 * buffer. */
+			xlow = clamp(xlow, 0, width);
+			xhigh = clamp(xhigh, 0, width);
+			ylow = clamp(ylow, 0, height);
+			yhigh = clamp(yhigh, 0, height);
+
+			damage_array[i].start = offset + stride * ylow +
+						bpp * xlow;
+			damage_array[i].rep = yhigh - ylow;
+			damage_array[i].stride = stride;
+			damage_array[i].width = bpp * (xhigh - xlow);
+			i++;
+		}
+	}
+
+	merge_damage_records(&sfd->damage, i, damage_array, alignment_bits);
+	free(damage_array);
+	return 0;
+}
+static void stamp_feedback_commit(
+		struct context *ctx, struct obj_wl_surface *surface)
+{
+	struct wp_object *obj = tracker_get(ctx->tracker, surface->feedback_id);
+	surface->feedback_id = 0;
+	if (!obj || obj->type != &intf_wp_presentation_feedback) {
+		return;
+	}
+	struct obj_wp_presentation_feedback *feedback =
+			(struct obj_wp_presentation_feedback *)obj;
+	struct timespec t;
+	if (feedback->surface_id != surface->base.obj_id ||
+			clock_gettime(feedback->clock_id, &t) == -1) {
+		return;
+	}
+	feedback->commit_nsec = t.tv_sec * 1000000000LL + t.tv_nsec;
+	feedback->committed = true;
+	pacing_note_feedback_commit(&ctx->g->pacing);
+}
 void do_wl_surface_req_commit(struct context *ctx)
 {
 	struct obj_wl_surface *surface = (struct obj_wl_surface *)ctx->obj;
 
+	if (surface->feedback_id && !ctx->on_display_side) {
+		stamp_feedback_commit(ctx, surface);
+	}
 	if (!surface->attached_buffer_id) {
 		/* The wl_surface.commit operation applies all "pending
 		 * state", much of which we don't care about. Typically,
@@ -765,10 +877,19 @@ void do_wl_surface_req_commit(struct context *ctx)
 		wp_error("Buffer to commit has the wrong type, and may have been recycled");
 		return;
 	}
+	stats_note_commit(&ctx->g->stats, surface->base.obj_id);
+
 	struct obj_wl_buffer *buf = (struct obj_wl_buffer *)obj;
 	surface->attached_buffer_uids[0] = buf->unique_id;
 	if (buf->type == BUF_DMA) {
-		rotate_damage_lists(surface);
+		/* Mapped DMABUFs are seen with a linear layout, with rows
+		 * spaced as in the transferred copy, so damage can be
+		 * tracked like for wl_shm buffers, whatever the modifier.
+		 * Planar (e.g. YUV) formats are not yet handled. */
+		int bpp = get_shm_bytes_per_pixel(buf->dmabuf_format);
+		bool detailed = buf->dmabuf_nplanes == 1 && bpp != -1 &&
+				surface->scale > 0 && surface->transform >= 0 &&
+				surface->transform < 8;
 
 		for (int i = 0; i < buf->dmabuf_nplanes; i++) {
 			struct shadow_fd *sfd = buf->dmabuf_buffers[i];
@@ -784,10 +905,29 @@ void do_wl_surface_req_commit(struct context *ctx)
 				continue;
 			}
 
-			// detailed damage tracking is not yet supported
 			sfd->is_dirty = true;
-			damage_everything(&sfd->damage);
+			ctx->g->map.change_generation++;
+			if (!detailed) {
+				damage_everything(&sfd->damage);
+				continue;
+			}
+			/* For video, damage is used to skip unchanged frames
+			 * and to mark regions of interest */
+			int32_t stride = (int32_t)sfd->dmabuf_info.strides[0];
+			if (sfd->type == FDC_DMABUF) {
+				note_row_layout(sfd, 0, (uint32_t)stride,
+						(uint32_t)(bpp * buf->dmabuf_width),
+						(uint32_t)buf->dmabuf_height);
+			}
+			if (replay_surface_damage(surface, sfd, 0,
+					    buf->dmabuf_width,
+					    buf->dmabuf_height, stride, bpp,
+					    ctx->g->threads.diff_alignment_bits) ==
+					-1) {
+				damage_everything(&sfd->damage);
+			}
 		}
+		rotate_damage_lists(surface);
 		return;
 	} else if (buf->type != BUF_SHM) {
 		wp_error("wp_buffer is backed neither by DMA nor SHM, not yet supported");
@@ -804,6 +944,7 @@ void do_wl_surface_req_commit(struct context *ctx)
 		return;
 	}
 	sfd->is_dirty = true;
+	ctx->g->map.change_generation++;
 	int bpp = get_shm_bytes_per_pixel(buf->shm_format);
 	if (bpp == -1) {
 		wp_error("Encountered unknown/planar/subsampled wl_shm format %x; marking entire buffer",
@@ -821,65 +962,18 @@ void do_wl_surface_req_commit(struct context *ctx)
 		goto backup;
 	}
 
-	/* The damage specified as of wl_surface commit indicates which region
-	 * of the surface has changed between the last commit and the current
-	 * one. However, the last time the attached buffer was used may have
-	 * been several commits ago, so we need to replay all the damage up
-	 * to the current point. */
-	int age = -1;
-	int n_damaged_rects = surface->damage_lists[0].len;
-	for (int j = 1; j < SURFACE_DAMAGE_BACKLOG; j++) {
-		if (surface->attached_buffer_uids[0] ==
-				surface->attached_buffer_uids[j]) {
-			age = j;
-			break;
-		}
-		n_damaged_rects += surface->damage_lists[j].len;
+	if (buf->shm_offset >= 0 && buf->shm_stride > 0 &&
+			buf->shm_width > 0 && buf->shm_height > 0) {
+		note_row_layout(sfd, (size_t)buf->shm_offset,
+				(uint32_t)buf->shm_stride,
+				(uint32_t)(bpp * buf->shm_width),
+				(uint32_t)buf->shm_height);
 	}
-	if (age == -1) {
-		/* cannot find last time buffer+surface combo was used */
-		goto backup;
-	}
-
-	struct ext_interval *damage_array = malloc(
-			sizeof(struct ext_interval) * (size_t)n_damaged_rects);
-	if (!damage_array) {
-		wp_error("Failed to allocate damage array");
+	if (replay_surface_damage(surface, sfd, buf->shm_offset,
+			    buf->shm_width, buf->shm_height, buf->shm_stride,
+			    bpp, ctx->g->threads.diff_alignment_bits) == -1) {
 		goto backup;
 	}
-	int i = 0;
-
-	// Translate damage stack into damage records for the fd buffer
-	for (int k = 0; k < age; k++) {
-		const struct damage_list *frame_damage =
-				&surface->damage_lists[k];
-		for (int j = 0; j < frame_damage->len; j++) {
-			int xlow, xhigh, ylow, yhigh;
-			compute_damage_coordinates(&xlow, &xhigh, &ylow, &yhigh,
-					&frame_damage->list[j], buf->shm_width,
-					buf->shm_height, surface->transform,
-					surface->scale);
-
-			/* Clip the damage rectangle to the containing
-			 * buffer. */
-			xlow = clamp(xlow, 0, buf->shm_width);
-			xhigh = clamp(xhigh, 0, buf->shm_width);
-			ylow = clamp(ylow, 0, buf->shm_height);
-			yhigh = clamp(yhigh, 0, buf->shm_height);
-
-			damage_array[i].start = buf->shm_offset +
-						buf->shm_stride * ylow +
-						bpp * xlow;
-			damage_array[i].rep = yhigh - ylow;
-			damage_array[i].stride = buf->shm_stride;
-			damage_array[i].width = bpp * (xhigh - xlow);
-			i++;
-		}
-	}
-
-	merge_damage_records(&sfd->damage, i, damage_array,
-			ctx->g->threads.diff_alignment_bits);
-	free(damage_array);
 	rotate_damage_lists(surface);
 backup:
 	if (1) {
@@ -936,6 +1030,24 @@ void do_wl_surface_req_damage_buffer(struct context *ctx, int32_t x, int32_t y,
 	append_damage_record((struct obj_wl_surface *)ctx->obj, x, y, width,
 			height, true);
 }
+void do_wl_surface_req_frame(struct context *ctx, struct wp_object *callback)
+{
+	(void)ctx;
+	((struct obj_wl_callback *)callback)->is_frame = true;
+}
+void do_wl_callback_evt_done(struct context *ctx, uint32_t callback_data)
+{
+	(void)callback_data;
+	struct obj_wl_callback *callback = (struct obj_wl_callback *)ctx->obj;
+	/* Delaying frame callbacks while the channel is congested makes the
+	 * application wait before drawing its next frame */
+	if (!ctx->on_display_side && callback->is_frame &&
+			pacing_hold_event(&ctx->g->pacing, ctx->message,
+					ctx->message_length,
+					callback->base.obj_id)) {
+		ctx->drop_this_msg = true;
+	}
+}
 void do_wl_surface_req_set_buffer_transform(
 		struct context *ctx, int32_t transform)
 {
@@ -1034,6 +1146,7 @@ void do_wl_shm_pool_req_resize(struct context *ctx, int32_t size)
 	if (!ctx->on_display_side) {
 		extend_shm_shadow(&ctx->g->threads, the_shm_pool->owned_buffer,
 				(size_t)size);
+		ctx->g->map.change_generation++;
 	}
 }
 void do_wl_shm_pool_req_create_buffer(struct context *ctx, struct wp_object *id,
@@ -1103,6 +1216,7 @@ void do_zwlr_screencopy_frame_v1_evt_ready(struct context *ctx,
 		return;
 	}
 	sfd->is_dirty = true;
+	ctx->g->map.change_generation++;
 	/* The protocol guarantees that the buffer attributes match
 	 * those of the written frame */
 	const struct ext_interval interval = {.start = buffer->shm_offset,
@@ -1164,9 +1278,15 @@ void do_wp_presentation_req_feedback(struct context *ctx,
 			(struct obj_wp_presentation *)ctx->obj;
 	struct obj_wp_presentation_feedback *feedback =
 			(struct obj_wp_presentation_feedback *)callback;
-	(void)surface;
 
 	feedback->clock_delta_nsec = pres->clock_delta_nsec;
+	feedback->clock_id = pres->clock_id;
+	if (surface) {
+		/* Measure the latency from the next commit */
+		feedback->surface_id = surface->obj_id;
+		((struct obj_wl_surface *)surface)->feedback_id =
+				callback->obj_id;
+	}
 }
 void do_wp_presentation_feedback_evt_presented(struct context *ctx,
 		uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec,
@@ -1176,7 +1296,6 @@ void do_wp_presentation_feedback_evt_presented(struct context *ctx,
 	struct obj_wp_presentation_feedback *feedback =
 			(struct obj_wp_presentation_feedback *)ctx->obj;
 
-	(void)refresh;
 	(void)seq_hi;
 	(void)seq_lo;
 	(void)flags;
@@ -1197,6 +1316,33 @@ void do_wp_presentation_feedback_evt_presented(struct context *ctx,
 	ctx->message[2] = (uint32_t)(sec / 0x100000000uLL);
 	ctx->message[3] = (uint32_t)(sec % 0x100000000uLL);
 	ctx->message[4] = (uint32_t)nsec;
+
+	if (!ctx->on_display_side && feedback->committed) {
+		int64_t present_nsec = (int64_t)sec * 1000000000LL + nsec;
+		pacing_note_presented(&ctx->g->pacing, feedback->surface_id,
+				present_nsec - feedback->commit_nsec, refresh);
+		feedback->committed = false;
+	}
+	if (!ctx->on_display_side &&
+			pacing_hold_event(&ctx->g->pacing, ctx->message,
+					ctx->message_length,
+					feedback->base.obj_id)) {
+		ctx->drop_this_msg = true;
+	}
+}
+void do_wp_presentation_feedback_evt_discarded(struct context *ctx)
+{
+	struct obj_wp_presentation_feedback *feedback =
+			(struct obj_wp_presentation_feedback *)ctx->obj;
+	if (!ctx->on_display_side && feedback->committed) {
+		pacing_note_discarded(&ctx->g->pacing);
+		feedback->committed = false;
+	}
+	if (!ctx->on_display_side &&
+			pacing_hold_event(&ctx->g->pacing, ctx->message,
+					ctx->message_length, ctx->obj->obj_id)) {
+		ctx->drop_this_msg = true;
+	}
 }
 
 void do_wl_drm_evt_device(struct context *ctx, const char *name)
@@ -1900,6 +2046,7 @@ void do_zwlr_export_dmabuf_frame_v1_evt_ready(struct context *ctx,
 		struct shadow_fd *sfd = frame->objects[i].buffer;
 		if (sfd) {
 			sfd->is_dirty = true;
+			ctx->g->map.change_generation++;
 			damage_everything(&sfd->damage);
 		}
 	}
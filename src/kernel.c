@@ -98,6 +98,17 @@ static size_t run_interval_diff_C(const int diff_window_size,
 	return dc * 2;
 }
 
+static void copy_span_C(char *__restrict__ dest, char *__restrict__ nt_dest,
+		const char *__restrict__ src, size_t size)
+{
+	if (dest) {
+		memcpy(dest, src, size);
+	}
+	if (nt_dest) {
+		memcpy(nt_dest, src, size);
+	}
+}
+
 #ifdef HAVE_AVX512F
 static bool avx512f_available(void)
 {
@@ -106,6 +117,8 @@ static bool avx512f_available(void)
 size_t run_interval_diff_avx512f(const int diff_window_size,
 		const void *__restrict__ imod, void *__restrict__ ibase,
 		uint32_t *__restrict__ idiff, size_t i, const size_t i_end);
+void copy_span_avx512f(char *__restrict__ dest, char *__restrict__ nt_dest,
+		const char *__restrict__ src, size_t size);
 #endif
 
 #ifdef HAVE_AVX2
@@ -113,6 +126,8 @@ static bool avx2_available(void) { return __builtin_cpu_supports("avx2"); }
 size_t run_interval_diff_avx2(const int diff_window_size,
 		const void *__restrict__ imod, void *__restrict__ ibase,
 		uint32_t *__restrict__ idiff, size_t i, const size_t i_end);
+void copy_span_avx2(char *__restrict__ dest, char *__restrict__ nt_dest,
+		const char *__restrict__ src, size_t size);
 #endif
 
 #ifdef HAVE_NEON
@@ -127,6 +142,8 @@ static bool sse3_available(void) { return __builtin_cpu_supports("sse3"); }
 size_t run_interval_diff_sse3(const int diff_window_size,
 		const void *__restrict__ imod, void *__restrict__ ibase,
 		uint32_t *__restrict__ idiff, size_t i, const size_t i_end);
+void copy_span_sse3(char *__restrict__ dest, char *__restrict__ nt_dest,
+		const char *__restrict__ src, size_t size);
 #endif
 
 interval_diff_fn_t get_diff_function(enum diff_type type, int *alignment_bits)
@@ -164,6 +181,37 @@ interval_diff_fn_t get_diff_function(enum diff_type type, int *alignment_bits)
 	return NULL;
 }
 
+span_copy_fn_t get_copy_function(enum diff_type type)
+{
+#ifdef HAVE_AVX512F
+	if ((type == DIFF_FASTEST || type == DIFF_AVX512F) &&
+			avx512f_available()) {
+		return copy_span_avx512f;
+	}
+#endif
+#ifdef HAVE_AVX2
+	if ((type == DIFF_FASTEST || type == DIFF_AVX2) && avx2_available()) {
+		return copy_span_avx2;
+	}
+#endif
+#ifdef HAVE_NEON
+	/* There is no non-temporal store intrinsic, and memcpy is already
+	 * vectorized, so the C kernel is used */
+	if ((type == DIFF_FASTEST || type == DIFF_NEON) && neon_available()) {
+		return copy_span_C;
+	}
+#endif
+#ifdef HAVE_SSE3
+	if ((type == DIFF_FASTEST || type == DIFF_SSE3) && sse3_available()) {
+		return copy_span_sse3;
+	}
+#endif
+	if (type == DIFF_FASTEST || type == DIFF_C) {
+		return copy_span_C;
+	}
+	return NULL;
+}
+
 /** Construct the main portion of a diff. The provided arguments should
  * be validated beforehand. All intervals, as well as the base/changed data
  * pointers, should be aligned to the alignment size associated with the
@@ -206,8 +254,9 @@ size_t construct_diff_trailing(size_t size, int alignment_bits,
 	}
 	return 0;
 }
-void apply_diff(size_t size, char *__restrict__ target1,
-		char *__restrict__ target2, size_t diffsize, size_t ntrailing,
+void apply_diff(span_copy_fn_t copy_fn, size_t size,
+		char *__restrict__ target1, char *__restrict__ target2,
+		size_t diffsize, size_t ntrailing,
 		const char *__restrict__ diff)
 {
 	size_t nblocks = size / sizeof(uint32_t);
@@ -226,9 +275,9 @@ void apply_diff(size_t size, char *__restrict__ target1,
 					i + 1 + span, ndiffblocks);
 			return;
 		}
-		memcpy(t1_blocks + nfrom, diff_blocks + i + 2,
-				sizeof(uint32_t) * span);
-		memcpy(t2_blocks + nfrom, diff_blocks + i + 2,
+		(*copy_fn)((char *)(t2_blocks + nfrom),
+				(char *)(t1_blocks + nfrom),
+				(const char *)(diff_blocks + i + 2),
 				sizeof(uint32_t) * span);
 		i += span + 2;
 	}
@@ -241,9 +290,19 @@ void apply_diff(size_t size, char *__restrict__ target1,
 	}
 }
 
-void stride_shifted_copy(char *dest, const char *src, size_t src_start,
-		size_t copy_length, size_t row_length, size_t src_stride,
-		size_t dst_stride)
+static inline void copy_row(span_copy_fn_t copy_fn, char *dest,
+		const char *src, size_t size)
+{
+	if (copy_fn) {
+		(*copy_fn)(NULL, dest, src, size);
+	} else {
+		memcpy(dest, src, size);
+	}
+}
+
+void stride_shifted_copy(span_copy_fn_t copy_fn, char *dest, const char *src,
+		size_t src_start, size_t copy_length, size_t row_length,
+		size_t src_stride, size_t dst_stride)
 {
 	size_t src_end = src_start + copy_length;
 	size_t lrow = src_start / src_stride;
@@ -254,7 +313,7 @@ void stride_shifted_copy(char *dest, const char *src, size_t src_start,
 		if (cstart < row_length) {
 			size_t cend = src_end - trow * src_stride;
 			cend = cend > row_length ? row_length : cend;
-			memcpy(dest + dst_stride * lrow + cstart,
+			copy_row(copy_fn, dest + dst_stride * lrow + cstart,
 					src + src_start, cend - cstart);
 		}
 		return;
@@ -264,21 +323,52 @@ void stride_shifted_copy(char *dest, const char *src, size_t src_start,
 	if (src_start > lrow * src_stride) {
 		size_t igap = src_start - lrow * src_stride;
 		if (igap < row_length) {
-			memcpy(dest + dst_stride * lrow + igap, src + src_start,
-					row_length - igap);
+			copy_row(copy_fn, dest + dst_stride * lrow + igap,
+					src + src_start, row_length - igap);
 		}
 	}
 
 	/* main body */
 	size_t srow = (src_start + src_stride - 1) / src_stride;
 	for (size_t i = srow; i < trow; i++) {
-		memcpy(dest + dst_stride * i, src + src_stride * i, row_length);
+		copy_row(copy_fn, dest + dst_stride * i, src + src_stride * i,
+				row_length);
 	}
 
 	/* trailing segment */
 	if (src_end > trow * src_stride) {
 		size_t local = src_end - trow * src_stride;
 		local = local > row_length ? row_length : local;
-		memcpy(dest + dst_stride * trow, src + src_end - local, local);
+		copy_row(copy_fn, dest + dst_stride * trow,
+				src + src_end - local, local);
+	}
+}
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t v)
+{
+	acc += v * 0xc2b2ae3d27d4eb4fuLL;
+	acc = (acc << 31) | (acc >> 33);
+	return acc * 0x9e3779b185ebca87uLL;
+}
+uint64_t hash_block(const void *data, size_t size)
+{
+	/* Four independent lanes, so that the multiplications can overlap */
+	uint64_t lanes[4] = {0x60ea27eeadc0b5d6uLL, 0xc2b2ae3d27d4eb4fuLL,
+			0x0uLL, 0x61c8864e7a143579uLL};
+	const char *src = data;
+	for (size_t i = 0; i < size; i += 32) {
+		for (int k = 0; k < 4; k++) {
+			uint64_t v;
+			memcpy(&v, src + i + 8 * (size_t)k, sizeof(v));
+			lanes[k] = hash_round(lanes[k], v);
+		}
 	}
+	uint64_t h = ((lanes[0] << 1) | (lanes[0] >> 63)) +
+		     ((lanes[1] << 7) | (lanes[1] >> 57)) +
+		     ((lanes[2] << 12) | (lanes[2] >> 52)) +
+		     ((lanes[3] << 18) | (lanes[3] >> 46));
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccduLL;
+	h ^= h >> 33;
+	return h;
 }
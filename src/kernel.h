@@ -33,6 +33,12 @@ typedef size_t (*interval_diff_fn_t)(const int diff_window_size,
 		const void *__restrict__ imod, void *__restrict__ ibase,
 		uint32_t *__restrict__ diff, size_t i, const size_t i_end);
 
+/** Copy `size` bytes from `src` to `dest` and to `nt_dest`, either of which
+ * may be NULL. Where the kernel can, stores to `nt_dest` bypass the cache. */
+typedef void (*span_copy_fn_t)(char *__restrict__ dest,
+		char *__restrict__ nt_dest, const char *__restrict__ src,
+		size_t size);
+
 enum diff_type {
 	DIFF_FASTEST,
 	DIFF_AVX512F,
@@ -45,6 +51,9 @@ enum diff_type {
 /** Returns a function pointer to a diff construction kernel, and indicates
  * the alignment of the data which is to be passed in */
 interval_diff_fn_t get_diff_function(enum diff_type type, int *alignment_bits);
+/** Returns a function pointer to a copy kernel for applying diffs, using
+ * the same instruction set as the diff kernel for `type` */
+span_copy_fn_t get_copy_function(enum diff_type type);
 /** Given intervals aligned to 1<<alignment_bits, create a diff of changed
  * over base, and update base to match changed. */
 size_t construct_diff_core(interval_diff_fn_t idiff_fn, int alignment_bits,
@@ -56,9 +65,12 @@ size_t construct_diff_core(interval_diff_fn_t idiff_fn, int alignment_bits,
 size_t construct_diff_trailing(size_t size, int alignment_bits,
 		char *__restrict__ base, const char *__restrict__ changed,
 		char *__restrict__ diff);
-/** Apply a diff to both target buffers */
-void apply_diff(size_t size, char *__restrict__ target1,
-		char *__restrict__ target2, size_t diffsize, size_t ntrailing,
+/** Apply a diff to both target buffers, using `copy_fn` to make the copies.
+ * target1 is written with non-temporal stores, if possible, since it is
+ * typically the mirror buffer, which is only read for the next update. */
+void apply_diff(span_copy_fn_t copy_fn, size_t size,
+		char *__restrict__ target1, char *__restrict__ target2,
+		size_t diffsize, size_t ntrailing,
 		const char *__restrict__ diff);
 /**
  * src, dest are buffers whose meaningful content consists of a series
@@ -73,9 +85,15 @@ void apply_diff(size_t size, char *__restrict__ target1,
  *
  * This function copies the content bytes of src to the content bytes of dest.
  * Note: 'src' is the original point of the src buffer, this may be unintuitive.
+ *
+ * If 'copy_fn' is not NULL, rows are copied with it, using non-temporal
+ * stores; otherwise, memcpy is used.
  */
-void stride_shifted_copy(char *dest, const char *src, size_t src_start,
-		size_t copy_length, size_t row_length, size_t src_stride,
-		size_t dst_stride);
+void stride_shifted_copy(span_copy_fn_t copy_fn, char *dest, const char *src,
+		size_t src_start, size_t copy_length, size_t row_length,
+		size_t src_stride, size_t dst_stride);
+/** Hash `size` bytes of data, where `size` is a multiple of 32. Matches must
+ * be confirmed by comparing the data. */
+uint64_t hash_block(const void *data, size_t size);
 
 #endif // WAYPIPE_KERNEL_H
@@ -26,6 +26,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <x86intrin.h>
 
@@ -164,3 +165,54 @@ size_t run_interval_diff_avx2(const int diff_window_size,
 
 	return dc;
 }
+
+/* Below this size, aligning the stores and fencing them costs more than is
+ * saved by not filling the cache */
+#define STREAM_MIN_SIZE 1024
+
+void copy_span_avx2(char *__restrict__ dest, char *__restrict__ nt_dest,
+		const char *__restrict__ src, size_t size)
+{
+	if (!nt_dest || size < STREAM_MIN_SIZE) {
+		if (dest) {
+			memcpy(dest, src, size);
+		}
+		if (nt_dest) {
+			memcpy(nt_dest, src, size);
+		}
+		return;
+	}
+	/* Streaming stores must be aligned */
+	size_t head = (size_t)(-(uintptr_t)nt_dest) & 31;
+	if (dest) {
+		memcpy(dest, src, head);
+	}
+	memcpy(nt_dest, src, head);
+	size_t i = head;
+	if (dest) {
+		for (; i + 64 <= size; i += 64) {
+			__m256i v0 = _mm256_loadu_si256(
+					(const __m256i *)(src + i));
+			__m256i v1 = _mm256_loadu_si256(
+					(const __m256i *)(src + i + 32));
+			_mm256_storeu_si256((__m256i *)(dest + i), v0);
+			_mm256_storeu_si256((__m256i *)(dest + i + 32), v1);
+			_mm256_stream_si256((__m256i *)(nt_dest + i), v0);
+			_mm256_stream_si256((__m256i *)(nt_dest + i + 32), v1);
+		}
+	} else {
+		for (; i + 64 <= size; i += 64) {
+			__m256i v0 = _mm256_loadu_si256(
+					(const __m256i *)(src + i));
+			__m256i v1 = _mm256_loadu_si256(
+					(const __m256i *)(src + i + 32));
+			_mm256_stream_si256((__m256i *)(nt_dest + i), v0);
+			_mm256_stream_si256((__m256i *)(nt_dest + i + 32), v1);
+		}
+	}
+	_mm_sfence();
+	if (dest) {
+		memcpy(dest + i, src + i, size - i);
+	}
+	memcpy(nt_dest + i, src + i, size - i);
+}
@@ -26,6 +26,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <x86intrin.h>
 
@@ -117,3 +118,54 @@ size_t run_interval_diff_avx512f(const int diff_window_size,
 
 	return dc;
 }
+
+/* Below this size, aligning the stores and fencing them costs more than is
+ * saved by not filling the cache */
+#define STREAM_MIN_SIZE 1024
+
+void copy_span_avx512f(char *__restrict__ dest, char *__restrict__ nt_dest,
+		const char *__restrict__ src, size_t size)
+{
+	if (!nt_dest || size < STREAM_MIN_SIZE) {
+		if (dest) {
+			memcpy(dest, src, size);
+		}
+		if (nt_dest) {
+			memcpy(nt_dest, src, size);
+		}
+		return;
+	}
+	/* Streaming stores must be aligned */
+	size_t head = (size_t)(-(uintptr_t)nt_dest) & 63;
+	if (dest) {
+		memcpy(dest, src, head);
+	}
+	memcpy(nt_dest, src, head);
+	size_t i = head;
+	if (dest) {
+		for (; i + 128 <= size; i += 128) {
+			__m512i v0 = _mm512_loadu_si512(
+					(const __m512i *)(src + i));
+			__m512i v1 = _mm512_loadu_si512(
+					(const __m512i *)(src + i + 64));
+			_mm512_storeu_si512((__m512i *)(dest + i), v0);
+			_mm512_storeu_si512((__m512i *)(dest + i + 64), v1);
+			_mm512_stream_si512((__m512i *)(nt_dest + i), v0);
+			_mm512_stream_si512((__m512i *)(nt_dest + i + 64), v1);
+		}
+	} else {
+		for (; i + 128 <= size; i += 128) {
+			__m512i v0 = _mm512_loadu_si512(
+					(const __m512i *)(src + i));
+			__m512i v1 = _mm512_loadu_si512(
+					(const __m512i *)(src + i + 64));
+			_mm512_stream_si512((__m512i *)(nt_dest + i), v0);
+			_mm512_stream_si512((__m512i *)(nt_dest + i + 64), v1);
+		}
+	}
+	_mm_sfence();
+	if (dest) {
+		memcpy(dest + i, src + i, size - i);
+	}
+	memcpy(nt_dest + i, src + i, size - i);
+}
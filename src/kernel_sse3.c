@@ -26,6 +26,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <emmintrin.h> // sse
 #include <pmmintrin.h> // sse2
@@ -133,3 +134,54 @@ size_t run_interval_diff_sse3(const int diff_window_size,
 	}
 	return dc;
 }
+
+/* Below this size, aligning the stores and fencing them costs more than is
+ * saved by not filling the cache */
+#define STREAM_MIN_SIZE 1024
+
+void copy_span_sse3(char *__restrict__ dest, char *__restrict__ nt_dest,
+		const char *__restrict__ src, size_t size)
+{
+	if (!nt_dest || size < STREAM_MIN_SIZE) {
+		if (dest) {
+			memcpy(dest, src, size);
+		}
+		if (nt_dest) {
+			memcpy(nt_dest, src, size);
+		}
+		return;
+	}
+	/* Streaming stores must be aligned */
+	size_t head = (size_t)(-(uintptr_t)nt_dest) & 15;
+	if (dest) {
+		memcpy(dest, src, head);
+	}
+	memcpy(nt_dest, src, head);
+	size_t i = head;
+	if (dest) {
+		for (; i + 32 <= size; i += 32) {
+			__m128i v0 = _mm_loadu_si128(
+					(const __m128i *)(src + i));
+			__m128i v1 = _mm_loadu_si128(
+					(const __m128i *)(src + i + 16));
+			_mm_storeu_si128((__m128i *)(dest + i), v0);
+			_mm_storeu_si128((__m128i *)(dest + i + 16), v1);
+			_mm_stream_si128((__m128i *)(nt_dest + i), v0);
+			_mm_stream_si128((__m128i *)(nt_dest + i + 16), v1);
+		}
+	} else {
+		for (; i + 32 <= size; i += 32) {
+			__m128i v0 = _mm_loadu_si128(
+					(const __m128i *)(src + i));
+			__m128i v1 = _mm_loadu_si128(
+					(const __m128i *)(src + i + 16));
+			_mm_stream_si128((__m128i *)(nt_dest + i), v0);
+			_mm_stream_si128((__m128i *)(nt_dest + i + 16), v1);
+		}
+	}
+	_mm_sfence();
+	if (dest) {
+		memcpy(dest + i, src + i, size - i);
+	}
+	memcpy(nt_dest + i, src + i, size - i);
+}
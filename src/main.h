@@ -34,6 +34,8 @@ struct main_config {
 	int n_worker_threads;
 	enum compression_mode compression;
 	int compression_level;
+	/* if true, compression_level is only the initial level */
+	bool compression_auto;
 	bool no_gpu;
 	bool only_linear_dmabuf;
 	bool video_if_possible;
@@ -46,13 +48,204 @@ struct main_config {
 	uint32_t vsock_port;
 	bool vsock_to_host;
 	const char *title_prefix;
+	bool io_uring;
+	/* if not NULL, periodically append statistics to this file/socket */
+	const char *stats_path;
+	/* if true, send references to file content the remote already has */
+	bool dedup;
+	/* if nonzero, the number of unacknowledged bytes beyond which buffer
+	 * updates are coalesced and frame events are held back */
+	size_t max_inflight;
+	/* if true, coalesce buffer updates and hold back frame events while
+	 * commits are presented more than a frame later than they can be */
+	bool collapse_frames;
+	/* if true, compress buffer updates using a dictionary made from the
+	 * first data sent */
+	bool compress_dict;
+	/* if not NULL, record the messages received from the channel to a file
+	 * starting with this path */
+	const char *record_path;
+	/* the total number of channel connections the waypipe-server opens,
+	 * over which buffer updates are spread */
+	int n_streams;
+	/* if nonzero, free the mirrors of files which have not changed for
+	 * between one and two such periods, in seconds */
+	uint32_t evict_idle_secs;
+	/* if true, keep a process ready which has already set up what the
+	 * next connection will need */
+	bool prewarm;
+	/* if true, the connections of a multi-client session are run by
+	 * threads of one process, which share their worker threads */
+	bool shared_workers;
+	/* if not NULL, the threads which run the tasks of the connection,
+	 * instead of ones made for it */
+	struct worker_group *workers;
 };
+
+/** Latency from wl_surface.commit until the remote side acknowledged the
+ * message containing it, accumulated over a reporting period */
+struct surface_latency {
+	uint32_t surface_id;
+	uint32_t count;
+	uint64_t total_ns, max_ns;
+};
+/** A commit whose acknowledgement has not yet been received */
+struct pending_commit {
+	uint32_t surface_id;
+	/* If `queued`, the number of the last message containing the commit */
+	bool queued;
+	uint32_t msgno;
+	uint64_t time_ns;
+};
+/** State for the --stats output */
+struct wp_stats {
+	int fd; /* -1 if disabled */
+	bool display_side;
+	uint64_t period_start_ns;
+	int npending, pending_size;
+	struct pending_commit *pending;
+	int nsurfaces, surfaces_size;
+	struct surface_latency *surfaces;
+	/* Maxima over the period */
+	int max_queued_blocks;
+	size_t max_unacked_bytes;
+	/* Written, but not yet acknowledged */
+	size_t max_retained_bytes;
+	uint64_t bytes_written, bytes_read;
+	/* Acknowledgements sent without other messages to accompany them */
+	uint64_t standalone_acks;
+	/* Latest estimate, not reset between reports */
+	uint64_t ack_rtt_ns;
+};
+
+/** State for --record */
+struct session_recorder {
+	int fd; /* -1 if disabled */
+	uint64_t start_ns;
+};
+
+/** A buffer update sent over an extra channel connection. Its place in the
+ * transfer queue is taken by `ref` until it has been acknowledged. */
+struct striped_block {
+	struct wmsg_stripe ref;
+	struct iovec data;
+	bool static_alloc, arena_alloc;
+};
+/** One of the extra channel connections of a session */
+struct channel_stripe {
+	int fd; /* -1 if not connected */
+	/* Blocks assigned to this connection, in order; the first `nwritten`
+	 * have been completely written, and `partial_write_amt` bytes of the
+	 * next one */
+	struct striped_block **blocks;
+	int nblocks, blocks_size;
+	int nwritten;
+	size_t partial_write_amt;
+	size_t unwritten_bytes;
+	/* Data read from the connection; `recv_start` is at a message header */
+	char *recv_buffer;
+	size_t recv_size, recv_start, recv_end;
+	bool recv_closed;
+};
+/** State for --streams. Buffer updates are written over whichever channel
+ * connection has the least unwritten data, while the main channel keeps the
+ * order in which all messages are handled. */
+struct channel_stripes {
+	/* The connection with index i is at i - 1 */
+	struct channel_stripe s[MAX_CHANNEL_STREAMS - 1];
+	int count;
+	/* Connections with higher indices are never made */
+	int max_index;
+	/* Whether connections which are missing may still be handed over */
+	bool may_connect;
+};
+
+/** When to acknowledge received messages. Acknowledgements are sent along
+ * with any other messages written to the channel; when there are none, they
+ * are sent alone after a delay which grows with the round trip time, so that
+ * a burst of received messages needs only one, or immediately once enough
+ * data was received that the other side retains a lot of it. */
+struct ack_cadence {
+	/* Smoothed time from writing a message until it was acknowledged;
+	 * 0 until measured */
+	uint64_t rtt_ns;
+	bool probing;
+	uint32_t probe_msgno;
+	uint64_t probe_ns;
+	/* When the oldest unacknowledged message was noticed, or 0 */
+	uint64_t pending_since_ns;
+	/* Size of messages received since the last acknowledgement */
+	size_t pending_bytes;
+};
+
+/** Estimate of the time from a surface's wl_surface.commit until the remote
+ * compositor presented it, from wp_presentation_feedback.presented */
+struct present_estimate {
+	uint32_t surface_id;
+	/* Exponentially weighted mean of the latency */
+	int64_t smoothed_ns;
+	/* Lowest latency in the current and previous windows of samples; the
+	 * lower of the two estimates the latency without queued frames, plus
+	 * any offset between the two machines' clocks */
+	int64_t window_min_ns, prev_min_ns;
+	int nwindow;
+	uint32_t refresh_ns; /* 0 if unknown */
+	uint64_t last_sample;
+};
+
+/** State for --max-inflight and --collapse-frames. While the channel is
+ * congested, or frames are queued for presentation, buffer updates are
+ * postponed (their damage accumulates), the commits relying on them are held
+ * with all later requests, and the events which tell the application that a
+ * frame was shown are held back, so that the application renders no faster
+ * than its frames can be sent and shown. */
+struct frame_pacing {
+	size_t max_inflight; /* 0 if disabled */
+	bool congested;
+	bool collapse_frames;
+	/* Set while a surface's commits are presented more than a frame later
+	 * than its lowest recent latency, until that drops below half a frame
+	 * or no commits are waiting to be presented */
+	bool behind;
+	uint32_t behind_surface;
+	/* Commits with presentation feedback not yet presented or discarded */
+	int nawaiting;
+	struct present_estimate *estimates;
+	int nestimates, estimates_size;
+	uint64_t nsamples;
+	/* Buffers whose updates the last collection postponed */
+	int ndeferred;
+	/* Complete Wayland messages to be sent to the application once the
+	 * channel is no longer congested */
+	char *held;
+	int held_len, held_size;
+	/* Objects for which events are held, and whose wl_display.delete_id
+	 * must therefore also be held */
+	uint32_t *held_ids;
+	int nheld_ids, held_ids_size;
+	/* Protocol data from the program, and the RIDs of the fds sent with
+	 * it, held from a commit whose buffer updates were postponed until
+	 * those updates are collected */
+	char *held_proto;
+	int held_proto_len, held_proto_size;
+	int *held_rids;
+	int nheld_rids, held_rids_size;
+	/* Commits with presentation feedback read since the last call to
+	 * release_held_protocol, and those whose requests are held; the
+	 * latter are not counted in `nawaiting` until they are sent */
+	int nnew_feedback, nheld_feedback;
+};
+
 struct globals {
 	const struct main_config *config;
 	struct fd_translation_map map;
 	struct render_data render;
 	struct message_tracker tracker;
 	struct thread_pool threads;
+	struct wp_stats stats;
+	struct frame_pacing pacing;
+	struct session_recorder recorder;
+	struct channel_stripes stripes;
 };
 
 /** Main processing loop
@@ -60,12 +253,272 @@ struct globals {
  * chanfd: connected socket to channel
  * progfd: connected socket to Wayland program
  * linkfd: optional socket providing new chanfds. (-1 means not provided)
+ * stripe_fds: the `nstripes` extra channel connections, from index 1;
+ *   unconnected ones are -1
  *
  * Returns either EXIT_SUCCESS or EXIT_FAILURE (if exit caused by an error.)
  */
 int main_interface_loop(int chanfd, int progfd, int linkfd,
+		const int *stripe_fds, int nstripes,
 		const struct main_config *config, bool display_side);
 
+/** A process forked ahead of time for --prewarm, which is waiting in
+ * warm_interface_loop for the next connection */
+struct warm_process {
+	pid_t pid; /* 0 if there is none */
+	int linkfd;
+};
+/** Sent to a warm process along with the fds of its connection: the channel,
+ * the program, the link if WARM_HAS_LINK is set, and then each extra channel
+ * connection whose bit is set in `stripe_mask` */
+struct warm_handoff {
+	uint32_t flags;
+	uint32_t stripe_mask;
+};
+#define WARM_HAS_LINK 0x1
+#define WARM_NO_GPU 0x2
+
+/** Like main_interface_loop, but the connection is not yet known. Everything
+ * that does not depend on it, including the thread pool and the render
+ * device, is set up first; then the process waits for the connection's fds
+ * to be sent over `warmfd`. Returns EXIT_SUCCESS without running if `warmfd`
+ * is closed first. */
+int warm_interface_loop(
+		int warmfd, const struct main_config *config, bool display_side);
+/** If `warm` is ready, send it the fds of a new connection and return its
+ * pid. The warm process is used up either way. Returns -1 if it was not
+ * ready or could not be reached; the fds remain owned by the caller. */
+pid_t hand_off_connection(struct warm_process *warm, uint32_t flags,
+		int chanfd, int progfd, int linkfd, const int *stripe_fds,
+		int nstripes);
+
+struct conn_thread;
+/** The connections run by threads of this process, for --shared-workers,
+ * and the worker threads they all use */
+struct conn_threads {
+	struct worker_group workers;
+	bool has_workers;
+	struct conn_thread **list;
+	int count, size;
+	/* The number of threads started so far */
+	int nstarted;
+};
+/** Run main_interface_loop for a new connection on a thread, which takes
+ * ownership of the fds; `linkfd` must be valid, since closing its other end
+ * is how the thread is woken to check shutdown_flag. When the connection
+ * ends, the calling thread is sent SIGCHLD. Returns -1 on failure, in which
+ * case the fds remain owned by the caller. */
+int start_connection_thread(struct conn_threads *threads, int chanfd,
+		int progfd, int linkfd, const int *stripe_fds, int nstripes,
+		const struct connection_token *token,
+		const struct main_config *config, bool display_side);
+/** Join the threads whose connections have ended, and close their links in
+ * `connmap`. If `wait` is set, wait for all of them to end, and then stop
+ * the shared workers. */
+void reap_connection_threads(struct conn_threads *threads,
+		struct conn_map *connmap, bool wait);
+
+struct pollfd;
+struct uring_poller;
+/** Create a poller that keeps its poll requests registered with an io_uring
+ * between calls. Returns NULL and sets errno if io_uring is not available. */
+struct uring_poller *create_uring_poller(void);
+void destroy_uring_poller(struct uring_poller *p);
+/** Drop-in replacement for poll(2). Only the fds whose readiness was last
+ * reported, or whose requested events have changed, are resubmitted to the
+ * kernel, so `reset` must be set whenever a previously listed fd may have
+ * been closed (and its number reused) since the last call. */
+int uring_poll(struct uring_poller *p, struct pollfd *pfds, int nfds,
+		int timeout_ms, bool reset);
+
+/** Open the --stats output, which may be a file (opened for appending) or a
+ * Unix socket, and enable the thread pool's counters. Returns -1 on failure. */
+int setup_stats(struct wp_stats *stats, struct thread_pool *pool,
+		const char *path, bool display_side);
+void cleanup_stats(struct wp_stats *stats);
+/** Record the time at which a surface was committed */
+void stats_note_commit(struct wp_stats *stats, uint32_t surface_id);
+/** Mark all unqueued commits as sent in the message `msgno` */
+void stats_note_commits_queued(struct wp_stats *stats, uint32_t msgno);
+/** Compute the latency of all commits sent up to message `msgno` */
+void stats_note_ack(struct wp_stats *stats, uint32_t msgno);
+/** Record the transfer queue size, to report its maximum */
+void stats_note_queue(struct wp_stats *stats,
+		const struct transfer_queue *transfers);
+/** Record the size of the messages written but not yet acknowledged, to
+ * report its maximum */
+void stats_note_retained(struct wp_stats *stats,
+		const struct transfer_queue *transfers);
+/** If the reporting period has elapsed, write a line of JSON with the
+ * statistics for the period. Returns the number of milliseconds until the
+ * next report is due, for use as a poll timeout, or -1 if disabled. */
+int stats_report(struct wp_stats *stats, struct thread_pool *pool);
+
+/** Create the --record output file, `path` followed by a period and the
+ * process id, for messages made with the given compression mode. Returns -1
+ * on failure. */
+int setup_recorder(struct session_recorder *rec, const char *path,
+		enum compression_mode compression);
+void cleanup_recorder(struct session_recorder *rec);
+/** Append the `size` byte channel message `msg`, with the time it arrived, to
+ * the recording. Recording stops if this fails. */
+void record_message(struct session_recorder *rec, const char *msg, size_t size);
+
+/** Measurements from \ref replay_recording */
+struct replay_stats {
+	int nmessages;
+	/* Number of frames which changed any file */
+	int nframes;
+	/* Time between the first and last recorded messages */
+	uint64_t duration_ns;
+	uint64_t recorded_bytes;
+	/* Size of the regions of files rewritten in each frame */
+	uint64_t changed_bytes;
+	/* Size of the replayed file updates, and of protocol messages */
+	uint64_t wire_bytes;
+	/* Messages for pipes and DMABUFs, which are not replayed */
+	int nskipped;
+	uint64_t skipped_bytes;
+	/* Time to collect and compress updates, and to apply them */
+	uint64_t collect_ns, apply_ns;
+	uint64_t max_collect_ns, max_apply_ns;
+	/* Frames after which a copy did not match its original */
+	int nmismatched;
+};
+/** Rebuild the files in a recording made with --record. After each message
+ * with protocol data, copy the changes to the files since the last one into
+ * a second set of files, and measure the time to collect and apply them, as
+ * between two Waypipe instances with the given settings. Returns -1 if the
+ * recording could not be read or replayed. */
+int replay_recording(const char *path, enum compression_mode compression,
+		int compression_level, int n_worker_threads,
+		struct replay_stats *stats);
+/** Measurements from \ref replay_protocol */
+struct parse_stats {
+	/* Whether the recording was made by the display side Waypipe, and
+	 * so contains requests instead of events */
+	bool display_side;
+	/* Wayland messages parsed in each pass, and groups of messages that
+	 * were skipped because they were sent with fds */
+	int nmessages;
+	int nskipped;
+	int npasses;
+	/* Total time spent in parse_and_prune_messages */
+	uint64_t parse_ns;
+};
+/** Run the protocol messages of a recording made with --record through
+ * parse_and_prune_messages `npasses` times, each time with a new set of
+ * protocol objects, and measure the time spent parsing. Returns -1 if the
+ * recording could not be read. */
+int replay_protocol(const char *path, const struct main_config *config,
+		int npasses, struct parse_stats *stats);
+
+void setup_stripes(struct channel_stripes *st);
+/** Use `fd` as the extra channel connection with the given index. Returns -1
+ * (and closes `fd`) on failure, or if that connection already exists. */
+int add_stripe(struct channel_stripes *st, int index, int fd);
+/** Close all extra channel connections, and put the blocks sent over them
+ * back into the transfer queue */
+void reset_stripes(struct channel_stripes *st, struct transfer_queue *td);
+/** Move large buffer updates which the main channel has not started to write
+ * to the extra connections with less unwritten data, leaving references in
+ * their place. Returns the number of blocks moved. */
+int stripe_transfers(struct channel_stripes *st, struct transfer_queue *td);
+/** Put the blocks of all messages up to `inclusive_cutoff` back in the
+ * transfer queue, so that they can be freed with the others */
+void release_striped_blocks(struct channel_stripes *st,
+		struct transfer_queue *td, uint32_t inclusive_cutoff);
+/** Add pollfds for the extra connections, at most MAX_CHANNEL_STREAMS - 1;
+ * returns the number added */
+int fill_stripe_pollfds(const struct channel_stripes *st, struct pollfd *pfds);
+/** Read from and write to the extra connections which `pfds` report as
+ * ready. Returns 1 if messages may have arrived, 0 if not, and ERR_DISCONN or
+ * ERR_FATAL on failure. */
+int advance_stripes(struct channel_stripes *st, const struct pollfd *pfds,
+		int npfds);
+/** Write pending blocks to all extra connections, without waiting */
+int write_stripes(struct channel_stripes *st);
+/** Return the next complete message received on the extra connection with
+ * the given index, or NULL if there is none yet; `closed` is then set if none
+ * will arrive */
+char *peek_striped_message(
+		struct channel_stripes *st, int index, bool *closed);
+/** Whether a message may still arrive on the extra connection with the given
+ * index: it is connected, or it may yet be handed over */
+bool stripe_may_receive(const struct channel_stripes *st, int index);
+/** Discard the message returned by peek_striped_message */
+void pop_striped_message(struct channel_stripes *st, int index);
+
+/** Note that a message of `size` bytes was received */
+void ack_note_received(struct ack_cadence *a, size_t size);
+/** Note that an acknowledgement of all received messages was queued */
+void ack_note_sent(struct ack_cadence *a);
+/** Note that messages up to `msgno` were written at time `now`, and start
+ * timing their acknowledgement if no other is being timed */
+void ack_note_written(struct ack_cadence *a, uint32_t msgno, uint64_t now);
+/** Note that the other side acknowledged messages up to `msgno`; returns
+ * true if this updated the round trip time estimate */
+bool ack_note_confirmed(struct ack_cadence *a, uint32_t msgno, uint64_t now);
+/** With an acknowledgement pending, return the number of milliseconds until
+ * it should be sent alone, or 0 if it should be sent now */
+int ack_delay_ms(struct ack_cadence *a, uint64_t now);
+
+void cleanup_frame_pacing(struct frame_pacing *p);
+/** Recompute whether the channel is congested, given that all messages up
+ * to `acked_msgno` have been acknowledged. Congestion starts once more than
+ * `max_inflight` bytes are unacknowledged, and ends once at most half as many
+ * remain. */
+void update_frame_pacing(struct frame_pacing *p,
+		const struct transfer_queue *transfers, uint32_t acked_msgno);
+/** Whether buffer updates should be postponed and frame events held, as the
+ * channel is congested or frames are queued for presentation */
+bool pacing_is_holding(const struct frame_pacing *p);
+/** Whether updates postponed while pacing_is_holding should now be collected,
+ * even if the program has sent nothing since */
+bool pacing_should_collect(const struct frame_pacing *p);
+/** Collect the updates of all buffers into `transfers`, postponing those
+ * which can wait while pacing_is_holding. Returns the number postponed. */
+int collect_buffer_updates(
+		struct globals *g, struct transfer_queue *transfers);
+/** Note that a commit was made for which presentation feedback was asked */
+void pacing_note_feedback_commit(struct frame_pacing *p);
+/** Add a sample of the latency from a commit of `surface_id` until it was
+ * presented, with the output's `refresh_ns` (0 if unknown), and update
+ * whether frames are queued */
+void pacing_note_presented(struct frame_pacing *p, uint32_t surface_id,
+		int64_t latency_ns, uint32_t refresh_ns);
+/** Note that a commit with presentation feedback was discarded */
+void pacing_note_discarded(struct frame_pacing *p);
+/** If the channel is congested, frames are queued, or earlier events are
+ * still held, keep a copy of the `len` byte message `msg` to object `obj_id`
+ * and return true; the caller should then drop the message. */
+bool pacing_hold_event(struct frame_pacing *p, const uint32_t *msg, int len,
+		uint32_t obj_id);
+/** Return true, keeping a copy of the message, if `msg` is a
+ * wl_display.delete_id for an object with held events */
+bool pacing_hold_delete_id(struct frame_pacing *p, const uint32_t *msg,
+		int len, uint32_t id);
+/** Unless pacing_is_holding, replace the contents of `dst` with the
+ * held messages. Returns the number of bytes released, or -1 on allocation
+ * failure. */
+int release_held_events(struct frame_pacing *p, struct char_window *dst);
+/** Whether protocol data from the program is held */
+bool pacing_has_held_protocol(const struct frame_pacing *p);
+/** If the last collection postponed buffer updates, or earlier protocol data
+ * is still held, keep a copy of the `len` bytes of protocol data at `data`
+ * and of the `nrids` RIDs at `rids`, whose transfer references are then kept
+ * until release. Returns 1 if the data was held, 0 if it should be sent now,
+ * and -1 on allocation failure. */
+int pacing_hold_protocol(struct frame_pacing *p, const char *data, int len,
+		const int *rids, int nrids);
+/** Call once per collection, after the protocol data read has been held or
+ * sent. If no updates were postponed, replace the contents of `proto` and
+ * `rids` with the held protocol data and RIDs and return 1, so that they can
+ * be sent after the updates; otherwise return 0. Returns -1 on allocation
+ * failure. */
+int release_held_protocol(struct frame_pacing *p, struct char_window *proto,
+		struct int_window *rids);
+
 /** Act as a Wayland server */
 int run_server(int cwd_fd, struct socket_path socket_path,
 		const char *display_suffix, const char *control_path,
@@ -79,5 +532,9 @@ int run_client(int cwd_fd, const char *sock_folder_name, int sock_folder_fd,
 		int channelsock);
 /** Run benchmarking tool; n_worker_threads defined as with \ref main_config */
 int run_bench(float bandwidth_mBps, uint32_t test_size, int n_worker_threads);
+/** Replay a recorded session with the compression settings and thread count
+ * from `config`, and report the time taken and amount of data sent */
+int run_bench_replay(float bandwidth_mBps, const char *path,
+		const struct main_config *config);
 
 #endif // WAYPIPE_MAIN_H
@@ -30,6 +30,8 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <poll.h>
+#include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
@@ -189,6 +191,8 @@ struct way_msg_state {
 
 	/** Queue of fds to be used by protocol parser */
 	struct int_window fds;
+	/** RIDs of fds released with held protocol data */
+	struct int_window held_rids;
 
 	/** Individual messages, to be sent out via writev and deleted on
 	 * acknowledgement */
@@ -198,7 +202,8 @@ struct way_msg_state {
 	/** Maximum chunk size to writev at once*/
 	int max_iov;
 
-	/** Transfers to send after the compute queue is empty */
+	/** Transfers to send after the compute queue is empty, allocated from
+	 * the arena of `transfers` */
 	int ntrailing;
 	struct iovec trailing[3];
 
@@ -227,6 +232,10 @@ struct chan_msg_state {
 	size_t recv_start; // (recv_buffer+rev_start) should be a message header
 	size_t recv_end;   // last byte read from channel, always >=recv_start
 	int recv_unhandled_messages; // number of messages to parse
+
+	/** If not -1, the index of the extra channel connection whose next
+	 * message must be handled before any more from the channel */
+	int held_stripe;
 };
 
 /** State used by both forward and reverse messages */
@@ -243,6 +252,7 @@ struct cross_state {
 	/* Which was the last message number sent to the other application which
 	 * was acknowledged by that side? */
 	uint32_t last_confirmed_msgno;
+	struct ack_cadence acks;
 };
 
 static int interpret_chanmsg(struct chan_msg_state *cmsg,
@@ -285,9 +295,15 @@ static int interpret_chanmsg(struct chan_msg_state *cmsg,
 				    cxs->last_confirmed_msgno)) {
 			cxs->last_confirmed_msgno = ackm->messages_received;
 		}
+		if (ack_note_confirmed(&cxs->acks, ackm->messages_received,
+				    monotonic_ns())) {
+			g->stats.ack_rtt_ns = cxs->acks.rtt_ns;
+		}
+		stats_note_ack(&g->stats, ackm->messages_received);
 		return 0;
 	} else {
 		cxs->last_received_msgno++;
+		ack_note_received(&cxs->acks, unpadded_size);
 		if (msgno_gt(cxs->newest_received_msgno,
 				    cxs->last_received_msgno)) {
 			/* Skip packet, as we already received it */
@@ -298,6 +314,17 @@ static int interpret_chanmsg(struct chan_msg_state *cmsg,
 		}
 		cxs->newest_received_msgno = cxs->last_received_msgno;
 	}
+	record_message(&g->recorder, packet, unpadded_size);
+
+	if (type != WMSG_BUFFER_FILL && type != WMSG_BUFFER_DIFF) {
+		/* Buffer updates may still be applied by worker threads; make
+		 * them visible before any protocol messages are released, or
+		 * the shadow structures are otherwise modified */
+		int ret = wait_for_apply_tasks(&g->threads);
+		if (ret < 0) {
+			return ret;
+		}
+	}
 
 	if (type == WMSG_INJECT_RIDS) {
 		const int32_t *fds = &((const int32_t *)packet)[1];
@@ -371,6 +398,14 @@ static int interpret_chanmsg(struct chan_msg_state *cmsg,
 			cmsg->proto_fds.zone_end -= cmsg->proto_fds.zone_start;
 		}
 		return 0;
+	} else if (type == WMSG_COMPRESSION_DICT) {
+		struct bytebuf msg = {
+				.data = packet,
+				.size = unpadded_size,
+		};
+		wp_debug("Received WMSG_COMPRESSION_DICT with %zu bytes",
+				unpadded_size - sizeof(uint32_t));
+		return apply_compression_dict(&g->threads, &msg);
 	} else {
 		if (unpadded_size < sizeof(struct wmsg_basic)) {
 			wp_error("Message is too small to contain header+RID, %d bytes",
@@ -391,10 +426,77 @@ static int interpret_chanmsg(struct chan_msg_state *cmsg,
 	}
 }
 
+/* Handle the message from the extra connection that `cmsg->held_stripe` is
+ * waiting for, if it has arrived */
+static int interpret_held_stripe_msg(struct chan_msg_state *cmsg,
+		struct cross_state *cxs, struct globals *g, bool display_side)
+{
+	bool closed = false;
+	char *msg = peek_striped_message(
+			&g->stripes, cmsg->held_stripe, &closed);
+	if (!msg) {
+		if (closed) {
+			wp_debug("Extra channel connection %d closed before sending the next message",
+					cmsg->held_stripe);
+			return ERR_DISCONN;
+		}
+		if (!stripe_may_receive(&g->stripes, cmsg->held_stripe)) {
+			wp_error("Extra channel connection %d is not connected, and can no longer be",
+					cmsg->held_stripe);
+			return ERR_FATAL;
+		}
+		return 0;
+	}
+	int ret = interpret_chanmsg(cmsg, cxs, g, display_side, msg);
+	pop_striped_message(&g->stripes, cmsg->held_stripe);
+	cmsg->held_stripe = -1;
+	return ret;
+}
+
+/* Like interpret_chanmsg, except that a WMSG_STRIPE message is replaced by
+ * the message it refers to; if that has not yet arrived, `cmsg->held_stripe`
+ * remains set */
+static int interpret_chanmsg_or_hold(struct chan_msg_state *cmsg,
+		struct cross_state *cxs, struct globals *g, bool display_side,
+		char *packet)
+{
+	uint32_t size_and_type = *(uint32_t *)packet;
+	if (transfer_type(size_and_type) != WMSG_STRIPE) {
+		return interpret_chanmsg(cmsg, cxs, g, display_side, packet);
+	}
+	const struct wmsg_stripe *ref = (const struct wmsg_stripe *)packet;
+	if (transfer_size(size_and_type) < sizeof(struct wmsg_stripe)) {
+		wp_error("Received invalid WMSG_STRIPE message");
+		return ERR_FATAL;
+	}
+	/* Otherwise, the channel would wait forever */
+	if (!stripe_may_receive(&g->stripes, (int)ref->stripe)) {
+		wp_error("Received WMSG_STRIPE for extra channel connection %u, which is not connected",
+				ref->stripe);
+		return ERR_FATAL;
+	}
+	cmsg->held_stripe = (int)ref->stripe;
+	return interpret_held_stripe_msg(cmsg, cxs, g, display_side);
+}
+
 static int advance_chanmsg_chanread(struct chan_msg_state *cmsg,
 		struct cross_state *cxs, int chanfd, bool display_side,
 		struct globals *g)
 {
+	if (cmsg->held_stripe != -1) {
+		int ret = interpret_held_stripe_msg(
+				cmsg, cxs, g, display_side);
+		if (ret < 0) {
+			return ret;
+		}
+		if (cmsg->held_stripe != -1) {
+			return 0;
+		}
+		if (cmsg->proto_write.zone_start < cmsg->proto_write.zone_end) {
+			goto next_stage;
+		}
+	}
+
 	/* Setup read operation to be able to read a minimum number of bytes,
 	 * wrapping around as early as overlap conditions permit */
 	if (cmsg->recv_unhandled_messages == 0) {
@@ -470,10 +572,11 @@ static int advance_chanmsg_chanread(struct chan_msg_state *cmsg,
 			wp_error("chanfd read failure: %s", strerror(errno));
 			return ERR_FATAL;
 		} else {
+			g->stats.bytes_read += (uint64_t)r;
 			if (nvec == 2 && (size_t)r >= vec[0].iov_len) {
 				/* Complete parsing this message */
-				int cm_ret = interpret_chanmsg(cmsg, cxs, g,
-						display_side,
+				int cm_ret = interpret_chanmsg_or_hold(cmsg,
+						cxs, g, display_side,
 						cmsg->recv_buffer +
 								cmsg->recv_start);
 				if (cm_ret < 0) {
@@ -483,6 +586,9 @@ static int advance_chanmsg_chanread(struct chan_msg_state *cmsg,
 				cmsg->recv_start = 0;
 				cmsg->recv_end = (size_t)r - vec[0].iov_len;
 
+				if (cmsg->held_stripe != -1) {
+					return 0;
+				}
 				if (cmsg->proto_write.zone_start <
 						cmsg->proto_write.zone_end) {
 					goto next_stage;
@@ -514,13 +620,16 @@ static int advance_chanmsg_chanread(struct chan_msg_state *cmsg,
 		char *packet_start = &cmsg->recv_buffer[cmsg->recv_start];
 		uint32_t *header = (uint32_t *)packet_start;
 		size_t sz = transfer_size(*header);
-		int cm_ret = interpret_chanmsg(
+		int cm_ret = interpret_chanmsg_or_hold(
 				cmsg, cxs, g, display_side, packet_start);
 		if (cm_ret < 0) {
 			return cm_ret;
 		}
 		cmsg->recv_start += alignz(sz, 4);
 		cmsg->recv_unhandled_messages--;
+		if (cmsg->held_stripe != -1) {
+			return 0;
+		}
 
 		if (cmsg->proto_write.zone_start < cmsg->proto_write.zone_end) {
 			goto next_stage;
@@ -609,6 +718,52 @@ static int advance_chanmsg_transfer(struct globals *g,
 	return 0;
 }
 
+/* Blocks at least this large are written without copying, when the channel
+ * supports it; for smaller blocks, pinning pages and handling the completion
+ * notification costs more than the copy saved */
+#define ZEROCOPY_MIN_BLOCK 65536
+
+static bool is_zerocopy_block(const struct transfer_queue *td, int i)
+{
+	return !td->meta[i].static_alloc &&
+	       td->vecs[i].iov_len >= ZEROCOPY_MIN_BLOCK;
+}
+
+/* Collect any notifications that zero-copy writes on the channel have
+ * completed, so that the blocks which they reference may be freed */
+static void update_zerocopy_completions(struct transfer_queue *td, int chanfd)
+{
+	if (td->zc_sent == td->zc_completed || chanfd == -1) {
+		return;
+	}
+	bool copied = false;
+	if (read_zerocopy_completions(chanfd, &td->zc_completed, &copied) ==
+			-1) {
+		wp_error("Failed to read zero-copy completions: %s",
+				strerror(errno));
+	}
+	if (copied && td->zerocopy) {
+		/* The kernel will likely keep copying, so avoid the overhead
+		 * of completion tracking */
+		wp_debug("Zero-copy channel writes were copied, disabling them");
+		td->zerocopy = false;
+	}
+}
+
+/* Set up zero-copy writes for a new channel connection. Writes made on any
+ * previous connection need no longer be waited for. */
+static void reset_zerocopy(struct transfer_queue *td, int chanfd)
+{
+	td->zc_sent = 0;
+	td->zc_completed = 0;
+	for (int i = 0; i < td->end; i++) {
+		td->meta[i].zc_pending = false;
+	}
+	td->zerocopy = enable_zerocopy(chanfd) == 0;
+	wp_debug("Zero-copy channel writes are %s",
+			td->zerocopy ? "enabled" : "not supported");
+}
+
 static void clear_old_transfers(
 		struct transfer_queue *td, uint32_t inclusive_cutoff)
 {
@@ -623,9 +778,13 @@ static void clear_old_transfers(
 		if (!msgno_gt(inclusive_cutoff, td->meta[i].msgno)) {
 			break;
 		}
-		if (!td->meta[i].static_alloc) {
-			free(td->vecs[i].iov_base);
+		if (td->meta[i].zc_pending &&
+				(int32_t)(td->zc_completed -
+						td->meta[i].zc_seq) <= 0) {
+			/* The kernel may still be reading the block */
+			break;
 		}
+		transfer_block_free(td, i);
 		td->vecs[i].iov_base = NULL;
 		td->vecs[i].iov_len = 0;
 		k = i + 1;
@@ -639,6 +798,25 @@ static void clear_old_transfers(
 	}
 }
 
+/* Update the channel bandwidth measurements with the result of a write,
+ * where `offered` bytes were passed to the kernel */
+static void note_channel_write(
+		struct transfer_queue *td, size_t offered, ssize_t written)
+{
+	uint64_t now = monotonic_ns();
+	if (written > 0 && td->write_blocked) {
+		td->blocked_ns += now - td->blocked_since_ns;
+		td->blocked_bytes += (uint64_t)written;
+		td->write_blocked = false;
+	}
+	if (written < 0 || (size_t)written < offered) {
+		if (!td->write_blocked) {
+			td->write_blocked = true;
+			td->blocked_since_ns = now;
+		}
+	}
+}
+
 /* Returns 0 sucessful -1 if fatal error, -2 if closed */
 static int partial_write_transfer(int chanfd, struct transfer_queue *td,
 		int *total_written, int max_iov)
@@ -652,11 +830,41 @@ static int partial_write_transfer(int chanfd, struct transfer_queue *td,
 				orig_base + td->partial_write_amt;
 		td->vecs[td->start].iov_len = orig_len - td->partial_write_amt;
 		int count = min(max_iov, td->end - td->start);
-		ssize_t wr = writev(chanfd, &td->vecs[td->start], count);
+		bool zerocopy = false;
+		if (td->zerocopy) {
+			/* Write either a run of large blocks without copying,
+			 * or a run of small blocks normally */
+			zerocopy = is_zerocopy_block(td, td->start);
+			int run = 1;
+			while (run < count && is_zerocopy_block(td,
+							      td->start + run) ==
+							      zerocopy) {
+				run++;
+			}
+			count = run;
+		}
+		size_t offered = 0;
+		for (int i = 0; i < count; i++) {
+			offered += td->vecs[td->start + i].iov_len;
+		}
+		ssize_t wr;
+		if (zerocopy) {
+			wr = zerocopy_writev(
+					chanfd, &td->vecs[td->start], count);
+			if (wr == -1 && errno == ENOBUFS) {
+				/* Out of memory to track completions */
+				zerocopy = false;
+				wr = writev(chanfd, &td->vecs[td->start],
+						count);
+			}
+		} else {
+			wr = writev(chanfd, &td->vecs[td->start], count);
+		}
 		td->vecs[td->start].iov_base = orig_base;
 		td->vecs[td->start].iov_len = orig_len;
 
 		if (wr == -1 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
+			note_channel_write(td, offered, -1);
 			return 0;
 		} else if (wr == -1 &&
 				(errno == ECONNRESET || errno == EPIPE)) {
@@ -667,6 +875,13 @@ static int partial_write_transfer(int chanfd, struct transfer_queue *td,
 			return ERR_FATAL;
 		}
 
+		note_channel_write(td, offered, wr);
+
+		uint32_t zc_seq = 0;
+		if (zerocopy) {
+			zc_seq = td->zc_sent++;
+		}
+
 		size_t uwr = (size_t)wr;
 		*total_written += (int)wr;
 		while (uwr > 0 && td->start < td->end) {
@@ -675,6 +890,10 @@ static int partial_write_transfer(int chanfd, struct transfer_queue *td,
 				td->start++;
 				continue;
 			}
+			if (zerocopy) {
+				td->meta[td->start].zc_pending = true;
+				td->meta[td->start].zc_seq = zc_seq;
+			}
 			size_t left = td->vecs[td->start].iov_len -
 				      td->partial_write_amt;
 			if (left > uwr) {
@@ -753,7 +972,10 @@ static int inject_acknowledge(
 				sizeof(struct wmsg_ack);
 		wmsg->transfers.vecs[next_slot].iov_base = queued_msg;
 		wmsg->transfers.meta[next_slot].msgno = ack_msgno;
+		wmsg->transfers.meta[next_slot].lane = LANE_CONTROL;
 		wmsg->transfers.meta[next_slot].static_alloc = true;
+		wmsg->transfers.meta[next_slot].arena_alloc = false;
+		wmsg->transfers.meta[next_slot].zc_pending = false;
 		wmsg->transfers.end++;
 	}
 
@@ -763,6 +985,7 @@ static int inject_acknowledge(
 			sizeof(struct wmsg_ack), WMSG_ACK_NBLOCKS);
 	queued_msg->messages_received = cxs->last_received_msgno;
 	cxs->last_acked_msgno = cxs->last_received_msgno;
+	ack_note_sent(&cxs->acks);
 	return 0;
 }
 
@@ -776,12 +999,28 @@ static int advance_waymsg_chanwrite(struct way_msg_state *wmsg,
 	(void)transfer_load_async(&wmsg->transfers);
 
 	// First, clear out any transfers that are no longer needed
+	update_zerocopy_completions(&wmsg->transfers, chanfd);
+	release_striped_blocks(&g->stripes, &wmsg->transfers,
+			cxs->last_confirmed_msgno);
+	stats_note_retained(&g->stats, &wmsg->transfers);
 	clear_old_transfers(&wmsg->transfers, cxs->last_confirmed_msgno);
 
 	/* Acknowledge the other side's transfers as soon as possible */
 	if (cxs->last_acked_msgno != cxs->last_received_msgno) {
 		(void)inject_acknowledge(wmsg, cxs);
 	}
+	/* and let protocol messages which do not need them overtake buffer
+	 * updates */
+	if (transfer_reorder_lanes(&wmsg->transfers) > 0) {
+		wp_debug("Moved priority messages ahead of queued buffer data");
+	}
+	/* Spread buffer updates over the extra channel connections */
+	if (stripe_transfers(&g->stripes, &wmsg->transfers) > 0) {
+		int sr = write_stripes(&g->stripes);
+		if (sr < 0) {
+			return sr;
+		}
+	}
 
 	int ret = partial_write_transfer(chanfd, &wmsg->transfers,
 			&wmsg->total_written, wmsg->max_iov);
@@ -796,10 +1035,7 @@ static int advance_waymsg_chanwrite(struct way_msg_state *wmsg,
 	/* Run a task ourselves, making use of the main thread */
 	if (has_task) {
 		run_task(&task, &g->threads.threads[0]);
-
-		pthread_mutex_lock(&g->threads.work_mutex);
-		g->threads.tasks_in_progress--;
-		pthread_mutex_unlock(&g->threads.work_mutex);
+		finish_work_task(&g->threads);
 		/* To skip the next poll */
 		uint8_t triv = 0;
 		if (write(g->threads.selfpipe_w, &triv, 1) == -1) {
@@ -816,7 +1052,7 @@ static int advance_waymsg_chanwrite(struct way_msg_state *wmsg,
 
 	if (is_done && wmsg->ntrailing > 0) {
 		for (int i = 0; i < wmsg->ntrailing; i++) {
-			transfer_add(&wmsg->transfers,
+			transfer_add_arena(&wmsg->transfers,
 					wmsg->trailing[i].iov_len,
 					wmsg->trailing[i].iov_base);
 		}
@@ -837,15 +1073,23 @@ static int advance_waymsg_chanwrite(struct way_msg_state *wmsg,
 		}
 
 		/* Reset work queue */
-		pthread_mutex_lock(&g->threads.work_mutex);
 		if (g->threads.stack_count > 0 ||
-				g->threads.tasks_in_progress > 0) {
+				atomic_load(&g->threads.tasks_queued) > 0 ||
+				atomic_load(&g->threads.tasks_in_progress) > 0) {
 			wp_error("Multithreading state failure");
 		}
-		g->threads.do_work = false;
 		g->threads.stack_count = 0;
-		g->threads.tasks_in_progress = 0;
-		pthread_mutex_unlock(&g->threads.work_mutex);
+		update_compression_level(&g->threads, &wmsg->transfers);
+		update_compression_dict(&g->threads, &wmsg->transfers);
+		/* The last message of the cycle holds the protocol data */
+		stats_note_commits_queued(
+				&g->stats, wmsg->transfers.last_msgno - 1);
+		stats_note_queue(&g->stats, &wmsg->transfers);
+		g->stats.bytes_written += (uint64_t)wmsg->total_written;
+		uint32_t last_sent = wmsg->transfers.last_msgno - 1;
+		if (!msgno_gt(cxs->last_confirmed_msgno, last_sent)) {
+			ack_note_written(&cxs->acks, last_sent, monotonic_ns());
+		}
 
 		DTRACE_PROBE(waypipe, channel_write_end);
 		size_t unacked_bytes = 0;
@@ -863,13 +1107,117 @@ static int advance_waymsg_chanwrite(struct way_msg_state *wmsg,
 	}
 	return 0;
 }
+/* Return a WMSG_PROTOCOL message containing `len` bytes of protocol data,
+ * padded to a multiple of 4 bytes, and set `msg_size` to the padded size. The
+ * message is allocated from the arena of `transfers`. */
+static uint8_t *make_protocol_message(struct transfer_queue *transfers,
+		const char *data, int len, size_t *msg_size)
+{
+	size_t act_size = (size_t)len + sizeof(uint32_t);
+	uint32_t protoh = transfer_header(act_size, WMSG_PROTOCOL);
+	*msg_size = alignz(act_size, 4);
+	uint8_t *msg = transfer_block_alloc(transfers, *msg_size);
+	if (!msg) {
+		return NULL;
+	}
+	memcpy(msg, &protoh, sizeof(uint32_t));
+	memcpy(msg + sizeof(uint32_t), data, (size_t)len);
+	memset(msg + act_size, 0, *msg_size - act_size);
+	return msg;
+}
+
+int collect_buffer_updates(
+		struct globals *g, struct transfer_queue *transfers)
+{
+	int ndeferred = 0;
+	for (struct shadow_fd_link *lcur = g->map.link.l_next,
+				   *lnxt = lcur->l_next;
+			lcur != &g->map.link;
+			lcur = lnxt, lnxt = lcur->l_next) {
+		/* Note: finish_update() may delete `cur` */
+		struct shadow_fd *cur = (struct shadow_fd *)lcur;
+		if (pacing_is_holding(&g->pacing) && update_can_wait(cur)) {
+			/* Older updates are still in flight or queued for
+			 * presentation; leave the damage to be merged with
+			 * that of later commits */
+			ndeferred++;
+		} else {
+			collect_update(&g->threads, cur, transfers,
+					g->config->old_video_mode);
+		}
+		/* collecting updates can reset `pipe.remote_can_X` state, so
+		 * garbage collect the sfd immediately after */
+		destroy_shadow_if_unreferenced(cur);
+	}
+
+	if (ndeferred > 0) {
+		const char *why = g->pacing.congested
+						  ? "the channel is congested"
+						  : "frames are queued";
+		wp_debug("Postponed updates for %d buffers, as %s", ndeferred,
+				why);
+	}
+	g->pacing.ndeferred = ndeferred;
+	return ndeferred;
+}
+
+static int add_trailing_protocol(
+		struct way_msg_state *wmsg, const char *data, int len)
+{
+	wp_debug("We are transferring a data buffer with %d bytes", len);
+	size_t msg_size;
+	uint8_t *msg = make_protocol_message(
+			&wmsg->transfers, data, len, &msg_size);
+	if (!msg) {
+		wp_error("Failed to allocate protocol tx msg");
+		return ERR_NOMEM;
+	}
+	wmsg->trailing[wmsg->ntrailing].iov_len = msg_size;
+	wmsg->trailing[wmsg->ntrailing].iov_base = msg;
+	wmsg->ntrailing++;
+	return 0;
+}
+
+/* Queue protocol data and fd RIDs that release_held_protocol placed in
+ * `proto_write` and `held_rids`, after this cycle's buffer updates. Nothing
+ * read this cycle is in the trailing queue, as it was held as well. */
+static int add_trailing_held_protocol(
+		struct way_msg_state *wmsg, struct globals *g)
+{
+	int nrids = wmsg->held_rids.zone_end;
+	if (nrids > 0) {
+		size_t act_size = (size_t)nrids * sizeof(int32_t) +
+				  sizeof(uint32_t);
+		uint32_t *msg = transfer_block_alloc(
+				&wmsg->transfers, act_size);
+		if (!msg) {
+			wp_error("Failed to allocate file desc tx msg");
+			return ERR_NOMEM;
+		}
+		msg[0] = transfer_header(act_size, WMSG_INJECT_RIDS);
+		memcpy(msg + 1, wmsg->held_rids.data,
+				(size_t)nrids * sizeof(int32_t));
+		decref_transferred_rids(&g->map, nrids, wmsg->held_rids.data);
+		wmsg->trailing[wmsg->ntrailing].iov_len = act_size;
+		wmsg->trailing[wmsg->ntrailing].iov_base = msg;
+		wmsg->ntrailing++;
+		wmsg->held_rids.zone_end = 0;
+	}
+	if (wmsg->proto_write.zone_end > 0) {
+		return add_trailing_protocol(wmsg, wmsg->proto_write.data,
+				wmsg->proto_write.zone_end);
+	}
+	return 0;
+}
+
 static int advance_waymsg_progread(struct way_msg_state *wmsg,
-		struct globals *g, int progfd, bool display_side,
-		bool progsock_readable)
+		const struct cross_state *cxs, struct globals *g, int progfd,
+		bool display_side, bool progsock_readable)
 {
 	const char *progdesc = display_side ? "compositor" : "application";
 	// We have data to read from programs/pipes
 	bool new_proto_data = false;
+	int nindependent = 0;
 	int old_fbuffer_end = wmsg->fds.zone_end;
 	if (progsock_readable) {
 		// Read /once/
@@ -896,6 +1244,13 @@ static int advance_waymsg_progread(struct way_msg_state *wmsg,
 		}
 	}
 
+	/* Protocol handlers and update collection may inspect buffers that
+	 * tasks from the channel are still writing to */
+	int ret = wait_for_apply_tasks(&g->threads);
+	if (ret < 0) {
+		return ret;
+	}
+
 	if (new_proto_data) {
 		wp_debug("Read %d new file descriptors, have %d total now",
 				wmsg->fds.zone_end - old_fbuffer_end,
@@ -910,9 +1265,9 @@ static int advance_waymsg_progread(struct way_msg_state *wmsg,
 
 		wmsg->proto_write.zone_start = 0;
 		wmsg->proto_write.zone_end = 0;
-		parse_and_prune_messages(g, display_side, !display_side,
-				&wmsg->proto_read, &wmsg->proto_write,
-				&wmsg->fds);
+		nindependent = parse_and_prune_messages(g, display_side,
+				!display_side, &wmsg->proto_read,
+				&wmsg->proto_write, &wmsg->fds);
 
 		/* Recycle partial message bytes */
 		if (wmsg->proto_read.zone_start > 0) {
@@ -932,22 +1287,38 @@ static int advance_waymsg_progread(struct way_msg_state *wmsg,
 
 	read_readable_pipes(&g->map);
 
-	for (struct shadow_fd_link *lcur = g->map.link.l_next,
-				   *lnxt = lcur->l_next;
-			lcur != &g->map.link;
-			lcur = lnxt, lnxt = lcur->l_next) {
-		/* Note: finish_update() may delete `cur` */
-		struct shadow_fd *cur = (struct shadow_fd *)lcur;
-		collect_update(&g->threads, cur, &wmsg->transfers,
-				g->config->old_video_mode);
-		/* collecting updates can reset `pipe.remote_can_X` state, so
-		 * garbage collect the sfd immediately after */
-		destroy_shadow_if_unreferenced(cur);
-	}
+	update_frame_pacing(&g->pacing, &wmsg->transfers,
+			cxs->last_confirmed_msgno);
+	(void)collect_buffer_updates(g, &wmsg->transfers);
 
 	int num_mt_tasks = start_parallel_work(
 			&g->threads, &wmsg->transfers.async_recv_queue);
 
+	/* While the updates for a commit are postponed, that commit and all
+	 * protocol data after it are held, so that the remote side does not
+	 * apply the commit to stale buffer contents */
+	if (new_proto_data && nindependent > 0 &&
+			pacing_has_held_protocol(&g->pacing)) {
+		if (pacing_hold_protocol(&g->pacing, wmsg->proto_write.data,
+				    nindependent, NULL, 0) == -1) {
+			return ERR_NOMEM;
+		}
+	} else if (new_proto_data && nindependent > 0) {
+		/* The first messages do not refer to any buffer updated
+		 * now, so need not wait for the updates to be written */
+		size_t msg_size;
+		uint8_t *msg = make_protocol_message(&wmsg->transfers,
+				wmsg->proto_write.data, nindependent, &msg_size);
+		if (!msg || transfer_add_priority(&wmsg->transfers, msg_size,
+					    msg, true) == -1) {
+			wp_error("Failed to allocate protocol tx msg");
+			arena_free(msg);
+			return ERR_NOMEM;
+		}
+		wp_debug("Sending %d bytes of protocol data ahead of buffer updates",
+				nindependent);
+	}
+
 	if (new_proto_data) {
 		/* Send all file descriptors which have been used by the
 		 * protocol parser, translating them if this has not already
@@ -956,10 +1327,9 @@ static int advance_waymsg_progread(struct way_msg_state *wmsg,
 			size_t act_size = (size_t)wmsg->fds.zone_start *
 							  sizeof(int32_t) +
 					  sizeof(uint32_t);
-			uint32_t *msg = malloc(act_size);
+			uint32_t *msg = transfer_block_alloc(
+					&wmsg->transfers, act_size);
 			if (!msg) {
-				// TODO: use a ring buffer for allocations,
-				// and figure out how to block until it is clear
 				wp_error("Failed to allocate file desc tx msg");
 				return ERR_NOMEM;
 			}
@@ -970,11 +1340,18 @@ static int advance_waymsg_progread(struct way_msg_state *wmsg,
 			if (translate_fds(&g->map, &g->render, &g->threads,
 					    wmsg->fds.zone_start,
 					    wmsg->fds.data, rbuffer) == -1) {
-				free(msg);
+				arena_free(msg);
 				return ERR_FATAL;
 			}
-			decref_transferred_rids(
-					&g->map, wmsg->fds.zone_start, rbuffer);
+			int held = pacing_hold_protocol(&g->pacing, NULL, 0,
+					rbuffer, wmsg->fds.zone_start);
+			if (held == -1) {
+				arena_free(msg);
+				return ERR_NOMEM;
+			} else if (held == 0) {
+				decref_transferred_rids(&g->map,
+						wmsg->fds.zone_start, rbuffer);
+			}
 			memmove(wmsg->fds.data,
 					wmsg->fds.data + wmsg->fds.zone_start,
 					sizeof(int) * (size_t)(wmsg->fds.zone_end -
@@ -982,37 +1359,44 @@ static int advance_waymsg_progread(struct way_msg_state *wmsg,
 			wmsg->fds.zone_end -= wmsg->fds.zone_start;
 			wmsg->fds.zone_start = 0;
 
-			/* Add message to trailing queue */
-			wmsg->trailing[wmsg->ntrailing].iov_len = act_size;
-			wmsg->trailing[wmsg->ntrailing].iov_base = msg;
-			wmsg->ntrailing++;
+			if (held) {
+				arena_free(msg);
+			} else {
+				/* Add message to trailing queue */
+				wmsg->trailing[wmsg->ntrailing].iov_len =
+						act_size;
+				wmsg->trailing[wmsg->ntrailing].iov_base = msg;
+				wmsg->ntrailing++;
+			}
 		}
-		if (wmsg->proto_write.zone_end > 0) {
-			wp_debug("We are transferring a data buffer with %d bytes",
-					wmsg->proto_write.zone_end);
-			size_t act_size = (size_t)wmsg->proto_write.zone_end +
-					  sizeof(uint32_t);
-			uint32_t protoh = transfer_header(
-					act_size, WMSG_PROTOCOL);
-
-			uint8_t *copy_proto = malloc(alignz(act_size, 4));
-			if (!copy_proto) {
-				wp_error("Failed to allocate protocol tx msg");
+		if (wmsg->proto_write.zone_end > nindependent) {
+			int held = pacing_hold_protocol(&g->pacing,
+					wmsg->proto_write.data + nindependent,
+					wmsg->proto_write.zone_end -
+							nindependent,
+					NULL, 0);
+			if (held == -1) {
 				return ERR_NOMEM;
+			} else if (held == 0) {
+				ret = add_trailing_protocol(wmsg,
+						wmsg->proto_write.data +
+								nindependent,
+						wmsg->proto_write.zone_end -
+								nindependent);
+				if (ret < 0) {
+					return ret;
+				}
 			}
-			memcpy(copy_proto, &protoh, sizeof(uint32_t));
-			memcpy(copy_proto + sizeof(uint32_t),
-					wmsg->proto_write.data,
-					(size_t)wmsg->proto_write.zone_end);
-			memset(copy_proto + sizeof(uint32_t) +
-							wmsg->proto_write
-									.zone_end,
-					0, alignz(act_size, 4) - act_size);
-
-			wmsg->trailing[wmsg->ntrailing].iov_len =
-					alignz(act_size, 4);
-			wmsg->trailing[wmsg->ntrailing].iov_base = copy_proto;
-			wmsg->ntrailing++;
+		}
+	}
+	ret = release_held_protocol(
+			&g->pacing, &wmsg->proto_write, &wmsg->held_rids);
+	if (ret == -1) {
+		return ERR_NOMEM;
+	} else if (ret == 1) {
+		ret = add_trailing_held_protocol(wmsg, g);
+		if (ret < 0) {
+			return ret;
 		}
 	}
 
@@ -1040,13 +1424,17 @@ static int advance_waymsg_transfer(struct globals *g,
 		return advance_waymsg_chanwrite(
 				wmsg, cxs, g, chanfd, display_side);
 	} else if (wmsg->state == WM_WAITING_FOR_PROGRAM) {
-		return advance_waymsg_progread(wmsg, g, progfd, display_side,
-				progsock_readable);
+		return advance_waymsg_progread(wmsg, cxs, g, progfd,
+				display_side, progsock_readable);
 	}
 	return 0;
 }
 
-static int read_new_chanfd(int linkfd, struct int_window *recon_fds)
+/* Returns a new channel connection, setting `tag` to 0 if it replaces the
+ * main channel, or to the index of an extra channel connection with the
+ * LINK_LAST_USE flag */
+static int read_new_chanfd(
+		int linkfd, struct int_window *recon_fds, uint8_t *tag)
 {
 	uint8_t tmp = 0;
 	ssize_t rd = iovec_read(linkfd, (char *)&tmp, 1, recon_fds);
@@ -1069,6 +1457,7 @@ static int read_new_chanfd(int linkfd, struct int_window *recon_fds)
 		ret_fd = recon_fds->data[recon_fds->zone_end - 1];
 	}
 	recon_fds->zone_end = 0;
+	*tag = tmp;
 	return ret_fd;
 }
 
@@ -1091,7 +1480,14 @@ static int reconnect_loop(int linkfd, int progfd, struct int_window *recon_fds)
 			}
 		}
 		if (rcfs[0].revents & POLLIN) {
-			int nfd = read_new_chanfd(linkfd, recon_fds);
+			uint8_t tag = 0;
+			int nfd = read_new_chanfd(linkfd, recon_fds, &tag);
+			if (nfd >= 0 && tag != 0) {
+				/* Extra connections are only made for the
+				 * first channel connection */
+				checked_close(nfd);
+				continue;
+			}
 			if (nfd != -1) {
 				return nfd;
 			}
@@ -1103,19 +1499,40 @@ static int reconnect_loop(int linkfd, int progfd, struct int_window *recon_fds)
 	return -1;
 }
 
-static void reset_connection(struct cross_state *cxs,
+static void reset_connection(struct globals *g, struct cross_state *cxs,
 		struct chan_msg_state *cmsg, struct way_msg_state *wmsg,
 		int chanfd)
 {
+	struct fd_translation_map *map = &g->map;
 	/* Discard partial read transfer, throwing away complete but unread
 	 * messages, and trailing remnants */
 	cmsg->recv_end = 0;
 	cmsg->recv_start = 0;
 	cmsg->recv_unhandled_messages = 0;
+	cmsg->held_stripe = -1;
+	/* The extra connections ended with the old channel; everything will
+	 * be resent over the new one */
+	if (g->stripes.count > 0) {
+		wp_debug("Closing %d extra channel connections",
+				g->stripes.count);
+	}
+	reset_stripes(&g->stripes, &wmsg->transfers);
 
+	reset_zerocopy(&wmsg->transfers, chanfd);
+	/* A wait for the old channel says nothing about the new one */
+	wmsg->transfers.write_blocked = false;
+	cxs->acks.probing = false;
 	clear_old_transfers(&wmsg->transfers, cxs->last_confirmed_msgno);
 	wp_debug("Resetting connection: %d blocks unacknowledged",
 			wmsg->transfers.end);
+	/* Rather than replaying a long series of updates to the same file,
+	 * send its current contents */
+	size_t ndropped = drop_stale_file_updates(
+			map, &g->threads, &wmsg->transfers);
+	if (ndropped > 0) {
+		wp_debug("Replaced %zu bytes of file updates with resends",
+				ndropped);
+	}
 	if (wmsg->transfers.end > 0) {
 		/* If there was any data in flight, restart. If there wasn't
 		 * anything in flight, then the remote side shouldn't notice the
@@ -1164,14 +1581,115 @@ static int set_connections_nonblocking(
 	return 0;
 }
 
-int main_interface_loop(int chanfd, int progfd, int linkfd,
+pid_t hand_off_connection(struct warm_process *warm, uint32_t flags,
+		int chanfd, int progfd, int linkfd, const int *stripe_fds,
+		int nstripes)
+{
+	if (warm->pid == 0) {
+		return -1;
+	}
+	int fds[3 + MAX_CHANNEL_STREAMS - 1];
+	int nfds = 0;
+	struct warm_handoff handoff = {.flags = flags, .stripe_mask = 0};
+	fds[nfds++] = chanfd;
+	fds[nfds++] = progfd;
+	if (linkfd != -1) {
+		handoff.flags |= WARM_HAS_LINK;
+		fds[nfds++] = linkfd;
+	}
+	for (int i = 0; i < nstripes; i++) {
+		if (stripe_fds[i] != -1) {
+			handoff.stripe_mask |= 1u << i;
+			fds[nfds++] = stripe_fds[i];
+		}
+	}
+	int nwritten = 0;
+	ssize_t ret = iovec_write(warm->linkfd, (const char *)&handoff,
+			sizeof(handoff), fds, nfds, &nwritten);
+	pid_t pid = warm->pid;
+	checked_close(warm->linkfd);
+	warm->linkfd = -1;
+	warm->pid = 0;
+	if (ret != (ssize_t)sizeof(handoff) || nwritten != nfds) {
+		wp_error("Failed to hand connection to prepared process %d: %s",
+				(int)pid, strerror(errno));
+		return -1;
+	}
+	wp_debug("Handed connection to prepared process %d", (int)pid);
+	return pid;
+}
+
+/* Wait for a connection to be handed over by hand_off_connection. Returns -1
+ * if `warmfd` closed or the fds were not as expected. */
+static int await_connection(int warmfd, int *chanfd, int *progfd,
+		int *linkfd, int *stripe_fds, int *nstripes, uint32_t *flags)
+{
+	struct warm_handoff handoff = {.flags = 0, .stripe_mask = 0};
+	struct int_window fds = {
+			.data = NULL, .size = 0, .zone_start = 0, .zone_end = 0};
+	ssize_t ret = -1;
+	while (!shutdown_flag) {
+		ret = iovec_read(warmfd, (char *)&handoff, sizeof(handoff),
+				&fds);
+		if (ret != -1 || errno != EINTR) {
+			break;
+		}
+	}
+	checked_close(warmfd);
+
+	int nexpected = 2 + ((handoff.flags & WARM_HAS_LINK) ? 1 : 0);
+	uint32_t valid_stripes = (1u << (MAX_CHANNEL_STREAMS - 1)) - 1;
+	if (ret == (ssize_t)sizeof(handoff)) {
+		for (int i = 0; i < MAX_CHANNEL_STREAMS - 1; i++) {
+			nexpected += (handoff.stripe_mask >> i) & 1;
+		}
+	}
+	if (ret != (ssize_t)sizeof(handoff) ||
+			(handoff.stripe_mask & ~valid_stripes) ||
+			fds.zone_end != nexpected) {
+		if (ret != 0 && !shutdown_flag) {
+			wp_error("Invalid connection handoff (%zd bytes, %d fds)",
+					ret, fds.zone_end);
+		}
+		for (int i = 0; i < fds.zone_end; i++) {
+			checked_close(fds.data[i]);
+		}
+		free(fds.data);
+		return -1;
+	}
+
+	int k = 0;
+	*chanfd = fds.data[k++];
+	*progfd = fds.data[k++];
+	*linkfd = (handoff.flags & WARM_HAS_LINK) ? fds.data[k++] : -1;
+	*nstripes = 0;
+	for (int i = 0; i < MAX_CHANNEL_STREAMS - 1; i++) {
+		if (handoff.stripe_mask & (1u << i)) {
+			stripe_fds[i] = fds.data[k++];
+			*nstripes = i + 1;
+		} else {
+			stripe_fds[i] = -1;
+		}
+	}
+	*flags = handoff.flags;
+	free(fds.data);
+	return 0;
+}
+
+static int run_interface_loop(int chanfd, int progfd, int linkfd,
+		const int *stripe_fds, int nstripes, int warmfd,
 		const struct main_config *config, bool display_side)
 {
-	if (set_connections_nonblocking(chanfd, progfd, linkfd, display_side) ==
-			-1) {
+	if (warmfd == -1 && set_connections_nonblocking(chanfd, progfd, linkfd,
+					    display_side) == -1) {
 		if (linkfd != -1) {
 			checked_close(linkfd);
 		}
+		for (int i = 0; i < nstripes; i++) {
+			if (stripe_fds[i] != -1) {
+				checked_close(stripe_fds[i]);
+			}
+		}
 		checked_close(chanfd);
 		checked_close(progfd);
 		return EXIT_FAILURE;
@@ -1187,6 +1705,9 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 	memset(&cross_data, 0, sizeof(cross_data));
 	struct globals g;
 	memset(&g, 0, sizeof(g));
+	g.stats.fd = -1;
+	g.recorder.fd = -1;
+	setup_stripes(&g.stripes);
 
 	way_msg.state = WM_WAITING_FOR_PROGRAM;
 	/* AFAIK, there is no documented upper bound for the size of a
@@ -1201,14 +1722,9 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 	way_msg.proto_write.size = 2 * max_read_size;
 	way_msg.proto_write.data = malloc((size_t)way_msg.proto_write.size);
 	way_msg.max_iov = get_iov_max();
-	int mut_ret = pthread_mutex_init(
-			&way_msg.transfers.async_recv_queue.lock, NULL);
-	if (mut_ret) {
-		wp_error("Mutex creation failed: %s", strerror(mut_ret));
-		goto init_failure_cleanup;
-	}
 
 	chan_msg.state = CM_WAITING_FOR_CHANNEL;
+	chan_msg.held_stripe = -1;
 	chan_msg.recv_size = 2 * RECV_GOAL_READ_SIZE;
 	chan_msg.recv_buffer = malloc((size_t)chan_msg.recv_size);
 	chan_msg.proto_write.size = max_read_size * 2;
@@ -1224,6 +1740,8 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 	way_msg.transfers.last_msgno = 1;
 
 	g.config = config;
+	g.pacing.max_inflight = config->max_inflight;
+	g.pacing.collapse_frames = config->collapse_frames;
 	g.render = (struct render_data){
 			.drm_node_path = config->drm_node,
 			.drm_fd = -1,
@@ -1238,16 +1756,82 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 			.av_vadisplay = NULL,
 			.av_copy_config = 0,
 	};
+	/* With shared workers, the pool only needs the main thread */
 	if (setup_thread_pool(&g.threads, config->compression,
 			    config->compression_level,
-			    config->n_worker_threads) == -1) {
+			    config->workers ? 1 : config->n_worker_threads) ==
+			-1) {
+		goto init_failure_cleanup;
+	}
+	if (config->workers) {
+		(void)join_worker_group(&g.threads, config->workers);
+	}
+	if (config->compression_auto &&
+			enable_compression_autotune(&g.threads) == -1) {
+		goto init_failure_cleanup;
+	}
+	if (config->compress_dict &&
+			enable_compression_dict(&g.threads) == -1) {
+		goto init_failure_cleanup;
+	}
+	if (setup_stats(&g.stats, &g.threads, config->stats_path,
+			    display_side) == -1) {
+		goto init_failure_cleanup;
+	}
+	if (setup_recorder(&g.recorder, config->record_path,
+			    config->compression) == -1) {
 		goto init_failure_cleanup;
 	}
 	setup_translation_map(&g.map, display_side);
+	if (config->dedup && enable_block_cache(&g.map) == -1) {
+		goto init_failure_cleanup;
+	}
 	if (init_message_tracker(&g.tracker) == -1) {
 		goto init_failure_cleanup;
 	}
 
+	int warm_stripe_fds[MAX_CHANNEL_STREAMS - 1];
+	if (warmfd != -1) {
+		/* Do the slow parts of setup that are otherwise left until a
+		 * buffer needs them */
+		if (init_render_data(&g.render) == 0) {
+			(void)init_hwcontext(&g.render);
+		}
+		uint32_t flags = 0;
+		int ret = await_connection(warmfd, &chanfd, &progfd, &linkfd,
+				warm_stripe_fds, &nstripes, &flags);
+		warmfd = -1;
+		if (ret == -1) {
+			goto init_failure_cleanup;
+		}
+		stripe_fds = warm_stripe_fds;
+		if (flags & WARM_NO_GPU) {
+			cleanup_hwcontext(&g.render);
+			cleanup_render_data(&g.render);
+			g.render.disabled = true;
+			g.render.av_disabled = true;
+		}
+		wp_debug("Prepared process received a connection");
+		if (set_connections_nonblocking(chanfd, progfd, linkfd,
+				    display_side) == -1) {
+			for (int i = 0; i < nstripes; i++) {
+				if (stripe_fds[i] != -1) {
+					checked_close(stripe_fds[i]);
+				}
+			}
+			goto init_failure_cleanup;
+		}
+	}
+	for (int i = 0; i < nstripes; i++) {
+		if (stripe_fds[i] != -1) {
+			(void)add_stripe(&g.stripes, i + 1, stripe_fds[i]);
+		}
+	}
+	/* Those not yet connected can only arrive over the link */
+	g.stripes.max_index = nstripes;
+	g.stripes.may_connect = linkfd != -1;
+	reset_zerocopy(&way_msg.transfers, chanfd);
+
 	struct int_window recon_fds = {
 			.data = NULL,
 			.size = 0,
@@ -1255,6 +1839,24 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 			.zone_end = 0,
 	};
 
+	struct uring_poller *poller = NULL;
+	if (config->io_uring) {
+		poller = create_uring_poller();
+		if (!poller) {
+			wp_error("Failed to set up io_uring, using poll instead: %s",
+					strerror(errno));
+		}
+	}
+	/* The poller must be reset when a polled fd was closed, since its
+	 * number may be reused */
+	bool closed_polled_fd = false;
+	uint32_t polled_generation = g.map.fd_generation;
+
+	/* When to next look for idle mirrors to free */
+	uint64_t evict_period_ns =
+			(uint64_t)config->evict_idle_secs * 1000000000uLL;
+	uint64_t next_evict_ns = monotonic_ns() + evict_period_ns;
+
 	bool needs_new_channel = false;
 	struct pollfd *pfds = NULL;
 	int pfds_size = 0;
@@ -1262,7 +1864,7 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 	while (!shutdown_flag && exit_code == 0 &&
 			!(way_msg.state == WM_TERMINAL &&
 					chan_msg.state == CM_TERMINAL)) {
-		int psize = 4 + count_npipes(&g.map);
+		int psize = 4 + count_npipes(&g.map) + g.stripes.count;
 		if (buf_ensure_size(psize, sizeof(struct pollfd), &pfds_size,
 				    (void **)&pfds) == -1) {
 			wp_error("Allocation failure, not enough space for pollfds");
@@ -1271,6 +1873,22 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 		}
 		pfds[0].fd = chanfd;
 		pfds[1].fd = progfd;
+		int ack_delay = -1;
+		bool ack_pending = cross_data.last_acked_msgno !=
+				   cross_data.last_received_msgno;
+		if (ack_pending && way_msg.state == WM_WAITING_FOR_PROGRAM &&
+				chanfd != -1) {
+			ack_delay = ack_delay_ms(
+					&cross_data.acks, monotonic_ns());
+			if (ack_delay == 0) {
+				/* No other message is being written which the
+				 * acknowledgement could accompany */
+				way_msg.state = WM_WAITING_FOR_CHANNEL;
+				g.stats.standalone_acks++;
+				ack_delay = -1;
+			}
+		}
+
 		pfds[2].fd = linkfd;
 		pfds[3].fd = g.threads.selfpipe_r;
 		pfds[0].events = 0;
@@ -1282,34 +1900,67 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 		} else if (way_msg.state == WM_WAITING_FOR_PROGRAM) {
 			pfds[1].events |= POLLIN;
 		}
-		if (chan_msg.state == CM_WAITING_FOR_CHANNEL) {
+		/* While a message from an extra connection is awaited, the
+		 * rest of the channel must wait */
+		if (chan_msg.state == CM_WAITING_FOR_CHANNEL &&
+				chan_msg.held_stripe == -1) {
 			pfds[0].events |= POLLIN;
 		} else if (chan_msg.state == CM_WAITING_FOR_PROGRAM) {
 			pfds[1].events |= POLLOUT;
 		}
 		bool check_read = way_msg.state == WM_WAITING_FOR_PROGRAM;
-		int npoll = 4 + fill_with_pipes(&g.map, pfds + 4, check_read);
+		int npipes = fill_with_pipes(&g.map, pfds + 4, check_read);
+		int nstripe_pfds =
+				fill_stripe_pollfds(&g.stripes, pfds + 4 + npipes);
+		int npoll = 4 + npipes + nstripe_pfds;
 
-		bool own_msg_pending =
-				(cross_data.last_acked_msgno !=
-						cross_data.last_received_msgno) &&
-				way_msg.state == WM_WAITING_FOR_PROGRAM;
 		bool unread_chan_msgs =
 				chan_msg.state == CM_WAITING_FOR_CHANNEL &&
-				chan_msg.recv_unhandled_messages > 0;
+				chan_msg.recv_unhandled_messages > 0 &&
+				chan_msg.held_stripe == -1;
 
 		int poll_delay;
 		if (unread_chan_msgs) {
 			/* There is work to do, so continue */
 			poll_delay = 0;
-		} else if (own_msg_pending) {
-			/* To coalesce acknowledgements, we wait for a minimum
-			 * amount */
-			poll_delay = 20;
+		} else if (way_msg.state == WM_WAITING_FOR_PROGRAM &&
+				pacing_should_collect(&g.pacing)) {
+			/* Postponed updates need not wait for the program to
+			 * commit again */
+			poll_delay = 0;
+		} else if (ack_delay > 0) {
+			/* Wait a little to coalesce acknowledgements */
+			poll_delay = ack_delay;
 		} else {
 			poll_delay = -1;
 		}
-		int r = poll(pfds, (nfds_t)npoll, poll_delay);
+		int report_delay = stats_report(&g.stats, &g.threads);
+		if (report_delay >= 0 &&
+				(poll_delay == -1 || report_delay < poll_delay)) {
+			poll_delay = report_delay;
+		}
+		if (config->evict_idle_secs > 0) {
+			uint64_t now = monotonic_ns();
+			if (now >= next_evict_ns) {
+				(void)evict_idle_mirrors(&g.map, &g.threads);
+				next_evict_ns = now + evict_period_ns;
+			}
+			int evict_delay =
+					(int)((next_evict_ns - now) / 1000000) + 1;
+			if (poll_delay == -1 || evict_delay < poll_delay) {
+				poll_delay = evict_delay;
+			}
+		}
+		int r;
+		if (poller) {
+			bool reset = closed_polled_fd ||
+				     polled_generation != g.map.fd_generation;
+			closed_polled_fd = false;
+			polled_generation = g.map.fd_generation;
+			r = uring_poll(poller, pfds, npoll, poll_delay, reset);
+		} else {
+			r = poll(pfds, (nfds_t)npoll, poll_delay);
+		}
 		if (r == -1) {
 			if (errno == EINTR) {
 				wp_error("poll interrupted: shutdown=%c",
@@ -1329,7 +1980,14 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 			(void)read(g.threads.selfpipe_r, tmp, sizeof(tmp));
 		}
 
-		mark_pipe_object_statuses(&g.map, npoll - 4, pfds + 4);
+		if (pfds[0].revents & POLLERR) {
+			/* Zero-copy completions are reported as errors */
+			update_zerocopy_completions(&way_msg.transfers, chanfd);
+		}
+
+		mark_pipe_object_statuses(&g.map, npipes, pfds + 4);
+		int stripe_ret = advance_stripes(
+				&g.stripes, pfds + 4 + npipes, nstripe_pfds);
 		/* POLLHUP sometimes implies POLLIN, but not on all systems.
 		 * Checking POLLHUP|POLLIN means that we can detect EOF when
 		 * we actually do try to read from the sockets, but also, if
@@ -1338,23 +1996,53 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 		bool progsock_readable = pfds[1].revents & (POLLIN | POLLHUP);
 		bool chanmsg_active = (pfds[0].revents & (POLLIN | POLLHUP)) ||
 				      (pfds[1].revents & POLLOUT) ||
-				      unread_chan_msgs;
+				      unread_chan_msgs || stripe_ret > 0;
+		if (stripe_ret == ERR_DISCONN && chanfd != -1) {
+			/* Recover from this as if the channel had failed */
+			checked_close(chanfd);
+			chanfd = -1;
+			closed_polled_fd = true;
+			if (linkfd == -1) {
+				wp_error("Extra channel connection hang up detected, no reconnection link, fatal");
+				exit_code = ERR_FATAL;
+				break;
+			}
+			needs_new_channel = true;
+		} else if (stripe_ret < 0 && stripe_ret != ERR_DISCONN) {
+			exit_code = stripe_ret;
+			break;
+		}
 
 		bool maybe_new_channel = (pfds[2].revents & (POLLIN | POLLHUP));
 		if (maybe_new_channel) {
-			int new_fd = read_new_chanfd(linkfd, &recon_fds);
-			if (new_fd >= 0) {
+			uint8_t tag = 0;
+			int new_fd = read_new_chanfd(linkfd, &recon_fds, &tag);
+			if (new_fd >= 0 && tag != 0) {
+				closed_polled_fd = true;
+				(void)add_stripe(&g.stripes,
+						tag & ~LINK_LAST_USE, new_fd);
+				if (tag & LINK_LAST_USE) {
+					/* The link was only kept to provide
+					 * the extra connections */
+					checked_close(linkfd);
+					linkfd = -1;
+					g.stripes.may_connect = false;
+				}
+			} else if (new_fd >= 0) {
 				if (chanfd != -1) {
 					checked_close(chanfd);
 				}
 				chanfd = new_fd;
-				reset_connection(&cross_data, &chan_msg,
+				closed_polled_fd = true;
+				reset_connection(&g, &cross_data, &chan_msg,
 						&way_msg, chanfd);
 				needs_new_channel = false;
 			} else if (new_fd == -2) {
 				wp_error("Link to root process hang-up detected");
 				checked_close(linkfd);
 				linkfd = -1;
+				g.stripes.may_connect = false;
+				closed_polled_fd = true;
 			}
 		}
 		if (needs_new_channel && linkfd != -1) {
@@ -1371,7 +2059,8 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 					checked_close(chanfd);
 				}
 				chanfd = new_fd;
-				reset_connection(&cross_data, &chan_msg,
+				closed_polled_fd = true;
+				reset_connection(&g, &cross_data, &chan_msg,
 						&way_msg, chanfd);
 				needs_new_channel = false;
 			}
@@ -1404,6 +2093,7 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 				 * fully. */
 				checked_close(chanfd);
 				chanfd = -1;
+				closed_polled_fd = true;
 				if (linkfd == -1) {
 					wp_error("Channel hang up detected, no reconnection link, fatal");
 					exit_code = ERR_FATAL;
@@ -1456,9 +2146,30 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 			}
 		}
 
+		if (exit_code != 0) {
+			break;
+		}
+		/* Once the channel has caught up, send the held events,
+		 * between writes of other messages to the program */
+		update_frame_pacing(&g.pacing, &way_msg.transfers,
+				cross_data.last_confirmed_msgno);
+		if (chan_msg.state == CM_WAITING_FOR_CHANNEL) {
+			int nreleased = release_held_events(
+					&g.pacing, &chan_msg.proto_write);
+			if (nreleased == -1) {
+				exit_code = ERR_NOMEM;
+				break;
+			} else if (nreleased > 0) {
+				wp_debug("Releasing %d bytes of held events",
+						nreleased);
+				chan_msg.state = CM_WAITING_FOR_PROGRAM;
+			}
+		}
+
 		// Periodic maintenance. It doesn't matter who does this
 		flush_writable_pipes(&g.map);
 	}
+	destroy_uring_poller(poller);
 	free(pfds);
 	free(recon_fds.data);
 	wp_debug("Exiting main loop (%d, %d, %d), attempting close message",
@@ -1519,11 +2230,30 @@ init_failure_cleanup:
 			wp_error("Failed to send close notification: %s",
 					strerror(errno));
 		}
+		/* Give the kernel a chance to finish zero-copy writes before
+		 * the blocks that they read from are freed */
+		while (way_msg.transfers.zc_sent !=
+				way_msg.transfers.zc_completed) {
+			struct pollfd zc_poll = {.fd = chanfd, .events = 0};
+			if (poll(&zc_poll, 1, 200) <= 0) {
+				wp_debug("Zero-copy completion wait timed out");
+				break;
+			}
+			uint32_t prev = way_msg.transfers.zc_completed;
+			update_zerocopy_completions(
+					&way_msg.transfers, chanfd);
+			if (way_msg.transfers.zc_completed == prev) {
+				break;
+			}
+		}
 	} else {
 		wp_debug("Channel closed, hence no close notification");
 	}
 
 	cleanup_thread_pool(&g.threads);
+	cleanup_stats(&g.stats);
+	cleanup_recorder(&g.recorder);
+	cleanup_frame_pacing(&g.pacing);
 	cleanup_message_tracker(&g.tracker);
 	cleanup_translation_map(&g.map);
 	cleanup_render_data(&g.render);
@@ -1531,9 +2261,12 @@ init_failure_cleanup:
 	free(way_msg.proto_read.data);
 	free(way_msg.proto_write.data);
 	free(way_msg.fds.data);
+	free(way_msg.held_rids.data);
+	/* Return striped blocks to the queue, so that they are freed */
+	reset_stripes(&g.stripes, &way_msg.transfers);
 	cleanup_transfer_queue(&way_msg.transfers);
 	for (int i = 0; i < way_msg.ntrailing; i++) {
-		free(way_msg.trailing[i].iov_base);
+		arena_free(way_msg.trailing[i].iov_base);
 	}
 	free(chan_msg.transf_fds.data);
 	free(chan_msg.proto_fds.data);
@@ -1549,5 +2282,173 @@ init_failure_cleanup:
 	if (linkfd != -1) {
 		checked_close(linkfd);
 	}
+	if (warmfd != -1) {
+		checked_close(warmfd);
+	}
 	return EXIT_SUCCESS;
 }
+
+int main_interface_loop(int chanfd, int progfd, int linkfd,
+		const int *stripe_fds, int nstripes,
+		const struct main_config *config, bool display_side)
+{
+	return run_interface_loop(chanfd, progfd, linkfd, stripe_fds, nstripes,
+			-1, config, display_side);
+}
+
+int warm_interface_loop(
+		int warmfd, const struct main_config *config, bool display_side)
+{
+	return run_interface_loop(
+			-1, -1, -1, NULL, 0, warmfd, config, display_side);
+}
+
+struct conn_thread {
+	pthread_t thread;
+	pthread_t parent;
+	int chanfd, progfd, linkfd;
+	int stripe_fds[MAX_CHANNEL_STREAMS - 1];
+	int nstripes;
+	uint32_t key[3];
+	bool display_side;
+	struct main_config config;
+	/* Each connection gets its own --record file */
+	char record_path[4096];
+	atomic_bool done;
+	/* Set while reaping, if the thread is to be joined */
+	bool joining;
+};
+
+static void *connection_thread_main(void *arg)
+{
+	struct conn_thread *t = arg;
+	(void)main_interface_loop(t->chanfd, t->progfd, t->linkfd,
+			t->stripe_fds, t->nstripes, &t->config,
+			t->display_side);
+	atomic_store(&t->done, true);
+	/* Like the SIGCHLD from a connection process, this tells the parent
+	 * to clean up */
+	pthread_kill(t->parent, SIGCHLD);
+	return NULL;
+}
+
+int start_connection_thread(struct conn_threads *threads, int chanfd,
+		int progfd, int linkfd, const int *stripe_fds, int nstripes,
+		const struct connection_token *token,
+		const struct main_config *config, bool display_side)
+{
+	if (buf_ensure_size(threads->count + 1, sizeof(struct conn_thread *),
+			    &threads->size, (void **)&threads->list) == -1) {
+		wp_error("Failed to allocate space to track connection thread");
+		return -1;
+	}
+	struct conn_thread *t = calloc(1, sizeof(struct conn_thread));
+	if (!t) {
+		wp_error("Failed to allocate connection thread data");
+		return -1;
+	}
+	t->parent = pthread_self();
+	t->chanfd = chanfd;
+	t->progfd = progfd;
+	t->linkfd = linkfd;
+	t->nstripes = nstripes;
+	for (int i = 0; i < nstripes; i++) {
+		t->stripe_fds[i] = stripe_fds[i];
+	}
+	memcpy(t->key, token->key, sizeof(t->key));
+	t->display_side = display_side;
+	t->config = *config;
+	if (config->record_path) {
+		/* The file name is completed with the process id */
+		if (snprintf(t->record_path, sizeof(t->record_path), "%s.%d",
+				    config->record_path,
+				    threads->nstarted) >=
+				(int)sizeof(t->record_path)) {
+			wp_error("Recording path '%s' is too long",
+					config->record_path);
+			free(t);
+			return -1;
+		}
+		t->config.record_path = t->record_path;
+	}
+	atomic_init(&t->done, false);
+
+	/* Signals should only interrupt the parent, which watches for them;
+	 * new threads take the signal mask of the thread creating them */
+	sigset_t mask, old_mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGCHLD);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+	if (!threads->has_workers) {
+		if (setup_worker_group(&threads->workers, config->compression,
+				    config->n_worker_threads) == -1) {
+			wp_error("Failed to start shared workers, running connection without them");
+		} else {
+			threads->has_workers = true;
+		}
+	}
+	t->config.workers = threads->has_workers ? &threads->workers : NULL;
+	int ret = pthread_create(
+			&t->thread, NULL, connection_thread_main, t);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+	if (ret) {
+		wp_error("Thread creation failed: %s", strerror(ret));
+		free(t);
+		return -1;
+	}
+	threads->list[threads->count++] = t;
+	threads->nstarted++;
+	return 0;
+}
+
+void reap_connection_threads(struct conn_threads *threads,
+		struct conn_map *connmap, bool wait)
+{
+	for (int k = 0; k < threads->count; k++) {
+		threads->list[k]->joining =
+				wait || atomic_load(&threads->list[k]->done);
+	}
+	int iw = 0;
+	for (int ir = 0; ir < connmap->count; ir++) {
+		struct conn_addr *c = &connmap->data[ir];
+		bool joining = false;
+		for (int k = 0; k < threads->count && c->threaded; k++) {
+			struct conn_thread *t = threads->list[k];
+			if (!memcmp(c->token.key, t->key, sizeof(t->key))) {
+				joining = t->joining;
+				break;
+			}
+		}
+		/* If the parent is stopping, closing the links also wakes up
+		 * the threads so that they see the shutdown_flag */
+		if (c->threaded && (joining || wait)) {
+			checked_close(c->linkfd);
+		} else {
+			connmap->data[iw++] = *c;
+		}
+	}
+	connmap->count = iw;
+
+	iw = 0;
+	for (int ir = 0; ir < threads->count; ir++) {
+		struct conn_thread *t = threads->list[ir];
+		if (!t->joining) {
+			threads->list[iw++] = t;
+			continue;
+		}
+		pthread_join(t->thread, NULL);
+		wp_debug("Connection thread has finished");
+		free(t);
+	}
+	threads->count = iw;
+	if (wait) {
+		free(threads->list);
+		threads->list = NULL;
+		threads->size = 0;
+		if (threads->has_workers) {
+			cleanup_worker_group(&threads->workers);
+			threads->has_workers = false;
+		}
+	}
+}
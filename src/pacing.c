@@ -0,0 +1,415 @@
+/*
+ * Copyright © 2019 Manuel Stoeckl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "main.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Bounds on the delay before sending an acknowledgement alone */
+#define ACK_MIN_DELAY_NSEC 1000000uLL
+#define ACK_MAX_DELAY_NSEC 20000000uLL
+/* Once this much was received without being acknowledged, acknowledge it
+ * immediately so the other side can free it */
+#define ACK_PENDING_LIMIT (1u << 20)
+
+void ack_note_received(struct ack_cadence *a, size_t size)
+{
+	a->pending_bytes += size;
+}
+
+void ack_note_sent(struct ack_cadence *a)
+{
+	a->pending_since_ns = 0;
+	a->pending_bytes = 0;
+}
+
+void ack_note_written(struct ack_cadence *a, uint32_t msgno, uint64_t now)
+{
+	if (!a->probing) {
+		a->probing = true;
+		a->probe_msgno = msgno;
+		a->probe_ns = now;
+	}
+}
+
+bool ack_note_confirmed(struct ack_cadence *a, uint32_t msgno, uint64_t now)
+{
+	if (!a->probing || !msgno_gt(msgno, a->probe_msgno)) {
+		return false;
+	}
+	a->probing = false;
+	uint64_t sample = now - a->probe_ns;
+	a->rtt_ns = a->rtt_ns ? (3 * a->rtt_ns + sample) / 4 : sample;
+	return true;
+}
+
+int ack_delay_ms(struct ack_cadence *a, uint64_t now)
+{
+	if (a->pending_since_ns == 0) {
+		a->pending_since_ns = now;
+	}
+	if (a->pending_bytes >= ACK_PENDING_LIMIT) {
+		return 0;
+	}
+	/* The other side can only free its messages a round trip after
+	 * sending them, so waiting for a fraction of that costs little. The
+	 * estimate includes this delay, which it thus inflates by a third. */
+	uint64_t delay = a->rtt_ns ? a->rtt_ns / 4 : ACK_MAX_DELAY_NSEC;
+	delay = maxu(ACK_MIN_DELAY_NSEC, minu(delay, ACK_MAX_DELAY_NSEC));
+	uint64_t elapsed = now - a->pending_since_ns;
+	if (elapsed >= delay) {
+		return 0;
+	}
+	return (int)((delay - elapsed + 999999) / 1000000);
+}
+
+void cleanup_frame_pacing(struct frame_pacing *p)
+{
+	free(p->held);
+	free(p->held_ids);
+	free(p->held_proto);
+	free(p->held_rids);
+	p->held = NULL;
+	p->held_ids = NULL;
+	p->held_proto = NULL;
+	p->held_rids = NULL;
+	p->held_len = 0;
+	p->nheld_ids = 0;
+	p->held_proto_len = 0;
+	p->nheld_rids = 0;
+	free(p->estimates);
+	p->estimates = NULL;
+	p->nestimates = 0;
+}
+
+void update_frame_pacing(struct frame_pacing *p,
+		const struct transfer_queue *transfers, uint32_t acked_msgno)
+{
+	if (p->max_inflight == 0) {
+		return;
+	}
+	/* Transfers are only removed from the queue on the next write, so
+	 * skip those that have already been acknowledged */
+	size_t unacked_bytes = 0;
+	for (int i = 0; i < transfers->end; i++) {
+		if (!msgno_gt(acked_msgno, transfers->meta[i].msgno)) {
+			unacked_bytes += transfers->vecs[i].iov_len;
+		}
+	}
+	bool congested = p->congested ? unacked_bytes > p->max_inflight / 2
+				      : unacked_bytes > p->max_inflight;
+	if (congested != p->congested) {
+		wp_debug("Channel is %s, %zu bytes unacknowledged",
+				congested ? "congested" : "no longer congested",
+				unacked_bytes);
+		p->congested = congested;
+	}
+}
+
+/* Number of samples after which the windowed minimum latency is restarted,
+ * so that the base latency can follow changes in the clocks' offset */
+#define PRESENT_WINDOW 64
+/* Most surfaces with latency estimates; the least recently sampled is
+ * replaced when more are used */
+#define PRESENT_MAX_SURFACES 16
+/* Frame interval assumed when the output's refresh rate is unknown */
+#define DEFAULT_FRAME_NSEC 16666667
+
+bool pacing_is_holding(const struct frame_pacing *p)
+{
+	return p->congested || p->behind;
+}
+
+bool pacing_should_collect(const struct frame_pacing *p)
+{
+	return p->ndeferred > 0 && !pacing_is_holding(p);
+}
+
+void pacing_note_feedback_commit(struct frame_pacing *p)
+{
+	p->nawaiting++;
+	p->nnew_feedback++;
+}
+
+static struct present_estimate *get_estimate(
+		struct frame_pacing *p, uint32_t surface_id)
+{
+	for (int i = 0; i < p->nestimates; i++) {
+		if (p->estimates[i].surface_id == surface_id) {
+			return &p->estimates[i];
+		}
+	}
+	struct present_estimate *e;
+	if (p->nestimates < PRESENT_MAX_SURFACES) {
+		if (buf_ensure_size(p->nestimates + 1,
+				    sizeof(struct present_estimate),
+				    &p->estimates_size,
+				    (void **)&p->estimates) == -1) {
+			wp_error("Failed to allocate latency estimate");
+			return NULL;
+		}
+		e = &p->estimates[p->nestimates++];
+	} else {
+		e = &p->estimates[0];
+		for (int i = 1; i < p->nestimates; i++) {
+			if (p->estimates[i].last_sample < e->last_sample) {
+				e = &p->estimates[i];
+			}
+		}
+	}
+	memset(e, 0, sizeof(*e));
+	e->surface_id = surface_id;
+	return e;
+}
+
+static int64_t base_latency(const struct present_estimate *e)
+{
+	if (e->nwindow == 0) {
+		return e->prev_min_ns;
+	}
+	return e->prev_min_ns < e->window_min_ns ? e->prev_min_ns
+						 : e->window_min_ns;
+}
+
+static void set_behind(struct frame_pacing *p, bool behind,
+		uint32_t surface_id, const char *why)
+{
+	if (behind == p->behind) {
+		return;
+	}
+	wp_debug("Frames for surface %u are %s, as %s", surface_id,
+			behind ? "queued" : "no longer queued", why);
+	p->behind = behind;
+	p->behind_surface = surface_id;
+}
+
+static void check_drained(struct frame_pacing *p)
+{
+	if (p->nawaiting == 0 && p->behind) {
+		/* With nothing queued, the next commit is presented as soon
+		 * as it can be; forget the latency built up so far */
+		struct present_estimate *e = get_estimate(p, p->behind_surface);
+		if (e) {
+			e->smoothed_ns = base_latency(e);
+		}
+		set_behind(p, false, p->behind_surface,
+				"all commits were presented");
+	}
+}
+
+static void note_drained(struct frame_pacing *p)
+{
+	if (p->nawaiting > 0) {
+		p->nawaiting--;
+	}
+	check_drained(p);
+}
+
+void pacing_note_presented(struct frame_pacing *p, uint32_t surface_id,
+		int64_t latency_ns, uint32_t refresh_ns)
+{
+	struct present_estimate *e = get_estimate(p, surface_id);
+	if (!e) {
+		note_drained(p);
+		return;
+	}
+	if (e->nwindow == 0 && e->last_sample == 0) {
+		e->smoothed_ns = latency_ns;
+		e->prev_min_ns = latency_ns;
+	} else {
+		e->smoothed_ns += (latency_ns - e->smoothed_ns) / 4;
+	}
+	if (e->nwindow == 0 || latency_ns < e->window_min_ns) {
+		e->window_min_ns = latency_ns;
+	}
+	if (++e->nwindow >= PRESENT_WINDOW) {
+		e->prev_min_ns = e->window_min_ns;
+		e->nwindow = 0;
+	}
+	e->refresh_ns = refresh_ns;
+	e->last_sample = ++p->nsamples;
+
+	if (p->collapse_frames) {
+		/* Both clocks' offset and the fixed part of the latency cancel
+		 * in the difference from the lowest recent latency */
+		int64_t frame = refresh_ns ? refresh_ns : DEFAULT_FRAME_NSEC;
+		int64_t excess = e->smoothed_ns - base_latency(e);
+		if (!p->behind && excess > frame) {
+			set_behind(p, true, surface_id,
+					"presentation is over a frame late");
+		} else if (p->behind && p->behind_surface == surface_id &&
+				2 * excess < frame) {
+			set_behind(p, false, surface_id,
+					"presentation has caught up");
+		}
+	}
+	note_drained(p);
+}
+
+void pacing_note_discarded(struct frame_pacing *p) { note_drained(p); }
+
+static int hold_message(struct frame_pacing *p, const uint32_t *msg, int len)
+{
+	if (buf_ensure_size(p->held_len + len, 1, &p->held_size,
+			    (void **)&p->held) == -1) {
+		wp_error("Failed to allocate space to hold message");
+		return -1;
+	}
+	memcpy(p->held + p->held_len, msg, (size_t)len);
+	p->held_len += len;
+	return 0;
+}
+
+bool pacing_hold_event(struct frame_pacing *p, const uint32_t *msg, int len,
+		uint32_t obj_id)
+{
+	/* Once one event is held, all later ones are as well, so that they
+	 * are not reordered */
+	if (!pacing_is_holding(p) && p->held_len == 0) {
+		return false;
+	}
+	if (buf_ensure_size(p->nheld_ids + 1, sizeof(uint32_t),
+			    &p->held_ids_size, (void **)&p->held_ids) == -1) {
+		wp_error("Failed to allocate space to hold message");
+		return false;
+	}
+	if (hold_message(p, msg, len) == -1) {
+		return false;
+	}
+	p->held_ids[p->nheld_ids++] = obj_id;
+	return true;
+}
+
+bool pacing_hold_delete_id(struct frame_pacing *p, const uint32_t *msg,
+		int len, uint32_t id)
+{
+	for (int i = 0; i < p->nheld_ids; i++) {
+		if (p->held_ids[i] == id) {
+			return hold_message(p, msg, len) == 0;
+		}
+	}
+	return false;
+}
+
+int release_held_events(struct frame_pacing *p, struct char_window *dst)
+{
+	if (pacing_is_holding(p) || p->held_len == 0) {
+		return 0;
+	}
+	if (buf_ensure_size(p->held_len, 1, &dst->size, (void **)&dst->data) ==
+			-1) {
+		wp_error("Failed to allocate space to release held messages");
+		return -1;
+	}
+	memcpy(dst->data, p->held, (size_t)p->held_len);
+	dst->zone_start = 0;
+	dst->zone_end = p->held_len;
+	int len = p->held_len;
+	p->held_len = 0;
+	p->nheld_ids = 0;
+	return len;
+}
+
+bool pacing_has_held_protocol(const struct frame_pacing *p)
+{
+	return p->held_proto_len > 0 || p->nheld_rids > 0;
+}
+
+int pacing_hold_protocol(struct frame_pacing *p, const char *data, int len,
+		const int *rids, int nrids)
+{
+	/* Once a commit is held, everything after it is as well, so that
+	 * requests are not reordered */
+	if (p->ndeferred == 0 && !pacing_has_held_protocol(p)) {
+		return 0;
+	}
+	if (buf_ensure_size(p->held_proto_len + len, 1, &p->held_proto_size,
+			    (void **)&p->held_proto) == -1 ||
+			buf_ensure_size(p->nheld_rids + nrids, sizeof(int),
+					&p->held_rids_size,
+					(void **)&p->held_rids) == -1) {
+		wp_error("Failed to allocate space to hold protocol data");
+		return -1;
+	}
+	if (len > 0) {
+		memcpy(p->held_proto + p->held_proto_len, data, (size_t)len);
+		p->held_proto_len += len;
+	}
+	if (nrids > 0) {
+		memcpy(p->held_rids + p->nheld_rids, rids,
+				sizeof(int) * (size_t)nrids);
+		p->nheld_rids += nrids;
+	}
+	return 1;
+}
+
+int release_held_protocol(struct frame_pacing *p, struct char_window *proto,
+		struct int_window *rids)
+{
+	if (p->ndeferred > 0) {
+		/* The commits just read are held, so cannot be presented
+		 * until released; were they counted, `behind` could never
+		 * clear */
+		p->nawaiting = p->nawaiting > p->nnew_feedback
+					       ? p->nawaiting - p->nnew_feedback
+					       : 0;
+		p->nheld_feedback += p->nnew_feedback;
+		p->nnew_feedback = 0;
+		check_drained(p);
+		return 0;
+	}
+	p->nnew_feedback = 0;
+	if (!pacing_has_held_protocol(p)) {
+		return 0;
+	}
+	if (buf_ensure_size(p->held_proto_len, 1, &proto->size,
+			    (void **)&proto->data) == -1 ||
+			buf_ensure_size(p->nheld_rids, sizeof(int),
+					&rids->size,
+					(void **)&rids->data) == -1) {
+		wp_error("Failed to allocate space to release held protocol data");
+		return -1;
+	}
+	if (p->held_proto_len > 0) {
+		memcpy(proto->data, p->held_proto, (size_t)p->held_proto_len);
+	}
+	proto->zone_start = 0;
+	proto->zone_end = p->held_proto_len;
+	if (p->nheld_rids > 0) {
+		memcpy(rids->data, p->held_rids,
+				sizeof(int) * (size_t)p->nheld_rids);
+	}
+	rids->zone_start = 0;
+	rids->zone_end = p->nheld_rids;
+	wp_debug("Releasing %d bytes of held protocol data with %d fds",
+			p->held_proto_len, p->nheld_rids);
+	p->held_proto_len = 0;
+	p->nheld_rids = 0;
+	p->nawaiting += p->nheld_feedback;
+	p->nheld_feedback = 0;
+	return 1;
+}
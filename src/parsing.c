@@ -174,9 +174,74 @@ static void tree_clear(struct wp_object **tree,
 	*tree = NULL;
 }
 
+#define OBJ_PAGE_SIZE (1u << OBJ_PAGE_BITS)
+/* Objects with ids further than this from the start of their range are kept
+ * in the tree instead */
+#define OBJ_RANGE_MAX_PAGES 4096u
+#define SERVER_ID_START 0xff000000u
+
+struct obj_page {
+	struct wp_object *objs[OBJ_PAGE_SIZE];
+};
+
+/** Return the table entry for the object with the given id, or NULL if there
+ * is none. If `create` is set, the table is extended if necessary; should
+ * that fail, the object must go in the tree. */
+static struct wp_object **range_slot(
+		struct message_tracker *mt, uint32_t id, bool create)
+{
+	struct obj_range *r = &mt->ranges[id >= SERVER_ID_START];
+	uint32_t offset = id - r->base;
+	uint32_t p = offset >> OBJ_PAGE_BITS;
+	if (p >= r->npages || !r->pages[p]) {
+		if (!create || p >= OBJ_RANGE_MAX_PAGES) {
+			return NULL;
+		}
+		if (p >= r->npages) {
+			uint32_t npages = (uint32_t)minu(OBJ_RANGE_MAX_PAGES,
+					maxu(2 * (uint64_t)r->npages, p + 1));
+			void *pages = realloc(r->pages,
+					sizeof(struct obj_page *) * npages);
+			if (!pages) {
+				wp_error("Failed to extend object table");
+				return NULL;
+			}
+			r->pages = pages;
+			memset(r->pages + r->npages, 0,
+					sizeof(struct obj_page *) *
+							(npages - r->npages));
+			r->npages = npages;
+		}
+		r->pages[p] = calloc(1, sizeof(struct obj_page));
+		if (!r->pages[p]) {
+			wp_error("Failed to allocate object table page");
+			return NULL;
+		}
+	}
+	return &r->pages[p]->objs[offset & (OBJ_PAGE_SIZE - 1)];
+}
+static void tracker_place(struct message_tracker *mt, struct wp_object *obj)
+{
+	struct wp_object **slot = range_slot(mt, obj->obj_id, true);
+	if (slot) {
+		*slot = obj;
+	} else {
+		tree_insert(&mt->objtree_root, obj);
+	}
+}
+static void tracker_remove_id(struct message_tracker *mt, uint32_t id)
+{
+	struct wp_object **slot = range_slot(mt, id, false);
+	if (slot && *slot) {
+		*slot = NULL;
+	} else {
+		tree_remove(&mt->objtree_root, id);
+	}
+}
+
 void tracker_insert(struct message_tracker *mt, struct wp_object *obj)
 {
-	struct wp_object *old_obj = tree_lookup(&mt->objtree_root, obj->obj_id);
+	struct wp_object *old_obj = tracker_get(mt, obj->obj_id);
 	if (old_obj) {
 		/* We /always/ replace the object, to ensure that map
 		 * elements are never duplicated and make the deletion
@@ -189,24 +254,30 @@ void tracker_insert(struct message_tracker *mt, struct wp_object *obj)
 		/* Zombie objects (server allocated, client deleted) are
 		 * only acknowledged destroyed by the server when they
 		 * are replaced. */
-		tree_remove(&mt->objtree_root, old_obj->obj_id);
+		tracker_remove_id(mt, old_obj->obj_id);
 		destroy_wp_object(old_obj);
 	}
 
-	tree_insert(&mt->objtree_root, obj);
+	tracker_place(mt, obj);
 }
 void tracker_replace_existing(
 		struct message_tracker *mt, struct wp_object *new_obj)
 {
-	tree_remove(&mt->objtree_root, new_obj->obj_id);
-	tree_insert(&mt->objtree_root, new_obj);
+	tracker_remove_id(mt, new_obj->obj_id);
+	tracker_place(mt, new_obj);
 }
 void tracker_remove(struct message_tracker *mt, struct wp_object *obj)
 {
-	tree_remove(&mt->objtree_root, obj->obj_id);
+	tracker_remove_id(mt, obj->obj_id);
 }
 struct wp_object *tracker_get(struct message_tracker *mt, uint32_t id)
 {
+	struct wp_object **slot = range_slot(mt, id, false);
+	if (slot && *slot) {
+		return *slot;
+	}
+	/* Objects which could not be put in the table may also be in the
+	 * tree */
 	return tree_lookup(&mt->objtree_root, id);
 }
 struct wp_object *get_object(struct message_tracker *mt, uint32_t id,
@@ -219,6 +290,7 @@ struct wp_object *get_object(struct message_tracker *mt, uint32_t id,
 int init_message_tracker(struct message_tracker *mt)
 {
 	memset(mt, 0, sizeof(*mt));
+	mt->ranges[1].base = SERVER_ID_START;
 
 	/* heap allocate this, so we don't need to protect against adversarial
 	 * replacement */
@@ -231,6 +303,23 @@ int init_message_tracker(struct message_tracker *mt)
 }
 void cleanup_message_tracker(struct message_tracker *mt)
 {
+	for (int i = 0; i < 2; i++) {
+		struct obj_range *r = &mt->ranges[i];
+		for (uint32_t p = 0; p < r->npages; p++) {
+			if (!r->pages[p]) {
+				continue;
+			}
+			for (uint32_t k = 0; k < OBJ_PAGE_SIZE; k++) {
+				if (r->pages[p]->objs[k]) {
+					destroy_wp_object(r->pages[p]->objs[k]);
+				}
+			}
+			free(r->pages[p]);
+		}
+		free(r->pages);
+		r->pages = NULL;
+		r->npages = 0;
+	}
 	tree_clear(&mt->objtree_root, destroy_wp_object);
 }
 
@@ -248,6 +337,14 @@ bool size_check(const struct msg_data *data, const uint32_t *payload,
 				fd_length);
 		return false;
 	}
+	if (data->fixed_words >= 0) {
+		if ((unsigned int)data->fixed_words > true_length) {
+			wp_error("Msg overflow, not enough words %d > %d",
+					data->fixed_words, true_length);
+			return false;
+		}
+		return true;
+	}
 
 	const uint16_t *gaps = data->gaps;
 	uint32_t pos = 0;
@@ -287,6 +384,26 @@ bool size_check(const struct msg_data *data, const uint32_t *payload,
 	}
 }
 
+static bool build_new_object(const struct wp_interface *type,
+		uint32_t new_id, struct message_tracker *mt,
+		const struct wp_object *caller_obj, int msg_offset)
+{
+	if (new_id == caller_obj->obj_id) {
+		wp_error("In %s.%s, tried to create object id=%u conflicting with object being called, also id=%u",
+				caller_obj->type->name,
+				get_nth_packed_string(caller_obj->type->msg_names,
+						msg_offset),
+				new_id, caller_obj->obj_id);
+		return false;
+	}
+	struct wp_object *new_obj = create_wp_object(new_id, type);
+	if (!new_obj) {
+		return false;
+	}
+	tracker_insert(mt, new_obj);
+	return true;
+}
+
 /* Given a size-checked request, try to construct all the new objects
  * that the request requires. Return true if successful, false otherwise.
  *
@@ -298,6 +415,14 @@ static bool build_new_objects(const struct msg_data *data,
 		const uint32_t *payload, struct message_tracker *mt,
 		const struct wp_object *caller_obj, int msg_offset)
 {
+	if (!data->new_objs) {
+		return true;
+	} else if (data->new_id_pos >= 0) {
+		return build_new_object(data->new_objs[0],
+				payload[data->new_id_pos], mt, caller_obj,
+				msg_offset);
+	}
+
 	const uint16_t *gaps = data->gaps;
 	uint32_t pos = 0;
 	uint32_t objno = 0;
@@ -311,22 +436,11 @@ static bool build_new_objects(const struct msg_data *data,
 			pos += (payload[pos - 1] + 3) / 4;
 			break;
 		case GAP_CODE_OBJ: {
-			uint32_t new_id = payload[pos - 1];
-			if (new_id == caller_obj->obj_id) {
-				wp_error("In %s.%s, tried to create object id=%u conflicting with object being called, also id=%u",
-						caller_obj->type->name,
-						get_nth_packed_string(
-								caller_obj->type->msg_names,
-								msg_offset),
-						new_id, caller_obj->obj_id);
-				return false;
-			}
-			struct wp_object *new_obj = create_wp_object(
-					new_id, data->new_objs[objno]);
-			if (!new_obj) {
+			if (!build_new_object(data->new_objs[objno],
+					    payload[pos - 1], mt, caller_obj,
+					    msg_offset)) {
 				return false;
 			}
-			tracker_insert(mt, new_obj);
 			objno++;
 		} break;
 		case GAP_CODE_END:
@@ -505,11 +619,14 @@ enum parse_state handle_message(struct globals *g, bool display_side,
 	return PARSE_KNOWN;
 }
 
-void parse_and_prune_messages(struct globals *g, bool on_display_side,
+int parse_and_prune_messages(struct globals *g, bool on_display_side,
 		bool from_client, struct char_window *source_bytes,
 		struct char_window *dest_bytes, struct int_window *fds)
 {
 	bool anything_unknown = false;
+	/* The end of the messages which do not use fds or change buffers */
+	bool independent = true;
+	int independent_end = dest_bytes->zone_start;
 	struct char_window scan_bytes;
 	scan_bytes.data = dest_bytes->data;
 	scan_bytes.zone_start = dest_bytes->zone_start;
@@ -556,12 +673,21 @@ void parse_and_prune_messages(struct globals *g, bool on_display_side,
 		source_bytes->zone_start += msgsz;
 		scan_bytes.zone_end = scan_bytes.zone_start + msgsz;
 
+		int fds_start = fds->zone_start, fds_end = fds->zone_end;
+		uint32_t generation = g->map.change_generation;
 		enum parse_state pstate = handle_message(g, on_display_side,
 				from_client, &scan_bytes, fds);
 		if (pstate == PARSE_UNKNOWN || pstate == PARSE_ERROR) {
 			anything_unknown = true;
 		}
+		independent = independent && !anything_unknown &&
+			      fds->zone_start == fds_start &&
+			      fds->zone_end == fds_end &&
+			      g->map.change_generation == generation;
 		scan_bytes.zone_start = scan_bytes.zone_end;
+		if (independent) {
+			independent_end = scan_bytes.zone_end;
+		}
 	}
 	dest_bytes->zone_end = scan_bytes.zone_end;
 
@@ -582,5 +708,5 @@ void parse_and_prune_messages(struct globals *g, bool on_display_side,
 		}
 	}
 	DTRACE_PROBE(waypipe, parse_exit);
-	return;
+	return independent_end - dest_bytes->zone_start;
 }
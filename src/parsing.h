@@ -42,8 +42,23 @@ struct wp_object {
 	uint32_t obj_id;
 	bool is_zombie; // object deleted but not yet acknowledged remotely
 };
+/** Log2 of the number of objects in each page of a \ref obj_range */
+#define OBJ_PAGE_BITS 8
+struct obj_page;
+/** A table of the objects whose ids are close to the start of the client or
+ * the server id range, which are directly indexed by id. Pages are allocated
+ * once an object in them is inserted. */
+struct obj_range {
+	/* The id of the first object in the range */
+	uint32_t base;
+	uint32_t npages;
+	struct obj_page **pages;
+};
 struct message_tracker {
-	/* Tree containing all objects that are currently alive or zombie */
+	/* Objects that are currently alive or zombie are kept in the tables
+	 * for client and server allocated ids, or, if their ids are not
+	 * close enough to the start of either range, in the tree */
+	struct obj_range ranges[2];
 	struct wp_object *objtree_root;
 	/* sequence number to discriminate between wl_buffer objects; object ids
 	 * and pointers are not guaranteed to be unique */
@@ -123,8 +138,12 @@ enum parse_state handle_message(struct globals *g, bool on_display_side,
  * The file descriptor queue `fds` will have its start advanced, leaving only
  * file descriptors that have not yet been read. Further edits may be made
  * to inject new file descriptors.
+ *
+ * Returns the length of the longest prefix of the written data whose
+ * messages neither use fds nor change any shadow structure, and hence do
+ * not depend on any buffer update made for the messages.
  */
-void parse_and_prune_messages(struct globals *g, bool on_display_side,
+int parse_and_prune_messages(struct globals *g, bool on_display_side,
 		bool from_client, struct char_window *source_bytes,
 		struct char_window *dest_bytes, struct int_window *fds);
 
@@ -29,6 +29,7 @@
 
 #include "config-waypipe.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -37,7 +38,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #if defined(__linux__) && defined(__arm__)
@@ -58,6 +61,31 @@
 #define HAS_O_PATH 1
 #endif
 
+#if defined(SEEK_HOLE) && defined(SEEK_DATA)
+#define HAS_SEEK_HOLE 1
+#endif
+
+#if defined(__linux__)
+/* Opening /proc/self/fd/N makes a new open file description */
+#define HAS_PROC_FD 1
+#endif
+
+#if defined(F_SETPIPE_SZ)
+#define HAS_PIPE_SZ 1
+#endif
+
+#if defined(__linux__) && defined(MREMAP_MAYMOVE)
+#define HAS_MREMAP 1
+#endif
+
+#if defined(__linux__)
+#include <linux/errqueue.h>
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && \
+		defined(SO_EE_ORIGIN_ZEROCOPY)
+#define HAS_ZEROCOPY 1
+#endif
+#endif
+
 int create_anon_file(void)
 {
 	int new_fileno;
@@ -107,31 +135,155 @@ static void *align_ptr(void *ptr, size_t alignment)
 {
 	return (uint8_t *)ptr + ((alignment - (uintptr_t)ptr) % alignment);
 }
+
+/* Allocations at least this large are given their own anonymous mapping,
+ * so that pages which are never written use no memory, even after they have
+ * been read; calloc may reuse (and clear) memory from the heap instead */
+#define MAP_ALLOC_MIN ((size_t)1 << 18)
+#define MAP_PAGE_SIZE ((size_t)4096)
+/* Mappings at least this large are aligned so that the kernel can back them
+ * with huge pages */
+#define HUGE_ALLOC_MIN ((size_t)4 << 20)
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+static bool use_huge_pages = true;
+static bool use_reserved_huge_pages = false;
+void set_huge_page_policy(bool enabled) { use_huge_pages = enabled; }
+void set_reserved_huge_pages(bool enabled)
+{
+	use_reserved_huge_pages = enabled;
+}
+
+/* The handle for a zeroed aligned allocation */
+struct aligned_region {
+	void *base;
+	/* Length of the region if it was created by mmap, otherwise 0 */
+	size_t map_len;
+	/* Whether the mapping uses reserved huge pages */
+	bool hugetlb;
+};
+
+static size_t round_up(size_t v, size_t m) { return (v + m - 1) & ~(m - 1); }
+
+/* Map anonymous (and hence zeroed) memory. For large regions, ask for
+ * transparent huge pages, trying reserved huge pages first only if they were
+ * asked for. Returns NULL on failure */
+static void *map_region(size_t bytes, struct aligned_region *region)
+{
+	if (!use_huge_pages || bytes < HUGE_ALLOC_MIN) {
+		region->map_len = round_up(bytes, MAP_PAGE_SIZE);
+		void *base = mmap(NULL, region->map_len, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		return base == MAP_FAILED ? NULL : base;
+	}
+
+	size_t len = round_up(bytes, HUGE_PAGE_SIZE);
+#ifdef MAP_HUGETLB
+	if (use_reserved_huge_pages) {
+		void *huge = mmap(NULL, len, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1,
+				0);
+		if (huge != MAP_FAILED) {
+			region->map_len = len;
+			region->hugetlb = true;
+			return huge;
+		}
+	}
+#endif
+	/* Overallocate, and trim the ends to leave an aligned region */
+	uint8_t *raw = mmap(NULL, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (raw == MAP_FAILED) {
+		return NULL;
+	}
+	uint8_t *base = align_ptr(raw, HUGE_PAGE_SIZE);
+	size_t head = (size_t)(base - raw);
+	if (head > 0) {
+		munmap(raw, head);
+	}
+	munmap(base + len, HUGE_PAGE_SIZE - head);
+#ifdef MADV_HUGEPAGE
+	/* Only advice; fails harmlessly if transparent huge pages are off */
+	(void)madvise(base, len, MADV_HUGEPAGE);
+#endif
+	region->map_len = len;
+	return base;
+}
+
 void *zeroed_aligned_alloc(size_t bytes, size_t alignment, void **handle)
 {
 	if (*handle) {
 		/* require a clean handle */
 		return NULL;
 	}
-	*handle = calloc(bytes + alignment - 1, 1);
-	return align_ptr(*handle, alignment);
+	struct aligned_region *region = calloc(1, sizeof(*region));
+	if (!region) {
+		return NULL;
+	}
+	if (bytes >= MAP_ALLOC_MIN && alignment <= MAP_PAGE_SIZE) {
+		region->base = map_region(bytes, region);
+		if (region->base) {
+			*handle = region;
+			return region->base;
+		}
+		region->map_len = 0;
+		region->hugetlb = false;
+	}
+	region->base = calloc(bytes + alignment - 1, 1);
+	if (!region->base) {
+		free(region);
+		return NULL;
+	}
+	*handle = region;
+	return align_ptr(region->base, alignment);
+}
+void zeroed_aligned_free(void *data, void **handle)
+{
+	(void)data;
+	struct aligned_region *region = *handle;
+	if (region) {
+		if (region->map_len) {
+			munmap(region->base, region->map_len);
+		} else {
+			free(region->base);
+		}
+		free(region);
+	}
+	*handle = NULL;
 }
 void *zeroed_aligned_realloc(size_t old_size_bytes, size_t new_size_bytes,
 		size_t alignment, void *data, void **handle)
 {
+	struct aligned_region *region = *handle;
+#ifdef HAS_MREMAP
+	if (region->map_len && !region->hugetlb) {
+		/* Moving the pages keeps those never written unallocated, and
+		 * the extension is zero */
+		size_t new_len = round_up(new_size_bytes, MAP_PAGE_SIZE);
+		void *new_base = mremap(region->base, region->map_len, new_len,
+				MREMAP_MAYMOVE);
+		if (new_base == MAP_FAILED) {
+			return NULL;
+		}
+		region->base = new_base;
+		region->map_len = new_len;
+		return new_base;
+	}
+#endif
+	bool to_mapping = new_size_bytes >= MAP_ALLOC_MIN;
 	/* warning: this might copy a lot of data */
-	if (new_size_bytes <= 2 * old_size_bytes) {
-		void *old_handle = *handle;
-		ptrdiff_t old_offset = (uint8_t *)data - (uint8_t *)old_handle;
+	if (new_size_bytes <= 2 * old_size_bytes && !region->map_len &&
+			!to_mapping) {
+		void *old_base = region->base;
+		ptrdiff_t old_offset = (uint8_t *)data - (uint8_t *)old_base;
 
-		void *new_handle = realloc(
-				old_handle, new_size_bytes + alignment - 1);
-		if (!new_handle) {
+		void *new_base = realloc(
+				old_base, new_size_bytes + alignment - 1);
+		if (!new_base) {
 			return NULL;
 		}
-		void *new_data = align_ptr(new_handle, alignment);
-		ptrdiff_t new_offset =
-				(uint8_t *)new_data - (uint8_t *)new_handle;
+		void *new_data = align_ptr(new_base, alignment);
+		ptrdiff_t new_offset = (uint8_t *)new_data - (uint8_t *)new_base;
 		if (old_offset != new_offset) {
 			/* realloc broke alignment offset */
 			memmove((uint8_t *)new_data + new_offset,
@@ -144,29 +296,24 @@ void *zeroed_aligned_realloc(size_t old_size_bytes, size_t new_size_bytes,
 			memset((uint8_t *)new_data + old_size_bytes, 0,
 					new_size_bytes - old_size_bytes);
 		}
-		*handle = new_handle;
+		region->base = new_base;
 		return new_data;
 	} else {
-		void *new_handle = calloc(new_size_bytes + alignment - 1, 1);
-		if (!new_handle) {
+		void *new_handle = NULL;
+		void *new_data = zeroed_aligned_alloc(
+				new_size_bytes, alignment, &new_handle);
+		if (!new_data) {
 			return NULL;
 		}
-		void *new_data = align_ptr(new_handle, alignment);
 		memcpy(new_data, data,
 				new_size_bytes > old_size_bytes
 						? old_size_bytes
 						: new_size_bytes);
-		free(*handle);
+		zeroed_aligned_free(data, handle);
 		*handle = new_handle;
 		return new_data;
 	}
 }
-void zeroed_aligned_free(void *data, void **handle)
-{
-	(void)data;
-	free(*handle);
-	*handle = NULL;
-}
 
 int open_folder(const char *name)
 {
@@ -177,3 +324,138 @@ int open_folder(const char *name)
 	return open(path, O_RDONLY | O_DIRECTORY);
 #endif
 }
+
+#ifdef HAS_SEEK_HOLE
+int find_file_hole(int fd, size_t pos, size_t end, size_t *hole_start,
+		size_t *hole_end)
+{
+	off_t hole = lseek(fd, (off_t)pos, SEEK_HOLE);
+	if (hole == -1) {
+		return errno == ENXIO ? 0 : -1;
+	}
+	if ((size_t)hole >= end) {
+		return 0;
+	}
+	off_t data = lseek(fd, hole, SEEK_DATA);
+	if (data == -1 && errno != ENXIO) {
+		return -1;
+	}
+	*hole_start = (size_t)hole;
+	*hole_end = (data == -1 || (size_t)data > end) ? end : (size_t)data;
+	return 1;
+}
+#else
+int find_file_hole(int fd, size_t pos, size_t end, size_t *hole_start,
+		size_t *hole_end)
+{
+	(void)fd;
+	(void)pos;
+	(void)end;
+	(void)hole_start;
+	(void)hole_end;
+	errno = EOPNOTSUPP;
+	return -1;
+}
+#endif
+
+#ifdef HAS_PROC_FD
+int reopen_file(int fd)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	return open(path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+}
+#else
+int reopen_file(int fd)
+{
+	(void)fd;
+	errno = EOPNOTSUPP;
+	return -1;
+}
+#endif
+
+#ifdef HAS_PIPE_SZ
+int set_pipe_capacity(int fd, int size)
+{
+	return fcntl(fd, F_SETPIPE_SZ, size);
+}
+#else
+int set_pipe_capacity(int fd, int size)
+{
+	(void)fd;
+	(void)size;
+	errno = EOPNOTSUPP;
+	return -1;
+}
+#endif
+
+#ifdef HAS_ZEROCOPY
+int enable_zerocopy(int sockfd)
+{
+	int one = 1;
+	return setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one));
+}
+ssize_t zerocopy_writev(int sockfd, const struct iovec *vecs, int count)
+{
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec *)vecs;
+	msg.msg_iovlen = (size_t)count;
+	return sendmsg(sockfd, &msg, MSG_ZEROCOPY);
+}
+int read_zerocopy_completions(int sockfd, uint32_t *completed, bool *copied)
+{
+	while (1) {
+		char control[128];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			return -1;
+		}
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+				cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			struct sock_extended_err err;
+			if (cmsg->cmsg_len < CMSG_LEN(sizeof(err))) {
+				continue;
+			}
+			memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+			if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY ||
+					err.ee_errno != 0) {
+				continue;
+			}
+			/* Sends [ee_info, ee_data] have completed; for stream
+			 * sockets, completions are reported in order */
+			uint32_t end = err.ee_data + 1;
+			if ((int32_t)(end - *completed) > 0) {
+				*completed = end;
+			}
+			if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+				*copied = true;
+			}
+		}
+	}
+}
+#else
+int enable_zerocopy(int sockfd)
+{
+	(void)sockfd;
+	errno = EOPNOTSUPP;
+	return -1;
+}
+ssize_t zerocopy_writev(int sockfd, const struct iovec *vecs, int count)
+{
+	return writev(sockfd, vecs, count);
+}
+int read_zerocopy_completions(int sockfd, uint32_t *completed, bool *copied)
+{
+	(void)sockfd;
+	(void)completed;
+	(void)copied;
+	return 0;
+}
+#endif
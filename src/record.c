@@ -0,0 +1,664 @@
+/*
+ * Copyright © 2019 Manuel Stoeckl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "main.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* A recording starts with a header, followed by one entry for each message
+ * received from the channel, each followed by the message (including its
+ * own header), padded to a multiple of 4 bytes. */
+#define RECORD_MAGIC "WPRECORD"
+#define RECORD_VERSION 1
+struct record_header {
+	char magic[8];
+	uint32_t version;
+	/* The compression mode used by the messages */
+	uint32_t compression;
+};
+struct record_entry {
+	/* Time since the recording started */
+	uint64_t time_ns;
+	uint32_t size;
+	uint32_t reserved;
+};
+
+int setup_recorder(struct session_recorder *rec, const char *path,
+		enum compression_mode compression)
+{
+	memset(rec, 0, sizeof(*rec));
+	rec->fd = -1;
+	if (!path) {
+		return 0;
+	}
+	/* Each connection is handled by its own process, so give each its
+	 * own file */
+	char name[4096];
+	if (snprintf(name, sizeof(name), "%s.%d", path, (int)getpid()) >=
+			(int)sizeof(name)) {
+		wp_error("Recording path '%s' is too long", path);
+		return -1;
+	}
+	rec->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_NOCTTY | O_CLOEXEC,
+			0644);
+	if (rec->fd == -1) {
+		wp_error("Failed to open recording file '%s': %s", name,
+				strerror(errno));
+		return -1;
+	}
+	struct record_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, RECORD_MAGIC, sizeof(header.magic));
+	header.version = RECORD_VERSION;
+	header.compression = (uint32_t)compression;
+	if (write(rec->fd, &header, sizeof(header)) != sizeof(header)) {
+		wp_error("Failed to write recording header to '%s': %s", name,
+				strerror(errno));
+		checked_close(rec->fd);
+		rec->fd = -1;
+		return -1;
+	}
+	wp_debug("Recording channel messages to '%s'", name);
+	rec->start_ns = monotonic_ns();
+	return 0;
+}
+
+void cleanup_recorder(struct session_recorder *rec)
+{
+	if (rec->fd != -1) {
+		checked_close(rec->fd);
+		rec->fd = -1;
+	}
+}
+
+void record_message(struct session_recorder *rec, const char *msg, size_t size)
+{
+	if (rec->fd == -1) {
+		return;
+	}
+	struct record_entry entry;
+	entry.time_ns = monotonic_ns() - rec->start_ns;
+	entry.size = (uint32_t)size;
+	entry.reserved = 0;
+	uint32_t padding = 0;
+	struct iovec vecs[3] = {
+			{.iov_base = &entry, .iov_len = sizeof(entry)},
+			{.iov_base = (void *)msg, .iov_len = size},
+			{.iov_base = &padding, .iov_len = alignz(size, 4) - size},
+	};
+	size_t total = sizeof(entry) + alignz(size, 4);
+	/* Blocking writes to a regular file are not expected to be
+	 * partial; if one is, the recording would be unreadable anyway */
+	if (writev(rec->fd, vecs, 3) != (ssize_t)total) {
+		wp_error("Failed to write to recording, stopping: %s",
+				strerror(errno));
+		checked_close(rec->fd);
+		rec->fd = -1;
+	}
+}
+
+/* A copy of a recorded file, which is updated through a second pair of
+ * translation maps */
+struct replay_file {
+	int recorded_rid;
+	struct shadow_fd *src;
+	bool changed;
+};
+
+struct replay_state {
+	struct thread_pool rec_pool, src_pool, dst_pool;
+	struct fd_translation_map rec_map, src_map, dst_map;
+	struct render_data render;
+	struct replay_file *files;
+	int nfiles, files_size;
+	struct transfer_queue transfers;
+};
+
+static struct replay_file *get_replay_file(struct replay_state *s, int rid)
+{
+	for (int i = 0; i < s->nfiles; i++) {
+		if (s->files[i].recorded_rid == rid) {
+			return &s->files[i];
+		}
+	}
+	return NULL;
+}
+
+static int add_replay_file(struct replay_state *s, int rid, size_t size)
+{
+	if (buf_ensure_size(s->nfiles + 1, sizeof(struct replay_file),
+			    &s->files_size, (void **)&s->files) == -1) {
+		wp_error("Failed to allocate replay file list");
+		return -1;
+	}
+	int fd = create_anon_file();
+	if (fd == -1 || ftruncate(fd, (off_t)size) == -1) {
+		wp_error("Failed to create replay file: %s", strerror(errno));
+		if (fd != -1) {
+			checked_close(fd);
+		}
+		return -1;
+	}
+	struct shadow_fd *sfd = translate_fd(&s->src_map, &s->render,
+			&s->src_pool, fd, FDC_FILE, size, NULL, false);
+	if (!sfd) {
+		return -1;
+	}
+	struct replay_file *f = &s->files[s->nfiles++];
+	f->recorded_rid = rid;
+	f->src = sfd;
+	f->changed = true;
+	return 0;
+}
+
+static void run_all_tasks(struct thread_pool *pool)
+{
+	bool done = false;
+	while (!done) {
+		struct task_data task;
+		if (request_work_task(pool, &task, &done)) {
+			run_task(&task, &pool->threads[0]);
+			finish_work_task(pool);
+		}
+	}
+}
+
+/* Copy the changed region of the recorded file into `f`, and mark it as
+ * damaged. Like the application, this only touches the parts of the buffer
+ * which change. */
+static size_t copy_replay_changes(struct replay_file *f,
+		const struct shadow_fd *rec, int alignment_bits)
+{
+	const size_t chunk = 4096;
+	char *dst = f->src->mem_local;
+	const char *src = rec->mem_local;
+	size_t size = min(f->src->buffer_size, rec->buffer_size);
+	size_t start = 0, end = size;
+	while (start < end && !memcmp(dst + start, src + start,
+					      min(chunk, end - start))) {
+		start += chunk;
+	}
+	while (end > start) {
+		size_t w = end % chunk ? end % chunk : chunk;
+		if (memcmp(dst + end - w, src + end - w, w)) {
+			break;
+		}
+		end -= w;
+	}
+	if (start >= end) {
+		return 0;
+	}
+	memcpy(dst + start, src + start, end - start);
+	struct ext_interval damage = {
+			.start = (int32_t)start,
+			.width = (int32_t)(end - start),
+			.rep = 1,
+			.stride = 0,
+	};
+	merge_damage_records(&f->src->damage, 1, &damage, alignment_bits);
+	f->src->is_dirty = true;
+	return end - start;
+}
+
+/* Collect the changes made by the recording since the last frame, and apply
+ * them to the destination copies */
+static int replay_frame(struct replay_state *s, struct replay_stats *stats)
+{
+	if (wait_for_apply_tasks(&s->rec_pool) < 0) {
+		return -1;
+	}
+	bool any_changed = false;
+	for (int i = 0; i < s->nfiles; i++) {
+		struct replay_file *f = &s->files[i];
+		if (!f->changed) {
+			continue;
+		}
+		f->changed = false;
+		any_changed = true;
+		struct shadow_fd *rec =
+				get_shadow_for_rid(&s->rec_map, f->recorded_rid);
+		if (!rec || !rec->mem_local || !f->src->mem_local) {
+			continue;
+		}
+		if (rec->buffer_size > f->src->buffer_size) {
+			if (ftruncate(f->src->fd_local,
+					    (off_t)rec->buffer_size) == -1) {
+				wp_error("Failed to extend replay file: %s",
+						strerror(errno));
+				return -1;
+			}
+			extend_shm_shadow(&s->src_pool, f->src,
+					rec->buffer_size);
+		}
+		stats->changed_bytes += copy_replay_changes(
+				f, rec, s->src_pool.diff_alignment_bits);
+	}
+	if (!any_changed) {
+		return 0;
+	}
+
+	uint64_t t0 = monotonic_ns();
+	for (int i = 0; i < s->nfiles; i++) {
+		collect_update(&s->src_pool, s->files[i].src, &s->transfers,
+				false);
+	}
+	start_parallel_work(&s->src_pool, &s->transfers.async_recv_queue);
+	run_all_tasks(&s->src_pool);
+	for (int i = 0; i < s->nfiles; i++) {
+		finish_update(s->files[i].src);
+	}
+	transfer_load_async(&s->transfers);
+	uint64_t t1 = monotonic_ns();
+
+	int ret = 0;
+	for (int i = s->transfers.start; i < s->transfers.end; i++) {
+		uint32_t header = *(uint32_t *)s->transfers.vecs[i].iov_base;
+		struct bytebuf msg = {.data = s->transfers.vecs[i].iov_base,
+				.size = transfer_size(header)};
+		enum wmsg_type type = transfer_type(header);
+		stats->wire_bytes += s->transfers.vecs[i].iov_len;
+		if (type != WMSG_BUFFER_FILL && type != WMSG_BUFFER_DIFF &&
+				wait_for_apply_tasks(&s->dst_pool) < 0) {
+			ret = -1;
+		}
+		if (apply_update(&s->dst_map, &s->dst_pool, &s->render, type,
+				    ((int32_t *)msg.data)[1], &msg) < 0) {
+			ret = -1;
+		}
+	}
+	if (wait_for_apply_tasks(&s->dst_pool) < 0) {
+		ret = -1;
+	}
+	uint64_t t2 = monotonic_ns();
+	cleanup_transfer_queue(&s->transfers);
+	memset(&s->transfers, 0, sizeof(s->transfers));
+
+	for (int i = 0; i < s->nfiles; i++) {
+		struct shadow_fd *src = s->files[i].src;
+		struct shadow_fd *dst =
+				get_shadow_for_rid(&s->dst_map, src->remote_id);
+		if (!dst || !dst->mem_local || !src->mem_local ||
+				dst->buffer_size != src->buffer_size ||
+				memcmp(dst->mem_local, src->mem_local,
+						src->buffer_size)) {
+			stats->nmismatched++;
+			break;
+		}
+	}
+	stats->collect_ns += t1 - t0;
+	stats->apply_ns += t2 - t1;
+	stats->max_collect_ns = max(stats->max_collect_ns, t1 - t0);
+	stats->max_apply_ns = max(stats->max_apply_ns, t2 - t1);
+	stats->nframes++;
+	return ret;
+}
+
+/* Apply a recorded message to the reconstruction of the recorded files.
+ * Returns 1 if the message ends a frame, 0 if not, and -1 on failure */
+static int replay_message(struct replay_state *s, const struct bytebuf *msg,
+		struct replay_stats *stats)
+{
+	enum wmsg_type type = transfer_type(*(uint32_t *)msg->data);
+	if (type == WMSG_PROTOCOL || type == WMSG_INJECT_RIDS) {
+		/* These are passed through unchanged */
+		stats->wire_bytes += alignz(msg->size, 4);
+		return type == WMSG_PROTOCOL ? 1 : 0;
+	} else if (type == WMSG_COMPRESSION_DICT) {
+		if (wait_for_apply_tasks(&s->rec_pool) < 0) {
+			return -1;
+		}
+		return apply_compression_dict(&s->rec_pool, msg) < 0 ? -1 : 0;
+	}
+	if (msg->size < sizeof(struct wmsg_basic)) {
+		wp_error("Recorded %s message is too short",
+				wmsg_type_to_str(type));
+		return -1;
+	}
+	int rid = ((const int32_t *)msg->data)[1];
+	struct shadow_fd *rec = get_shadow_for_rid(&s->rec_map, rid);
+	bool for_file = rec && rec->type == FDC_FILE;
+	if (type == WMSG_OPEN_FILE) {
+		for_file = true;
+	} else if (type != WMSG_EXTEND_FILE && type != WMSG_BUFFER_FILL &&
+			type != WMSG_BUFFER_DIFF && type != WMSG_BUFFER_COPY) {
+		for_file = false;
+	}
+	if (!for_file) {
+		/* Pipes and DMABUFs are not replayed */
+		stats->nskipped++;
+		stats->skipped_bytes += alignz(msg->size, 4);
+		return 0;
+	}
+	if (type != WMSG_BUFFER_FILL && type != WMSG_BUFFER_DIFF &&
+			wait_for_apply_tasks(&s->rec_pool) < 0) {
+		return -1;
+	}
+	if (apply_update(&s->rec_map, &s->rec_pool, &s->render, type, rid,
+			    msg) < 0) {
+		return -1;
+	}
+	struct replay_file *f = get_replay_file(s, rid);
+	if (f) {
+		f->changed = true;
+	} else if (type == WMSG_OPEN_FILE) {
+		const struct wmsg_open_file *header =
+				(const struct wmsg_open_file *)msg->data;
+		if (add_replay_file(s, rid, header->file_size) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Map and check the header of a recording. Returns NULL on failure */
+static char *map_recording(const char *path, size_t *size,
+		struct record_header *header)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		wp_error("Failed to open recording '%s': %s", path,
+				strerror(errno));
+		return NULL;
+	}
+	struct stat fsdata;
+	if (fstat(fd, &fsdata) == -1 ||
+			(size_t)fsdata.st_size < sizeof(struct record_header)) {
+		wp_error("Recording '%s' is too short", path);
+		checked_close(fd);
+		return NULL;
+	}
+	*size = (size_t)fsdata.st_size;
+	char *data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	checked_close(fd);
+	if (data == MAP_FAILED) {
+		wp_error("Failed to map recording '%s': %s", path,
+				strerror(errno));
+		return NULL;
+	}
+	memcpy(header, data, sizeof(*header));
+	if (memcmp(header->magic, RECORD_MAGIC, sizeof(header->magic)) ||
+			header->version != RECORD_VERSION ||
+			header->compression > COMP_ZSTD) {
+		wp_error("File '%s' is not a recording of a supported version",
+				path);
+		munmap(data, *size);
+		return NULL;
+	}
+	return data;
+}
+
+/* Read the entry at `*pos`, and advance past it. Returns -1 if the entry is
+ * invalid */
+static int read_entry(const char *data, size_t size, size_t *pos,
+		struct record_entry *entry, struct bytebuf *msg)
+{
+	if (size - *pos < sizeof(*entry)) {
+		wp_error("Recording ends with a partial entry");
+		return -1;
+	}
+	memcpy(entry, data + *pos, sizeof(*entry));
+	*pos += sizeof(*entry);
+	if (entry->size < sizeof(uint32_t) ||
+			size - *pos < alignz(entry->size, 4)) {
+		wp_error("Recorded message at offset %zu has invalid size %u",
+				*pos, entry->size);
+		return -1;
+	}
+	/* The messages are 4-aligned, and the mapping is page aligned, so
+	 * this can be read in place */
+	msg->data = (char *)data + *pos;
+	msg->size = entry->size;
+	*pos += alignz(entry->size, 4);
+	return 0;
+}
+
+int replay_recording(const char *path, enum compression_mode compression,
+		int compression_level, int n_worker_threads,
+		struct replay_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	size_t size;
+	struct record_header header;
+	char *data = map_recording(path, &size, &header);
+	if (!data) {
+		return -1;
+	}
+
+	struct replay_state *s = calloc(1, sizeof(struct replay_state));
+	if (!s) {
+		wp_error("Failed to allocate replay state");
+		munmap(data, size);
+		return -1;
+	}
+	s->render.disabled = true;
+	s->render.drm_fd = -1;
+	s->render.av_disabled = true;
+	setup_translation_map(&s->rec_map, true);
+	setup_translation_map(&s->src_map, false);
+	setup_translation_map(&s->dst_map, true);
+	/* The recording is decoded as it was received; the copies use the
+	 * settings being measured */
+	int ret = 0, npools = 0;
+	if (setup_thread_pool(&s->rec_pool,
+			    (enum compression_mode)header.compression, 0,
+			    n_worker_threads) == -1) {
+		ret = -1;
+		goto end;
+	}
+	npools++;
+	if (setup_thread_pool(&s->src_pool, compression, compression_level,
+			    n_worker_threads) == -1) {
+		ret = -1;
+		goto end;
+	}
+	npools++;
+	if (setup_thread_pool(&s->dst_pool, compression, compression_level,
+			    n_worker_threads) == -1) {
+		ret = -1;
+		goto end;
+	}
+	npools++;
+
+	uint64_t first_ns = 0, last_ns = 0;
+	size_t pos = sizeof(struct record_header);
+	while (ret == 0 && !shutdown_flag && pos < size) {
+		struct record_entry entry;
+		struct bytebuf msg;
+		if (read_entry(data, size, &pos, &entry, &msg) == -1) {
+			ret = -1;
+			break;
+		}
+		if (stats->nmessages == 0) {
+			first_ns = entry.time_ns;
+		}
+		last_ns = entry.time_ns;
+		stats->nmessages++;
+		stats->recorded_bytes += alignz(entry.size, 4);
+
+		int r = replay_message(s, &msg, stats);
+		if (r < 0) {
+			ret = -1;
+		} else if (r == 1 && replay_frame(s, stats) == -1) {
+			ret = -1;
+		}
+	}
+	if (ret == 0 && replay_frame(s, stats) == -1) {
+		ret = -1;
+	}
+	stats->duration_ns = last_ns - first_ns;
+
+end:
+	cleanup_transfer_queue(&s->transfers);
+	cleanup_translation_map(&s->rec_map);
+	cleanup_translation_map(&s->src_map);
+	cleanup_translation_map(&s->dst_map);
+	struct thread_pool *pools[3] = {&s->rec_pool, &s->src_pool, &s->dst_pool};
+	for (int i = 0; i < npools; i++) {
+		cleanup_thread_pool(pools[i]);
+	}
+	free(s->files);
+	free(s);
+	munmap(data, size);
+	return ret;
+}
+
+/* Parse the recorded protocol messages once, with a new set of objects */
+static int parse_recording_pass(const char *data, size_t size,
+		const struct main_config *config, struct char_window *dst,
+		struct parse_stats *stats)
+{
+	struct globals *g = calloc(1, sizeof(struct globals));
+	if (!g) {
+		wp_error("Failed to allocate parsing state");
+		return -1;
+	}
+	g->config = config;
+	g->render.disabled = true;
+	g->render.drm_fd = -1;
+	g->render.av_disabled = true;
+	(void)setup_stats(&g->stats, &g->threads, NULL, false);
+	if (setup_thread_pool(&g->threads, COMP_NONE, 0, 1) == -1) {
+		free(g);
+		return -1;
+	}
+	setup_translation_map(&g->map, stats->display_side);
+	int ret = init_message_tracker(&g->tracker);
+
+	struct int_window fds = {.data = NULL, .size = 0};
+	bool after_fds = false;
+	size_t pos = sizeof(struct record_header);
+	while (ret == 0 && pos < size) {
+		struct record_entry entry;
+		struct bytebuf msg;
+		if (read_entry(data, size, &pos, &entry, &msg) == -1) {
+			ret = -1;
+			break;
+		}
+		enum wmsg_type type = transfer_type(*(uint32_t *)msg.data);
+		if (type == WMSG_INJECT_RIDS) {
+			after_fds = true;
+			continue;
+		} else if (type != WMSG_PROTOCOL) {
+			continue;
+		}
+		if (after_fds) {
+			/* The fds for these messages were not recorded */
+			after_fds = false;
+			stats->nskipped++;
+			continue;
+		}
+		int len = (int)(msg.size - sizeof(uint32_t));
+		struct char_window src = {.data = msg.data + sizeof(uint32_t),
+				.zone_start = 0,
+				.zone_end = len,
+				.size = len};
+		dst->zone_start = 0;
+		dst->zone_end = 0;
+
+		uint64_t t0 = monotonic_ns();
+		parse_and_prune_messages(g, stats->display_side,
+				stats->display_side, &src, dst, &fds);
+		stats->parse_ns += monotonic_ns() - t0;
+		for (int k = 0; k + 8 <= len;) {
+			int msgsz = peek_message_size(src.data + k);
+			if (msgsz < 8) {
+				break;
+			}
+			stats->nmessages++;
+			k += msgsz;
+		}
+	}
+
+	cleanup_message_tracker(&g->tracker);
+	cleanup_translation_map(&g->map);
+	cleanup_frame_pacing(&g->pacing);
+	cleanup_stats(&g->stats);
+	cleanup_thread_pool(&g->threads);
+	free(g);
+	return ret;
+}
+
+int replay_protocol(const char *path, const struct main_config *config,
+		int npasses, struct parse_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	size_t size;
+	struct record_header header;
+	char *data = map_recording(path, &size, &header);
+	if (!data) {
+		return -1;
+	}
+
+	/* Find the direction of the recording: the first request made is to
+	 * the wl_display, while events are for other objects */
+	size_t max_len = 0;
+	bool found_first = false;
+	size_t pos = sizeof(struct record_header);
+	while (pos < size) {
+		struct record_entry entry;
+		struct bytebuf msg;
+		if (read_entry(data, size, &pos, &entry, &msg) == -1) {
+			munmap(data, size);
+			return -1;
+		}
+		if (transfer_type(*(uint32_t *)msg.data) != WMSG_PROTOCOL ||
+				msg.size < sizeof(uint32_t) * 3) {
+			continue;
+		}
+		if (!found_first) {
+			found_first = true;
+			stats->display_side = ((uint32_t *)msg.data)[1] == 1;
+		}
+		max_len = max(max_len, msg.size);
+	}
+
+	/* Handlers may enlarge messages, as in the main loop */
+	struct char_window dst = {.data = malloc(max_len + 1024),
+			.size = (int)(max_len + 1024)};
+	int ret = 0;
+	if (!dst.data) {
+		wp_error("Failed to allocate parsing buffer");
+		ret = -1;
+	}
+	for (int i = 0; ret == 0 && i < npasses && !shutdown_flag; i++) {
+		struct parse_stats pass = {.display_side = stats->display_side};
+		ret = parse_recording_pass(data, size, config, &dst, &pass);
+		stats->nmessages = pass.nmessages;
+		stats->nskipped = pass.nskipped;
+		stats->parse_ns += pass.parse_ns;
+		stats->npasses++;
+	}
+	free(dst.data);
+	munmap(data, size);
+	return ret;
+}
@@ -46,6 +46,10 @@ static inline uint32_t conntoken_header(const struct main_config *config,
 	uint32_t header = (WAYPIPE_PROTOCOL_VERSION << 16) | CONN_FIXED_BIT;
 	header |= (update ? CONN_UPDATE_BIT : 0);
 	header |= (reconnectable ? CONN_RECONNECTABLE_BIT : 0);
+	if (config->n_streams > 1) {
+		header |= (uint32_t)(config->n_streams - 1)
+			  << CONN_STREAMS_SHIFT;
+	}
 	// TODO: stop compile gating the 'COMP' enum entries
 #ifdef HAS_LZ4
 	header |= (config->compression == COMP_LZ4 ? CONN_LZ4_COMPRESSION : 0);
@@ -100,6 +104,59 @@ static void fill_random_key(struct connection_token *token)
 	}
 }
 
+/** Connect the extra channel connections of a session, whose tokens are sent
+ * by write_stripe_tokens. Connections which failed are set to -1. */
+static void connect_stripes(int cwd_fd, struct socket_path socket_path,
+		bool vsock, const struct main_config *config,
+		int stripe_fds[static MAX_CHANNEL_STREAMS - 1])
+{
+	for (int i = 0; i < config->n_streams - 1; i++) {
+		stripe_fds[i] = -1;
+		int ret;
+		if (!vsock) {
+			ret = connect_to_socket(
+					cwd_fd, socket_path, NULL, &stripe_fds[i]);
+		} else {
+#ifdef HAS_VSOCK
+			ret = connect_to_vsock(config->vsock_port,
+					config->vsock_cid,
+					config->vsock_to_host, &stripe_fds[i]);
+#else
+			ret = -1;
+#endif
+		}
+		if (ret == -1) {
+			wp_error("Failed to open extra channel connection %d",
+					i + 1);
+			stripe_fds[i] = -1;
+		}
+	}
+}
+
+/** Identify each extra channel connection by the key of the initial token and
+ * its index */
+static void write_stripe_tokens(int stripe_fds[static MAX_CHANNEL_STREAMS - 1],
+		int nstripes, const struct connection_token *token)
+{
+	for (int i = 0; i < nstripes; i++) {
+		if (stripe_fds[i] == -1) {
+			continue;
+		}
+		struct connection_token stripe_token = *token;
+		stripe_token.header &= ~CONN_STREAMS_MASK;
+		stripe_token.header |= CONN_STRIPE_BIT |
+				       ((uint32_t)(i + 1) << CONN_STREAMS_SHIFT);
+		if (write(stripe_fds[i], &stripe_token,
+				    sizeof(stripe_token)) !=
+				sizeof(stripe_token)) {
+			wp_error("Failed to write token to extra channel connection: %s",
+					strerror(errno));
+			checked_close(stripe_fds[i]);
+			stripe_fds[i] = -1;
+		}
+	}
+}
+
 static int read_path(int control_pipe, char *path, size_t path_space)
 {
 	/* It is unlikely that a signal would interrupt a read of a ~100 byte
@@ -205,6 +262,10 @@ static int run_single_server(int cwd_fd, int control_pipe,
 			-1) {
 		goto fail_srv;
 	}
+	/* The extra connections must be made before the socket is unlinked */
+	int nstripes = max(config->n_streams - 1, 0);
+	int stripe_fds[MAX_CHANNEL_STREAMS - 1];
+	connect_stripes(cwd_fd, socket_path, false, config, stripe_fds);
 	/* Only unlink the socket if it actually was a socket */
 	if (unlink_at_end) {
 		unlink_at_folder(cwd_fd, chanfolder_fd, socket_path.folder,
@@ -222,6 +283,7 @@ static int run_single_server(int cwd_fd, int control_pipe,
 		wp_error("Failed to write connection token to socket");
 		goto fail_cfd;
 	}
+	write_stripe_tokens(stripe_fds, nstripes, &token);
 
 	int linkfds[2] = {-1, -1};
 	if (control_pipe != -1) {
@@ -241,6 +303,11 @@ static int run_single_server(int cwd_fd, int control_pipe,
 			checked_close(chanfd);
 			checked_close(linkfds[0]);
 			checked_close(server_link);
+			for (int i = 0; i < nstripes; i++) {
+				if (stripe_fds[i] != -1) {
+					checked_close(stripe_fds[i]);
+				}
+			}
 
 			/* Further uses of the token will be to reconnect */
 			token.header |= CONN_UPDATE_BIT;
@@ -252,25 +319,72 @@ static int run_single_server(int cwd_fd, int control_pipe,
 		checked_close(linkfds[1]);
 	}
 
-	int ret = main_interface_loop(
-			chanfd, server_link, linkfds[0], config, false);
+	int ret = main_interface_loop(chanfd, server_link, linkfds[0],
+			stripe_fds, nstripes, config, false);
 	return ret;
 
 fail_cfd:
+	for (int i = 0; i < nstripes; i++) {
+		if (stripe_fds[i] != -1) {
+			checked_close(stripe_fds[i]);
+		}
+	}
 	checked_close(chanfd);
 fail_srv:
 	checked_close(server_link);
 	return EXIT_FAILURE;
 }
 
+/** Fork a process which prepares to handle the next connection; failures
+ * are only logged, since connections can still be handled without it */
+static void start_warm_process(struct warm_process *warm, int control_pipe,
+		int wdisplay_socket, const struct conn_map *connmap,
+		const struct main_config *config)
+{
+	int warmsocks[2] = {-1, -1};
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, warmsocks) == -1) {
+		wp_error("Socketpair for prepared process failed: %s",
+				strerror(errno));
+		return;
+	}
+	pid_t npid = fork();
+	if (npid == 0) {
+		checked_close(warmsocks[0]);
+		checked_close(wdisplay_socket);
+		if (control_pipe != -1) {
+			checked_close(control_pipe);
+		}
+		for (int i = 0; i < connmap->count; i++) {
+			if (connmap->data[i].linkfd != -1) {
+				checked_close(connmap->data[i].linkfd);
+			}
+		}
+		int rc = warm_interface_loop(warmsocks[1], config, false);
+		check_unclosed_fds();
+		exit(rc);
+	} else if (npid == -1) {
+		wp_error("Fork failure: %s", strerror(errno));
+		checked_close(warmsocks[0]);
+		checked_close(warmsocks[1]);
+		return;
+	}
+	checked_close(warmsocks[1]);
+	warm->pid = npid;
+	warm->linkfd = warmsocks[0];
+}
+
 static int handle_new_server_connection(int cwd_fd,
 		struct socket_path current_sockaddr, int control_pipe,
 		int wdisplay_socket, int appfd, struct conn_map *connmap,
+		struct warm_process *warm, struct conn_threads *threads,
 		const struct main_config *config,
 		const struct connection_token *new_token)
 {
 	bool reconnectable = control_pipe != -1;
-	if (reconnectable && buf_ensure_size(connmap->count + 1,
+	/* Threads are also woken to stop by closing their link */
+	bool threaded = config->shared_workers;
+	bool linked = reconnectable || threaded;
+	if (linked && buf_ensure_size(connmap->count + 1,
 					     sizeof(struct conn_addr),
 					     &connmap->size,
 					     (void **)&connmap->data) == -1) {
@@ -298,17 +412,44 @@ static int handle_new_server_connection(int cwd_fd,
 				strerror(errno));
 		goto fail_chanfd;
 	}
+	int nstripes = max(config->n_streams - 1, 0);
+	int stripe_fds[MAX_CHANNEL_STREAMS - 1];
+	connect_stripes(cwd_fd, current_sockaddr, config->vsock, config,
+			stripe_fds);
+	write_stripe_tokens(stripe_fds, nstripes, new_token);
 
 	int linksocks[2] = {-1, -1};
-	if (reconnectable) {
+	if (linked) {
 		if (socketpair(AF_UNIX, SOCK_STREAM, 0, linksocks) == -1) {
 			wp_error("Socketpair for process link failed: %s",
 					strerror(errno));
-			goto fail_chanfd;
+			goto fail_stripes;
 		}
 	}
 
-	pid_t npid = fork();
+	if (threaded) {
+		if (start_connection_thread(threads, chanfd, appfd,
+				    linksocks[1], stripe_fds, nstripes,
+				    new_token, config, false) == -1) {
+			checked_close(linksocks[0]);
+			checked_close(linksocks[1]);
+			goto fail_stripes;
+		}
+		/* The thread now owns the connection's fds */
+		connmap->data[connmap->count++] = (struct conn_addr){
+				.token = *new_token,
+				.pid = 0,
+				.linkfd = linksocks[0],
+				.threaded = true,
+		};
+		return 0;
+	}
+
+	pid_t npid = hand_off_connection(warm, 0, chanfd, appfd, linksocks[1],
+			stripe_fds, nstripes);
+	if (npid == -1) {
+		npid = fork();
+	}
 	if (npid == 0) {
 		// Run forked process, with the only shared state being the
 		// new channel socket
@@ -322,8 +463,8 @@ static int handle_new_server_connection(int cwd_fd,
 				checked_close(connmap->data[i].linkfd);
 			}
 		}
-		int rc = main_interface_loop(
-				chanfd, appfd, linksocks[1], config, false);
+		int rc = main_interface_loop(chanfd, appfd, linksocks[1],
+				stripe_fds, nstripes, config, false);
 		check_unclosed_fds();
 		exit(rc);
 	} else if (npid == -1) {
@@ -332,10 +473,15 @@ static int handle_new_server_connection(int cwd_fd,
 			checked_close(linksocks[0]);
 			checked_close(linksocks[1]);
 		}
-		goto fail_chanfd;
+		goto fail_stripes;
 	}
 
 	// This process no longer needs the application connection
+	for (int i = 0; i < nstripes; i++) {
+		if (stripe_fds[i] != -1) {
+			checked_close(stripe_fds[i]);
+		}
+	}
 	checked_close(chanfd);
 	checked_close(appfd);
 	if (reconnectable) {
@@ -349,6 +495,12 @@ static int handle_new_server_connection(int cwd_fd,
 	}
 
 	return 0;
+fail_stripes:
+	for (int i = 0; i < nstripes; i++) {
+		if (stripe_fds[i] != -1) {
+			checked_close(stripe_fds[i]);
+		}
+	}
 fail_chanfd:
 	checked_close(chanfd);
 fail_appfd:
@@ -417,6 +569,13 @@ static int run_multi_server(int cwd_fd, int control_pipe,
 	token.header = conntoken_header(config, control_pipe != -1, false);
 	wp_debug("Connection token header: %08" PRIx32, token.header);
 
+	struct warm_process warm = {.pid = 0, .linkfd = -1};
+	struct conn_threads threads = {.has_workers = false,
+			.list = NULL,
+			.count = 0,
+			.size = 0,
+			.nstarted = 0};
+
 	int current_folder_fd = open_folder(current_sockaddr.folder);
 	if (current_folder_fd == -1) {
 		wp_error("Failed to open folder '%s' for connection socket: %s",
@@ -433,6 +592,11 @@ static int run_multi_server(int cwd_fd, int control_pipe,
 			retcode = WEXITSTATUS(status);
 			break;
 		}
+		reap_connection_threads(&threads, &connmap, false);
+		if (config->prewarm && warm.pid == 0) {
+			start_warm_process(&warm, control_pipe, wdisplay_socket,
+					&connmap, config);
+		}
 
 		int r = poll(pfs, 1 + (control_pipe != -1), -1);
 		if (r == -1) {
@@ -530,8 +694,8 @@ static int run_multi_server(int cwd_fd, int control_pipe,
 						    current_sockaddr,
 						    control_pipe,
 						    wdisplay_socket, appfd,
-						    &connmap, config,
-						    &token) == -1) {
+						    &connmap, &warm, &threads,
+						    config, &token) == -1) {
 					retcode = EXIT_FAILURE;
 					break;
 				}
@@ -548,9 +712,14 @@ static int run_multi_server(int cwd_fd, int control_pipe,
 		checked_close(control_pipe);
 	}
 	checked_close(current_folder_fd);
+	reap_connection_threads(&threads, &connmap, true);
 	for (int i = 0; i < connmap.count; i++) {
 		checked_close(connmap.data[i].linkfd);
 	}
+	if (warm.linkfd != -1) {
+		/* the prepared process exits when this closes */
+		checked_close(warm.linkfd);
+	}
 	free(connmap.data);
 	return retcode;
 }
@@ -43,32 +43,155 @@
 #endif
 #ifdef HAS_ZSTD
 #include <zstd.h>
+#if ZSTD_VERSION_NUMBER >= 10400
+/* The streaming compression API became stable in 1.4.0 */
+#define HAS_ZSTD_STREAM 1
+#endif
 #endif
 
-struct shadow_fd *get_shadow_for_local_fd(
-		struct fd_translation_map *map, int lfd)
+/* When diffs are compressed as they are made, this much diff is constructed
+ * at a time, so that it is still in cache when it is compressed */
+#define DIFF_STREAM_CHUNK 65536
+
+static uint32_t sfd_index_hash(int key)
 {
-	for (struct shadow_fd_link *lcur = map->link.l_next,
-				   *lnxt = lcur->l_next;
-			lcur != &map->link; lcur = lnxt, lnxt = lcur->l_next) {
-		struct shadow_fd *cur = (struct shadow_fd *)lcur;
-		if (cur->fd_local == lfd) {
-			return cur;
+	/* Fibonacci hashing; remote ids and fds are both mostly sequential */
+	return (uint32_t)key * 2654435769u;
+}
+static struct shadow_fd *sfd_index_find(struct sfd_index *idx, int key)
+{
+	if (idx->nslots == 0) {
+		return NULL;
+	}
+	uint32_t mask = (uint32_t)idx->nslots - 1;
+	for (uint32_t i = sfd_index_hash(key) & mask;; i = (i + 1) & mask) {
+		if (!idx->slots[i].sfd) {
+			return NULL;
+		}
+		if (idx->slots[i].key == key) {
+			return idx->slots[i].sfd;
 		}
 	}
-	return NULL;
 }
-struct shadow_fd *get_shadow_for_rid(struct fd_translation_map *map, int rid)
+/* Requires that the index have a free slot */
+static void sfd_index_insert(
+		struct sfd_index *idx, int key, struct shadow_fd *sfd)
 {
-	for (struct shadow_fd_link *lcur = map->link.l_next,
-				   *lnxt = lcur->l_next;
-			lcur != &map->link; lcur = lnxt, lnxt = lcur->l_next) {
-		struct shadow_fd *cur = (struct shadow_fd *)lcur;
-		if (cur->remote_id == rid) {
-			return cur;
+	uint32_t mask = (uint32_t)idx->nslots - 1;
+	uint32_t i = sfd_index_hash(key) & mask;
+	while (idx->slots[i].sfd) {
+		i = (i + 1) & mask;
+	}
+	idx->slots[i].key = key;
+	idx->slots[i].sfd = sfd;
+}
+static void sfd_index_remove(
+		struct sfd_index *idx, int key, struct shadow_fd *sfd)
+{
+	if (idx->nslots == 0) {
+		return;
+	}
+	uint32_t mask = (uint32_t)idx->nslots - 1;
+	uint32_t i = sfd_index_hash(key) & mask;
+	while (idx->slots[i].sfd != sfd) {
+		if (!idx->slots[i].sfd) {
+			wp_error("Shadow structure for key %d missing from index",
+					key);
+			return;
 		}
+		i = (i + 1) & mask;
 	}
-	return NULL;
+	/* Backward shift deletion: move later entries of the probe sequence
+	 * into the hole, so that no tombstones are needed */
+	uint32_t hole = i;
+	for (uint32_t j = (i + 1) & mask; idx->slots[j].sfd;
+			j = (j + 1) & mask) {
+		uint32_t home = sfd_index_hash(idx->slots[j].key) & mask;
+		/* Can the entry at j be moved to the hole? Only if its home
+		 * slot is not cyclically within (hole, j] */
+		if (((j - home) & mask) >= ((j - hole) & mask)) {
+			idx->slots[hole] = idx->slots[j];
+			hole = j;
+		}
+	}
+	idx->slots[hole].sfd = NULL;
+	idx->slots[hole].key = 0;
+}
+/* Move the entries of the index into `slots`, of which there are `nslots` */
+static void sfd_index_rehash(struct sfd_index *idx,
+		struct sfd_index_slot *slots, int nslots)
+{
+	struct sfd_index_slot *old_slots = idx->slots;
+	int old_nslots = idx->nslots;
+	idx->slots = slots;
+	idx->nslots = nslots;
+	for (int i = 0; i < old_nslots; i++) {
+		if (old_slots[i].sfd) {
+			sfd_index_insert(idx, old_slots[i].key,
+					old_slots[i].sfd);
+		}
+	}
+	free(old_slots);
+}
+/* Add a new shadow structure to the list and indices of the map. Returns -1
+ * on allocation failure, in which case the map is unchanged. */
+static int link_shadow(struct fd_translation_map *map, struct shadow_fd *sfd)
+{
+	/* Keep the load factor at most 1/2 */
+	if (2 * (map->nshadows + 1) > map->rid_index.nslots) {
+		int nslots = map->rid_index.nslots ? 2 * map->rid_index.nslots
+						   : 16;
+		/* Both indices must keep the same size, so that neither can
+		 * fill up */
+		struct sfd_index_slot *rid_slots = calloc(
+				(size_t)nslots, sizeof(struct sfd_index_slot));
+		struct sfd_index_slot *lfd_slots = calloc(
+				(size_t)nslots, sizeof(struct sfd_index_slot));
+		if (!rid_slots || !lfd_slots) {
+			free(rid_slots);
+			free(lfd_slots);
+			return -1;
+		}
+		sfd_index_rehash(&map->rid_index, rid_slots, nslots);
+		sfd_index_rehash(&map->lfd_index, lfd_slots, nslots);
+	}
+	sfd->link.l_prev = &map->link;
+	sfd->link.l_next = map->link.l_next;
+	sfd->link.l_prev->l_next = &sfd->link;
+	sfd->link.l_next->l_prev = &sfd->link;
+
+	sfd->map = map;
+	map->nshadows++;
+	sfd_index_insert(&map->rid_index, sfd->remote_id, sfd);
+	if (sfd->fd_local >= 0) {
+		sfd_index_insert(&map->lfd_index, sfd->fd_local, sfd);
+	}
+	return 0;
+}
+/* Change the local file descriptor of a shadow structure, keeping the map's
+ * index up to date */
+static void set_shadow_local_fd(struct shadow_fd *sfd, int lfd)
+{
+	if (sfd->map && sfd->fd_local >= 0) {
+		sfd_index_remove(&sfd->map->lfd_index, sfd->fd_local, sfd);
+	}
+	sfd->fd_local = lfd;
+	if (sfd->map && sfd->fd_local >= 0) {
+		sfd_index_insert(&sfd->map->lfd_index, sfd->fd_local, sfd);
+	}
+}
+
+struct shadow_fd *get_shadow_for_local_fd(
+		struct fd_translation_map *map, int lfd)
+{
+	if (lfd < 0) {
+		return NULL;
+	}
+	return sfd_index_find(&map->lfd_index, lfd);
+}
+struct shadow_fd *get_shadow_for_rid(struct fd_translation_map *map, int rid)
+{
+	return sfd_index_find(&map->rid_index, rid);
 }
 static void destroy_unlinked_sfd(struct shadow_fd *sfd)
 {
@@ -84,6 +207,10 @@ static void destroy_unlinked_sfd(struct shadow_fd *sfd)
 	if (sfd->type == FDC_FILE) {
 		munmap(sfd->mem_local, sfd->buffer_size);
 		zeroed_aligned_free(sfd->mem_mirror, &sfd->mem_mirror_handle);
+		free(sfd->zero_pages);
+		if (sfd->holes_fd >= 0) {
+			checked_close(sfd->holes_fd);
+		}
 	} else if (sfd->type == FDC_DMABUF || sfd->type == FDC_DMAVID_IR ||
 			sfd->type == FDC_DMAVID_IW) {
 		if (sfd->dmabuf_map_handle) {
@@ -117,6 +244,7 @@ static void cleanup_thread_local(struct thread_data *data)
 	free(data->comp_ctx.lz4_extstate);
 #endif
 	free(data->tmp_buf);
+	release_transfer_arena(data->arena);
 }
 
 static void setup_thread_local(struct thread_data *data,
@@ -149,7 +277,26 @@ static void setup_thread_local(struct thread_data *data,
 
 	data->tmp_buf = NULL;
 	data->tmp_size = 0;
+	data->arena = NULL;
+}
+#ifdef HAS_LZ4
+/** Replace the thread's LZ4 state with one that can be used for every
+ * compression level. Returns -1 on allocation failure. */
+static int setup_any_level_lz4_state(struct comp_ctx *ctx)
+{
+	/* The state for LZ4HC is larger than, and can also be used as, the
+	 * state for the fast compressor */
+	size_t state_size =
+			(size_t)max(LZ4_sizeofState(), LZ4_sizeofStateHC());
+	free(ctx->lz4_extstate);
+	ctx->lz4_extstate = malloc(state_size);
+	if (!ctx->lz4_extstate) {
+		wp_error("Failed to allocate LZ4 state");
+		return -1;
+	}
+	return 0;
 }
+#endif
 void cleanup_translation_map(struct fd_translation_map *map)
 {
 	for (struct shadow_fd_link *lcur = map->link.l_next,
@@ -160,6 +307,20 @@ void cleanup_translation_map(struct fd_translation_map *map)
 	}
 	map->link.l_next = &map->link;
 	map->link.l_prev = &map->link;
+	free(map->rid_index.slots);
+	free(map->lfd_index.slots);
+	memset(&map->rid_index, 0, sizeof(map->rid_index));
+	memset(&map->lfd_index, 0, sizeof(map->lfd_index));
+	if (map->block_cache.nentries > 0) {
+		wp_debug("Block cache: %" PRIu64 " hits, %" PRIu64
+			 " misses, %" PRIu64 " row shifts",
+				map->block_cache.nhits,
+				map->block_cache.nmisses,
+				map->block_cache.nshifts);
+	}
+	free(map->block_cache.entries);
+	memset(&map->block_cache, 0, sizeof(map->block_cache));
+	map->nshadows = 0;
 }
 bool destroy_shadow_if_unreferenced(struct shadow_fd *sfd)
 {
@@ -171,11 +332,21 @@ bool destroy_shadow_if_unreferenced(struct shadow_fd *sfd)
 	}
 	if (sfd->refcount.protocol == 0 && sfd->refcount.transfer == 0 &&
 			sfd->refcount.compute == false && autodelete) {
-		/* remove shadowfd from list */
+		/* remove shadowfd from list and indices */
 		sfd->link.l_prev->l_next = sfd->link.l_next;
 		sfd->link.l_next->l_prev = sfd->link.l_prev;
 		sfd->link.l_next = NULL;
 		sfd->link.l_prev = NULL;
+		sfd_index_remove(&sfd->map->rid_index, sfd->remote_id, sfd);
+		if (sfd->fd_local >= 0) {
+			sfd_index_remove(&sfd->map->lfd_index, sfd->fd_local,
+					sfd);
+		}
+		sfd->map->nshadows--;
+		if (sfd->type == FDC_PIPE) {
+			sfd->map->fd_generation++;
+		}
+		sfd->map = NULL;
 
 		destroy_unlinked_sfd(sfd);
 		return true;
@@ -188,25 +359,69 @@ bool destroy_shadow_if_unreferenced(struct shadow_fd *sfd)
 }
 
 static void *worker_thread_main(void *arg);
+static void *group_worker_main(void *arg);
 void setup_translation_map(struct fd_translation_map *map, bool display_side)
 {
 	map->local_sign = display_side ? -1 : 1;
 	map->link.l_next = &map->link;
 	map->link.l_prev = &map->link;
 	map->max_local_id = 1;
+	memset(&map->rid_index, 0, sizeof(map->rid_index));
+	memset(&map->lfd_index, 0, sizeof(map->lfd_index));
+	memset(&map->block_cache, 0, sizeof(map->block_cache));
+	map->nshadows = 0;
+}
+
+int enable_block_cache(struct fd_translation_map *map)
+{
+	/* Enough to index 64 MB of tiles */
+	const int nentries = 1 << 16;
+	map->block_cache.entries =
+			calloc((size_t)nentries, sizeof(struct block_cache_entry));
+	if (!map->block_cache.entries) {
+		wp_error("Failed to allocate block cache");
+		return -1;
+	}
+	map->block_cache.nentries = nentries;
+	return 0;
 }
 
 static void shutdown_threads(struct thread_pool *pool)
 {
+	/* Pending updates still refer to shadow structures, which may be
+	 * destroyed soon after this point */
+	(void)wait_for_apply_tasks(pool);
+
+	struct worker_group *group = pool->group;
+	if (group) {
+		pthread_mutex_lock(&group->mutex);
+		for (int i = 0; i < group->npools; i++) {
+			if (group->pools[i] != pool) {
+				continue;
+			}
+			memmove(group->pools + i, group->pools + i + 1,
+					sizeof(struct thread_pool *) *
+							(size_t)(group->npools -
+									i - 1));
+			group->npools--;
+			if (group->next_pool > i) {
+				group->next_pool--;
+			}
+			break;
+		}
+		if (group->next_pool >= group->npools) {
+			group->next_pool = 0;
+		}
+		/* Shared workers may still be running tasks for the pool */
+		while (pool->group_users > 0) {
+			pthread_cond_wait(&group->idle_cond, &group->mutex);
+		}
+		pthread_mutex_unlock(&group->mutex);
+		pool->group = NULL;
+	}
+
 	pthread_mutex_lock(&pool->work_mutex);
-	free(pool->stack);
-	struct task_data task;
-	memset(&task, 0, sizeof(task));
-	task.type = TASK_STOP;
-	pool->stack = &task;
-	pool->stack_count = 1;
-	pool->stack_size = 1;
-	pool->do_work = true;
+	pool->stopping = true;
 	pthread_cond_broadcast(&pool->work_cond);
 	pthread_mutex_unlock(&pool->work_mutex);
 
@@ -217,7 +432,6 @@ static void shutdown_threads(struct thread_pool *pool)
 			}
 		}
 	}
-	pool->stack = NULL;
 }
 
 int setup_thread_pool(struct thread_pool *pool,
@@ -228,6 +442,8 @@ int setup_thread_pool(struct thread_pool *pool,
 
 	pool->diff_func = get_diff_function(
 			DIFF_FASTEST, &pool->diff_alignment_bits);
+	pool->copy_func = get_copy_function(DIFF_FASTEST);
+	pool->stream_diffs = true;
 
 	pool->compression = compression;
 	pool->compression_level = comp_level;
@@ -241,8 +457,14 @@ int setup_thread_pool(struct thread_pool *pool,
 	pool->stack_size = 0;
 	pool->stack_count = 0;
 	pool->stack = NULL;
-	pool->tasks_in_progress = 0;
-	pool->do_work = true;
+	atomic_init(&pool->tasks_queued, 0);
+	atomic_init(&pool->tasks_in_progress, 0);
+	pool->stopping = false;
+	pool->apply_stack_size = 0;
+	pool->apply_stack_count = 0;
+	pool->apply_stack = NULL;
+	pool->apply_tasks_in_progress = 0;
+	pool->apply_failed = false;
 
 	/* Thread #0 is the 'main' thread */
 	pool->threads = calloc(
@@ -264,6 +486,28 @@ int setup_thread_pool(struct thread_pool *pool,
 				strerror(ret));
 		return -1;
 	}
+	ret = pthread_cond_init(&pool->apply_done_cond, NULL);
+	if (ret) {
+		wp_error("Condition variable creation failed: %s",
+				strerror(ret));
+		return -1;
+	}
+
+	/* Workers may steal from any deque, so all must be ready before the
+	 * first worker starts */
+	for (int i = 0; i < pool->nthreads; i++) {
+		ret = pthread_mutex_init(&pool->threads[i].deque_lock, NULL);
+		if (ret) {
+			wp_error("Mutex creation failed: %s", strerror(ret));
+			for (int k = 0; k < i; k++) {
+				pthread_mutex_destroy(
+						&pool->threads[k].deque_lock);
+			}
+			free(pool->threads);
+			pool->threads = NULL;
+			return -1;
+		}
+	}
 
 	pool->threads[0].pool = pool;
 	pool->threads[0].thread = pthread_self();
@@ -274,6 +518,10 @@ int setup_thread_pool(struct thread_pool *pool,
 		if (ret) {
 			wp_error("Thread creation failed: %s", strerror(ret));
 			// Stop making new threads, but keep what is there
+			for (int k = i; k < pool->nthreads; k++) {
+				pthread_mutex_destroy(
+						&pool->threads[k].deque_lock);
+			}
 			pool->nthreads = i;
 			break;
 		}
@@ -302,19 +550,406 @@ void cleanup_thread_pool(struct thread_pool *pool)
 	shutdown_threads(pool);
 	if (pool->threads) {
 		for (int i = 0; i < pool->nthreads; i++) {
-			cleanup_thread_local(&pool->threads[i]);
+			struct thread_data *data = &pool->threads[i];
+			wp_debug("Thread %d ran %" PRIu64 " tasks, %" PRIu64
+				 " of which were stolen",
+					i, data->tasks_run, data->tasks_stolen);
+			cleanup_thread_local(data);
+			pthread_mutex_destroy(&data->deque_lock);
+			free(data->deque);
 		}
 	}
 
 	pthread_mutex_destroy(&pool->work_mutex);
 	pthread_cond_destroy(&pool->work_cond);
+	pthread_cond_destroy(&pool->apply_done_cond);
 	free(pool->threads);
 	free(pool->stack);
+	free(pool->apply_stack);
+	free(pool->dict.samples);
+	free(pool->dict.remote);
 
 	checked_close(pool->selfpipe_r);
 	checked_close(pool->selfpipe_w);
 }
 
+int setup_worker_group(struct worker_group *group,
+		enum compression_mode compression, int n_threads)
+{
+	memset(group, 0, sizeof(struct worker_group));
+	if (n_threads <= 0) {
+		int nt = get_hardware_thread_count();
+		n_threads = max(nt / 2, 1);
+	}
+	group->compression = compression;
+
+	int ret = pthread_mutex_init(&group->mutex, NULL);
+	if (ret) {
+		wp_error("Mutex creation failed: %s", strerror(ret));
+		return -1;
+	}
+	ret = pthread_cond_init(&group->work_cond, NULL);
+	if (ret) {
+		wp_error("Condition variable creation failed: %s",
+				strerror(ret));
+		return -1;
+	}
+	ret = pthread_cond_init(&group->idle_cond, NULL);
+	if (ret) {
+		wp_error("Condition variable creation failed: %s",
+				strerror(ret));
+		return -1;
+	}
+	if (n_threads <= 1) {
+		/* Each connection's main thread runs its own tasks */
+		return 0;
+	}
+
+	int nworkers = n_threads - 1;
+	group->threads = calloc((size_t)nworkers, sizeof(struct thread_data));
+	if (!group->threads) {
+		wp_error("Failed to allocate list of thread data");
+		return -1;
+	}
+	/* The pools using the group may each pick different levels, so
+	 * every thread's compression context must support all of them */
+	for (int i = 0; i < nworkers; i++) {
+		setup_thread_local(&group->threads[i], compression, 0);
+		group->threads[i].group = group;
+#ifdef HAS_LZ4
+		if (compression == COMP_LZ4 &&
+				setup_any_level_lz4_state(
+						&group->threads[i].comp_ctx) ==
+						-1) {
+			for (int k = 0; k <= i; k++) {
+				cleanup_thread_local(&group->threads[k]);
+			}
+			free(group->threads);
+			group->threads = NULL;
+			return -1;
+		}
+#endif
+	}
+	for (int i = 0; i < nworkers; i++) {
+		ret = pthread_create(&group->threads[i].thread, NULL,
+				group_worker_main, &group->threads[i]);
+		if (ret) {
+			wp_error("Thread creation failed: %s", strerror(ret));
+			// Stop making new threads, but keep what is there
+			for (int k = i; k < nworkers; k++) {
+				cleanup_thread_local(&group->threads[k]);
+			}
+			nworkers = i;
+			break;
+		}
+	}
+	group->nworkers = nworkers;
+	return 0;
+}
+void cleanup_worker_group(struct worker_group *group)
+{
+	if (group->npools > 0) {
+		wp_error("Stopping shared workers while %d pools still use them",
+				group->npools);
+	}
+	pthread_mutex_lock(&group->mutex);
+	group->stopping = true;
+	pthread_cond_broadcast(&group->work_cond);
+	pthread_mutex_unlock(&group->mutex);
+
+	for (int i = 0; i < group->nworkers; i++) {
+		struct thread_data *data = &group->threads[i];
+		pthread_join(data->thread, NULL);
+		wp_debug("Shared worker %d ran %" PRIu64 " tasks", i,
+				data->tasks_run);
+		cleanup_thread_local(data);
+	}
+	pthread_mutex_destroy(&group->mutex);
+	pthread_cond_destroy(&group->work_cond);
+	pthread_cond_destroy(&group->idle_cond);
+	free(group->threads);
+	free(group->pools);
+	memset(group, 0, sizeof(struct worker_group));
+}
+int join_worker_group(struct thread_pool *pool, struct worker_group *group)
+{
+	if (group->nworkers == 0) {
+		return 0;
+	}
+	if (pool->nthreads != 1 || pool->compression != group->compression) {
+		wp_error("Thread pool has %d threads and compression=%s, but the shared workers need one thread and compression=%s",
+				pool->nthreads,
+				compression_mode_to_str(pool->compression),
+				compression_mode_to_str(group->compression));
+		return -1;
+	}
+	pthread_mutex_lock(&group->mutex);
+	if (buf_ensure_size(group->npools + 1, sizeof(struct thread_pool *),
+			    &group->pools_size,
+			    (void **)&group->pools) == -1) {
+		pthread_mutex_unlock(&group->mutex);
+		wp_error("Failed to allocate space to register with shared workers");
+		return -1;
+	}
+	group->pools[group->npools++] = pool;
+	pool->group = group;
+	pthread_mutex_unlock(&group->mutex);
+	return 0;
+}
+int pool_thread_count(const struct thread_pool *pool)
+{
+	return pool->group ? pool->group->nworkers + 1 : pool->nthreads;
+}
+/** Wake only as many idle threads as there are new tasks for them to run */
+static void wake_workers(struct thread_pool *pool, int ntasks)
+{
+	/* Idle shared workers wait for tasks from any pool */
+	pthread_mutex_t *mutex = pool->group ? &pool->group->mutex
+					     : &pool->work_mutex;
+	pthread_cond_t *cond = pool->group ? &pool->group->work_cond
+					   : &pool->work_cond;
+	pthread_mutex_lock(mutex);
+	if (ntasks >= pool_thread_count(pool) - 1) {
+		pthread_cond_broadcast(cond);
+	} else {
+		for (int i = 0; i < ntasks; i++) {
+			pthread_cond_signal(cond);
+		}
+	}
+	pthread_mutex_unlock(mutex);
+}
+
+/* Compression levels are only adjusted after cycles in which at least this
+ * many bytes were compressed, so that measurements are not too noisy */
+#define AUTOTUNE_MIN_SAMPLE 16384
+/* Measurements older than this many cycles are refreshed by trying the level
+ * again, every AUTOTUNE_PROBE_INTERVAL cycles */
+#define AUTOTUNE_STALE_CYCLES 64
+#define AUTOTUNE_PROBE_INTERVAL 8
+/* Upper limit for the bandwidth estimate, in bytes per nanosecond */
+#define AUTOTUNE_MAX_BANDWIDTH 10.0
+
+int enable_compression_autotune(struct thread_pool *pool)
+{
+	struct comp_autotune *at = &pool->autotune;
+	if (pool->compression == COMP_LZ4) {
+		/* Acceleration factors 10 to 1, and then the HC levels; the
+		 * optimal parsing levels above 9 are far slower */
+		at->min_level = -10;
+		at->max_level = 9;
+#ifdef HAS_LZ4
+		for (int i = 0; i < pool->nthreads; i++) {
+			if (setup_any_level_lz4_state(
+					    &pool->threads[i].comp_ctx) == -1) {
+				return -1;
+			}
+		}
+#endif
+	} else if (pool->compression == COMP_ZSTD) {
+		at->min_level = -10;
+		at->max_level = 15;
+	} else {
+		return 0;
+	}
+	pool->compression_level = clamp(pool->compression_level,
+			at->min_level, at->max_level);
+	memset(at->levels, 0, sizeof(at->levels));
+	at->bandwidth = 0.0;
+	at->cycle = 0;
+	atomic_init(&at->comp_ns, 0);
+	atomic_init(&at->comp_in_bytes, 0);
+	atomic_init(&at->comp_out_bytes, 0);
+	at->enabled = true;
+	return 0;
+}
+
+/* Time to send a byte through the channel if compressed with the given
+ * level. As workers compress some blocks while earlier ones are written,
+ * this is approximately the larger of the compression and the transfer
+ * time. (An unknown bandwidth is taken to be very large.) */
+static double level_cost(const struct comp_level_stats *s, double bandwidth,
+		int nthreads, bool *compute_bound)
+{
+	double compute = s->ns_per_byte / nthreads;
+	double transfer = bandwidth > 0.0 ? s->ratio / bandwidth : 0.0;
+	if (compute_bound) {
+		*compute_bound = compute > transfer;
+	}
+	return compute > transfer ? compute : transfer;
+}
+
+void update_compression_level(
+		struct thread_pool *pool, struct transfer_queue *transfers)
+{
+	uint64_t blocked_ns = transfers->blocked_ns;
+	uint64_t blocked_bytes = transfers->blocked_bytes;
+	transfers->blocked_ns = 0;
+	transfers->blocked_bytes = 0;
+
+	struct comp_autotune *at = &pool->autotune;
+	if (!at->enabled) {
+		return;
+	}
+	uint64_t comp_ns = atomic_exchange(&at->comp_ns, 0);
+	uint64_t comp_in = atomic_exchange(&at->comp_in_bytes, 0);
+	uint64_t comp_out = atomic_exchange(&at->comp_out_bytes, 0);
+	if (comp_in < AUTOTUNE_MIN_SAMPLE) {
+		return;
+	}
+	at->cycle++;
+
+	if (blocked_ns > 0 && blocked_bytes > 0) {
+		double sample = (double)blocked_bytes / (double)blocked_ns;
+		at->bandwidth = at->bandwidth > 0.0 ? 0.75 * at->bandwidth +
+								      0.25 * sample
+						    : sample;
+	} else if (at->bandwidth > 0.0) {
+		/* The channel kept up with everything sent, so it may be
+		 * faster than estimated */
+		at->bandwidth *= 1.25;
+		if (at->bandwidth > AUTOTUNE_MAX_BANDWIDTH) {
+			at->bandwidth = AUTOTUNE_MAX_BANDWIDTH;
+		}
+	}
+
+	int level = pool->compression_level;
+	struct comp_level_stats *cur = &at->levels[level - at->min_level];
+	double ns_per_byte = (double)comp_ns / (double)comp_in;
+	double ratio = (double)comp_out / (double)comp_in;
+	if (cur->measured) {
+		cur->ns_per_byte = 0.5 * cur->ns_per_byte + 0.5 * ns_per_byte;
+		cur->ratio = 0.5 * cur->ratio + 0.5 * ratio;
+	} else {
+		cur->ns_per_byte = ns_per_byte;
+		cur->ratio = ratio;
+		cur->measured = true;
+	}
+	cur->last_cycle = at->cycle;
+
+	/* Only reducing the larger of the compression and transfer times can
+	 * help, so there is just one neighboring level to consider */
+	bool compute_bound;
+	int nthreads = pool_thread_count(pool);
+	double cur_cost = level_cost(
+			cur, at->bandwidth, nthreads, &compute_bound);
+	int next = level + (compute_bound ? -1 : 1);
+	if (next < at->min_level || next > at->max_level) {
+		return;
+	}
+	struct comp_level_stats *alt = &at->levels[next - at->min_level];
+	bool stale = !alt->measured ||
+		     at->cycle - alt->last_cycle > AUTOTUNE_STALE_CYCLES;
+	bool change;
+	if (stale) {
+		change = !alt->measured ||
+			 at->cycle % AUTOTUNE_PROBE_INTERVAL == 0;
+	} else {
+		change = level_cost(alt, at->bandwidth, nthreads, NULL) <
+			 0.95 * cur_cost;
+	}
+	if (change) {
+		wp_debug("Changing %s compression level from %d to %d; bandwidth estimate %g MB/s, %g ns/byte to compress, ratio %g",
+				compression_mode_to_str(pool->compression),
+				level, next, at->bandwidth * 1e3,
+				cur->ns_per_byte, cur->ratio);
+		pool->compression_level = next;
+	}
+}
+
+/* Each block compressed contributes up to this many slices of this size
+ * to the dictionary samples */
+#define COMP_DICT_SLICES 8
+#define COMP_DICT_SLICE_SIZE 256
+
+int enable_compression_dict(struct thread_pool *pool)
+{
+	if (pool->compression == COMP_NONE) {
+		return 0;
+	}
+	struct comp_dict *d = &pool->dict;
+	d->samples = calloc(COMP_DICT_SIZE, 1);
+	if (!d->samples) {
+		wp_error("Failed to allocate compression dictionary");
+		return -1;
+	}
+	/* Start with zeros, so that the samples can never be mistaken for a
+	 * Zstd formatted dictionary, which begins with a magic number */
+	d->nsampled = 8;
+	d->size = 0;
+	d->enabled = true;
+	return 0;
+}
+
+/* Called by worker threads on blocks about to be compressed */
+static void sample_for_dict(
+		struct thread_pool *pool, size_t isize, const char *ibuf)
+{
+	struct comp_dict *d = &pool->dict;
+	/* Small blocks are sampled whole, larger ones in slices spread across
+	 * the block */
+	size_t nslices = COMP_DICT_SLICES, slice = COMP_DICT_SLICE_SIZE;
+	if (isize < nslices * slice) {
+		nslices = 1;
+		slice = isize;
+	}
+	pthread_mutex_lock(&pool->work_mutex);
+	for (size_t k = 0; k < nslices && d->nsampled < COMP_DICT_SIZE; k++) {
+		/* Spread the slices evenly across the block */
+		size_t pos = nslices > 1 ? (isize - slice) * k / (nslices - 1)
+					 : 0;
+		size_t len = min(slice, COMP_DICT_SIZE - d->nsampled);
+		memcpy(d->samples + d->nsampled, ibuf + pos, len);
+		d->nsampled += len;
+	}
+	pthread_mutex_unlock(&pool->work_mutex);
+}
+
+void update_compression_dict(
+		struct thread_pool *pool, struct transfer_queue *transfers)
+{
+	struct comp_dict *d = &pool->dict;
+	if (!d->enabled || d->size > 0 || d->nsampled < COMP_DICT_SIZE) {
+		return;
+	}
+	size_t msg_size = sizeof(uint32_t) + COMP_DICT_SIZE;
+	uint32_t *msg = malloc(msg_size);
+	if (!msg) {
+		wp_error("Failed to allocate compression dictionary message");
+		return;
+	}
+	msg[0] = transfer_header(msg_size, WMSG_COMPRESSION_DICT);
+	memcpy(msg + 1, d->samples, COMP_DICT_SIZE);
+	if (transfer_add(transfers, msg_size, msg) == -1) {
+		wp_error("Failed to queue compression dictionary message");
+		free(msg);
+		return;
+	}
+	wp_debug("Compressing with a %d byte dictionary from now on",
+			COMP_DICT_SIZE);
+	d->size = COMP_DICT_SIZE;
+}
+
+int apply_compression_dict(struct thread_pool *pool, const struct bytebuf *msg)
+{
+	size_t size = msg->size - min(msg->size, sizeof(uint32_t));
+	if (size == 0 || size > COMP_DICT_SIZE) {
+		wp_error("Compression dictionary has invalid size %zu", size);
+		return ERR_FATAL;
+	}
+	struct comp_dict *d = &pool->dict;
+	if (!d->remote) {
+		d->remote = malloc(COMP_DICT_SIZE);
+		if (!d->remote) {
+			wp_error("Failed to allocate compression dictionary");
+			return ERR_NOMEM;
+		}
+	}
+	memcpy(d->remote, msg->data + sizeof(uint32_t), size);
+	d->remote_size = size;
+	wp_debug("Decompressing with a %zu byte dictionary from now on", size);
+	return 0;
+}
+
 const char *fdcat_to_str(enum fdcat cat)
 {
 	switch (cat) {
@@ -394,7 +1029,7 @@ enum fdcat get_fd_type(int fd, size_t *size)
 	}
 }
 
-static size_t compress_bufsize(struct thread_pool *pool, size_t max_input)
+size_t compress_bufsize(struct thread_pool *pool, size_t max_input)
 {
 	switch (pool->compression) {
 	default:
@@ -414,10 +1049,19 @@ static size_t compress_bufsize(struct thread_pool *pool, size_t max_input)
 	return 0;
 }
 
+static void add_autotune_sample(struct thread_pool *pool, uint64_t comp_ns,
+		size_t isize, size_t osize)
+{
+	struct comp_autotune *at = &pool->autotune;
+	atomic_fetch_add(&at->comp_ns, comp_ns);
+	atomic_fetch_add(&at->comp_in_bytes, isize);
+	atomic_fetch_add(&at->comp_out_bytes, osize);
+}
+
 /* With the selected compression method, compress the buffer
  * {isize,ibuf}, possibly modifying {msize,mbuf}, and setting
  * {wsize,wbuf} to indicate the result */
-static void compress_buffer(struct thread_pool *pool, struct comp_ctx *ctx,
+void compress_buffer(struct thread_pool *pool, struct comp_ctx *ctx,
 		size_t isize, const char *ibuf, size_t msize, char *mbuf,
 		struct bytebuf *dst)
 {
@@ -430,18 +1074,43 @@ static void compress_buffer(struct thread_pool *pool, struct comp_ctx *ctx,
 	}
 
 	DTRACE_PROBE1(waypipe, compress_buffer_enter, isize);
+	uint64_t start_ns = pool->autotune.enabled ? monotonic_ns() : 0;
+	size_t dict_size = pool->dict.size;
+	if (pool->dict.enabled && dict_size == 0) {
+		sample_for_dict(pool, isize, ibuf);
+	}
 	switch (pool->compression) {
 	default:
 	case COMP_NONE:
 		(void)msize;
 		(void)mbuf;
+		(void)dict_size;
 		dst->size = isize;
 		dst->data = (char *)ibuf;
 		break;
 #ifdef HAS_LZ4
 	case COMP_LZ4: {
 		int ws;
-		if (pool->compression_level <= 0) {
+		if (dict_size > 0 && pool->compression_level <= 0) {
+			/* The state is only used for this block, which is
+			 * compressed as if it followed the dictionary */
+			LZ4_stream_t *stream = LZ4_initStream(ctx->lz4_extstate,
+					(size_t)LZ4_sizeofState());
+			LZ4_loadDict(stream, pool->dict.samples,
+					(int)dict_size);
+			ws = LZ4_compress_fast_continue(stream, ibuf, mbuf,
+					(int)isize, (int)msize,
+					-pool->compression_level);
+		} else if (dict_size > 0) {
+			LZ4_streamHC_t *stream = LZ4_initStreamHC(
+					ctx->lz4_extstate,
+					(size_t)LZ4_sizeofStateHC());
+			LZ4_resetStreamHC_fast(stream, pool->compression_level);
+			LZ4_loadDictHC(stream, pool->dict.samples,
+					(int)dict_size);
+			ws = LZ4_compress_HC_continue(stream, ibuf, mbuf,
+					(int)isize, (int)msize);
+		} else if (pool->compression_level <= 0) {
 			ws = LZ4_compress_fast_extState(ctx->lz4_extstate, ibuf,
 					mbuf, (int)isize, (int)msize,
 					-pool->compression_level);
@@ -461,8 +1130,15 @@ static void compress_buffer(struct thread_pool *pool, struct comp_ctx *ctx,
 #endif
 #ifdef HAS_ZSTD
 	case COMP_ZSTD: {
-		size_t ws = ZSTD_compressCCtx(ctx->zstd_ccontext, mbuf, msize,
-				ibuf, isize, pool->compression_level);
+		size_t ws;
+		if (dict_size > 0) {
+			ws = ZSTD_compress_usingDict(ctx->zstd_ccontext, mbuf,
+					msize, ibuf, isize, pool->dict.samples,
+					dict_size, pool->compression_level);
+		} else {
+			ws = ZSTD_compressCCtx(ctx->zstd_ccontext, mbuf, msize,
+					ibuf, isize, pool->compression_level);
+		}
 		if (ZSTD_isError(ws)) {
 			wp_error("Zstd compression failed for %d bytes in %d of space: %s",
 					(int)isize, (int)msize,
@@ -474,12 +1150,16 @@ static void compress_buffer(struct thread_pool *pool, struct comp_ctx *ctx,
 	}
 #endif
 	}
+	if (pool->autotune.enabled) {
+		add_autotune_sample(pool, monotonic_ns() - start_ns, isize,
+				dst->size);
+	}
 	DTRACE_PROBE1(waypipe, compress_buffer_exit, dst->size);
 }
 /* With the selected compression method, uncompress the buffer {isize,ibuf},
  * to precisely msize bytes, setting {wsize,wbuf} to indicate the result.
  * If the compression mode requires it. */
-static void uncompress_buffer(struct thread_pool *pool, struct comp_ctx *ctx,
+void uncompress_buffer(struct thread_pool *pool, struct comp_ctx *ctx,
 		size_t isize, const char *ibuf, size_t msize, char *mbuf,
 		size_t *wsize, const char **wbuf)
 {
@@ -502,8 +1182,16 @@ static void uncompress_buffer(struct thread_pool *pool, struct comp_ctx *ctx,
 		break;
 #ifdef HAS_LZ4
 	case COMP_LZ4: {
-		int ws = LZ4_decompress_safe(
-				ibuf, mbuf, (int)isize, (int)msize);
+		int ws;
+		if (pool->dict.remote_size > 0) {
+			ws = LZ4_decompress_safe_usingDict(ibuf, mbuf,
+					(int)isize, (int)msize,
+					pool->dict.remote,
+					(int)pool->dict.remote_size);
+		} else {
+			ws = LZ4_decompress_safe(
+					ibuf, mbuf, (int)isize, (int)msize);
+		}
 		if (ws < 0 || (size_t)ws != msize) {
 			wp_error("Lz4 decompression failed for %d bytes to %d of space, used %d",
 					(int)isize, (int)msize, ws);
@@ -515,8 +1203,15 @@ static void uncompress_buffer(struct thread_pool *pool, struct comp_ctx *ctx,
 #endif
 #ifdef HAS_ZSTD
 	case COMP_ZSTD: {
-		size_t ws = ZSTD_decompressDCtx(
-				ctx->zstd_dcontext, mbuf, msize, ibuf, isize);
+		size_t ws;
+		if (pool->dict.remote_size > 0) {
+			ws = ZSTD_decompress_usingDict(ctx->zstd_dcontext, mbuf,
+					msize, ibuf, isize, pool->dict.remote,
+					pool->dict.remote_size);
+		} else {
+			ws = ZSTD_decompressDCtx(ctx->zstd_dcontext, mbuf,
+					msize, ibuf, isize);
+		}
 		if (ZSTD_isError(ws) || (size_t)ws != msize) {
 			wp_error("Zstd decompression failed for %d bytes to %d of space: %s",
 					(int)isize, (int)msize,
@@ -554,17 +1249,20 @@ struct shadow_fd *translate_fd(struct fd_translation_map *map,
 		wp_error("Failed to allocate shadow_fd structure");
 		return NULL;
 	}
-	sfd->link.l_prev = &map->link;
-	sfd->link.l_next = map->link.l_next;
-	sfd->link.l_prev->l_next = &sfd->link;
-	sfd->link.l_next->l_prev = &sfd->link;
-
 	sfd->fd_local = fd;
+	sfd->holes_fd = -1;
+	sfd->remote_id = map->max_local_id * map->local_sign;
+	if (link_shadow(map, sfd) == -1) {
+		wp_error("Failed to expand shadow_fd index");
+		free(sfd);
+		return NULL;
+	}
+	map->max_local_id++;
+
 	sfd->mem_local = NULL;
 	sfd->mem_mirror = NULL;
 	sfd->mem_mirror_handle = NULL;
 	sfd->buffer_size = 0;
-	sfd->remote_id = (map->max_local_id++) * map->local_sign;
 	sfd->type = type;
 	// File changes must be propagated
 	sfd->is_dirty = true;
@@ -657,7 +1355,8 @@ struct shadow_fd *translate_fd(struct fd_translation_map *map,
 		if (!sfd->dmabuf_bo) {
 			return sfd;
 		}
-		if (setup_video_encode(sfd, render, threads->nthreads) == -1) {
+		if (setup_video_encode(sfd, render,
+				    pool_thread_count(threads)) == -1) {
 			wp_error("Video encoding setup failed for RID=%d",
 					sfd->remote_id);
 		}
@@ -700,18 +1399,130 @@ struct shadow_fd *translate_fd(struct fd_translation_map *map,
 	return sfd;
 }
 
-static void *shrink_buffer(void *buf, size_t sz)
+void *alloc_msg_block(struct thread_data *local, size_t size)
 {
-	void *nbuf = realloc(buf, sz);
-	if (nbuf) {
-		return nbuf;
-	} else {
-		wp_debug("Failed to shrink buffer with realloc, not a problem");
-		return buf;
+	if (!local->arena) {
+		local->arena = create_transfer_arena();
+		if (!local->arena) {
+			return NULL;
+		}
 	}
+	return arena_alloc(local->arena, size);
 }
 
-/* Construct and optionally compress a diff between sfd->mem_mirror and
+#ifdef HAS_ZSTD_STREAM
+/* Feed the `isize` bytes at `ibuf` to the Zstd stream, ending the frame if
+ * `end` is set. Returns -1 on failure. */
+static int stream_compress(struct thread_pool *pool, ZSTD_CCtx *cctx,
+		const char *ibuf, size_t isize, ZSTD_outBuffer *out, bool end)
+{
+	uint64_t start_ns = pool->autotune.enabled ? monotonic_ns() : 0;
+	size_t start_pos = out->pos;
+	ZSTD_inBuffer in = {.src = ibuf, .size = isize, .pos = 0};
+	ZSTD_EndDirective op = end ? ZSTD_e_end : ZSTD_e_continue;
+	while (true) {
+		size_t r = ZSTD_compressStream2(cctx, out, &in, op);
+		if (ZSTD_isError(r)) {
+			wp_error("Zstd stream compression failed for %zu bytes: %s",
+					isize, ZSTD_getErrorName(r));
+			return -1;
+		}
+		bool finished = end ? r == 0 : in.pos == in.size;
+		if (finished) {
+			break;
+		}
+		if (out->pos == out->size) {
+			wp_error("Zstd stream compression ran out of space");
+			return -1;
+		}
+	}
+	if (pool->autotune.enabled) {
+		add_autotune_sample(pool, monotonic_ns() - start_ns, isize,
+				out->pos - start_pos);
+	}
+	return 0;
+}
+
+/* Construct the diff for the task in pieces of about DIFF_STREAM_CHUNK bytes,
+ * compressing each into a single Zstd frame at `dst` while it is still in
+ * cache, instead of making the whole diff first. The frame decompresses to
+ * exactly the diff that construct_diff_core and construct_diff_trailing would
+ * produce, except that the diff may have more, shorter segments. Returns the
+ * compressed size, or (size_t)-1 on failure. */
+static size_t construct_compressed_diff(struct task_data *task,
+		struct thread_data *local, const char *source, char *dst,
+		size_t dst_size, size_t *diffsize, size_t *ntrailing)
+{
+	struct shadow_fd *sfd = task->sfd;
+	struct thread_pool *pool = local->pool;
+	ZSTD_CCtx *cctx = local->comp_ctx.zstd_ccontext;
+	size_t bs = (size_t)1 << pool->diff_alignment_bits;
+	/* Each piece of an interval may produce an 8 byte segment header
+	 * more than its length; the trailing bytes are shorter than `bs` */
+	size_t stage_space = DIFF_STREAM_CHUNK + 8 + bs;
+	if (buf_ensure_size((int)stage_space, 1, &local->tmp_size,
+			    &local->tmp_buf) == -1) {
+		wp_error("Allocation failed, dropping diff transfer block");
+		return (size_t)-1;
+	}
+	char *stage = local->tmp_buf;
+
+	size_t r = ZSTD_CCtx_reset(cctx, ZSTD_reset_session_only);
+	if (!ZSTD_isError(r)) {
+		r = ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel,
+				pool->compression_level);
+	}
+	if (!ZSTD_isError(r) && pool->dict.size > 0) {
+		/* Equivalent to the raw content dictionary used by
+		 * ZSTD_compress_usingDict */
+		r = ZSTD_CCtx_refPrefix(cctx, pool->dict.samples,
+				pool->dict.size);
+	}
+	if (ZSTD_isError(r)) {
+		wp_error("Failed to set up Zstd stream: %s",
+				ZSTD_getErrorName(r));
+		return (size_t)-1;
+	}
+
+	ZSTD_outBuffer out = {.dst = dst, .size = dst_size, .pos = 0};
+	size_t nstaged = 0;
+	*diffsize = 0;
+	*ntrailing = 0;
+	for (int i = 0; i < task->damage_len; i++) {
+		struct interval e = task->damage_intervals[i];
+		for (int32_t start = e.start; start < e.end;) {
+			int32_t end = min(start + DIFF_STREAM_CHUNK, e.end);
+			if (nstaged + (size_t)(end - start) + 8 > stage_space) {
+				if (stream_compress(pool, cctx, stage, nstaged,
+						    &out, false) == -1) {
+					return (size_t)-1;
+				}
+				nstaged = 0;
+			}
+			struct interval piece = {.start = start, .end = end};
+			size_t sz = construct_diff_core(pool->diff_func,
+					pool->diff_alignment_bits, &piece, 1,
+					sfd->mem_mirror, source,
+					stage + nstaged);
+			nstaged += sz;
+			*diffsize += sz;
+			start = end;
+		}
+	}
+	if (task->damaged_end) {
+		*ntrailing = construct_diff_trailing(sfd->buffer_size,
+				pool->diff_alignment_bits, sfd->mem_mirror,
+				source, stage + nstaged);
+		nstaged += *ntrailing;
+	}
+	if (stream_compress(pool, cctx, stage, nstaged, &out, true) == -1) {
+		return (size_t)-1;
+	}
+	return out.pos;
+}
+#endif
+
+/* Construct and optionally compress a diff between sfd->mem_mirror and
  * the actual memmap'd data, and synchronize sfd->mem_mirror */
 static void worker_run_compress_diff(
 		struct task_data *task, struct thread_data *local)
@@ -732,10 +1543,28 @@ static void worker_run_compress_diff(
 
 	DTRACE_PROBE1(waypipe, worker_compdiff_enter, damage_space);
 
+	/* Sampling for the dictionary needs the whole diff */
+	bool stream = false;
+#ifdef HAS_ZSTD_STREAM
+	stream = pool->stream_diffs && pool->compression == COMP_ZSTD &&
+		 !(pool->dict.enabled && pool->dict.size == 0);
+#endif
+
 	char *diff_buffer = NULL;
 	char *diff_target = NULL;
-	if (pool->compression == COMP_NONE) {
-		diff_buffer = malloc(
+	char *stream_buf = NULL;
+	size_t stream_space = 0;
+	if (stream) {
+		stream_space = compress_bufsize(pool, damage_space);
+		size_t msg_space = alignz(stream_space, 4) +
+				   sizeof(struct wmsg_buffer_diff);
+		stream_buf = alloc_msg_block(local, msg_space);
+		if (!stream_buf) {
+			wp_error("Allocation failed, dropping diff transfer block");
+			goto end;
+		}
+	} else if (pool->compression == COMP_NONE) {
+		diff_buffer = alloc_msg_block(local,
 				damage_space + sizeof(struct wmsg_buffer_diff));
 		if (!diff_buffer) {
 			wp_error("Allocation failed, dropping diff transfer block");
@@ -770,8 +1599,9 @@ static void worker_run_compress_diff(
 					 (end / tx_stride) *
 							 sfd->dmabuf_map_stride;
 
-			stride_shifted_copy(sfd->dmabuf_warped, sfd->mem_local,
-					loc_start, loc_end - loc_start, common,
+			stride_shifted_copy(NULL, sfd->dmabuf_warped,
+					sfd->mem_local, loc_start,
+					loc_end - loc_start, common,
 					sfd->dmabuf_map_stride,
 					sfd->dmabuf_info.strides[0]);
 		}
@@ -790,8 +1620,9 @@ static void worker_run_compress_diff(
 					 (end / tx_stride) *
 							 sfd->dmabuf_map_stride;
 
-			stride_shifted_copy(sfd->dmabuf_warped, sfd->mem_local,
-					loc_start, loc_end - loc_start, common,
+			stride_shifted_copy(NULL, sfd->dmabuf_warped,
+					sfd->mem_local, loc_start,
+					loc_end - loc_start, common,
 					sfd->dmabuf_map_stride,
 					sfd->dmabuf_info.strides[0]);
 		}
@@ -799,33 +1630,66 @@ static void worker_run_compress_diff(
 		source = sfd->dmabuf_warped;
 	}
 
-	diffsize = construct_diff_core(pool->diff_func,
-			pool->diff_alignment_bits, task->damage_intervals,
-			task->damage_len, sfd->mem_mirror, source, diff_target);
 	size_t ntrailing = 0;
-	if (task->damaged_end) {
-		ntrailing = construct_diff_trailing(sfd->buffer_size,
-				pool->diff_alignment_bits, sfd->mem_mirror,
-				source, diff_target + diffsize);
+	size_t stream_size = 0;
+#ifdef HAS_ZSTD_STREAM
+	if (stream) {
+		stream_size = construct_compressed_diff(task, local, source,
+				stream_buf + sizeof(struct wmsg_buffer_diff),
+				stream_space, &diffsize, &ntrailing);
+		if (stream_size == (size_t)-1) {
+			arena_free(stream_buf);
+			goto end;
+		}
+	}
+#endif
+	if (!stream) {
+		diffsize = construct_diff_core(pool->diff_func,
+				pool->diff_alignment_bits,
+				task->damage_intervals, task->damage_len,
+				sfd->mem_mirror, source, diff_target);
+		if (task->damaged_end) {
+			ntrailing = construct_diff_trailing(sfd->buffer_size,
+					pool->diff_alignment_bits,
+					sfd->mem_mirror, source,
+					diff_target + diffsize);
+		}
 	}
 	DTRACE_PROBE1(waypipe, construct_diff_exit, diffsize);
+	if (pool->stats.enabled) {
+		size_t alignment = 1u << pool->diff_alignment_bits;
+		size_t damaged = task->damaged_end
+						 ? sfd->buffer_size % alignment
+						 : 0;
+		for (int i = 0; i < task->damage_len; i++) {
+			damaged += (size_t)(task->damage_intervals[i].end -
+					    task->damage_intervals[i].start);
+		}
+		atomic_fetch_add(&pool->stats.damaged_bytes, damaged);
+		atomic_fetch_add(&pool->stats.diff_bytes, diffsize + ntrailing);
+	}
 
 	if (diffsize == 0 && ntrailing == 0) {
-		free(diff_buffer);
+		arena_free(diff_buffer);
+		arena_free(stream_buf);
 		goto end;
 	}
 
 	uint8_t *msg;
 	size_t sz;
 	size_t net_diff_sz = diffsize + ntrailing;
-	if (pool->compression == COMP_NONE) {
+	if (stream) {
+		sz = stream_size + sizeof(struct wmsg_buffer_diff);
+		msg = (uint8_t *)stream_buf;
+	} else if (pool->compression == COMP_NONE) {
 		sz = net_diff_sz + sizeof(struct wmsg_buffer_diff);
 		msg = (uint8_t *)diff_buffer;
 	} else {
 		struct bytebuf dst;
 		size_t comp_size = compress_bufsize(pool, net_diff_sz);
-		char *comp_buf = malloc(alignz(comp_size, 4) +
-					sizeof(struct wmsg_buffer_diff));
+		size_t msg_space = alignz(comp_size, 4) +
+				   sizeof(struct wmsg_buffer_diff);
+		char *comp_buf = alloc_msg_block(local, msg_space);
 		if (!comp_buf) {
 			wp_error("Allocation failed, dropping diff transfer block");
 			goto end;
@@ -837,7 +1701,12 @@ static void worker_run_compress_diff(
 		sz = dst.size + sizeof(struct wmsg_buffer_diff);
 		msg = (uint8_t *)comp_buf;
 	}
-	msg = shrink_buffer(msg, alignz(sz, 4));
+	if (pool->stats.enabled) {
+		atomic_fetch_add(&pool->stats.comp_in_bytes, net_diff_sz);
+		atomic_fetch_add(&pool->stats.comp_out_bytes,
+				sz - sizeof(struct wmsg_buffer_diff));
+	}
+	arena_shrink(local->arena, msg, alignz(sz, 4));
 	memset(msg + sz, 0, alignz(sz, 4) - sz);
 	struct wmsg_buffer_diff header;
 	header.size_and_type = transfer_header(sz, WMSG_BUFFER_DIFF);
@@ -846,7 +1715,7 @@ static void worker_run_compress_diff(
 	header.ntrailing = (uint32_t)ntrailing;
 	memcpy(msg, &header, sizeof(struct wmsg_buffer_diff));
 
-	transfer_async_add(task->msg_queue, msg, alignz(sz, 4));
+	transfer_async_add(task->msg_queue, msg, alignz(sz, 4), true);
 
 end:
 	DTRACE_PROBE1(waypipe, worker_compdiff_exit, diffsize);
@@ -881,8 +1750,8 @@ static void worker_run_compress_block(
 				 (source_end / tx_stride) *
 						 sfd->dmabuf_map_stride;
 
-		stride_shifted_copy(sfd->mem_mirror, sfd->mem_local, loc_start,
-				loc_end - loc_start, common,
+		stride_shifted_copy(NULL, sfd->mem_mirror, sfd->mem_local,
+				loc_start, loc_end - loc_start, common,
 				sfd->dmabuf_map_stride,
 				sfd->dmabuf_info.strides[0]);
 	} else {
@@ -897,7 +1766,7 @@ static void worker_run_compress_block(
 		sz = sizeof(struct wmsg_buffer_fill) +
 		     (source_end - source_start);
 
-		msg = malloc(alignz(sz, 4));
+		msg = alloc_msg_block(local, alignz(sz, 4));
 		if (!msg) {
 			wp_error("Allocation failed, dropping fill transfer block");
 			goto end;
@@ -908,8 +1777,9 @@ static void worker_run_compress_block(
 	} else {
 		size_t comp_size = compress_bufsize(
 				pool, source_end - source_start);
-		msg = malloc(alignz(comp_size, 4) +
-				sizeof(struct wmsg_buffer_fill));
+		size_t msg_space = alignz(comp_size, 4) +
+				   sizeof(struct wmsg_buffer_fill);
+		msg = alloc_msg_block(local, msg_space);
 		if (!msg) {
 			wp_error("Allocation failed, dropping fill transfer block");
 			goto end;
@@ -921,7 +1791,13 @@ static void worker_run_compress_block(
 				(char *)msg + sizeof(struct wmsg_buffer_fill),
 				&dst);
 		sz = dst.size + sizeof(struct wmsg_buffer_fill);
-		msg = shrink_buffer(msg, alignz(sz, 4));
+		arena_shrink(local->arena, msg, alignz(sz, 4));
+	}
+	if (pool->stats.enabled) {
+		atomic_fetch_add(&pool->stats.comp_in_bytes,
+				source_end - source_start);
+		atomic_fetch_add(&pool->stats.comp_out_bytes,
+				sz - sizeof(struct wmsg_buffer_fill));
 	}
 	memset(msg + sz, 0, alignz(sz, 4) - sz);
 	struct wmsg_buffer_fill header;
@@ -931,13 +1807,84 @@ static void worker_run_compress_block(
 	header.end = (uint32_t)source_end;
 	memcpy(msg, &header, sizeof(struct wmsg_buffer_fill));
 
-	transfer_async_add(task->msg_queue, msg, alignz(sz, 4));
+	transfer_async_add(task->msg_queue, msg, alignz(sz, 4), true);
 
 end:
 	DTRACE_PROBE1(waypipe, worker_comp_exit,
 			sz - sizeof(struct wmsg_buffer_fill));
 }
 
+/* Decompress a fill update for a file, and write it to both mem_mirror and
+ * mem_local. Returns ERR_FATAL if the message contents were invalid. */
+static int worker_run_decompress_fill(
+		struct task_data *task, struct thread_data *local)
+{
+	struct shadow_fd *sfd = task->sfd;
+	const struct wmsg_buffer_fill *header =
+			(const struct wmsg_buffer_fill *)task->msg.data;
+
+	size_t uncomp_size = header->end - header->start;
+	if (buf_ensure_size((int)uncomp_size, 1, &local->tmp_size,
+			    &local->tmp_buf) == -1) {
+		wp_error("Failed to expand temporary decompression buffer, dropping update");
+		return 0;
+	}
+
+	const char *act_buffer = NULL;
+	size_t act_size = 0;
+	uncompress_buffer(local->pool, &local->comp_ctx,
+			task->msg.size - sizeof(struct wmsg_buffer_fill),
+			task->msg.data + sizeof(struct wmsg_buffer_fill),
+			uncomp_size, local->tmp_buf, &act_size, &act_buffer);
+	if (act_size != uncomp_size) {
+		wp_error("Transfer size mismatch %zu %zu", act_size,
+				uncomp_size);
+		return ERR_FATAL;
+	}
+
+	memcpy(sfd->mem_mirror + header->start, act_buffer, uncomp_size);
+	memcpy(sfd->mem_local + header->start, act_buffer, uncomp_size);
+	return 0;
+}
+
+/* Decompress a diff update for a file, and apply it to both mem_mirror and
+ * mem_local. Returns ERR_FATAL if the message contents were invalid. */
+static int worker_run_apply_diff(
+		struct task_data *task, struct thread_data *local)
+{
+	struct shadow_fd *sfd = task->sfd;
+	const struct wmsg_buffer_diff *header =
+			(const struct wmsg_buffer_diff *)task->msg.data;
+
+	size_t uncomp_size = (size_t)header->diff_size + header->ntrailing;
+	if (buf_ensure_size((int)uncomp_size, 1, &local->tmp_size,
+			    &local->tmp_buf) == -1) {
+		wp_error("Failed to expand temporary decompression buffer, dropping update");
+		return 0;
+	}
+
+	const char *act_buffer = NULL;
+	size_t act_size = 0;
+	uncompress_buffer(local->pool, &local->comp_ctx,
+			task->msg.size - sizeof(struct wmsg_buffer_diff),
+			task->msg.data + sizeof(struct wmsg_buffer_diff),
+			uncomp_size, local->tmp_buf, &act_size, &act_buffer);
+	// `memsize+8*remote_nthreads` is the worst-case diff expansion
+	if (act_size != uncomp_size) {
+		wp_error("Transfer size mismatch %zu %zu", act_size,
+				uncomp_size);
+		return ERR_FATAL;
+	}
+
+	DTRACE_PROBE2(waypipe, apply_diff_enter, sfd->buffer_size,
+			header->diff_size);
+	apply_diff(local->pool->copy_func, sfd->buffer_size, sfd->mem_mirror,
+			sfd->mem_local, header->diff_size, header->ntrailing,
+			act_buffer);
+	DTRACE_PROBE(waypipe, apply_diff_exit);
+	return 0;
+}
+
 /* Optionally compress the data in mem_mirror, and set up the initial
  * transfer blocks */
 static void queue_fill_transfers(struct thread_pool *threads,
@@ -987,6 +1934,220 @@ static void queue_fill_transfers(struct thread_pool *threads,
 	pthread_mutex_unlock(&threads->work_mutex);
 }
 
+/* Holes in files are tracked at this granularity; file systems report holes
+ * aligned to at least their page size */
+#define HOLE_PAGE_BITS 12
+#define HOLE_PAGE_SIZE ((size_t)1 << HOLE_PAGE_BITS)
+
+static bool test_page_bit(const uint64_t *bits, size_t page)
+{
+	return (bits[page / 64] >> (page % 64)) & 1;
+}
+static void set_page_bit(uint64_t *bits, size_t page)
+{
+	bits[page / 64] |= (uint64_t)1 << (page % 64);
+}
+
+/* Start tracking the unwritten pages of a file, whose mirror has just been
+ * created and is all zero */
+static void init_zero_pages(struct shadow_fd *sfd)
+{
+	size_t npages = sfd->buffer_size >> HOLE_PAGE_BITS;
+	size_t nwords = (npages + 63) / 64;
+	if (!sfd->has_owner || nwords == 0) {
+		return;
+	}
+	sfd->zero_pages = malloc(nwords * sizeof(uint64_t));
+	if (!sfd->zero_pages) {
+		/* Not tracking unwritten pages only makes diffs slower */
+		return;
+	}
+	memset(sfd->zero_pages, 0xff, nwords * sizeof(uint64_t));
+	sfd->zero_pages_count = npages;
+}
+
+/* Extend the bitmap of zero pages to a file which has grown from `old_size`;
+ * the extended part of the mirror is zero */
+static void grow_zero_pages(struct shadow_fd *sfd, size_t old_size)
+{
+	size_t npages = sfd->buffer_size >> HOLE_PAGE_BITS;
+	size_t nwords = (npages + 63) / 64;
+	uint64_t *bits = realloc(sfd->zero_pages, nwords * sizeof(uint64_t));
+	if (!bits) {
+		free(sfd->zero_pages);
+		sfd->zero_pages = NULL;
+		return;
+	}
+	size_t old_words = (sfd->zero_pages_count + 63) / 64;
+	memset(bits + old_words, 0, (nwords - old_words) * sizeof(uint64_t));
+	/* Pages which straddle the old end keep their bit clear */
+	for (size_t p = (old_size + HOLE_PAGE_SIZE - 1) >> HOLE_PAGE_BITS;
+			p < npages; p++) {
+		set_page_bit(bits, p);
+	}
+	sfd->zero_pages = bits;
+	sfd->zero_pages_count = npages;
+}
+
+static bool is_zero_page(const char *data)
+{
+	const uint64_t *words = (const uint64_t *)data;
+	uint64_t acc = 0;
+	for (size_t i = 0; i < HOLE_PAGE_SIZE / sizeof(uint64_t); i++) {
+		acc |= words[i];
+	}
+	return acc == 0;
+}
+
+/* Return the file descriptor with which to look for holes in the file, or
+ * -1 if there is none */
+static int get_holes_fd(struct shadow_fd *sfd)
+{
+	/* The file offset of fd_local may be in use by the program which sent
+	 * the fd, even while it is being read */
+	if (sfd->holes_fd == -1) {
+		sfd->holes_fd = reopen_file(sfd->fd_local);
+		if (sfd->holes_fd == -1) {
+			wp_debug("Not looking for holes in RID=%d, as it could not be reopened: %s",
+					sfd->remote_id, strerror(errno));
+			sfd->holes_fd = -2;
+		}
+	}
+	return sfd->holes_fd >= 0 ? sfd->holes_fd : -1;
+}
+
+/* Read the holes in the file into a bitmap of pages. Returns the number of
+ * holes, or -1 if they cannot be found */
+static int read_file_holes(struct shadow_fd *sfd, uint64_t *holes)
+{
+	size_t end = sfd->zero_pages_count << HOLE_PAGE_BITS;
+	int fd = get_holes_fd(sfd);
+	if (fd == -1) {
+		return -1;
+	}
+	int nholes = 0;
+	size_t pos = 0;
+	while (pos < end) {
+		size_t hole_start, hole_end;
+		int r = find_file_hole(fd, pos, end, &hole_start, &hole_end);
+		if (r == -1) {
+			return -1;
+		} else if (r == 0) {
+			break;
+		}
+		size_t p_start = (hole_start + HOLE_PAGE_SIZE - 1) >>
+				 HOLE_PAGE_BITS;
+		for (size_t p = p_start; p < hole_end >> HOLE_PAGE_BITS; p++) {
+			set_page_bit(holes, p);
+		}
+		nholes++;
+		pos = hole_end;
+	}
+	return nholes;
+}
+
+/* Append the interval [start, end), if nonempty */
+static int push_interval(struct interval **list, int *count, int *space,
+		int32_t start, int32_t end)
+{
+	if (start >= end) {
+		return 0;
+	}
+	if (buf_ensure_size(*count + 1, sizeof(struct interval), space,
+			    (void **)list) == -1) {
+		return -1;
+	}
+	(*list)[(*count)++] = (struct interval){.start = start, .end = end};
+	return 0;
+}
+
+/* Remove from the damage all pages which are holes in the file and are zero
+ * in the mirror, because nothing has been written to them since the last
+ * diff, and update the bitmap of such pages. A program may report more
+ * damage than it has drawn, or allocate a larger shm pool than it uses;
+ * comparing those pages would be slower, and, for tmpfs files, would make
+ * the kernel allocate memory for them. Returns the remaining damage size. */
+static int skip_unwritten_pages(struct shadow_fd *sfd, int net_damage)
+{
+	size_t nwords = (sfd->zero_pages_count + 63) / 64;
+	uint64_t *holes = calloc(nwords, sizeof(uint64_t));
+	uint64_t *zeros = calloc(nwords, sizeof(uint64_t));
+	struct interval *kept = NULL;
+	int nkept = 0, kept_space = 0;
+	int nholes = (holes && zeros) ? read_file_holes(sfd, holes) : -1;
+	if (nholes == -1) {
+		wp_debug("Stopping tracking of unwritten pages for RID=%d: %s",
+				sfd->remote_id, strerror(errno));
+		goto disable;
+	} else if (nholes == 0) {
+		memcpy(sfd->zero_pages, zeros, nwords * sizeof(uint64_t));
+		free(holes);
+		free(zeros);
+		return net_damage;
+	}
+
+	for (size_t i = 0; i < nwords; i++) {
+		zeros[i] = holes[i] & sfd->zero_pages[i];
+	}
+	for (int i = 0; i < sfd->damage.ndamage_intvs; i++) {
+		struct interval e = sfd->damage.damage[i];
+		int32_t cursor = e.start;
+		for (size_t p = (size_t)e.start >> HOLE_PAGE_BITS;
+				p < sfd->zero_pages_count &&
+				(p << HOLE_PAGE_BITS) < (size_t)e.end;
+				p++) {
+			int32_t p_start = (int32_t)(p << HOLE_PAGE_BITS);
+			int32_t p_end = p_start + (int32_t)HOLE_PAGE_SIZE;
+			if (!test_page_bit(holes, p)) {
+				continue;
+			}
+			bool skip = test_page_bit(zeros, p);
+			if (!skip && p_start >= e.start && p_end <= e.end &&
+					is_zero_page(sfd->mem_mirror +
+							p_start)) {
+				/* The mirror was already zero */
+				set_page_bit(zeros, p);
+				skip = true;
+			}
+			if (!skip) {
+				continue;
+			}
+			int32_t s_start = max(p_start, e.start);
+			if (push_interval(&kept, &nkept, &kept_space, cursor,
+					    s_start) == -1) {
+				goto disable;
+			}
+			cursor = min(p_end, e.end);
+		}
+		if (push_interval(&kept, &nkept, &kept_space, cursor, e.end) ==
+				-1) {
+			goto disable;
+		}
+	}
+	int remaining = 0;
+	for (int i = 0; i < nkept; i++) {
+		remaining += kept[i].end - kept[i].start;
+	}
+
+	free(sfd->damage.damage);
+	sfd->damage.damage = kept;
+	sfd->damage.ndamage_intvs = nkept;
+	free(sfd->zero_pages);
+	sfd->zero_pages = zeros;
+	free(holes);
+	return remaining;
+
+disable:
+	/* Diffing the damaged pages may write nonzero data to the mirror, so
+	 * the bitmap can no longer be trusted */
+	free(sfd->zero_pages);
+	sfd->zero_pages = NULL;
+	free(holes);
+	free(zeros);
+	free(kept);
+	return net_damage;
+}
+
 static void queue_diff_transfers(struct thread_pool *threads,
 		struct shadow_fd *sfd, struct transfer_queue *transfers)
 {
@@ -1031,7 +2192,15 @@ static void queue_diff_transfers(struct thread_pool *threads,
 			}
 		}
 	}
-	int nshards = ceildiv(net_damage, chunksize);
+	if (sfd->zero_pages && (size_t)bs <= HOLE_PAGE_SIZE) {
+		net_damage = skip_unwritten_pages(sfd, net_damage);
+	}
+	if (net_damage == 0 && !check_tail) {
+		reset_damage(&sfd->damage);
+		return;
+	}
+	/* Even without aligned damage, the unaligned tail may need a task */
+	int nshards = max(ceildiv(net_damage, chunksize), check_tail ? 1 : 0);
 
 	/* Instead of allocating individual buffers for each task, create a
 	 * global damage tracking buffer into which tasks index. It will be
@@ -1110,6 +2279,546 @@ static void queue_diff_transfers(struct thread_pool *threads,
 	free(offsets);
 }
 
+/* Copy the parts of mem_local which are not holes to the new, zeroed, mirror
+ * of a file */
+static void copy_written_pages(struct shadow_fd *sfd)
+{
+	int fd = get_holes_fd(sfd);
+	size_t pos = 0;
+	while (fd != -1 && pos < sfd->buffer_size) {
+		size_t hole_start, hole_end;
+		int r = find_file_hole(fd, pos, sfd->buffer_size, &hole_start,
+				&hole_end);
+		if (r != 1) {
+			break;
+		}
+		memcpy(sfd->mem_mirror + pos, sfd->mem_local + pos,
+				hole_start - pos);
+		pos = hole_end;
+	}
+	memcpy(sfd->mem_mirror + pos, sfd->mem_local + pos,
+			sfd->buffer_size - pos);
+}
+
+/* Recreate the mirror of a file after \ref evict_idle_mirrors freed it. As
+ * the file may have changed since, the whole file will be sent when it next
+ * has an update. Returns -1 on allocation failure. */
+static int restore_mirror(struct shadow_fd *sfd, struct thread_pool *threads)
+{
+	size_t alignment = 1u << threads->diff_alignment_bits;
+	sfd->mem_mirror = zeroed_aligned_alloc(
+			alignz(sfd->buffer_size, alignment), alignment,
+			&sfd->mem_mirror_handle);
+	if (!sfd->mem_mirror) {
+		wp_error("Failed to reallocate mirror for RID=%d",
+				sfd->remote_id);
+		return -1;
+	}
+	copy_written_pages(sfd);
+	sfd->mirror_evicted = false;
+	sfd->needs_resync = true;
+	return 0;
+}
+
+int evict_idle_mirrors(
+		struct fd_translation_map *map, struct thread_pool *pool)
+{
+	pthread_mutex_lock(&pool->work_mutex);
+	bool applying = pool->apply_stack_count > 0 ||
+			pool->apply_tasks_in_progress > 0;
+	pthread_mutex_unlock(&pool->work_mutex);
+	if (applying) {
+		return 0;
+	}
+
+	int nevicted = 0;
+	for (struct shadow_fd_link *lcur = map->link.l_next,
+				   *lnxt = lcur->l_next;
+			lcur != &map->link; lcur = lnxt, lnxt = lcur->l_next) {
+		struct shadow_fd *cur = (struct shadow_fd *)lcur;
+		if (cur->type != FDC_FILE || !cur->mem_mirror ||
+				cur->only_here) {
+			continue;
+		}
+		if (cur->mirror_used || cur->is_dirty ||
+				cur->refcount.compute) {
+			cur->mirror_used = false;
+			continue;
+		}
+		wp_debug("Freeing mirror of idle file RID=%d, %zu bytes",
+				cur->remote_id, cur->buffer_size);
+		zeroed_aligned_free(cur->mem_mirror, &cur->mem_mirror_handle);
+		cur->mem_mirror = NULL;
+		cur->mirror_evicted = true;
+		nevicted++;
+	}
+	return nevicted;
+}
+
+/** Return the file whose mirror has the tile at `entry`, if it still holds
+ * `data` and the remote side has the same content for it */
+static struct shadow_fd *check_cache_entry(struct fd_translation_map *map,
+		const struct block_cache_entry *entry, uint64_t hash,
+		const char *data)
+{
+	if (entry->remote_id == 0 || entry->hash != hash) {
+		return NULL;
+	}
+	struct shadow_fd *src = get_shadow_for_rid(map, entry->remote_id);
+	size_t end = ((size_t)entry->tile + 1) << BLOCK_CACHE_TILE_BITS;
+	if (!src || src->type != FDC_FILE || src->only_here ||
+			src->remote_updated || !src->mem_mirror ||
+			end > src->buffer_size || end > src->remote_bufsize) {
+		return NULL;
+	}
+	if (memcmp(src->mem_mirror + end - BLOCK_CACHE_TILE_SIZE, data,
+			    BLOCK_CACHE_TILE_SIZE) != 0) {
+		return NULL;
+	}
+	return src;
+}
+
+/** Add a copy to a WMSG_BUFFER_COPY message, extending the last range when
+ * possible. Returns -1 on allocation failure. */
+static int append_copy_range(char **msg, size_t *msg_size, int *msg_space,
+		const struct wmsg_copy_range *r)
+{
+	if (*msg_size > sizeof(struct wmsg_buffer_copy)) {
+		struct wmsg_copy_range *last =
+				(struct wmsg_copy_range *)(*msg + *msg_size -
+							   sizeof(*last));
+		if (last->source_id == r->source_id &&
+				last->source_start + last->length ==
+						r->source_start &&
+				last->dest_start + last->length ==
+						r->dest_start) {
+			last->length += r->length;
+			return 0;
+		}
+	}
+	if (buf_ensure_size((int)(*msg_size + sizeof(*r)), 1, msg_space,
+			    (void **)msg) == -1) {
+		return -1;
+	}
+	memcpy(*msg + *msg_size, r, sizeof(*r));
+	*msg_size += sizeof(*r);
+	return 0;
+}
+
+/** Apply the copy ranges of a WMSG_BUFFER_COPY message to the mirror of the
+ * file, and to mem_local if `to_local` is set. All sources are read before
+ * anything is written, so that the order of the ranges does not matter even
+ * when a file copies from itself. */
+static int apply_copy_ranges(struct fd_translation_map *map,
+		struct shadow_fd *sfd, const char *ranges, size_t nranges,
+		bool to_local)
+{
+	size_t total = 0;
+	for (size_t i = 0; i < nranges; i++) {
+		struct wmsg_copy_range r;
+		memcpy(&r, ranges + i * sizeof(r), sizeof(r));
+		struct shadow_fd *src = get_shadow_for_rid(map, r.source_id);
+		/* DMABUFs may only copy from themselves */
+		if (!src || (src->type != FDC_FILE && src != sfd) ||
+				!src->mem_mirror) {
+			wp_error("Copy source RID=%d for RID=%d is not a mirrored file",
+					r.source_id, sfd->remote_id);
+			return ERR_FATAL;
+		}
+		if (r.length > src->buffer_size ||
+				r.source_start > src->buffer_size - r.length ||
+				r.length > sfd->buffer_size ||
+				r.dest_start > sfd->buffer_size - r.length) {
+			wp_error("Copy range [%" PRIu32 ",+%" PRIu32
+				 ") from RID=%d to [%" PRIu32 ",+%" PRIu32
+				 ") of RID=%d overflows",
+					r.source_start, r.length, r.source_id,
+					r.dest_start, r.length, sfd->remote_id);
+			return ERR_FATAL;
+		}
+		total += r.length;
+	}
+	if (total == 0) {
+		return 0;
+	}
+	char *staging = malloc(total);
+	if (!staging) {
+		wp_error("Failed to allocate staging buffer for copy to RID=%d",
+				sfd->remote_id);
+		return ERR_NOMEM;
+	}
+	size_t pos = 0;
+	for (size_t i = 0; i < nranges; i++) {
+		struct wmsg_copy_range r;
+		memcpy(&r, ranges + i * sizeof(r), sizeof(r));
+		struct shadow_fd *src = get_shadow_for_rid(map, r.source_id);
+		memcpy(staging + pos, src->mem_mirror + r.source_start,
+				r.length);
+		pos += r.length;
+	}
+	pos = 0;
+	for (size_t i = 0; i < nranges; i++) {
+		struct wmsg_copy_range r;
+		memcpy(&r, ranges + i * sizeof(r), sizeof(r));
+		memcpy(sfd->mem_mirror + r.dest_start, staging + pos, r.length);
+		if (to_local) {
+			memcpy(sfd->mem_local + r.dest_start, staging + pos,
+					r.length);
+		}
+		pos += r.length;
+	}
+	free(staging);
+	return 0;
+}
+
+/* For each damaged tile of the file, if its new contents are somewhere in
+ * the mirror of a file that the remote side has, send a copy request instead,
+ * and update the mirror so that the diff will skip the tile. This runs before
+ * any tasks are started, so nothing else modifies the mirrors; and the remote
+ * side applies all preceding updates before the copy. */
+static void queue_block_copies(
+		struct shadow_fd *sfd, struct transfer_queue *transfers)
+{
+	struct fd_translation_map *map = sfd->map;
+	struct block_cache *bc = &map->block_cache;
+	if (bc->nentries == 0 || !sfd->damage.damage || !sfd->mem_local ||
+			!sfd->mem_mirror) {
+		return;
+	}
+	const size_t tile = BLOCK_CACHE_TILE_SIZE;
+	const size_t ntiles = sfd->buffer_size >> BLOCK_CACHE_TILE_BITS;
+
+	struct interval everything = {.start = 0, .end = (int)sfd->buffer_size};
+	const struct interval *intvs = &everything;
+	int nintvs = 1;
+	if (sfd->damage.damage != DAMAGE_EVERYTHING) {
+		intvs = sfd->damage.damage;
+		nintvs = sfd->damage.ndamage_intvs;
+	}
+
+	char *msg = NULL;
+	size_t msg_size = sizeof(struct wmsg_buffer_copy);
+	int msg_space = 0;
+	size_t next_tile = 0;
+	for (int i = 0; i < nintvs; i++) {
+		size_t t0 = maxu(next_tile,
+				(size_t)intvs[i].start >> BLOCK_CACHE_TILE_BITS);
+		size_t t1 = minu(ntiles,
+				((size_t)intvs[i].end + tile - 1) >>
+						BLOCK_CACHE_TILE_BITS);
+		for (size_t t = t0; t < t1; t++) {
+			const char *local = sfd->mem_local + t * tile;
+			uint64_t hash = hash_block(local, tile);
+			struct block_cache_entry *entry =
+					&bc->entries[hash & (uint64_t)(bc->nentries -
+									      1)];
+			/* If the source is this file, it is a different
+			 * tile, as this one has changed */
+			struct shadow_fd *src = NULL;
+			if (memcmp(local, sfd->mem_mirror + t * tile, tile)) {
+				src = check_cache_entry(map, entry, hash, local);
+				bc->nhits += src != NULL;
+				bc->nmisses += src == NULL;
+			}
+			if (src) {
+				struct wmsg_copy_range r = {
+						.source_id = src->remote_id,
+						.source_start = entry->tile *
+								(uint32_t)tile,
+						.dest_start = (uint32_t)(t * tile),
+						.length = (uint32_t)tile,
+				};
+				if (append_copy_range(&msg, &msg_size,
+						    &msg_space, &r) == -1) {
+					wp_error("Failed to allocate copy request, sending tile as diff");
+				}
+			}
+			entry->hash = hash;
+			entry->remote_id = sfd->remote_id;
+			entry->tile = (uint32_t)t;
+		}
+		next_tile = maxu(next_tile, t1);
+	}
+	if (!msg) {
+		return;
+	}
+	/* The mirror is only updated now, so that tiles copied within this
+	 * file were checked against the contents the remote side has */
+	size_t nranges = (msg_size - sizeof(struct wmsg_buffer_copy)) /
+			 sizeof(struct wmsg_copy_range);
+	if (apply_copy_ranges(map, sfd, msg + sizeof(struct wmsg_buffer_copy),
+			    nranges, false) < 0) {
+		free(msg);
+		return;
+	}
+	struct wmsg_buffer_copy header;
+	header.size_and_type = transfer_header(msg_size, WMSG_BUFFER_COPY);
+	header.remote_id = sfd->remote_id;
+	memcpy(msg, &header, sizeof(header));
+	transfer_add(transfers, msg_size, msg);
+}
+
+void note_row_layout(struct shadow_fd *sfd, size_t start, uint32_t stride,
+		uint32_t row_bytes, uint32_t nrows)
+{
+	if (sfd->map->block_cache.nentries == 0 ||
+			sfd->nrow_layouts >= MAX_ROW_LAYOUTS) {
+		return;
+	}
+	for (int i = 0; i < sfd->nrow_layouts; i++) {
+		const struct row_layout *l = &sfd->row_layouts[i];
+		if (l->start == start && l->stride == stride &&
+				l->row_bytes == row_bytes && l->nrows == nrows) {
+			return;
+		}
+	}
+	struct row_layout *l = &sfd->row_layouts[sfd->nrow_layouts++];
+	l->start = start;
+	l->stride = stride;
+	l->row_bytes = row_bytes;
+	l->nrows = nrows;
+}
+
+/* Shorter runs of shifted rows are left to the diff */
+#define MIN_SHIFTED_ROWS 4
+
+struct row_hash_slot {
+	uint64_t hash;
+	int row; /* -1 if empty, -2 if several rows have this hash */
+};
+
+/* Hash a row for comparison; matches must be confirmed with memcmp */
+static uint64_t hash_row(const char *row, uint32_t row_bytes)
+{
+	return hash_block(row, row_bytes & ~(uint32_t)31);
+}
+
+/* Find the vertical shift of the image's damaged rows, relative to the
+ * mirror, which matches the most changed rows, and add copy ranges for the
+ * runs of rows which it matches. Returns -1 on allocation failure. */
+static int find_row_shift(struct shadow_fd *sfd, const struct row_layout *l,
+		char **msg, size_t *msg_size, int *msg_space)
+{
+	size_t local_stride = l->stride;
+	const char *local_base = sfd->mem_local + l->start;
+	if (sfd->type == FDC_DMABUF) {
+		local_stride = sfd->dmabuf_map_stride;
+	}
+	if (l->row_bytes < 64 || l->row_bytes > l->stride ||
+			l->row_bytes > local_stride || l->nrows == 0 ||
+			l->start > sfd->buffer_size ||
+			(size_t)(l->nrows - 1) * l->stride + l->row_bytes >
+					sfd->buffer_size - l->start) {
+		return 0;
+	}
+
+	/* Only the damaged rows are compared; for DMABUFs, these are the only
+	 * rows which were mapped */
+	size_t r0 = 0, r1 = l->nrows;
+	if (sfd->damage.damage != DAMAGE_EVERYTHING) {
+		size_t lo = SIZE_MAX, hi = 0;
+		for (int i = 0; i < sfd->damage.ndamage_intvs; i++) {
+			lo = minu(lo, (size_t)sfd->damage.damage[i].start);
+			hi = maxu(hi, (size_t)sfd->damage.damage[i].end);
+		}
+		if (hi <= l->start) {
+			return 0;
+		}
+		r0 = lo <= l->start ? 0 : (lo - l->start) / l->stride;
+		r1 = minu(r1, (hi - l->start) / l->stride);
+	}
+	if (r1 < r0 + 2 * MIN_SHIFTED_ROWS) {
+		return 0;
+	}
+	size_t n = r1 - r0;
+
+	size_t nslots = 1;
+	while (nslots < 2 * n) {
+		nslots *= 2;
+	}
+	uint64_t *local_hashes = malloc(2 * n * sizeof(uint64_t));
+	struct row_hash_slot *slots =
+			malloc(nslots * sizeof(struct row_hash_slot));
+	int *votes = calloc(2 * n, sizeof(int));
+	int ret = 0;
+	if (!local_hashes || !slots || !votes) {
+		ret = -1;
+		goto end;
+	}
+	uint64_t *mirror_hashes = local_hashes + n;
+	for (size_t i = 0; i < nslots; i++) {
+		slots[i].row = -1;
+	}
+	for (size_t y = 0; y < n; y++) {
+		local_hashes[y] = hash_row(
+				local_base + (r0 + y) * local_stride, l->row_bytes);
+		mirror_hashes[y] = hash_row(sfd->mem_mirror + l->start +
+							    (r0 + y) * l->stride,
+				l->row_bytes);
+		size_t k = (size_t)mirror_hashes[y] & (nslots - 1);
+		while (slots[k].row != -1 &&
+				slots[k].hash != mirror_hashes[y]) {
+			k = (k + 1) & (nslots - 1);
+		}
+		slots[k].row = slots[k].row == -1 ? (int)y : -2;
+		slots[k].hash = mirror_hashes[y];
+	}
+
+	/* Each changed row which matches exactly one old row votes for the
+	 * shift between them */
+	int best_votes = 0;
+	ptrdiff_t best_shift = 0;
+	for (size_t y = 0; y < n; y++) {
+		if (local_hashes[y] == mirror_hashes[y]) {
+			continue;
+		}
+		size_t k = (size_t)local_hashes[y] & (nslots - 1);
+		while (slots[k].row != -1 && slots[k].hash != local_hashes[y]) {
+			k = (k + 1) & (nslots - 1);
+		}
+		if (slots[k].row < 0) {
+			continue;
+		}
+		ptrdiff_t shift = (ptrdiff_t)slots[k].row - (ptrdiff_t)y;
+		int v = ++votes[(ptrdiff_t)n + shift];
+		if (v > best_votes) {
+			best_votes = v;
+			best_shift = shift;
+		}
+	}
+	if (best_votes < MIN_SHIFTED_ROWS) {
+		goto end;
+	}
+
+	/* Copy each long enough run of rows which match under the shift */
+	size_t y_start = best_shift < 0 ? (size_t)-best_shift : 0;
+	size_t y_end = best_shift > 0 ? n - (size_t)best_shift : n;
+	size_t run_start = y_start;
+	for (size_t y = y_start; y <= y_end; y++) {
+		bool match = false;
+		if (y < y_end) {
+			size_t src_y = (size_t)((ptrdiff_t)y + best_shift);
+			match = local_hashes[y] == mirror_hashes[src_y] &&
+				memcmp(local_base + (r0 + y) * local_stride,
+						sfd->mem_mirror + l->start +
+								(r0 + src_y) * l->stride,
+						l->row_bytes) == 0;
+		}
+		if (match) {
+			continue;
+		}
+		if (y - run_start >= MIN_SHIFTED_ROWS) {
+			size_t dst = l->start + (r0 + run_start) * l->stride;
+			struct wmsg_copy_range r = {
+					.source_id = sfd->remote_id,
+					.source_start = (uint32_t)(
+							(ptrdiff_t)dst +
+							best_shift * (ptrdiff_t)l->stride),
+					.dest_start = (uint32_t)dst,
+					.length = (uint32_t)((y - run_start - 1) *
+									 l->stride +
+							     l->row_bytes),
+			};
+			if (append_copy_range(msg, msg_size, msg_space, &r) ==
+					-1) {
+				ret = -1;
+				goto end;
+			}
+			sfd->map->block_cache.nshifts++;
+		}
+		run_start = y + 1;
+	}
+end:
+	free(local_hashes);
+	free(slots);
+	free(votes);
+	return ret;
+}
+
+/* If part of an image committed from the buffer has moved up or down by a
+ * whole number of rows, as when scrolling, send a copy request for the rows
+ * the remote side already has, and update the mirror to match, so that only
+ * the new rows are diffed. Like queue_block_copies, this must run before the
+ * diff tasks are started. */
+static void queue_row_shifts(
+		struct shadow_fd *sfd, struct transfer_queue *transfers)
+{
+	int nlayouts = sfd->nrow_layouts;
+	sfd->nrow_layouts = 0;
+	/* With a staged DMABUF, the undamaged rows compared are stale */
+	if (sfd->map->block_cache.nentries == 0 || !sfd->damage.damage ||
+			!sfd->mem_local || !sfd->mem_mirror ||
+			sfd->remote_updated || sfd->dmabuf_staged) {
+		return;
+	}
+
+	char *msg = NULL;
+	size_t msg_size = sizeof(struct wmsg_buffer_copy);
+	int msg_space = 0;
+	for (int i = 0; i < nlayouts; i++) {
+		if (find_row_shift(sfd, &sfd->row_layouts[i], &msg, &msg_size,
+				    &msg_space) == -1) {
+			wp_error("Failed to allocate space to detect scrolling, sending rows as diff");
+			free(msg);
+			return;
+		}
+	}
+	if (!msg) {
+		return;
+	}
+	size_t nranges = (msg_size - sizeof(struct wmsg_buffer_copy)) /
+			 sizeof(struct wmsg_copy_range);
+	if (apply_copy_ranges(sfd->map, sfd,
+			    msg + sizeof(struct wmsg_buffer_copy), nranges,
+			    false) < 0) {
+		free(msg);
+		return;
+	}
+	struct wmsg_buffer_copy header;
+	header.size_and_type = transfer_header(msg_size, WMSG_BUFFER_COPY);
+	header.remote_id = sfd->remote_id;
+	memcpy(msg, &header, sizeof(header));
+	transfer_add(transfers, msg_size, msg);
+}
+
+static void count_warped_update(struct thread_pool *pool)
+{
+	if (pool->stats.enabled) {
+		atomic_fetch_add(&pool->stats.warped_updates, 1);
+	}
+}
+
+static void count_readback(struct thread_pool *pool, size_t nbytes)
+{
+	if (pool->stats.enabled) {
+		atomic_fetch_add(&pool->stats.readback_bytes, nbytes);
+	}
+}
+
+/* Before a DMABUF is first sent, adopt the stride at which it was mapped as
+ * the stride of the image data sent, so that updates need not be copied
+ * between strides on this side. The remote side allocates its buffer with a
+ * matching stride when it can, and the protocol handlers there report the
+ * stride it actually got. */
+static void match_wire_layout(struct shadow_fd *sfd)
+{
+	uint32_t map_stride = sfd->dmabuf_map_stride;
+	struct dmabuf_slice_data *info = &sfd->dmabuf_info;
+	if (info->num_planes != 1 || map_stride == info->strides[0]) {
+		return;
+	}
+	int bpp = get_shm_bytes_per_pixel(info->format);
+	if (bpp <= 0 || (uint64_t)map_stride < (uint64_t)bpp * info->width) {
+		return;
+	}
+	wp_debug("Sending DMABUF RID=%d with mapped stride %u instead of %u",
+			sfd->remote_id, map_stride, info->strides[0]);
+	info->strides[0] = map_stride;
+	sfd->buffer_size = (size_t)map_stride * info->height;
+	/* damage was computed with the original stride */
+	reset_damage(&sfd->damage);
+}
+
 static void add_dmabuf_create_request(struct transfer_queue *transfers,
 		struct shadow_fd *sfd, enum wmsg_type variant)
 {
@@ -1170,12 +2879,17 @@ void finish_update(struct shadow_fd *sfd)
 	if (!sfd->refcount.compute) {
 		return;
 	}
-	if (sfd->type == FDC_DMABUF && sfd->dmabuf_map_handle) {
+	if ((sfd->type == FDC_DMABUF || sfd->type == FDC_DMAVID_IR) &&
+			sfd->dmabuf_map_handle) {
 		// if this fails, unmap_dmabuf will print error
 		(void)unmap_dmabuf(sfd->dmabuf_bo, sfd->dmabuf_map_handle);
 		sfd->dmabuf_map_handle = NULL;
 		sfd->mem_local = NULL;
 	}
+	if (sfd->type == FDC_DMABUF && sfd->dmabuf_staged) {
+		sfd->dmabuf_staged = false;
+		sfd->mem_local = NULL;
+	}
 	if (sfd->damage_task_interval_store) {
 		free(sfd->damage_task_interval_store);
 		sfd->damage_task_interval_store = NULL;
@@ -1183,6 +2897,349 @@ void finish_update(struct shadow_fd *sfd)
 	sfd->refcount.compute = false;
 }
 
+/* Map just the rows of a DMABUF which contain bytes [start, end) of its image,
+ * as laid out for transfer. The returned pointer is offset so that it can be
+ * indexed as if the entire buffer had been mapped. */
+static char *map_dmabuf_range(struct shadow_fd *sfd, bool write, size_t start,
+		size_t end, void **map_handle, uint32_t *map_stride)
+{
+	size_t in_stride = (size_t)sfd->dmabuf_info.strides[0];
+	uint32_t row_start = 0, row_end = UINT32_MAX;
+	if (in_stride > 0) {
+		row_start = (uint32_t)minu(start / in_stride, UINT32_MAX);
+		row_end = (uint32_t)minu(
+				(end + in_stride - 1) / in_stride, UINT32_MAX);
+	}
+	char *data = map_dmabuf_rows(sfd->dmabuf_bo, write, row_start, row_end,
+			map_handle, map_stride);
+	if (!data) {
+		return NULL;
+	}
+	return data - (size_t)row_start * (size_t)(*map_stride);
+}
+
+int plan_readback_bands(const struct damage *damage, size_t stride,
+		size_t buffer_size, int alignment_bits, struct row_band *bands,
+		int max_bands)
+{
+	size_t nrows = stride > 0 ? (buffer_size + stride - 1) / stride : 0;
+	if (!damage->damage || damage->damage == DAMAGE_EVERYTHING ||
+			nrows == 0 || nrows > UINT32_MAX) {
+		return damage->damage ? -1 : 0;
+	}
+	/* Mark the rows touched by each interval, as the intervals may
+	 * overlap or be unsorted */
+	uint8_t *touched = calloc(nrows, 1);
+	if (!touched) {
+		return -1;
+	}
+	size_t bs = (size_t)1 << alignment_bits;
+	size_t align_end = bs * (buffer_size / bs);
+	for (int i = 0; i < damage->ndamage_intvs; i++) {
+		struct interval e = damage->damage[i];
+		size_t start = minu((size_t)e.start, buffer_size);
+		size_t end = minu((size_t)e.end, buffer_size);
+		/* the unaligned tail is diffed separately */
+		if ((size_t)e.end > align_end) {
+			end = buffer_size;
+		}
+		if (start < end) {
+			size_t r0 = start / stride;
+			size_t r1 = (end + stride - 1) / stride;
+			memset(touched + r0, 1, r1 - r0);
+		}
+	}
+	int n = 0;
+	for (size_t y = 0; y < nrows;) {
+		if (!touched[y]) {
+			y++;
+			continue;
+		}
+		uint32_t r0 = (uint32_t)y;
+		while (y < nrows && touched[y]) {
+			y++;
+		}
+		if (n > 0 && r0 - bands[n - 1].end < READBACK_MIN_GAP_ROWS) {
+			bands[n - 1].end = (uint32_t)y;
+		} else if (n == max_bands) {
+			n = -1;
+			break;
+		} else {
+			bands[n].start = r0;
+			bands[n].end = (uint32_t)y;
+			n++;
+		}
+	}
+	free(touched);
+	return n;
+}
+
+/* The most bands of rows of a DMABUF to map separately per update */
+#define MAX_READBACK_BANDS 16
+
+/* Whether reading back the bands separately, instead of every row from the
+ * first to the last, would skip at least half of those rows */
+static bool sparse_bands(const struct row_band *bands, int nbands)
+{
+	size_t spanned = (size_t)(bands[nbands - 1].end - bands[0].start);
+	size_t covered = 0;
+	for (int i = 0; i < nbands; i++) {
+		covered += (size_t)(bands[i].end - bands[i].start);
+	}
+	return 2 * covered <= spanned;
+}
+
+/* Read back just the given bands of rows of a DMABUF into sfd->dmabuf_warped,
+ * at the stride sent, so that the rows between them need not be copied from
+ * the GPU. Returns -1 on failure. */
+static int read_back_bands(struct shadow_fd *sfd, struct thread_pool *threads,
+		const struct row_band *bands, int nbands)
+{
+	size_t alignment = 1u << threads->diff_alignment_bits;
+	if (!sfd->dmabuf_warped) {
+		sfd->dmabuf_warped = zeroed_aligned_alloc(
+				alignz(sfd->buffer_size, alignment), alignment,
+				&sfd->dmabuf_warped_handle);
+		if (!sfd->dmabuf_warped) {
+			wp_error("Failed to allocate staging copy of DMABUF");
+			return -1;
+		}
+	}
+	size_t tx_stride = (size_t)sfd->dmabuf_info.strides[0];
+	bool warped = false;
+	for (int i = 0; i < nbands; i++) {
+		size_t start = (size_t)bands[i].start * tx_stride;
+		size_t end = minu((size_t)bands[i].end * tx_stride,
+				sfd->buffer_size);
+		void *handle = NULL;
+		uint32_t map_stride;
+		char *data = map_dmabuf_range(
+				sfd, false, start, end, &handle, &map_stride);
+		if (!data) {
+			return -1;
+		}
+		size_t nrows = (size_t)(bands[i].end - bands[i].start);
+		if (map_stride == tx_stride) {
+			memcpy(sfd->dmabuf_warped + start, data + start,
+					end - start);
+		} else {
+			size_t common = (size_t)minu(map_stride, tx_stride);
+			stride_shifted_copy(NULL, sfd->dmabuf_warped, data,
+					(size_t)bands[i].start * map_stride,
+					nrows * map_stride, common, map_stride,
+					tx_stride);
+			warped = true;
+		}
+		(void)unmap_dmabuf(sfd->dmabuf_bo, handle);
+		count_readback(threads, nrows * map_stride);
+	}
+	if (warped) {
+		count_warped_update(threads);
+	}
+	sfd->mem_local = sfd->dmabuf_warped;
+	sfd->dmabuf_map_stride = (uint32_t)tx_stride;
+	sfd->dmabuf_staged = true;
+	return 0;
+}
+
+/* If the transfer block is a file content update, return the RID it is for,
+ * and set `type` */
+static int get_update_rid(const struct iovec *vec, enum wmsg_type *type)
+{
+	*type = transfer_type(*(const uint32_t *)vec->iov_base);
+	if (vec->iov_len < sizeof(struct wmsg_basic)) {
+		return 0;
+	}
+	const struct wmsg_basic *header =
+			(const struct wmsg_basic *)vec->iov_base;
+	if (*type != WMSG_BUFFER_FILL && *type != WMSG_BUFFER_DIFF &&
+			*type != WMSG_BUFFER_COPY) {
+		return 0;
+	}
+	return header->remote_id;
+}
+
+/* An empty WMSG_PROTOCOL message, which the remote side counts but ignores */
+static uint32_t empty_message;
+
+/* Return a single WMSG_BUFFER_FILL message with the contents of the mirror of
+ * `sfd`, setting `msg_size` to its padded size, or NULL if one message cannot
+ * hold the file or the mirror is not available. */
+static void *make_resync_fill(struct thread_pool *threads,
+		struct shadow_fd *sfd, size_t *msg_size)
+{
+	/* Tasks still in flight may be writing to the mirror */
+	if (!sfd->mem_mirror || sfd->refcount.compute ||
+			sfd->remote_bufsize == 0) {
+		return NULL;
+	}
+	size_t len = sfd->remote_bufsize;
+	size_t comp_size = compress_bufsize(threads, len);
+	size_t space = sizeof(struct wmsg_buffer_fill) +
+		       alignz(comp_size > len ? comp_size : len, 4);
+	if (space >= ((size_t)1 << 27)) {
+		return NULL;
+	}
+	uint8_t *msg = malloc(space);
+	if (!msg) {
+		return NULL;
+	}
+	uint8_t *body = msg + sizeof(struct wmsg_buffer_fill);
+	struct bytebuf dst;
+	compress_buffer(threads, &threads->threads[0].comp_ctx, len,
+			sfd->mem_mirror, comp_size, (char *)body, &dst);
+	if (dst.data != (char *)body) {
+		memcpy(body, dst.data, dst.size);
+	}
+	size_t sz = sizeof(struct wmsg_buffer_fill) + dst.size;
+	*msg_size = alignz(sz, 4);
+	memset(msg + sz, 0, *msg_size - sz);
+
+	struct wmsg_buffer_fill header;
+	header.size_and_type = transfer_header(sz, WMSG_BUFFER_FILL);
+	header.remote_id = sfd->remote_id;
+	header.start = 0;
+	header.end = (uint32_t)len;
+	memcpy(msg, &header, sizeof(struct wmsg_buffer_fill));
+	return msg;
+}
+
+size_t drop_stale_file_updates(struct fd_translation_map *map,
+		struct thread_pool *threads, struct transfer_queue *transfers)
+{
+	empty_message = transfer_header(sizeof(uint32_t), WMSG_PROTOCOL);
+
+	size_t ndropped = 0;
+	for (struct shadow_fd_link *lcur = map->link.l_next;
+			lcur != &map->link; lcur = lcur->l_next) {
+		struct shadow_fd *sfd = (struct shadow_fd *)lcur;
+		if (sfd->type != FDC_FILE || sfd->only_here ||
+				sfd->remote_updated) {
+			continue;
+		}
+		size_t pending = 0;
+		bool has_copies = false;
+		int last = -1;
+		/* Blocks compressed with a dictionary can only be read after
+		 * the message that provides it */
+		int last_dict = -1;
+		for (int i = 0; i < transfers->end; i++) {
+			enum wmsg_type type;
+			if (get_update_rid(&transfers->vecs[i], &type) !=
+					sfd->remote_id) {
+				if (type == WMSG_COMPRESSION_DICT) {
+					last_dict = i;
+				}
+				continue;
+			}
+			pending += transfers->vecs[i].iov_len;
+			has_copies |= type == WMSG_BUFFER_COPY;
+			last = i;
+		}
+		/* Copies may read from other files whose updates are dropped,
+		 * so they are always replaced */
+		if (pending <= sfd->buffer_size && !has_copies) {
+			continue;
+		}
+		/* The mirror holds the contents the last update leaves the
+		 * file with, and putting them in its place keeps both the
+		 * message count and their order relative to the commits. The
+		 * remote side skips this message iff it received the original,
+		 * in which case it already has these contents. */
+		size_t fill_size = 0;
+		void *fill = NULL;
+		if (last_dict < last) {
+			fill = make_resync_fill(threads, sfd, &fill_size);
+		}
+		for (int i = 0; i < transfers->end; i++) {
+			enum wmsg_type type;
+			if (get_update_rid(&transfers->vecs[i], &type) !=
+					sfd->remote_id) {
+				continue;
+			}
+			transfer_block_free(transfers, i);
+			if (fill && i == last) {
+				transfers->vecs[i].iov_base = fill;
+				transfers->vecs[i].iov_len = fill_size;
+				transfers->meta[i].static_alloc = false;
+			} else {
+				transfers->vecs[i].iov_base = &empty_message;
+				transfers->vecs[i].iov_len = sizeof(uint32_t);
+				transfers->meta[i].static_alloc = true;
+			}
+			transfers->meta[i].arena_alloc = false;
+		}
+		ndropped += pending;
+		if (fill) {
+			wp_debug("Replaced %zu bytes of updates for RID=%d with a %zu byte fill",
+					pending, sfd->remote_id, fill_size);
+			continue;
+		}
+		wp_debug("Dropped %zu bytes of updates for RID=%d, will resend all %zu bytes",
+				pending, sfd->remote_id, sfd->buffer_size);
+		sfd->needs_resync = true;
+		sfd->is_dirty = true;
+	}
+	return ndropped;
+}
+
+bool update_can_wait(const struct shadow_fd *sfd)
+{
+	if (!sfd->is_dirty || sfd->only_here) {
+		return false;
+	}
+	switch (sfd->type) {
+	case FDC_FILE:
+		/* The remote file must be extended before buffers in the new
+		 * part of it are used */
+		return sfd->remote_bufsize >= sfd->buffer_size;
+	case FDC_DMABUF:
+	case FDC_DMAVID_IR:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Pipe receive buffers start at the minimum size, and double whenever a
+ * single wakeup fills them */
+#define PIPE_RECV_MIN_SIZE 32768
+#define PIPE_RECV_MAX_SIZE (1 << 22)
+/* Pipes carrying more than this are given larger kernel buffers */
+#define PIPE_KERNEL_SIZE (1 << 20)
+
+static void add_pipe_transfer(
+		struct transfer_queue *transfers, struct shadow_fd *sfd)
+{
+	struct pipe_buffer *recv = &sfd->pipe.recv;
+	size_t msgsz = sizeof(struct wmsg_basic) + (size_t)recv->used;
+	char *buf;
+	if (2 * recv->used >= recv->size) {
+		/* Send the buffer without copying it; a new one will be
+		 * allocated for the next read */
+		buf = recv->data;
+		recv->data = NULL;
+	} else {
+		buf = malloc(alignz(msgsz, 4));
+		if (!buf) {
+			wp_error("Failed to allocate pipe transfer for RID=%d, dropping data",
+					sfd->remote_id);
+			recv->used = 0;
+			return;
+		}
+		memcpy(buf + sizeof(struct wmsg_basic),
+				recv->data + sizeof(struct wmsg_basic),
+				(size_t)recv->used);
+	}
+	struct wmsg_basic *header = (struct wmsg_basic *)buf;
+	header->size_and_type = transfer_header(msgsz, WMSG_PIPE_TRANSFER);
+	header->remote_id = sfd->remote_id;
+	memset(buf + msgsz, 0, alignz(msgsz, 4) - msgsz);
+
+	transfer_add(transfers, alignz(msgsz, 4), buf);
+	recv->used = 0;
+}
+
 void collect_update(struct thread_pool *threads, struct shadow_fd *sfd,
 		struct transfer_queue *transfers, bool use_old_dmavid_req)
 {
@@ -1195,6 +3252,7 @@ void collect_update(struct thread_pool *threads, struct shadow_fd *sfd,
 		}
 		// Clear dirty state
 		sfd->is_dirty = false;
+		sfd->mirror_used = true;
 		if (sfd->only_here) {
 			// increase space, to avoid overflow when
 			// writing this buffer along with padding
@@ -1208,11 +3266,14 @@ void collect_update(struct thread_pool *threads, struct shadow_fd *sfd,
 			}
 
 			sfd->only_here = false;
+			sfd->nrow_layouts = 0;
+			init_zero_pages(sfd);
 
 			sfd->remote_bufsize = 0;
 
 			add_file_create_request(transfers, sfd);
 			sfd->remote_bufsize = sfd->buffer_size;
+			queue_block_copies(sfd, transfers);
 			queue_diff_transfers(threads, sfd, transfers);
 			return;
 		}
@@ -1231,7 +3292,27 @@ void collect_update(struct thread_pool *threads, struct shadow_fd *sfd,
 
 			sfd->remote_bufsize = sfd->buffer_size;
 		}
+		if (sfd->mirror_evicted) {
+			if (restore_mirror(sfd, threads) == -1) {
+				return;
+			}
+		} else if (sfd->needs_resync) {
+			memcpy(sfd->mem_mirror, sfd->mem_local, sfd->buffer_size);
+		}
+		if (sfd->needs_resync) {
+			/* The remote copy may lack any of the recent changes,
+			 * so send everything */
+			sfd->needs_resync = false;
+			sfd->nrow_layouts = 0;
+			reset_damage(&sfd->damage);
+			sfd->remote_bufsize = 0;
+			queue_fill_transfers(threads, sfd, transfers);
+			sfd->remote_bufsize = sfd->buffer_size;
+			return;
+		}
 
+		queue_row_shifts(sfd, transfers);
+		queue_block_copies(sfd, transfers);
 		queue_diff_transfers(threads, sfd, transfers);
 	} break;
 	case FDC_DMABUF: {
@@ -1244,32 +3325,87 @@ void collect_update(struct thread_pool *threads, struct shadow_fd *sfd,
 		bool first = false;
 		if (sfd->only_here) {
 			sfd->only_here = false;
+			sfd->nrow_layouts = 0;
 			first = true;
-
-			add_dmabuf_create_request(
-					transfers, sfd, WMSG_OPEN_DMABUF);
 		}
 		if (!sfd->dmabuf_bo) {
 			// ^ was not previously able to create buffer
+			if (first) {
+				add_dmabuf_create_request(
+						transfers, sfd, WMSG_OPEN_DMABUF);
+			}
 			return;
 		}
+		/* Damage is recorded on wl_surface.commit; when the buffer
+		 * is marked dirty for any other reason, the changed region is
+		 * unknown */
+		if (!first && !sfd->damage.damage) {
+			damage_everything(&sfd->damage);
+		}
 		if (!sfd->mem_local) {
-			sfd->mem_local = map_dmabuf(sfd->dmabuf_bo, false,
-					&sfd->dmabuf_map_handle,
-					&sfd->dmabuf_map_stride);
+			/* Only read back the rows which will be diffed */
+			size_t start = 0, end = sfd->buffer_size;
+			struct row_band bands[MAX_READBACK_BANDS];
+			int nbands = -1;
+			if (!first && sfd->damage.damage != DAMAGE_EVERYTHING) {
+				size_t bs = 1u << threads->diff_alignment_bits;
+				start = sfd->buffer_size;
+				end = 0;
+				for (int i = 0; i < sfd->damage.ndamage_intvs;
+						i++) {
+					struct interval e = sfd->damage.damage[i];
+					start = minu(start, (size_t)e.start);
+					end = maxu(end, (size_t)e.end);
+				}
+				/* the unaligned tail is diffed separately */
+				if (end > bs * (sfd->buffer_size / bs)) {
+					end = sfd->buffer_size;
+				}
+				if (sfd->dmabuf_info.num_planes == 1) {
+					nbands = plan_readback_bands(
+							&sfd->damage,
+							sfd->dmabuf_info.strides[0],
+							sfd->buffer_size,
+							threads->diff_alignment_bits,
+							bands,
+							MAX_READBACK_BANDS);
+				}
+			}
+			if (nbands > 1 && sparse_bands(bands, nbands)) {
+				(void)read_back_bands(sfd, threads, bands,
+						nbands);
+			} else if (start < end) {
+				sfd->mem_local = map_dmabuf_range(sfd, false,
+						start, end,
+						&sfd->dmabuf_map_handle,
+						&sfd->dmabuf_map_stride);
+				size_t stride = sfd->dmabuf_info.strides[0];
+				if (sfd->mem_local && stride > 0) {
+					size_t nrows = (end + stride - 1) /
+								       stride -
+						       start / stride;
+					count_readback(threads,
+							nrows * sfd->dmabuf_map_stride);
+				}
+			}
 			if (!sfd->mem_local) {
+				if (first) {
+					add_dmabuf_create_request(transfers,
+							sfd, WMSG_OPEN_DMABUF);
+				}
 				return;
 			}
 		}
+		size_t alignment = 1u << threads->diff_alignment_bits;
 		if (first) {
-			size_t alignment = 1u << threads->diff_alignment_bits;
+			match_wire_layout(sfd);
+			add_dmabuf_create_request(
+					transfers, sfd, WMSG_OPEN_DMABUF);
+
 			sfd->mem_mirror = zeroed_aligned_alloc(
 					alignz(sfd->buffer_size, alignment),
 					alignment, &sfd->mem_mirror_handle);
-			sfd->dmabuf_warped = zeroed_aligned_alloc(
-					alignz(sfd->buffer_size, alignment),
-					alignment, &sfd->dmabuf_warped_handle);
-			if (!sfd->mem_mirror || !sfd->dmabuf_warped) {
+			if (!sfd->mem_mirror) {
 				wp_error("Failed to allocate mirror");
 				return;
 			}
@@ -1277,11 +3413,26 @@ void collect_update(struct thread_pool *threads, struct shadow_fd *sfd,
 			sfd->remote_bufsize = 0;
 			queue_fill_transfers(threads, sfd, transfers);
 			sfd->remote_bufsize = sfd->buffer_size;
-		} else {
-			// TODO: detailed damage tracking
-			damage_everything(&sfd->damage);
-			queue_diff_transfers(threads, sfd, transfers);
+			break;
+		}
+
+		if (sfd->dmabuf_map_stride != sfd->dmabuf_info.strides[0]) {
+			/* diffs must be made from a copy with the sent stride */
+			if (!sfd->dmabuf_warped) {
+				sfd->dmabuf_warped = zeroed_aligned_alloc(
+						alignz(sfd->buffer_size,
+								alignment),
+						alignment,
+						&sfd->dmabuf_warped_handle);
+				if (!sfd->dmabuf_warped) {
+					wp_error("Failed to allocate stride-corrected copy of DMABUF");
+					return;
+				}
+			}
+			count_warped_update(threads);
 		}
+		queue_row_shifts(sfd, transfers);
+		queue_diff_transfers(threads, sfd, transfers);
 		/* Unmapping will be handled by finish_update() */
 	} break;
 	case FDC_DMAVID_IR: {
@@ -1293,8 +3444,10 @@ void collect_update(struct thread_pool *threads, struct shadow_fd *sfd,
 			// ^ was not previously able to create buffer
 			return;
 		}
+		bool first = false;
 		if (sfd->only_here) {
 			sfd->only_here = false;
+			first = true;
 			if (use_old_dmavid_req) {
 				add_dmabuf_create_request(transfers, sfd,
 						WMSG_OPEN_DMAVID_DST);
@@ -1304,7 +3457,15 @@ void collect_update(struct thread_pool *threads, struct shadow_fd *sfd,
 						sfd->video_fmt);
 			}
 		}
-		collect_video_from_mirror(sfd, transfers);
+		/* A commit which damaged nothing needs no new frame; buffers
+		 * without protocol handlers may have changed anywhere */
+		if (!first && !sfd->damage.damage) {
+			if (sfd->has_owner) {
+				return;
+			}
+			damage_everything(&sfd->damage);
+		}
+		collect_video_from_mirror(threads, sfd, transfers);
 	} break;
 	case FDC_DMAVID_IW: {
 		sfd->is_dirty = false;
@@ -1349,21 +3510,7 @@ void collect_update(struct thread_pool *threads, struct shadow_fd *sfd,
 		}
 
 		if (sfd->pipe.recv.used > 0) {
-			size_t msgsz = sizeof(struct wmsg_basic) +
-				       (size_t)sfd->pipe.recv.used;
-			char *buf = malloc(alignz(msgsz, 4));
-			struct wmsg_basic *header = (struct wmsg_basic *)buf;
-			header->size_and_type = transfer_header(
-					msgsz, WMSG_PIPE_TRANSFER);
-			header->remote_id = sfd->remote_id;
-			memcpy(buf + sizeof(struct wmsg_basic),
-					sfd->pipe.recv.data,
-					(size_t)sfd->pipe.recv.used);
-			memset(buf + msgsz, 0, alignz(msgsz, 4) - msgsz);
-
-			transfer_add(transfers, alignz(msgsz, 4), buf);
-
-			sfd->pipe.recv.used = 0;
+			add_pipe_transfer(transfers, sfd);
 		}
 
 		if (!sfd->pipe.can_read && sfd->pipe.remote_can_write) {
@@ -1420,6 +3567,9 @@ static void increase_buffer_sizes(struct shadow_fd *sfd,
 			return;
 		}
 		sfd->mem_mirror = new_mirror;
+		if (sfd->zero_pages) {
+			grow_zero_pages(sfd, old_size);
+		}
 	}
 }
 
@@ -1433,9 +3583,10 @@ static void pipe_close_write(struct shadow_fd *sfd)
 	} else {
 		checked_close(sfd->pipe.fd);
 		if (sfd->fd_local == sfd->pipe.fd) {
-			sfd->fd_local = -1;
+			set_shadow_local_fd(sfd, -1);
 		}
 		sfd->pipe.fd = -1;
+		sfd->map->fd_generation++;
 	}
 	sfd->pipe.can_write = false;
 
@@ -1453,11 +3604,59 @@ static void pipe_close_read(struct shadow_fd *sfd)
 	} else {
 		checked_close(sfd->pipe.fd);
 		if (sfd->fd_local == sfd->pipe.fd) {
-			sfd->fd_local = -1;
+			set_shadow_local_fd(sfd, -1);
+		}
+		sfd->pipe.fd = -1;
+		sfd->map->fd_generation++;
+	}
+	sfd->pipe.can_read = false;
+}
+
+/* Let the pipe hold more data, to reduce the number of wakeups needed to
+ * move large transfers through it */
+static void enlarge_pipe(struct shadow_fd *sfd)
+{
+	if (sfd->pipe.enlarged) {
+		return;
+	}
+	sfd->pipe.enlarged = true;
+	if (set_pipe_capacity(sfd->pipe.fd, PIPE_KERNEL_SIZE) == -1) {
+		wp_debug("Failed to enlarge buffer of pipe RID=%d: %s",
+				sfd->remote_id, strerror(errno));
+	}
+}
+
+/* Write as much of the data into the pipe as it will accept. Returns the
+ * number of bytes written, or -1 if the pipe was closed for writing. */
+static ssize_t write_to_pipe(
+		struct shadow_fd *sfd, const char *data, size_t len)
+{
+	size_t written = 0;
+	while (written < len) {
+		ssize_t changed = write(
+				sfd->pipe.fd, data + written, len - written);
+		if (changed == -1 &&
+				(errno == EAGAIN || errno == EWOULDBLOCK)) {
+			wp_debug("Writing to pipe RID=%d would block",
+					sfd->remote_id);
+			break;
+		} else if (changed == -1 &&
+				(errno == EPIPE || errno == EBADF)) {
+			/* No process has access to the other end of the pipe,
+			 * or the file descriptor is otherwise permanently
+			 * unwriteable */
+			pipe_close_write(sfd);
+			return -1;
+		} else if (changed == -1) {
+			wp_error("Failed to write into pipe with remote_id=%d: %s",
+					sfd->remote_id, strerror(errno));
+			break;
 		}
-		sfd->pipe.fd = -1;
+		written += (size_t)changed;
 	}
-	sfd->pipe.can_read = false;
+	wp_debug("Wrote %zu of %zu bytes into pipe RID=%d", written, len,
+			sfd->remote_id);
+	return (ssize_t)written;
 }
 
 static int open_sfd(struct fd_translation_map *map, struct shadow_fd **sfd_ptr,
@@ -1476,13 +3675,15 @@ static int open_sfd(struct fd_translation_map *map, struct shadow_fd **sfd_ptr,
 				remote_id);
 		return ERR_FATAL;
 	}
-	sfd->link.l_prev = &map->link;
-	sfd->link.l_next = map->link.l_next;
-	sfd->link.l_prev->l_next = &sfd->link;
-	sfd->link.l_next->l_prev = &sfd->link;
-
 	sfd->remote_id = remote_id;
 	sfd->fd_local = -1;
+	sfd->holes_fd = -1;
+	if (link_shadow(map, sfd) == -1) {
+		wp_error("failed to expand shadow index for RID=%d",
+				remote_id);
+		free(sfd);
+		return ERR_FATAL;
+	}
 	sfd->is_dirty = false;
 	/* a received file descriptor is up to date by default */
 	reset_damage(&sfd->damage);
@@ -1530,12 +3731,66 @@ static int check_sfd_type(struct shadow_fd *sfd, int remote_id,
 	return check_sfd_type_2(sfd, remote_id, mtype, ftype, ftype);
 }
 
+/* Apply a fill or diff update for a file, using a worker thread if one is
+ * available. Updates for a given shadow_fd that arrive between two protocol
+ * messages are produced by a single collect_update call, and thus touch
+ * disjoint regions, so they can safely be applied in any order. */
+static int queue_apply_task(struct thread_pool *pool, struct shadow_fd *sfd,
+		enum task_type type, const struct bytebuf *msg)
+{
+	struct task_data task;
+	memset(&task, 0, sizeof(task));
+	task.type = type;
+	task.sfd = sfd;
+	task.msg = *msg;
+	if (pool_thread_count(pool) <= 1) {
+		goto run_now;
+	}
+
+	task.msg.data = malloc(msg->size);
+	if (!task.msg.data) {
+		wp_error("Failed to allocate copy of update for RID=%d, applying it immediately",
+				sfd->remote_id);
+		task.msg.data = msg->data;
+		goto run_now;
+	}
+	memcpy(task.msg.data, msg->data, msg->size);
+
+	pthread_mutex_lock(&pool->work_mutex);
+	if (buf_ensure_size(pool->apply_stack_count + 1,
+			    sizeof(struct task_data), &pool->apply_stack_size,
+			    (void **)&pool->apply_stack) == -1) {
+		pthread_mutex_unlock(&pool->work_mutex);
+		wp_error("Failed to allocate space for apply task, applying update immediately");
+		free(task.msg.data);
+		task.msg.data = msg->data;
+		goto run_now;
+	}
+	pool->apply_stack[pool->apply_stack_count++] = task;
+	pthread_mutex_unlock(&pool->work_mutex);
+	wake_workers(pool, 1);
+	return 0;
+
+run_now:
+	if (type == TASK_DECOMPRESS_FILL) {
+		return worker_run_decompress_fill(&task, &pool->threads[0]);
+	} else {
+		return worker_run_apply_diff(&task, &pool->threads[0]);
+	}
+}
+
 int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 		struct render_data *render, enum wmsg_type type, int remote_id,
 		const struct bytebuf *msg)
 {
 	struct shadow_fd *sfd = get_shadow_for_rid(map, remote_id);
 	int ret = 0;
+	if (sfd && sfd->type == FDC_FILE) {
+		sfd->mirror_used = true;
+		if (sfd->mirror_evicted && restore_mirror(sfd, threads) == -1) {
+			return ERR_NOMEM;
+		}
+	}
 	switch (type) {
 	default:
 	case WMSG_RESTART:
@@ -1582,7 +3837,7 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 			return 0;
 		}
 
-		sfd->fd_local = create_anon_file();
+		set_shadow_local_fd(sfd, create_anon_file());
 		if (sfd->fd_local == -1) {
 			wp_error("Failed to create anon file for object %d: %s",
 					sfd->remote_id, strerror(errno));
@@ -1633,10 +3888,7 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 		sfd->mem_mirror = zeroed_aligned_alloc(
 				alignz(sfd->buffer_size, alignment), alignment,
 				&sfd->mem_mirror_handle);
-		sfd->dmabuf_warped = zeroed_aligned_alloc(
-				alignz(sfd->buffer_size, alignment), alignment,
-				&sfd->dmabuf_warped_handle);
-		if (!sfd->mem_mirror || !sfd->dmabuf_warped) {
+		if (!sfd->mem_mirror) {
 			wp_error("Failed to allocate mirror");
 			return 0;
 		}
@@ -1647,16 +3899,16 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 		// The file can only actually be created when we know
 		// what type it is?
 		if (init_render_data(render) == -1) {
-			sfd->fd_local = -1;
+			set_shadow_local_fd(sfd, -1);
 			return 0;
 		}
 
 		sfd->dmabuf_bo = make_dmabuf(render, &sfd->dmabuf_info);
 		if (!sfd->dmabuf_bo) {
-			sfd->fd_local = -1;
+			set_shadow_local_fd(sfd, -1);
 			return 0;
 		}
-		sfd->fd_local = export_dmabuf(sfd->dmabuf_bo);
+		set_shadow_local_fd(sfd, export_dmabuf(sfd->dmabuf_bo));
 
 		return 0;
 	}
@@ -1711,7 +3963,7 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 		}
 
 		if (init_render_data(render) == -1) {
-			sfd->fd_local = -1;
+			set_shadow_local_fd(sfd, -1);
 			return 0;
 		}
 		sfd->dmabuf_bo = make_dmabuf(render, &sfd->dmabuf_info);
@@ -1721,7 +3973,7 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 					sizeof(struct dmabuf_slice_data));
 			return 0;
 		}
-		sfd->fd_local = export_dmabuf(sfd->dmabuf_bo);
+		set_shadow_local_fd(sfd, export_dmabuf(sfd->dmabuf_bo));
 
 		if (setup_video_decode(sfd, render) == -1) {
 			wp_error("Video decoding setup failed for RID=%d",
@@ -1781,7 +4033,7 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 		}
 
 		if (init_render_data(render) == -1) {
-			sfd->fd_local = -1;
+			set_shadow_local_fd(sfd, -1);
 			return 0;
 		}
 
@@ -1791,9 +4043,10 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 					sfd->remote_id);
 			return 0;
 		}
-		sfd->fd_local = export_dmabuf(sfd->dmabuf_bo);
+		set_shadow_local_fd(sfd, export_dmabuf(sfd->dmabuf_bo));
 
-		if (setup_video_encode(sfd, render, threads->nthreads) == -1) {
+		if (setup_video_encode(sfd, render,
+				    pool_thread_count(threads)) == -1) {
 			wp_error("Video encoding setup failed for RID=%d",
 					sfd->remote_id);
 		}
@@ -1827,19 +4080,19 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 		 * read and write from pipe_fd if it exists. */
 		if (type == WMSG_OPEN_IR_PIPE) {
 			// Read end is 0; the other process writes
-			sfd->fd_local = pipedes[1];
+			set_shadow_local_fd(sfd, pipedes[1]);
 			sfd->pipe.fd = pipedes[0];
 			sfd->pipe.can_read = true;
 			sfd->pipe.remote_can_write = true;
 		} else if (type == WMSG_OPEN_IW_PIPE) {
 			// Write end is 1; the other process reads
-			sfd->fd_local = pipedes[0];
+			set_shadow_local_fd(sfd, pipedes[0]);
 			sfd->pipe.fd = pipedes[1];
 			sfd->pipe.can_write = true;
 			sfd->pipe.remote_can_read = true;
 		} else { // FDC_PIPE_RW
 			// Here, it doesn't matter which end is which
-			sfd->fd_local = pipedes[0];
+			set_shadow_local_fd(sfd, pipedes[0]);
 			sfd->pipe.fd = pipedes[1];
 			sfd->pipe.can_read = true;
 			sfd->pipe.can_write = true;
@@ -1893,6 +4146,7 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 				     FDC_DMABUF)) < 0) {
 			return ret;
 		}
+		sfd->remote_updated = true;
 		if (sfd->type == FDC_FILE && sfd->file_readonly) {
 			wp_debug("Ignoring a fill update to readonly file at RID=%d",
 					remote_id);
@@ -1901,6 +4155,16 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 
 		const struct wmsg_buffer_fill *header =
 				(const struct wmsg_buffer_fill *)msg->data;
+		if (sfd->type == FDC_FILE) {
+			if (header->end > sfd->buffer_size) {
+				wp_error("Transfer end overflow %" PRIu32
+					 " > %zu",
+						header->end, sfd->buffer_size);
+				return ERR_FATAL;
+			}
+			return queue_apply_task(threads, sfd,
+					TASK_DECOMPRESS_FILL, msg);
+		}
 
 		size_t uncomp_size = header->end - header->start;
 		struct thread_data *local = &threads->threads[0];
@@ -1931,58 +4195,134 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 			return ERR_FATAL;
 		}
 
-		if (sfd->type == FDC_DMABUF) {
-			int bpp = get_shm_bytes_per_pixel(
-					sfd->dmabuf_info.format);
-			if (bpp == -1) {
-				wp_error("Skipping update of RID=%d, non-RGBA/monoplane fmt %x",
-						sfd->remote_id,
-						sfd->dmabuf_info.format);
-				return 0;
-			}
+		int bpp = get_shm_bytes_per_pixel(sfd->dmabuf_info.format);
+		if (bpp == -1) {
+			wp_error("Skipping update of RID=%d, non-RGBA/monoplane fmt %x",
+					sfd->remote_id, sfd->dmabuf_info.format);
+			return 0;
+		}
+
+		memcpy(sfd->mem_mirror + header->start, act_buffer,
+				header->end - header->start);
 
-			memcpy(sfd->mem_mirror + header->start, act_buffer,
+		void *handle = NULL;
+		uint32_t map_stride = 0;
+		char *mem_local = map_dmabuf_range(sfd, true, header->start,
+				header->end, &handle, &map_stride);
+		if (!mem_local) {
+			wp_error("Failed to apply fill to RID=%d, fd not mapped",
+					sfd->remote_id);
+			return 0;
+		}
+		uint32_t in_stride = sfd->dmabuf_info.strides[0];
+		if (map_stride != in_stride) {
+			count_warped_update(threads);
+		}
+		if (map_stride == in_stride) {
+			memcpy(mem_local + header->start,
+					sfd->mem_mirror + header->start,
 					header->end - header->start);
+		} else {
+			/* stride changing transfer */
+			uint32_t row_length =
+					(uint32_t)bpp * sfd->dmabuf_info.width;
 
-			void *handle = NULL;
-			uint32_t map_stride = 0;
-			char *mem_local = map_dmabuf(sfd->dmabuf_bo, true,
-					&handle, &map_stride);
-			if (!mem_local) {
-				wp_error("Failed to apply fill to RID=%d, fd not mapped",
-						sfd->remote_id);
-				return 0;
-			}
-			uint32_t in_stride = sfd->dmabuf_info.strides[0];
-			if (map_stride == in_stride) {
-				memcpy(mem_local + header->start,
-						sfd->mem_mirror + header->start,
-						header->end - header->start);
-			} else {
-				/* stride changing transfer */
-				uint32_t row_length = (uint32_t)bpp *
-						      sfd->dmabuf_info.width;
-
-				uint32_t copy_size = (uint32_t)minu(row_length,
-						minu(map_stride, in_stride));
-
-				stride_shifted_copy(mem_local,
-						act_buffer - header->start,
-						header->start,
-						header->end - header->start,
-						copy_size, in_stride,
-						map_stride);
-			}
+			uint32_t copy_size = (uint32_t)minu(
+					row_length, minu(map_stride, in_stride));
 
-			if (unmap_dmabuf(sfd->dmabuf_bo, handle) == -1) {
-				return 0;
+			stride_shifted_copy(threads->copy_func, mem_local,
+					act_buffer - header->start,
+					header->start,
+					header->end - header->start, copy_size,
+					in_stride, map_stride);
+		}
+
+		if (unmap_dmabuf(sfd->dmabuf_bo, handle) == -1) {
+			return 0;
+		}
+		return 0;
+	}
+	case WMSG_BUFFER_COPY: {
+		if ((ret = check_message_min_size(type, msg,
+				     sizeof(struct wmsg_buffer_copy))) < 0) {
+			return ret;
+		}
+		if ((ret = check_sfd_type_2(sfd, remote_id, type, FDC_FILE,
+				     FDC_DMABUF)) < 0) {
+			return ret;
+		}
+		sfd->remote_updated = true;
+		if (sfd->type == FDC_FILE && sfd->file_readonly) {
+			wp_debug("Ignoring a copy update to readonly file at RID=%d",
+					remote_id);
+			return 0;
+		}
+		if ((sfd->type == FDC_FILE && !sfd->mem_local) ||
+				!sfd->mem_mirror) {
+			wp_error("Failed to apply copy to RID=%d, file not mapped",
+					remote_id);
+			return 0;
+		}
+		const char *ranges = msg->data + sizeof(struct wmsg_buffer_copy);
+		size_t nranges = (msg->size - sizeof(struct wmsg_buffer_copy)) /
+				 sizeof(struct wmsg_copy_range);
+		/* Copies may come from files whose mirrors were freed */
+		for (size_t i = 0; i < nranges; i++) {
+			struct wmsg_copy_range r;
+			memcpy(&r, ranges + i * sizeof(r), sizeof(r));
+			struct shadow_fd *src =
+					get_shadow_for_rid(map, r.source_id);
+			if (src && src->mirror_evicted &&
+					restore_mirror(src, threads) == -1) {
+				return ERR_NOMEM;
 			}
-		} else {
-			memcpy(sfd->mem_mirror + header->start, act_buffer,
-					header->end - header->start);
-			memcpy(sfd->mem_local + header->start, act_buffer,
-					header->end - header->start);
 		}
+		if (sfd->type == FDC_FILE) {
+			return apply_copy_ranges(map, sfd, ranges, nranges, true);
+		}
+		if ((ret = apply_copy_ranges(map, sfd, ranges, nranges,
+				     false)) < 0) {
+			return ret;
+		}
+
+		/* Write the changed part of the mirror to the DMABUF */
+		size_t touched_start = sfd->buffer_size, touched_end = 0;
+		for (size_t i = 0; i < nranges; i++) {
+			struct wmsg_copy_range r;
+			memcpy(&r, ranges + i * sizeof(r), sizeof(r));
+			touched_start = minu(touched_start, r.dest_start);
+			touched_end = maxu(touched_end,
+					(size_t)r.dest_start + r.length);
+		}
+		int bpp = get_shm_bytes_per_pixel(sfd->dmabuf_info.format);
+		if (bpp == -1 || touched_start >= touched_end) {
+			return 0;
+		}
+		void *handle = NULL;
+		uint32_t map_stride = 0;
+		char *mem_local = map_dmabuf_range(sfd, true, touched_start,
+				touched_end, &handle, &map_stride);
+		if (!mem_local) {
+			wp_error("Failed to apply copy to RID=%d, fd not mapped",
+					sfd->remote_id);
+			return 0;
+		}
+		uint32_t in_stride = sfd->dmabuf_info.strides[0];
+		if (map_stride != in_stride) {
+			count_warped_update(threads);
+		}
+		uint32_t row_length = (uint32_t)bpp * sfd->dmabuf_info.width;
+		uint32_t copy_size = (uint32_t)minu(
+				row_length, minu(map_stride, in_stride));
+		for (size_t i = 0; i < nranges; i++) {
+			struct wmsg_copy_range r;
+			memcpy(&r, ranges + i * sizeof(r), sizeof(r));
+			stride_shifted_copy(threads->copy_func, mem_local,
+					sfd->mem_mirror, r.dest_start,
+					r.length, copy_size, in_stride,
+					map_stride);
+		}
+		(void)unmap_dmabuf(sfd->dmabuf_bo, handle);
 		return 0;
 	}
 	case WMSG_BUFFER_DIFF: {
@@ -1994,6 +4334,7 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 				     FDC_DMABUF)) < 0) {
 			return ret;
 		}
+		sfd->remote_updated = true;
 		if (sfd->type == FDC_FILE && sfd->file_readonly) {
 			wp_debug("Ignoring a diff update to readonly file at RID=%d",
 					remote_id);
@@ -2001,6 +4342,10 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 		}
 		const struct wmsg_buffer_diff *header =
 				(const struct wmsg_buffer_diff *)msg->data;
+		if (sfd->type == FDC_FILE) {
+			return queue_apply_task(
+					threads, sfd, TASK_APPLY_DIFF, msg);
+		}
 
 		struct thread_data *local = &threads->threads[0];
 		if (buf_ensure_size((int)(header->diff_size +
@@ -2027,87 +4372,95 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 			return ERR_FATAL;
 		}
 
-		if (sfd->type == FDC_DMABUF) {
-			int bpp = get_shm_bytes_per_pixel(
-					sfd->dmabuf_info.format);
-			if (bpp == -1) {
-				wp_error("Skipping update of RID=%d, non-RGBA/monoplane fmt %x",
-						sfd->remote_id,
-						sfd->dmabuf_info.format);
-				return 0;
-			}
+		int bpp = get_shm_bytes_per_pixel(sfd->dmabuf_info.format);
+		if (bpp == -1) {
+			wp_error("Skipping update of RID=%d, non-RGBA/monoplane fmt %x",
+					sfd->remote_id, sfd->dmabuf_info.format);
+			return 0;
+		}
 
-			void *handle = NULL;
-			uint32_t map_stride = 0;
-			char *mem_local = map_dmabuf(sfd->dmabuf_bo, true,
-					&handle, &map_stride);
-			if (!mem_local) {
-				wp_error("Failed to apply diff to RID=%d, fd not mapped",
-						sfd->remote_id);
-				return 0;
-			}
-			uint32_t in_stride = sfd->dmabuf_info.strides[0];
-			uint32_t row_length =
-					(uint32_t)bpp * sfd->dmabuf_info.width;
-			uint32_t copy_size = (uint32_t)minu(row_length,
-					minu(map_stride, in_stride));
-
-			(void)in_stride;
-			size_t nblocks = sfd->buffer_size / sizeof(uint32_t);
-			size_t ndiffblocks =
-					header->diff_size / sizeof(uint32_t);
-			uint32_t *diff_blocks = (uint32_t *)act_buffer;
-			for (size_t i = 0; i < ndiffblocks;) {
-				size_t nfrom = (size_t)diff_blocks[i];
-				size_t nto = (size_t)diff_blocks[i + 1];
-				size_t span = nto - nfrom;
-				if (nto > nblocks || nfrom >= nto ||
-						i + (nto - nfrom) >=
-								ndiffblocks) {
-					wp_error("Invalid copy range [%zu,%zu) > %zu=nblocks or [%zu,%zu) > %zu=ndiffblocks",
-							nfrom, nto, nblocks,
-							i + 1, i + 1 + span,
-							ndiffblocks);
-					break;
-				}
-				memcpy(sfd->mem_mirror + sizeof(uint32_t) * nfrom,
-						diff_blocks + i + 2,
-						sizeof(uint32_t) * span);
-				stride_shifted_copy(mem_local,
-						(char *)((diff_blocks + i + 2) -
-								nfrom),
-						sizeof(uint32_t) * nfrom,
-						sizeof(uint32_t) * span,
-						copy_size, in_stride,
-						map_stride);
-				i += span + 2;
-			}
-			if (header->ntrailing > 0) {
-				size_t offset = sfd->buffer_size -
-						header->ntrailing;
-				memcpy(sfd->mem_mirror + offset,
-						act_buffer + header->diff_size,
-						header->ntrailing);
-				stride_shifted_copy(mem_local,
-						(act_buffer + header->diff_size) -
-								offset,
-						offset, header->ntrailing,
-						copy_size, in_stride,
-						map_stride);
-			}
+		size_t nblocks = sfd->buffer_size / sizeof(uint32_t);
+		size_t ndiffblocks = header->diff_size / sizeof(uint32_t);
+		uint32_t *diff_blocks = (uint32_t *)act_buffer;
 
-			if (unmap_dmabuf(sfd->dmabuf_bo, handle) == -1) {
-				return 0;
+		/* Find the range of the buffer that the diff touches, stopping
+		 * where the loop below would, so that only it is mapped */
+		size_t touched_start = sfd->buffer_size, touched_end = 0;
+		for (size_t i = 0; i < ndiffblocks;) {
+			size_t nfrom = (size_t)diff_blocks[i];
+			size_t nto = (size_t)diff_blocks[i + 1];
+			if (nto > nblocks || nfrom >= nto ||
+					i + (nto - nfrom) >= ndiffblocks) {
+				break;
 			}
-		} else {
-			DTRACE_PROBE2(waypipe, apply_diff_enter,
-					sfd->buffer_size, header->diff_size);
-			apply_diff(sfd->buffer_size, sfd->mem_mirror,
-					sfd->mem_local, header->diff_size,
-					header->ntrailing, act_buffer);
-			DTRACE_PROBE(waypipe, apply_diff_exit);
+			touched_start = minu(touched_start,
+					sizeof(uint32_t) * nfrom);
+			touched_end = maxu(touched_end, sizeof(uint32_t) * nto);
+			i += (nto - nfrom) + 2;
+		}
+		if (header->ntrailing > 0) {
+			touched_start = minu(touched_start,
+					sfd->buffer_size - header->ntrailing);
+			touched_end = sfd->buffer_size;
+		}
+		if (touched_start >= touched_end) {
+			return 0;
 		}
 
+		void *handle = NULL;
+		uint32_t map_stride = 0;
+		char *mem_local = map_dmabuf_range(sfd, true, touched_start,
+				touched_end, &handle, &map_stride);
+		if (!mem_local) {
+			wp_error("Failed to apply diff to RID=%d, fd not mapped",
+					sfd->remote_id);
+			return 0;
+		}
+		uint32_t in_stride = sfd->dmabuf_info.strides[0];
+		if (map_stride != in_stride) {
+			count_warped_update(threads);
+		}
+		uint32_t row_length = (uint32_t)bpp * sfd->dmabuf_info.width;
+		uint32_t copy_size = (uint32_t)minu(
+				row_length, minu(map_stride, in_stride));
+
+		for (size_t i = 0; i < ndiffblocks;) {
+			size_t nfrom = (size_t)diff_blocks[i];
+			size_t nto = (size_t)diff_blocks[i + 1];
+			size_t span = nto - nfrom;
+			if (nto > nblocks || nfrom >= nto ||
+					i + (nto - nfrom) >= ndiffblocks) {
+				wp_error("Invalid copy range [%zu,%zu) > %zu=nblocks or [%zu,%zu) > %zu=ndiffblocks",
+						nfrom, nto, nblocks, i + 1,
+						i + 1 + span, ndiffblocks);
+				break;
+			}
+			(*threads->copy_func)(NULL,
+					sfd->mem_mirror + sizeof(uint32_t) * nfrom,
+					(const char *)(diff_blocks + i + 2),
+					sizeof(uint32_t) * span);
+			stride_shifted_copy(threads->copy_func, mem_local,
+					(char *)((diff_blocks + i + 2) - nfrom),
+					sizeof(uint32_t) * nfrom,
+					sizeof(uint32_t) * span, copy_size,
+					in_stride, map_stride);
+			i += span + 2;
+		}
+		if (header->ntrailing > 0) {
+			size_t offset = sfd->buffer_size - header->ntrailing;
+			memcpy(sfd->mem_mirror + offset,
+					act_buffer + header->diff_size,
+					header->ntrailing);
+			stride_shifted_copy(threads->copy_func, mem_local,
+					(act_buffer + header->diff_size) -
+							offset,
+					offset, header->ntrailing, copy_size,
+					in_stride, map_stride);
+		}
+
+		if (unmap_dmabuf(sfd->dmabuf_bo, handle) == -1) {
+			return 0;
+		}
 		return 0;
 	}
 	case WMSG_PIPE_TRANSFER: {
@@ -2121,19 +4474,37 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 			return 0;
 		}
 
-		size_t transf_data_sz = msg->size - sizeof(struct wmsg_basic);
+		const char *data = msg->data + sizeof(struct wmsg_basic);
+		size_t len = msg->size - sizeof(struct wmsg_basic);
+		struct pipe_buffer *send = &sfd->pipe.send;
+		if (send->used == 0) {
+			/* Nothing is queued, so try to skip the copy */
+			ssize_t written = write_to_pipe(sfd, data, len);
+			if (written == -1) {
+				return 0;
+			}
+			data += written;
+			len -= (size_t)written;
+			if (len == 0) {
+				return 0;
+			}
+			enlarge_pipe(sfd);
+		} else if (send->start > 0) {
+			memmove(send->data, send->data + send->start,
+					(size_t)(send->used - send->start));
+			send->used -= send->start;
+			send->start = 0;
+		}
 
-		int netsize = sfd->pipe.send.used + (int)transf_data_sz;
-		if (buf_ensure_size(netsize, 1, &sfd->pipe.send.size,
-				    (void **)&sfd->pipe.send.data) == -1) {
+		int netsize = send->used + (int)len;
+		if (buf_ensure_size(netsize, 1, &send->size,
+				    (void **)&send->data) == -1) {
 			wp_error("Failed to expand pipe transfer buffer, dropping data");
 			return 0;
 		}
 
-		memcpy(sfd->pipe.send.data + sfd->pipe.send.used,
-				msg->data + sizeof(struct wmsg_basic),
-				transf_data_sz);
-		sfd->pipe.send.used = netsize;
+		memcpy(send->data + send->used, data, len);
+		send->used = netsize;
 
 		// The pipe itself will be flushed/or closed later by
 		// flush_writable_pipes
@@ -2210,7 +4581,7 @@ bool shadow_decref_transfer(struct shadow_fd *sfd)
 		 * the original pipe was introduced */
 		if (sfd->pipe.fd != sfd->fd_local) {
 			checked_close(sfd->fd_local);
-			sfd->fd_local = sfd->pipe.fd;
+			set_shadow_local_fd(sfd, sfd->pipe.fd);
 		}
 	}
 	return destroy_shadow_if_unreferenced(sfd);
@@ -2333,48 +4704,34 @@ void flush_writable_pipes(struct fd_translation_map *map)
 				   *lnxt = lcur->l_next;
 			lcur != &map->link; lcur = lnxt, lnxt = lcur->l_next) {
 		struct shadow_fd *sfd = (struct shadow_fd *)lcur;
+		struct pipe_buffer *send = &sfd->pipe.send;
 		if (sfd->type != FDC_PIPE || !sfd->pipe.writable ||
-				sfd->pipe.send.used <= 0) {
+				send->used <= 0) {
 			continue;
 		}
 
 		sfd->pipe.writable = false;
-		wp_debug("Flushing %zd bytes into RID=%d", sfd->pipe.send.used,
-				sfd->remote_id);
-		ssize_t changed = write(sfd->pipe.fd, sfd->pipe.send.data,
-				(size_t)sfd->pipe.send.used);
-
-		if (changed == -1 &&
-				(errno == EAGAIN || errno == EWOULDBLOCK)) {
-			wp_debug("Writing to pipe RID=%d would block",
-					sfd->remote_id);
+		wp_debug("Flushing %d bytes into RID=%d",
+				send->used - send->start, sfd->remote_id);
+		ssize_t changed = write_to_pipe(sfd, send->data + send->start,
+				(size_t)(send->used - send->start));
+		if (changed == -1) {
 			continue;
-		} else if (changed == -1 &&
-				(errno == EPIPE || errno == EBADF)) {
-			/* No process has access to the other end of the pipe,
-			 * or the file descriptor is otherwise permanently
-			 * unwriteable */
+		}
+		/* The unwritten data is only moved when more is appended */
+		send->start += (int)changed;
+		if (send->start < send->used) {
+			enlarge_pipe(sfd);
+			continue;
+		}
+		send->start = 0;
+		send->used = 0;
+		if (sfd->pipe.pending_w_shutdown) {
+			/* A shutdown request was made, but can only be
+			 * applied now that the write buffer has been
+			 * cleared */
 			pipe_close_write(sfd);
-		} else if (changed == -1) {
-			wp_error("Failed to write into pipe with remote_id=%d: %s",
-					sfd->remote_id, strerror(errno));
-		} else {
-			wp_debug("Wrote %zd more bytes into pipe RID=%d",
-					changed, sfd->remote_id);
-			sfd->pipe.send.used -= (int)changed;
-			if (sfd->pipe.send.used > 0) {
-				memmove(sfd->pipe.send.data,
-						sfd->pipe.send.data + changed,
-						(size_t)sfd->pipe.send.used);
-			}
-			if (sfd->pipe.send.used <= 0 &&
-					sfd->pipe.pending_w_shutdown) {
-				/* A shutdown request was made, but can only be
-				 * applied now that the write buffer has been
-				 * cleared */
-				pipe_close_write(sfd);
-				sfd->pipe.pending_w_shutdown = false;
-			}
+			sfd->pipe.pending_w_shutdown = false;
 		}
 	}
 	/* Destroy any new unreferenced objects */
@@ -2391,22 +4748,46 @@ void read_readable_pipes(struct fd_translation_map *map)
 				   *lnxt = lcur->l_next;
 			lcur != &map->link; lcur = lnxt, lnxt = lcur->l_next) {
 		struct shadow_fd *sfd = (struct shadow_fd *)lcur;
+		struct pipe_buffer *recv = &sfd->pipe.recv;
 		if (sfd->type != FDC_PIPE || !sfd->pipe.readable) {
 			continue;
 		}
 
-		if (sfd->pipe.recv.size == 0) {
-			sfd->pipe.recv.size = 32768;
-			sfd->pipe.recv.data =
-					malloc((size_t)sfd->pipe.recv.size);
-		}
-		if (sfd->pipe.recv.size > sfd->pipe.recv.used) {
-			sfd->pipe.readable = false;
+		sfd->pipe.readable = false;
+		/* Read until the pipe is empty, so that large transfers need
+		 * fewer trips through the main loop */
+		while (sfd->pipe.can_read) {
+			if (recv->used == recv->size && recv->data) {
+				if (recv->size >= PIPE_RECV_MAX_SIZE) {
+					break;
+				}
+				size_t nsize = sizeof(struct wmsg_basic) +
+					       2 * (size_t)recv->size + 4;
+				void *nbuf = realloc(recv->data, nsize);
+				if (!nbuf) {
+					break;
+				}
+				recv->data = nbuf;
+				recv->size *= 2;
+				enlarge_pipe(sfd);
+			}
+			if (!recv->data) {
+				recv->size = max(
+						recv->size, PIPE_RECV_MIN_SIZE);
+				/* Leave room for the header and padding */
+				recv->data = malloc(sizeof(struct wmsg_basic) +
+						    (size_t)recv->size + 4);
+				if (!recv->data) {
+					wp_error("Failed to allocate buffer for pipe RID=%d",
+							sfd->remote_id);
+					break;
+				}
+			}
+
 			ssize_t changed = read(sfd->pipe.fd,
-					sfd->pipe.recv.data +
-							sfd->pipe.recv.used,
-					(size_t)(sfd->pipe.recv.size -
-							sfd->pipe.recv.used));
+					recv->data + sizeof(struct wmsg_basic) +
+							recv->used,
+					(size_t)(recv->size - recv->used));
 			if (changed == 0) {
 				/* No process has access to the other end of the
 				 * pipe */
@@ -2416,15 +4797,16 @@ void read_readable_pipes(struct fd_translation_map *map)
 							errno == EWOULDBLOCK)) {
 				wp_debug("Reading from pipe RID=%d would block",
 						sfd->remote_id);
-				continue;
+				break;
 			} else if (changed == -1) {
 				wp_error("Failed to read from pipe with remote_id=%d: %s",
 						sfd->remote_id,
 						strerror(errno));
+				break;
 			} else {
 				wp_debug("Read %zd more bytes from pipe RID=%d",
 						changed, sfd->remote_id);
-				sfd->pipe.recv.used += (int)changed;
+				recv->used += (int)changed;
 			}
 		}
 	}
@@ -2466,62 +4848,228 @@ void extend_shm_shadow(struct thread_pool *threads, struct shadow_fd *sfd,
 
 void run_task(struct task_data *task, struct thread_data *local)
 {
+	struct pool_stats *stats = &local->pool->stats;
+	uint64_t start_ns = stats->enabled ? monotonic_ns() : 0;
 	if (task->type == TASK_COMPRESS_BLOCK) {
 		worker_run_compress_block(task, local);
 	} else if (task->type == TASK_COMPRESS_DIFF) {
 		worker_run_compress_diff(task, local);
+	} else if (task->type == TASK_CONVERT_VIDEO ||
+			task->type == TASK_ENCODE_VIDEO) {
+		worker_run_video_task(task, local);
+	} else if (task->type == TASK_DECOMPRESS_FILL ||
+			task->type == TASK_APPLY_DIFF) {
+		int ret = task->type == TASK_DECOMPRESS_FILL
+					  ? worker_run_decompress_fill(task, local)
+					  : worker_run_apply_diff(task, local);
+		if (ret < 0) {
+			pthread_mutex_lock(&local->pool->work_mutex);
+			local->pool->apply_failed = true;
+			pthread_mutex_unlock(&local->pool->work_mutex);
+		}
 	} else {
 		wp_error("Unidentified task type");
 	}
+	if (stats->enabled) {
+		atomic_fetch_add(&stats->busy_ns, monotonic_ns() - start_ns);
+	}
 }
 
 int start_parallel_work(struct thread_pool *pool,
 		struct thread_msg_recv_buf *recv_queue)
 {
-	pthread_mutex_lock(&pool->work_mutex);
-	if (recv_queue->zone_start != recv_queue->zone_end) {
-		wp_error("Some async messages not yet sent");
-	}
-	recv_queue->zone_start = 0;
-	recv_queue->zone_end = 0;
 	int num_mt_tasks = pool->stack_count;
-	if (buf_ensure_size(num_mt_tasks, sizeof(struct iovec),
-			    &recv_queue->size,
-			    (void **)&recv_queue->data) == -1) {
+	pool->stack_count = 0;
+	/* Each task sends at most one message, except that video frames may
+	 * be encoded into several packets, by whichever of the frame's
+	 * conversion tasks finishes last */
+	int num_msgs = 0;
+	for (int i = 0; i < num_mt_tasks; i++) {
+		const struct task_data *t = &pool->stack[i];
+		if (t->type == TASK_ENCODE_VIDEO ||
+				(t->type == TASK_CONVERT_VIDEO &&
+						t->zone_start == 0)) {
+			num_msgs += VIDEO_MAX_PACKETS;
+		} else if (t->type != TASK_CONVERT_VIDEO) {
+			num_msgs++;
+		}
+	}
+	if (transfer_async_prepare(recv_queue, num_msgs) == -1) {
 		wp_error("Failed to provide enough space for receive queue, skipping all work tasks");
-		num_mt_tasks = 0;
+		return 0;
+	}
+	if (num_mt_tasks == 0) {
+		return 0;
 	}
-	pool->do_work = num_mt_tasks > 0;
 
-	/* Start the work tasks here */
-	if (num_mt_tasks > 0) {
-		pthread_cond_broadcast(&pool->work_cond);
+	/* Ensure every deque can hold all tasks, so that tasks can be dealt
+	 * out among just the threads for which this succeeded */
+	int ndest = 0;
+	for (int i = 0; i < pool->nthreads; i++) {
+		struct thread_data *data = &pool->threads[i];
+		pthread_mutex_lock(&data->deque_lock);
+		data->deque_start = 0;
+		data->deque_end = 0;
+		if (buf_ensure_size(num_mt_tasks, sizeof(struct task_data),
+				    &data->deque_size,
+				    (void **)&data->deque) == -1) {
+			wp_error("Failed to allocate task deque for thread %d",
+					i);
+		} else {
+			ndest++;
+		}
+		pthread_mutex_unlock(&data->deque_lock);
+	}
+	if (ndest == 0) {
+		wp_error("Failed to allocate all task deques, skipping all work tasks");
+		return 0;
+	}
+
+	/* Counting the tasks before they are visible keeps request_work_task
+	 * from reporting completion early; thieves that see the count first
+	 * will just find empty deques and retry */
+	atomic_fetch_add(&pool->tasks_queued, num_mt_tasks);
+	for (int t = 0, k = 0; t < pool->nthreads; t++) {
+		struct thread_data *data = &pool->threads[t];
+		if (data->deque_size < num_mt_tasks) {
+			continue;
+		}
+		pthread_mutex_lock(&data->deque_lock);
+		for (int i = k; i < num_mt_tasks; i += ndest) {
+			data->deque[data->deque_end++] = pool->stack[i];
+		}
+		pthread_mutex_unlock(&data->deque_lock);
+		k++;
 	}
-	pthread_mutex_unlock(&pool->work_mutex);
 
+	wake_workers(pool, num_mt_tasks);
 	return num_mt_tasks;
 }
 
+/** Take a task from the end of the thread's own deque, or failing that, steal
+ * one from the start of another thread's deque. Returns false if no task was
+ * available. */
+static bool take_task(struct thread_pool *pool, struct thread_data *local,
+		struct task_data *task)
+{
+	if (atomic_load(&pool->tasks_queued) == 0) {
+		return false;
+	}
+
+	/* Threads of a worker group have no deque in the pool, and can
+	 * only steal */
+	int first = 0, nvictims = pool->nthreads;
+	if (!local->group) {
+		pthread_mutex_lock(&local->deque_lock);
+		if (local->deque_end > local->deque_start) {
+			*task = local->deque[--local->deque_end];
+			atomic_fetch_add(&pool->tasks_in_progress, 1);
+			atomic_fetch_sub(&pool->tasks_queued, 1);
+			pthread_mutex_unlock(&local->deque_lock);
+			local->tasks_run++;
+			return true;
+		}
+		pthread_mutex_unlock(&local->deque_lock);
+		first = (int)(local - pool->threads) + 1;
+		nvictims = pool->nthreads - 1;
+	}
+
+	for (int k = 0; k < nvictims; k++) {
+		struct thread_data *victim =
+				&pool->threads[(first + k) % pool->nthreads];
+		pthread_mutex_lock(&victim->deque_lock);
+		if (victim->deque_end > victim->deque_start) {
+			*task = victim->deque[victim->deque_start++];
+			atomic_fetch_add(&pool->tasks_in_progress, 1);
+			atomic_fetch_sub(&pool->tasks_queued, 1);
+			pthread_mutex_unlock(&victim->deque_lock);
+			local->tasks_run++;
+			local->tasks_stolen++;
+			return true;
+		}
+		pthread_mutex_unlock(&victim->deque_lock);
+	}
+	return false;
+}
+
 bool request_work_task(
 		struct thread_pool *pool, struct task_data *task, bool *is_done)
+{
+	bool has_task = take_task(pool, &pool->threads[0], task);
+	/* Tasks are counted as in progress before they stop being queued */
+	*is_done = !has_task && atomic_load(&pool->tasks_queued) == 0 &&
+		   atomic_load(&pool->tasks_in_progress) == 0;
+	return has_task;
+}
+
+void finish_work_task(struct thread_pool *pool)
+{
+	atomic_fetch_sub(&pool->tasks_in_progress, 1);
+}
+
+int wait_for_apply_tasks(struct thread_pool *pool)
 {
 	pthread_mutex_lock(&pool->work_mutex);
-	*is_done = pool->stack_count == 0 && pool->tasks_in_progress == 0;
-	bool has_task = false;
-	if (pool->stack_count > 0 && pool->do_work) {
-		int i = pool->stack_count - 1;
-		if (pool->stack[i].type != TASK_STOP) {
-			*task = pool->stack[i];
-			has_task = true;
-			pool->stack_count--;
-			pool->tasks_in_progress++;
-			if (pool->stack_count <= 0) {
-				pool->do_work = false;
-			}
+	while (pool->apply_stack_count > 0 ||
+			pool->apply_tasks_in_progress > 0) {
+		if (pool->apply_stack_count > 0) {
+			/* Help out, instead of waiting idly */
+			pool->apply_stack_count--;
+			struct task_data task =
+					pool->apply_stack[pool->apply_stack_count];
+			pool->apply_tasks_in_progress++;
+			pthread_mutex_unlock(&pool->work_mutex);
+			run_task(&task, &pool->threads[0]);
+			free(task.msg.data);
+			pthread_mutex_lock(&pool->work_mutex);
+			pool->apply_tasks_in_progress--;
+		} else {
+			pthread_cond_wait(&pool->apply_done_cond,
+					&pool->work_mutex);
 		}
 	}
+	int ret = pool->apply_failed ? ERR_FATAL : 0;
+	pool->apply_failed = false;
 	pthread_mutex_unlock(&pool->work_mutex);
-	return has_task;
+	return ret;
+}
+
+/** Run a compression task, if one can be taken, and wake the main loop to
+ * collect its result. Returns false if there was none. */
+static bool run_compress_task(
+		struct thread_pool *pool, struct thread_data *data)
+{
+	struct task_data task;
+	if (!take_task(pool, data, &task)) {
+		return false;
+	}
+	run_task(&task, data);
+	finish_work_task(pool);
+
+	uint8_t triv = 0;
+	if (write(pool->selfpipe_w, &triv, 1) == -1) {
+		wp_error("Failed to write to self-pipe");
+	}
+	return true;
+}
+
+/** Run the last queued apply task; work_mutex must be held, and there must be
+ * such a task. The mutex is released while the task runs. */
+static void run_apply_task(struct thread_pool *pool, struct thread_data *data)
+{
+	pool->apply_stack_count--;
+	struct task_data task = pool->apply_stack[pool->apply_stack_count];
+	pool->apply_tasks_in_progress++;
+	pthread_mutex_unlock(&pool->work_mutex);
+	run_task(&task, data);
+	free(task.msg.data);
+	pthread_mutex_lock(&pool->work_mutex);
+
+	pool->apply_tasks_in_progress--;
+	if (pool->apply_tasks_in_progress == 0 &&
+			pool->apply_stack_count == 0) {
+		pthread_cond_broadcast(&pool->apply_done_cond);
+	}
 }
 
 static void *worker_thread_main(void *arg)
@@ -2529,40 +5077,84 @@ static void *worker_thread_main(void *arg)
 	struct thread_data *data = arg;
 	struct thread_pool *pool = data->pool;
 
-	/* The loop is globally locked by default, and only unlocked in
-	 * pthread_cond_wait. Yes, there are fancier and faster schemes.
-	 */
-	pthread_mutex_lock(&pool->work_mutex);
 	while (1) {
-		while (!pool->do_work) {
-			pthread_cond_wait(&pool->work_cond, &pool->work_mutex);
-		}
-		if (pool->stack_count <= 0) {
-			pool->do_work = false;
+		if (run_compress_task(pool, data)) {
 			continue;
 		}
-		/* Copy task, since the queue may be resized */
-		int i = pool->stack_count - 1;
-		struct task_data task = pool->stack[i];
-		if (task.type == TASK_STOP) {
+
+		pthread_mutex_lock(&pool->work_mutex);
+		while (!pool->stopping &&
+				atomic_load(&pool->tasks_queued) == 0 &&
+				pool->apply_stack_count <= 0) {
+			pthread_cond_wait(&pool->work_cond, &pool->work_mutex);
+		}
+		if (pool->stopping) {
+			pthread_mutex_unlock(&pool->work_mutex);
 			break;
 		}
-		pool->tasks_in_progress++;
-		pool->stack_count--;
-		if (pool->stack_count <= 0) {
-			pool->do_work = false;
+		if (pool->apply_stack_count > 0) {
+			run_apply_task(pool, data);
 		}
 		pthread_mutex_unlock(&pool->work_mutex);
-		run_task(&task, data);
-		pthread_mutex_lock(&pool->work_mutex);
+	}
+
+	return NULL;
+}
 
-		uint8_t triv = 0;
-		pool->tasks_in_progress--;
-		if (write(pool->selfpipe_w, &triv, 1) == -1) {
-			wp_error("Failed to write to self-pipe");
+/** Find the next pool in the group, after the one last picked, which has a
+ * task waiting; the group's mutex must be held. */
+static struct thread_pool *pick_group_pool(struct worker_group *group)
+{
+	for (int k = 0; k < group->npools; k++) {
+		int i = (group->next_pool + k) % group->npools;
+		struct thread_pool *pool = group->pools[i];
+		bool ready = atomic_load(&pool->tasks_queued) > 0;
+		if (!ready) {
+			pthread_mutex_lock(&pool->work_mutex);
+			ready = pool->apply_stack_count > 0;
+			pthread_mutex_unlock(&pool->work_mutex);
+		}
+		if (ready) {
+			group->next_pool = (i + 1) % group->npools;
+			return pool;
 		}
 	}
-	pthread_mutex_unlock(&pool->work_mutex);
+	return NULL;
+}
+
+static void *group_worker_main(void *arg)
+{
+	struct thread_data *data = arg;
+	struct worker_group *group = data->group;
 
+	pthread_mutex_lock(&group->mutex);
+	while (!group->stopping) {
+		struct thread_pool *pool = pick_group_pool(group);
+		if (!pool) {
+			pthread_cond_wait(&group->work_cond, &group->mutex);
+			continue;
+		}
+		pool->group_users++;
+		pthread_mutex_unlock(&group->mutex);
+
+		/* Only one task is run before picking a pool again, so that
+		 * the pools take turns */
+		data->pool = pool;
+		if (!run_compress_task(pool, data)) {
+			pthread_mutex_lock(&pool->work_mutex);
+			if (pool->apply_stack_count > 0) {
+				run_apply_task(pool, data);
+			}
+			pthread_mutex_unlock(&pool->work_mutex);
+		}
+		data->pool = NULL;
+
+		pthread_mutex_lock(&group->mutex);
+		pool->group_users--;
+		if (pool->group_users == 0) {
+			pthread_cond_broadcast(&group->idle_cond);
+		}
+	}
+	pthread_mutex_unlock(&group->mutex);
 	return NULL;
 }
@@ -58,11 +58,136 @@ struct shadow_fd_link {
 	struct shadow_fd_link *l_prev, *l_next; /* Doubly linked list */
 };
 
+struct sfd_index_slot {
+	int key;
+	struct shadow_fd *sfd; /* NULL iff the slot is empty */
+};
+
+/** Open addressing hash table (with linear probing) from integer keys to
+ * shadow structures */
+struct sfd_index {
+	struct sfd_index_slot *slots;
+	int nslots; /* zero, or a power of two */
+};
+
+/** Size of the tiles of mirrored files that are indexed by content */
+#define BLOCK_CACHE_TILE_BITS 10
+#define BLOCK_CACHE_TILE_SIZE (1u << BLOCK_CACHE_TILE_BITS)
+
+struct block_cache_entry {
+	uint64_t hash;
+	int remote_id; /* 0 iff the entry is empty */
+	uint32_t tile;
+};
+/** Direct mapped table from the hash of a tile's contents to a location in
+ * some file's mem_mirror where that content was recently seen. Entries are
+ * never invalidated: they are only hints, checked against mem_mirror before
+ * use. */
+struct block_cache {
+	int nentries; /* zero (if disabled) or a power of two */
+	struct block_cache_entry *entries;
+	/* Statistics, for benchmarking */
+	uint64_t nhits, nmisses;
+	uint64_t nshifts;
+};
+
+/** Where the rows of an image committed from a buffer lie, as seen in
+ * mem_mirror; used to look for scrolled content */
+struct row_layout {
+	size_t start;
+	uint32_t stride;
+	uint32_t row_bytes;
+	uint32_t nrows;
+};
+#define MAX_ROW_LAYOUTS 4
+
 struct fd_translation_map {
 	struct shadow_fd_link link; /* store in first position */
 
 	int max_local_id;
 	int local_sign;
+
+	/* Indices of all shadow structures in the list by remote id and by
+	 * local fd (when nonnegative). Both are kept with the same capacity,
+	 * which suffices for every structure in the list, so that changing a
+	 * local fd never requires an allocation */
+	struct sfd_index rid_index, lfd_index;
+	int nshadows;
+	/* Incremented whenever a pipe fd, which may have been polled, is
+	 * closed; see \ref uring_poll */
+	uint32_t fd_generation;
+	/* Incremented whenever protocol handling marks a shadow structure as
+	 * changed, or resizes it; see \ref parse_and_prune_messages */
+	uint32_t change_generation;
+	/* If enabled, changed tiles of files which match a tile that the
+	 * remote side already has, and rows of images which moved vertically,
+	 * are sent as WMSG_BUFFER_COPY messages */
+	struct block_cache block_cache;
+};
+
+#define COMP_AUTOTUNE_MAX_LEVELS 32
+
+/** Measured cost of compressing at a given level */
+struct comp_level_stats {
+	bool measured;
+	/* The message cycle in which this was last updated */
+	uint32_t last_cycle;
+	/* Moving averages of worker time per input byte, and of the ratio of
+	 * output to input size */
+	double ns_per_byte, ratio;
+};
+
+/** State for choosing the compression level to use, from the measured
+ * channel bandwidth and compression speed and ratio */
+struct comp_autotune {
+	bool enabled;
+	int min_level, max_level;
+	struct comp_level_stats levels[COMP_AUTOTUNE_MAX_LEVELS];
+	/* Estimated channel bandwidth, in bytes per nanosecond */
+	double bandwidth;
+	uint32_t cycle;
+	/* Totals for the current message cycle, added to by all threads */
+	atomic_uint_fast64_t comp_ns, comp_in_bytes, comp_out_bytes;
+};
+
+/** Totals reported by the --stats output. These are only updated if
+ * `enabled`, by all threads, and are reset when read */
+struct pool_stats {
+	bool enabled;
+	/* Size of buffer update data, before and after compression */
+	atomic_uint_fast64_t comp_in_bytes, comp_out_bytes;
+	/* Size of the damaged regions scanned for changes, and of the diffs
+	 * made from them */
+	atomic_uint_fast64_t damaged_bytes, diff_bytes;
+	/* Number of DMABUF updates whose mapping had a different stride than
+	 * the one sent, and so had to be copied row by row */
+	atomic_uint_fast64_t warped_updates;
+	/* Size of the DMABUF rows mapped to be read */
+	atomic_uint_fast64_t readback_bytes;
+	/* Time spent by all threads running tasks */
+	atomic_uint_fast64_t busy_ns;
+};
+
+/** Maximum size of a compression dictionary; LZ4 can only refer to the last
+ * 64 KiB of one */
+#define COMP_DICT_SIZE 65536
+
+/** A dictionary of content from the first buffer updates compressed, which
+ * is used for all later ones, so that patterns recurring across frames, like
+ * glyphs, can be referenced. See \ref enable_compression_dict */
+struct comp_dict {
+	bool enabled;
+	/* Samples of compression input are appended (with work_mutex held)
+	 * until `nsampled` reaches COMP_DICT_SIZE */
+	char *samples;
+	size_t nsampled;
+	/* Once nonzero, `samples` is the dictionary. This is only changed by
+	 * the main thread when no compression tasks are running */
+	size_t size;
+	/* The dictionary from the other side, used for decompression; only
+	 * changed when no apply tasks are running */
+	char *remote;
+	size_t remote_size;
 };
 
 /** Thread pool and associated global information */
@@ -74,27 +199,85 @@ struct thread_pool {
 	 * content and use the same settings */
 	enum compression_mode compression;
 	int compression_level;
+	/* If enabled, compression_level is changed between message cycles,
+	 * when no tasks are running; see \ref update_compression_level */
+	struct comp_autotune autotune;
+	struct comp_dict dict;
+	struct pool_stats stats;
 
 	interval_diff_fn_t diff_func;
 	int diff_alignment_bits;
+	/* Used to copy diff segments into the mirror and local buffers when
+	 * updates are applied */
+	span_copy_fn_t copy_func;
+	/* If set, and supported by the compression mode, diffs are
+	 * compressed in pieces as they are constructed, instead of after
+	 * the whole diff has been made */
+	bool stream_diffs;
 
 	// Mutable state
+	/* Protects the stopping flag and the apply queue; idle workers wait
+	 * on work_cond */
 	pthread_mutex_t work_mutex;
 	pthread_cond_t work_cond;
+	bool stopping;
 
-	bool do_work;
+	/* Compression tasks are staged here by the main thread, and are then
+	 * dealt out to the per-thread deques by start_parallel_work */
 	int stack_count, stack_size;
 	struct task_data *stack;
-	// TODO: distinct queues for wayland->channel and channel->wayland,
-	// to make multithreaded decompression possible
-	int tasks_in_progress;
+	/* Number of tasks waiting in the per-thread deques, and the number
+	 * being run. A task is counted as in progress before it stops being
+	 * counted as queued, so that both are zero only once all are done */
+	atomic_int tasks_queued;
+	atomic_int tasks_in_progress;
+
+	/* Channel->wayland tasks (decompressing and applying buffer updates)
+	 * have their own queue, so that they can be run and waited for
+	 * independently of the wayland->channel compression work */
+	int apply_stack_count, apply_stack_size;
+	struct task_data *apply_stack;
+	int apply_tasks_in_progress;
+	bool apply_failed; /* set if an update was found to be malformed */
+	pthread_cond_t apply_done_cond;
 
 	// to wake the main loop
 	int selfpipe_r, selfpipe_w;
+
+	/* If set, the pool has no worker threads of its own, and its tasks
+	 * are instead run by those of the group. `group_users` counts the
+	 * group's threads running a task for this pool, and is protected by
+	 * the group's mutex */
+	struct worker_group *group;
+	int group_users;
+};
+
+/** Worker threads shared by the thread pools of several connections run by
+ * one process. The threads take tasks from each registered pool in turn, so
+ * that a connection with a large backlog of work does not hold up the
+ * others, and each keeps one set of compression contexts for all of them */
+struct worker_group {
+	int nworkers;
+	struct thread_data *threads;
+	enum compression_mode compression;
+
+	/* Protects the list of pools and the stopping flag; idle workers
+	 * wait on work_cond, and pools leaving the group wait on idle_cond
+	 * until no worker is running a task for them */
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond, idle_cond;
+	bool stopping;
+	struct thread_pool **pools;
+	int npools, pools_size;
+	/* The pool which the next worker to look for a task starts from */
+	int next_pool;
 };
 
 struct thread_data {
 	pthread_t thread;
+	/* For threads of a worker group, this is the group, and `pool` is
+	 * that of the task currently being run */
+	struct worker_group *group;
 	struct thread_pool *pool;
 	/* Thread local data */
 	struct comp_ctx comp_ctx;
@@ -103,20 +286,38 @@ struct thread_data {
 	 * compression */
 	void *tmp_buf;
 	int tmp_size;
+	/* Where to allocate the messages made by tasks on this thread;
+	 * created when first needed */
+	struct transfer_arena *arena;
+
+	/* Compression tasks assigned to this thread. The owner takes tasks
+	 * from the end; idle threads steal from the start */
+	pthread_mutex_t deque_lock;
+	struct task_data *deque;
+	int deque_start, deque_end, deque_size;
+	/* Statistics, only modified by the owning thread */
+	uint64_t tasks_run, tasks_stolen;
 };
 
 enum task_type {
-	TASK_STOP,
 	TASK_COMPRESS_BLOCK,
 	TASK_COMPRESS_DIFF,
+	TASK_DECOMPRESS_FILL,
+	TASK_APPLY_DIFF,
+	TASK_CONVERT_VIDEO,
+	TASK_ENCODE_VIDEO,
 };
 
+/* The most packets a video encode task may produce for one frame */
+#define VIDEO_MAX_PACKETS 4
+
 /** Specification for a task to be run on another thread */
 struct task_data {
 	enum task_type type;
 
 	struct shadow_fd *sfd;
-	/* For block compression option */
+	/* For block compression option; for video conversion, zone_start is
+	 * the index of the slice */
 	int zone_start, zone_end;
 	/* For diff compression option */
 	struct interval *damage_intervals;
@@ -124,6 +325,10 @@ struct task_data {
 	bool damaged_end;
 
 	struct thread_msg_recv_buf *msg_queue;
+
+	/* For decompression/application options; a copy of the received
+	 * message, owned by whoever removes the task from the queue */
+	struct bytebuf msg;
 };
 
 /** Shadow object types, signifying file descriptor type and usage */
@@ -140,6 +345,8 @@ struct pipe_buffer {
 	char *data;
 	int size;
 	int used;
+	/** Bytes before this offset have already been written out */
+	int start;
 };
 
 /** Reference count for a struct shadow_fd; the object can be safely deleted
@@ -155,8 +362,10 @@ struct refcount {
 };
 
 struct pipe_state {
-	/** Temporary buffers to contain small chunks of data, before it is
-	 * transported further */
+	/** Temporary buffers to contain chunks of data, before they are
+	 * transported further. `recv.data` starts with space for a
+	 * wmsg_basic header, so that a full buffer can be sent as is; it
+	 * grows, up to a limit, while the pipe keeps it filled. */
 	struct pipe_buffer send;
 	struct pipe_buffer recv;
 	/** Internal file descriptor through which all pipe interactions
@@ -173,6 +382,8 @@ struct pipe_state {
 	 * (POLLIN|POLLHUP -> readable ; POLLOUT -> writeable) */
 	bool readable, writable;
 	bool pending_w_shutdown;
+	/** Has the kernel buffer of `fd` been enlarged for bulk transfers */
+	bool enlarged;
 };
 
 /**
@@ -183,6 +394,7 @@ struct pipe_state {
  */
 struct shadow_fd {
 	struct shadow_fd_link link; /* part of doubly linked list */
+	struct fd_translation_map *map; /* containing map, for its indices */
 
 	enum fdcat type;
 	int remote_id; // + if created serverside; - if created clientside
@@ -195,6 +407,9 @@ struct shadow_fd {
 			// is_dirty flag?
 	bool is_dirty;  // If so, should this file be scanned for updates?
 	struct damage damage;
+	/* Images committed since the last update, for scroll detection */
+	struct row_layout row_layouts[MAX_ROW_LAYOUTS];
+	int nrow_layouts;
 	/* For worker threads, contains their allocated damage intervals */
 	struct interval *damage_task_interval_store;
 
@@ -212,6 +427,28 @@ struct shadow_fd {
 	// File data
 	size_t remote_bufsize; // used to check for and send file extensions
 	bool file_readonly;
+	/* Set once the remote side has sent an update for this file; as its
+	 * contents may then change at any time, it is not used as a source
+	 * for WMSG_BUFFER_COPY */
+	bool remote_updated;
+	/* Set when updates to the remote copy were discarded after a
+	 * reconnection, so that the whole file must be sent again */
+	bool needs_resync;
+	/* For files managed by protocol handlers, a bitmap of the pages which
+	 * were holes at the last diff and are zero in the mirror, covering
+	 * the first `zero_pages_count` pages; NULL if not tracked */
+	uint64_t *zero_pages;
+	size_t zero_pages_count;
+	/* The file opened again, so that looking for holes does not move the
+	 * file offset which fd_local shares with the program; -1 until it is
+	 * first needed, and -2 if it could not be opened */
+	int holes_fd;
+	/* Set whenever the mirror is used; see \ref evict_idle_mirrors */
+	bool mirror_used;
+	/* Set when the mirror was freed because the file was idle. It is
+	 * rebuilt from mem_local when next needed, and later changes are
+	 * then sent by resending the whole file */
+	bool mirror_evicted;
 
 	// Pipe data
 	struct pipe_state pipe;
@@ -222,9 +459,13 @@ struct shadow_fd {
 	void *dmabuf_map_handle; /* Nonnull when DMABUF is currently mapped */
 	uint32_t dmabuf_map_stride; /* stride at which mem_local is mapped */
 	/* temporary cache of stride-fixed mem_local. Same dimensions as
-	 * mem_mirror */
+	 * mem_mirror; only allocated once a mapping's stride disagrees with
+	 * the one sent, or the damage is read back in separate bands */
 	char *dmabuf_warped;
 	void *dmabuf_warped_handle;
+	/* Set when mem_local is dmabuf_warped, holding only the bands of rows
+	 * read back by \ref read_back_bands; other rows are stale */
+	bool dmabuf_staged;
 
 	// Video data
 	struct AVCodecContext *video_context;
@@ -235,6 +476,12 @@ struct shadow_fd {
 	void *video_local_frame_data;
 	struct AVPacket *video_packet;
 	struct SwsContext *video_color_context;
+	/* If there is more than one, color conversion for encoding is split
+	 * into slices of `video_slice_rows` rows, each with its own context */
+	struct SwsContext **video_slice_contexts;
+	int video_nslices, video_slice_rows;
+	/* Conversion tasks still running; the last to finish runs the encode */
+	atomic_int video_slices_left;
 	int64_t video_frameno;
 	enum video_coding_fmt video_fmt;
 
@@ -246,12 +493,73 @@ struct shadow_fd {
 const char *compression_mode_to_str(enum compression_mode mode);
 
 void setup_translation_map(struct fd_translation_map *map, bool display_side);
+/** Start indexing mem_mirror tiles of files, so that content which the
+ * remote side already has can be referenced instead of sent again.
+ * Returns -1 on allocation failure. */
+int enable_block_cache(struct fd_translation_map *map);
 void cleanup_translation_map(struct fd_translation_map *map);
+/** Record that an image with the given row layout was committed from the
+ * buffer, so that the next update can check whether its rows were shifted.
+ * `start` and `stride` are in terms of the buffer as transferred. */
+void note_row_layout(struct shadow_fd *sfd, size_t start, uint32_t stride,
+		uint32_t row_bytes, uint32_t nrows);
 
 int setup_thread_pool(struct thread_pool *pool,
 		enum compression_mode compression, int compression_level,
 		int n_threads);
 void cleanup_thread_pool(struct thread_pool *pool);
+/** Upper bound on the compressed size of `max_input` bytes with the pool's
+ * compression method, or 0 if data is not compressed */
+size_t compress_bufsize(struct thread_pool *pool, size_t max_input);
+/** Compress `isize` bytes of `ibuf` into `mbuf`, which has `msize` bytes of
+ * space, and point `dst` at the result, which is `ibuf` if nothing was
+ * compressed */
+void compress_buffer(struct thread_pool *pool, struct comp_ctx *ctx,
+		size_t isize, const char *ibuf, size_t msize, char *mbuf,
+		struct bytebuf *dst);
+/** Uncompress `isize` bytes of `ibuf` to exactly `msize` bytes in `mbuf`,
+ * and point `wbuf` at the result, which is `ibuf` if it was not compressed */
+void uncompress_buffer(struct thread_pool *pool, struct comp_ctx *ctx,
+		size_t isize, const char *ibuf, size_t msize, char *mbuf,
+		size_t *wsize, const char **wbuf);
+/** Start the shared worker threads. As with setup_thread_pool, `n_threads`
+ * includes the main thread of each connection, and is chosen automatically
+ * if zero. Returns -1 on failure. */
+int setup_worker_group(struct worker_group *group,
+		enum compression_mode compression, int n_threads);
+/** Stop the worker threads; all pools must have been cleaned up already */
+void cleanup_worker_group(struct worker_group *group);
+/** Have the group's threads run the tasks of a pool made with just one
+ * thread, until cleanup_thread_pool is called. Returns -1 on allocation
+ * failure, in which case the pool's main thread runs all its tasks. */
+int join_worker_group(struct thread_pool *pool, struct worker_group *group);
+/** The number of threads which can run tasks from the pool, including its
+ * main thread */
+int pool_thread_count(const struct thread_pool *pool);
+/** Let update_compression_level adjust the compression level, which is
+ * initially pool->compression_level. Returns -1 on allocation failure. */
+int enable_compression_autotune(struct thread_pool *pool);
+/** Call after each message cycle, once all compression tasks are complete
+ * and all resulting transfers have been written. This uses the compression
+ * and channel throughput measurements for the cycle to estimate, for nearby
+ * compression levels, the time to send a frame, and picks the fastest. */
+void update_compression_level(
+		struct thread_pool *pool, struct transfer_queue *transfers);
+/** Start collecting samples of the data being compressed, for use as a
+ * dictionary by \ref update_compression_dict. Does nothing if there is no
+ * compression. Returns -1 on allocation failure. */
+int enable_compression_dict(struct thread_pool *pool);
+/** Call after each message cycle, once all compression tasks are complete.
+ * When enough samples have been collected, this queues a
+ * WMSG_COMPRESSION_DICT message containing them, and all blocks compressed
+ * afterwards use them as a dictionary. */
+void update_compression_dict(
+		struct thread_pool *pool, struct transfer_queue *transfers);
+/** Use the dictionary in a WMSG_COMPRESSION_DICT message to decompress the
+ * following updates. Call only when no apply tasks are running. Returns
+ * ERR_FATAL if the message is malformed, or ERR_NOMEM. */
+int apply_compression_dict(
+		struct thread_pool *pool, const struct bytebuf *msg);
 
 /** Given a file descriptor, return which type code would be applied to its
  * shadow entry. (For example, FDC_PIPE_IR for a pipe-like object that can only
@@ -274,12 +582,40 @@ struct shadow_fd *translate_fd(struct fd_translation_map *map,
  * transfer messages. All pointers will be to existing memory. */
 void collect_update(struct thread_pool *threads, struct shadow_fd *cur,
 		struct transfer_queue *transfers, bool use_old_dmavid_req);
+/** Return true if the next update for the shadow_fd would only change the
+ * contents of a buffer that the remote side already has, so that it can be
+ * postponed and merged with a later update */
+bool update_can_wait(const struct shadow_fd *sfd);
+/** Called after a reconnection, when all messages in `transfers` will be
+ * resent. For each file whose unacknowledged updates are larger than the file
+ * itself, replace the last of those updates with a fill of the whole file and
+ * the others with empty messages, keeping the message count. If the file
+ * cannot be sent that way, the next collect_update sends it instead.
+ * Returns the number of bytes of updates that were dropped. */
+size_t drop_stale_file_updates(struct fd_translation_map *map,
+		struct thread_pool *threads, struct transfer_queue *transfers);
+/** A range of rows [start, end) of a DMABUF to read back */
+struct row_band {
+	uint32_t start, end;
+};
+/** Damaged rows separated by fewer untouched rows than this are read back
+ * together */
+#define READBACK_MIN_GAP_ROWS 16
+/** Find the bands of rows, of an image with the given stride and size, which
+ * contain the (not DAMAGE_EVERYTHING) damage, just as the diff will read
+ * it. Returns the number of bands written to `bands`, or -1 if more than
+ * `max_bands` would be needed or allocation failed. Visible for testing. */
+int plan_readback_bands(const struct damage *damage, size_t stride,
+		size_t buffer_size, int alignment_bits, struct row_band *bands,
+		int max_bands);
 /** After all thread pool tasks have completed, reduce refcounts and clean up
  * related data. The caller should then invoke destroy_shadow_if_unreferenced.
  */
 void finish_update(struct shadow_fd *sfd);
 /** Apply a data update message to an element in the translation map, creating
- * an entry when there is none.
+ * an entry when there is none. With worker threads available, the contents of
+ * WMSG_BUFFER_FILL and WMSG_BUFFER_DIFF messages for files may be applied
+ * later; call wait_for_apply_tasks before relying on the buffer contents.
  *
  * Returns -1 if the error is the fault of the other waypipe instance,
  * 0 otherwise. (For example, syscall failure => 0, bad message length => -1.)
@@ -293,6 +629,12 @@ struct shadow_fd *get_shadow_for_rid(struct fd_translation_map *map, int rid);
 struct shadow_fd *get_shadow_for_local_fd(
 		struct fd_translation_map *map, int lfd);
 
+/** Free the mirrors of files whose mirrors were not used since the last
+ * call, so that files left idle for over one call period use no extra
+ * memory. Does nothing while channel updates are being applied. Returns the
+ * number of mirrors freed. */
+int evict_idle_mirrors(
+		struct fd_translation_map *map, struct thread_pool *pool);
 /** Count the number of pipe fds being maintained by the translation map */
 int count_npipes(const struct fd_translation_map *map);
 /** Fill in pollfd entries, with POLLIN | POLLOUT, for applicable pipe objects.
@@ -338,18 +680,32 @@ void decref_transferred_rids(
 void extend_shm_shadow(struct thread_pool *threads, struct shadow_fd *sfd,
 		size_t new_size);
 
-/** Notify the threads so that they can start working on the tasks in the pool,
- * and return the total number of tasks */
+/** Divide the staged tasks among the threads' deques, notify the threads so
+ * that they can start working on them, and return the total number of tasks */
 int start_parallel_work(struct thread_pool *pool,
 		struct thread_msg_recv_buf *recv_queue);
-/** Return true if there is a work task (not a stop task) remaining for the
- * main thread to work on; also set *is_done if all tasks have completed. */
+/** Return true if there is a work task remaining for the main thread to work
+ * on, stealing one from a worker if necessary; also set *is_done if all tasks
+ * have completed. Each task returned must be followed by finish_work_task. */
 bool request_work_task(struct thread_pool *pool, struct task_data *task,
 		bool *is_done);
+/** Record that a task obtained from request_work_task has been run */
+void finish_work_task(struct thread_pool *pool);
 /** Run a work task */
 void run_task(struct task_data *task, struct thread_data *local);
+/** Allocate a block for a message made by a task running on the thread with
+ * data `local`, to be queued with transfer_async_add. Returns NULL on
+ * failure. */
+void *alloc_msg_block(struct thread_data *local, size_t size);
+/** Run any queued buffer update tasks on the calling thread, and then wait
+ * until all have completed, so that local buffers reflect every update
+ * received so far. Returns ERR_FATAL if any update was malformed, else 0. */
+int wait_for_apply_tasks(struct thread_pool *pool);
 
 // video.c
+/** Set up the hardware video device, unless disabled or already done.
+ * Returns -1 if hardware video cannot be used. */
+int init_hwcontext(struct render_data *rd);
 void cleanup_hwcontext(struct render_data *rd);
 bool video_supports_dmabuf_format(uint32_t format, uint64_t modifier);
 bool video_supports_shm_format(uint32_t format);
@@ -362,10 +718,13 @@ void destroy_video_data(struct shadow_fd *sfd);
 int setup_video_encode(
 		struct shadow_fd *sfd, struct render_data *rd, int nthreads);
 int setup_video_decode(struct shadow_fd *sfd, struct render_data *rd);
-/** the video frame to be transferred should already have been transferred into
- * `sfd->mem_mirror`. */
-void collect_video_from_mirror(
+/** Queue tasks to convert and encode the current contents of the DMABUF; the
+ * resulting packets are sent to transfers->async_recv_queue. Like the other
+ * tasks, these are started by start_parallel_work. */
+void collect_video_from_mirror(struct thread_pool *threads,
 		struct shadow_fd *sfd, struct transfer_queue *transfers);
+/** Run a TASK_CONVERT_VIDEO or TASK_ENCODE_VIDEO task */
+void worker_run_video_task(struct task_data *task, struct thread_data *local);
 /** Decompress a video packet and apply the new frame onto the shadow_fd  */
 void apply_video_packet(struct shadow_fd *sfd, struct render_data *rd,
 		const struct bytebuf *data);
@@ -0,0 +1,309 @@
+/*
+ * Copyright © 2019 Manuel Stoeckl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "main.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Time between reports */
+#define STATS_PERIOD_NS 1000000000uLL
+/* Commits beyond this many unacknowledged ones are not measured */
+#define STATS_MAX_PENDING 1024
+
+static int open_stats_output(const char *path)
+{
+	int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_NOCTTY | O_CLOEXEC,
+			0644);
+	if (fd != -1 || errno != ENXIO) {
+		return fd;
+	}
+	/* open() fails with ENXIO for sockets */
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		int err = errno;
+		checked_close(fd);
+		errno = err;
+		return -1;
+	}
+	/* A slow reader should not stall the connection; lines that do not
+	 * fit are dropped */
+	if (set_nonblocking(fd) == -1) {
+		checked_close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int setup_stats(struct wp_stats *stats, struct thread_pool *pool,
+		const char *path, bool display_side)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats->fd = -1;
+	if (!path) {
+		return 0;
+	}
+	stats->fd = open_stats_output(path);
+	if (stats->fd == -1) {
+		wp_error("Failed to open statistics output '%s': %s", path,
+				strerror(errno));
+		return -1;
+	}
+	stats->display_side = display_side;
+	stats->period_start_ns = monotonic_ns();
+	pool->stats.enabled = true;
+	return 0;
+}
+
+void cleanup_stats(struct wp_stats *stats)
+{
+	if (stats->fd != -1) {
+		checked_close(stats->fd);
+		stats->fd = -1;
+	}
+	free(stats->pending);
+	free(stats->surfaces);
+	stats->pending = NULL;
+	stats->surfaces = NULL;
+}
+
+void stats_note_commit(struct wp_stats *stats, uint32_t surface_id)
+{
+	if (stats->fd == -1 || stats->npending >= STATS_MAX_PENDING) {
+		return;
+	}
+	if (buf_ensure_size(stats->npending + 1, sizeof(struct pending_commit),
+			    &stats->pending_size,
+			    (void **)&stats->pending) == -1) {
+		wp_error("Failed to allocate space to record commit");
+		return;
+	}
+	struct pending_commit *c = &stats->pending[stats->npending++];
+	c->surface_id = surface_id;
+	c->queued = false;
+	c->msgno = 0;
+	c->time_ns = monotonic_ns();
+}
+
+void stats_note_commits_queued(struct wp_stats *stats, uint32_t msgno)
+{
+	for (int i = stats->npending - 1; i >= 0; i--) {
+		if (stats->pending[i].queued) {
+			break;
+		}
+		stats->pending[i].queued = true;
+		stats->pending[i].msgno = msgno;
+	}
+}
+
+static struct surface_latency *get_surface_latency(
+		struct wp_stats *stats, uint32_t surface_id)
+{
+	for (int i = 0; i < stats->nsurfaces; i++) {
+		if (stats->surfaces[i].surface_id == surface_id) {
+			return &stats->surfaces[i];
+		}
+	}
+	if (buf_ensure_size(stats->nsurfaces + 1,
+			    sizeof(struct surface_latency),
+			    &stats->surfaces_size,
+			    (void **)&stats->surfaces) == -1) {
+		wp_error("Failed to allocate space to record surface latency");
+		return NULL;
+	}
+	struct surface_latency *s = &stats->surfaces[stats->nsurfaces++];
+	memset(s, 0, sizeof(*s));
+	s->surface_id = surface_id;
+	return s;
+}
+
+void stats_note_ack(struct wp_stats *stats, uint32_t msgno)
+{
+	if (stats->npending == 0) {
+		return;
+	}
+	uint64_t now = monotonic_ns();
+	int k = 0;
+	for (; k < stats->npending; k++) {
+		struct pending_commit *c = &stats->pending[k];
+		if (!c->queued || msgno_gt(c->msgno, msgno)) {
+			break;
+		}
+		struct surface_latency *s =
+				get_surface_latency(stats, c->surface_id);
+		if (s) {
+			uint64_t delay = now - c->time_ns;
+			s->count++;
+			s->total_ns += delay;
+			s->max_ns = s->max_ns > delay ? s->max_ns : delay;
+		}
+	}
+	memmove(stats->pending, stats->pending + k,
+			sizeof(struct pending_commit) *
+					(size_t)(stats->npending - k));
+	stats->npending -= k;
+}
+
+void stats_note_queue(struct wp_stats *stats,
+		const struct transfer_queue *transfers)
+{
+	if (stats->fd == -1) {
+		return;
+	}
+	size_t unacked_bytes = 0;
+	for (int i = 0; i < transfers->end; i++) {
+		unacked_bytes += transfers->vecs[i].iov_len;
+	}
+	stats->max_queued_blocks = max(stats->max_queued_blocks,
+			transfers->end - transfers->start);
+	if (unacked_bytes > stats->max_unacked_bytes) {
+		stats->max_unacked_bytes = unacked_bytes;
+	}
+}
+
+void stats_note_retained(struct wp_stats *stats,
+		const struct transfer_queue *transfers)
+{
+	if (stats->fd == -1) {
+		return;
+	}
+	size_t retained = transfers->partial_write_amt;
+	for (int i = 0; i < transfers->start; i++) {
+		retained += transfers->vecs[i].iov_len;
+	}
+	if (retained > stats->max_retained_bytes) {
+		stats->max_retained_bytes = retained;
+	}
+}
+
+int stats_report(struct wp_stats *stats, struct thread_pool *pool)
+{
+	if (stats->fd == -1) {
+		return -1;
+	}
+	uint64_t now = monotonic_ns();
+	uint64_t elapsed = now - stats->period_start_ns;
+	if (elapsed < STATS_PERIOD_NS) {
+		return (int)((STATS_PERIOD_NS - elapsed + 999999) / 1000000);
+	}
+	stats->period_start_ns = now;
+
+	struct pool_stats *ps = &pool->stats;
+	uint64_t comp_in = atomic_exchange(&ps->comp_in_bytes, 0);
+	uint64_t comp_out = atomic_exchange(&ps->comp_out_bytes, 0);
+	uint64_t damaged = atomic_exchange(&ps->damaged_bytes, 0);
+	uint64_t diffed = atomic_exchange(&ps->diff_bytes, 0);
+	uint64_t warped = atomic_exchange(&ps->warped_updates, 0);
+	uint64_t readback = atomic_exchange(&ps->readback_bytes, 0);
+	uint64_t busy_ns = atomic_exchange(&ps->busy_ns, 0);
+	int nthreads = pool_thread_count(pool);
+	double utilization =
+			(double)busy_ns / ((double)elapsed * (double)nthreads);
+
+	struct timespec wall;
+	clock_gettime(CLOCK_REALTIME, &wall);
+
+	/* Each line is written with a single call, so that the reports of
+	 * several Waypipe processes sharing a file do not interleave */
+	size_t space = 1024 + 96 * (size_t)stats->nsurfaces;
+	char *line = malloc(space);
+	if (!line) {
+		wp_error("Failed to allocate statistics report");
+		goto end;
+	}
+	size_t len = (size_t)snprintf(line, space,
+			"{\"time\":%" PRIu64 ".%03d,\"pid\":%d,\"side\":\"%s\","
+			"\"period_ms\":%" PRIu64 ",\"bytes_written\":%" PRIu64
+			",\"bytes_read\":%" PRIu64
+			",\"comp_in_bytes\":%" PRIu64
+			",\"comp_out_bytes\":%" PRIu64
+			",\"compression_level\":%d,\"damaged_bytes\":%" PRIu64
+			",\"diff_bytes\":%" PRIu64 ",\"warped_updates\":%" PRIu64
+			",\"readback_bytes\":%" PRIu64
+			",\"max_queued_blocks\":%d,\"max_unacked_bytes\":%zu"
+			",\"max_retained_bytes\":%zu"
+			",\"standalone_acks\":%" PRIu64
+			",\"ack_rtt_us\":%" PRIu64
+			",\"worker_utilization\":%.4f,\"surfaces\":[",
+			(uint64_t)wall.tv_sec, (int)(wall.tv_nsec / 1000000),
+			(int)getpid(),
+			stats->display_side ? "compositor" : "application",
+			elapsed / 1000000, stats->bytes_written,
+			stats->bytes_read, comp_in, comp_out,
+			pool->compression_level, damaged, diffed,
+			warped, readback, stats->max_queued_blocks,
+			stats->max_unacked_bytes, stats->max_retained_bytes,
+			stats->standalone_acks, stats->ack_rtt_ns / 1000,
+			utilization);
+	for (int i = 0; i < stats->nsurfaces && len < space; i++) {
+		const struct surface_latency *s = &stats->surfaces[i];
+		len += (size_t)snprintf(line + len, space - len,
+				"%s{\"id\":%u,\"commits\":%u,"
+				"\"mean_latency_us\":%" PRIu64
+				",\"max_latency_us\":%" PRIu64 "}",
+				i > 0 ? "," : "", s->surface_id, s->count,
+				s->total_ns / s->count / 1000,
+				s->max_ns / 1000);
+	}
+	if (len < space) {
+		len += (size_t)snprintf(line + len, space - len, "]}\n");
+	}
+	if (len >= space) {
+		wp_error("Statistics report was truncated");
+	} else if (write(stats->fd, line, len) != (ssize_t)len) {
+		wp_debug("Failed to write statistics report: %s",
+				strerror(errno));
+	}
+	free(line);
+
+end:
+	stats->nsurfaces = 0;
+	stats->max_queued_blocks = 0;
+	stats->max_unacked_bytes = 0;
+	stats->max_retained_bytes = 0;
+	stats->standalone_acks = 0;
+	stats->bytes_written = 0;
+	stats->bytes_read = 0;
+	return (int)(STATS_PERIOD_NS / 1000000);
+}
@@ -0,0 +1,414 @@
+/*
+ * Copyright © 2019 Manuel Stoeckl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "main.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Smaller blocks are not worth the wait for another connection */
+#define STRIPE_MIN_BLOCK 16384
+#define STRIPE_READ_SIZE 131072
+#define STRIPE_MAX_IOV 16
+
+void setup_stripes(struct channel_stripes *st)
+{
+	memset(st, 0, sizeof(*st));
+	for (int i = 0; i < MAX_CHANNEL_STREAMS - 1; i++) {
+		st->s[i].fd = -1;
+	}
+	st->max_index = MAX_CHANNEL_STREAMS - 1;
+	st->may_connect = true;
+}
+
+static void close_stripe(struct channel_stripe *s)
+{
+	if (s->fd != -1) {
+		checked_close(s->fd);
+	}
+	free(s->blocks);
+	free(s->recv_buffer);
+	memset(s, 0, sizeof(*s));
+	s->fd = -1;
+}
+
+static bool is_stripe_ref(const struct transfer_queue *td, int i)
+{
+	return td->meta[i].static_alloc &&
+	       td->vecs[i].iov_len == sizeof(struct wmsg_stripe) &&
+	       transfer_type(*(const uint32_t *)td->vecs[i].iov_base) ==
+			       WMSG_STRIPE;
+}
+
+/* Put the block back into the queue position held by its reference */
+static void restore_block(struct transfer_queue *td, int i)
+{
+	struct striped_block *blk = td->vecs[i].iov_base;
+	td->vecs[i] = blk->data;
+	td->meta[i].static_alloc = blk->static_alloc;
+	td->meta[i].arena_alloc = blk->arena_alloc;
+	td->meta[i].lane = LANE_BULK;
+	free(blk);
+}
+
+int add_stripe(struct channel_stripes *st, int index, int fd)
+{
+	if (index < 1 || index >= MAX_CHANNEL_STREAMS) {
+		wp_error("Invalid channel connection index %d", index);
+		checked_close(fd);
+		return -1;
+	}
+	struct channel_stripe *s = &st->s[index - 1];
+	if (s->fd != -1) {
+		/* Part of a block may already have been written to the old
+		 * connection */
+		wp_error("Extra channel connection %d is already connected",
+				index);
+		checked_close(fd);
+		return -1;
+	}
+	if (set_nonblocking(fd) == -1) {
+		wp_error("Error making extra channel connection nonblocking: %s",
+				strerror(errno));
+		checked_close(fd);
+		return -1;
+	}
+	s->fd = fd;
+	s->recv_closed = false;
+	st->count++;
+	wp_debug("Added extra channel connection %d", index);
+	return 0;
+}
+
+void reset_stripes(struct channel_stripes *st, struct transfer_queue *td)
+{
+	for (int i = 0; i < td->end; i++) {
+		if (is_stripe_ref(td, i)) {
+			restore_block(td, i);
+		}
+	}
+	for (int i = 0; i < MAX_CHANNEL_STREAMS - 1; i++) {
+		close_stripe(&st->s[i]);
+	}
+	st->count = 0;
+}
+
+int stripe_transfers(struct channel_stripes *st, struct transfer_queue *td)
+{
+	if (st->count == 0) {
+		return 0;
+	}
+	/* Unwritten data on the main channel, up to the current block */
+	size_t main_load = 0;
+	int first = td->start;
+	if (td->partial_write_amt > 0) {
+		main_load = td->vecs[first].iov_len - td->partial_write_amt;
+		first++;
+	}
+	int nmoved = 0;
+	for (int i = first; i < td->end; i++) {
+		size_t len = td->vecs[i].iov_len;
+		if (td->meta[i].lane != LANE_BULK || len < STRIPE_MIN_BLOCK) {
+			main_load += len;
+			continue;
+		}
+		int best = -1;
+		for (int k = 0; k < MAX_CHANNEL_STREAMS - 1; k++) {
+			if (st->s[k].fd == -1) {
+				continue;
+			}
+			if (best == -1 || st->s[k].unwritten_bytes <
+							  st->s[best].unwritten_bytes) {
+				best = k;
+			}
+		}
+		if (best == -1) {
+			break;
+		}
+		struct channel_stripe *s = &st->s[best];
+		if (s->unwritten_bytes >= main_load) {
+			main_load += len;
+			continue;
+		}
+		struct striped_block *blk = malloc(sizeof(*blk));
+		if (!blk || buf_ensure_size(s->nblocks + 1, sizeof(blk),
+					    &s->blocks_size,
+					    (void **)&s->blocks) == -1) {
+			wp_error("Failed to allocate space to stripe a block");
+			free(blk);
+			break;
+		}
+		blk->ref.size_and_type =
+				transfer_header(sizeof(blk->ref), WMSG_STRIPE);
+		blk->ref.stripe = (uint32_t)(best + 1);
+		blk->data = td->vecs[i];
+		blk->static_alloc = td->meta[i].static_alloc;
+		blk->arena_alloc = td->meta[i].arena_alloc;
+		s->blocks[s->nblocks++] = blk;
+		s->unwritten_bytes += len;
+
+		td->vecs[i].iov_base = &blk->ref;
+		td->vecs[i].iov_len = sizeof(blk->ref);
+		td->meta[i].static_alloc = true;
+		td->meta[i].arena_alloc = false;
+		/* Priority messages must not be moved ahead of the reference,
+		 * as that would renumber it */
+		td->meta[i].lane = LANE_CONTROL;
+		main_load += sizeof(blk->ref);
+		nmoved++;
+	}
+	return nmoved;
+}
+
+void release_striped_blocks(struct channel_stripes *st,
+		struct transfer_queue *td, uint32_t inclusive_cutoff)
+{
+	int nreleased[MAX_CHANNEL_STREAMS - 1] = {0};
+	for (int i = 0; i < td->start; i++) {
+		if (!msgno_gt(inclusive_cutoff, td->meta[i].msgno)) {
+			break;
+		}
+		if (!is_stripe_ref(td, i)) {
+			continue;
+		}
+		const struct striped_block *blk = td->vecs[i].iov_base;
+		int k = (int)blk->ref.stripe - 1;
+		struct channel_stripe *s = &st->s[k];
+		/* Blocks are acknowledged in the order they were assigned */
+		if (nreleased[k] >= s->nwritten ||
+				s->blocks[nreleased[k]] != blk) {
+			wp_error("Acknowledged block was not written to extra connection %d",
+					k + 1);
+			continue;
+		}
+		nreleased[k]++;
+		restore_block(td, i);
+	}
+	for (int k = 0; k < MAX_CHANNEL_STREAMS - 1; k++) {
+		struct channel_stripe *s = &st->s[k];
+		if (nreleased[k] == 0) {
+			continue;
+		}
+		memmove(s->blocks, s->blocks + nreleased[k],
+				sizeof(s->blocks[0]) *
+						(size_t)(s->nblocks - nreleased[k]));
+		s->nblocks -= nreleased[k];
+		s->nwritten -= nreleased[k];
+	}
+}
+
+int fill_stripe_pollfds(const struct channel_stripes *st, struct pollfd *pfds)
+{
+	int n = 0;
+	for (int k = 0; k < MAX_CHANNEL_STREAMS - 1; k++) {
+		const struct channel_stripe *s = &st->s[k];
+		bool writable = s->nwritten < s->nblocks;
+		/* A hung up connection would always be reported as ready */
+		if (s->fd == -1 || (s->recv_closed && !writable)) {
+			continue;
+		}
+		pfds[n].fd = s->fd;
+		pfds[n].events = (s->recv_closed ? 0 : POLLIN) |
+				 (writable ? POLLOUT : 0);
+		pfds[n].revents = 0;
+		n++;
+	}
+	return n;
+}
+
+static int write_stripe(struct channel_stripe *s)
+{
+	while (s->nwritten < s->nblocks) {
+		struct iovec vecs[STRIPE_MAX_IOV];
+		int nvecs = 0;
+		for (int j = s->nwritten;
+				j < s->nblocks && nvecs < STRIPE_MAX_IOV; j++) {
+			vecs[nvecs++] = s->blocks[j]->data;
+		}
+		vecs[0].iov_base = (char *)vecs[0].iov_base +
+				   s->partial_write_amt;
+		vecs[0].iov_len -= s->partial_write_amt;
+
+		ssize_t wr = writev(s->fd, vecs, nvecs);
+		if (wr == -1 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
+			return 0;
+		} else if (wr == -1 &&
+				(errno == ECONNRESET || errno == EPIPE)) {
+			wp_debug("Extra channel connection closed");
+			return ERR_DISCONN;
+		} else if (wr == -1) {
+			wp_error("Extra channel connection write failure: %s",
+					strerror(errno));
+			return ERR_FATAL;
+		}
+		size_t uwr = (size_t)wr;
+		s->unwritten_bytes -= uwr;
+		while (uwr > 0) {
+			size_t left = s->blocks[s->nwritten]->data.iov_len -
+				      s->partial_write_amt;
+			if (left > uwr) {
+				s->partial_write_amt += uwr;
+				uwr = 0;
+			} else {
+				s->partial_write_amt = 0;
+				s->nwritten++;
+				uwr -= left;
+			}
+		}
+	}
+	return 0;
+}
+
+int write_stripes(struct channel_stripes *st)
+{
+	for (int k = 0; k < MAX_CHANNEL_STREAMS - 1; k++) {
+		if (st->s[k].fd == -1) {
+			continue;
+		}
+		int ret = write_stripe(&st->s[k]);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+	return 0;
+}
+
+/* Returns 1 if data was read, 0 if not, or ERR_NOMEM/ERR_FATAL */
+static int read_stripe(struct channel_stripe *s)
+{
+	if (s->recv_start == s->recv_end) {
+		s->recv_start = 0;
+		s->recv_end = 0;
+	} else if (s->recv_start > 0) {
+		memmove(s->recv_buffer, s->recv_buffer + s->recv_start,
+				s->recv_end - s->recv_start);
+		s->recv_end -= s->recv_start;
+		s->recv_start = 0;
+	}
+	size_t goal = s->recv_end + STRIPE_READ_SIZE;
+	if (s->recv_end >= sizeof(uint32_t)) {
+		size_t msg_size = alignz(
+				transfer_size(*(uint32_t *)s->recv_buffer), 4);
+		goal = maxu(goal, msg_size);
+	}
+	int recvsz = (int)s->recv_size;
+	if (buf_ensure_size((int)goal, 1, &recvsz,
+			    (void **)&s->recv_buffer) == -1) {
+		wp_error("Allocation failure, resizing extra connection receive buffer failed");
+		return ERR_NOMEM;
+	}
+	s->recv_size = (size_t)recvsz;
+
+	ssize_t r = read(s->fd, s->recv_buffer + s->recv_end,
+			s->recv_size - s->recv_end);
+	if (r == -1 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
+		return 0;
+	} else if (r == 0 || (r == -1 && errno == ECONNRESET)) {
+		/* This is only an error if a message was still expected */
+		wp_debug("Extra channel connection closed");
+		s->recv_closed = true;
+		return 1;
+	} else if (r == -1) {
+		wp_error("Extra channel connection read failure: %s",
+				strerror(errno));
+		return ERR_FATAL;
+	}
+	s->recv_end += (size_t)r;
+	return 1;
+}
+
+int advance_stripes(struct channel_stripes *st, const struct pollfd *pfds,
+		int npfds)
+{
+	int ret = 0;
+	for (int i = 0; i < npfds; i++) {
+		struct channel_stripe *s = NULL;
+		for (int k = 0; k < MAX_CHANNEL_STREAMS - 1; k++) {
+			if (st->s[k].fd != -1 && st->s[k].fd == pfds[i].fd) {
+				s = &st->s[k];
+			}
+		}
+		if (!s) {
+			continue;
+		}
+		if ((pfds[i].revents & (POLLIN | POLLHUP)) && !s->recv_closed) {
+			int r = read_stripe(s);
+			if (r < 0) {
+				return r;
+			}
+			ret |= r;
+		}
+		if (pfds[i].revents & POLLOUT) {
+			int r = write_stripe(s);
+			if (r < 0) {
+				return r;
+			}
+		}
+	}
+	return ret;
+}
+
+char *peek_striped_message(struct channel_stripes *st, int index, bool *closed)
+{
+	struct channel_stripe *s = &st->s[index - 1];
+	*closed = false;
+	size_t avail = s->recv_end - s->recv_start;
+	if (avail >= sizeof(uint32_t)) {
+		char *msg = s->recv_buffer + s->recv_start;
+		size_t sz = alignz(transfer_size(*(uint32_t *)msg), 4);
+		if (sz < sizeof(uint32_t)) {
+			wp_error("Encountered malformed zero size packet on extra connection %d",
+					index);
+			*closed = true;
+			return NULL;
+		}
+		if (sz <= avail) {
+			return msg;
+		}
+	}
+	*closed = s->recv_closed;
+	return NULL;
+}
+
+bool stripe_may_receive(const struct channel_stripes *st, int index)
+{
+	if (index < 1 || index > st->max_index) {
+		return false;
+	}
+	return st->s[index - 1].fd != -1 || st->may_connect;
+}
+
+void pop_striped_message(struct channel_stripes *st, int index)
+{
+	struct channel_stripe *s = &st->s[index - 1];
+	s->recv_start += alignz(
+			transfer_size(*(uint32_t *)(s->recv_buffer +
+							s->recv_start)),
+			4);
+}
@@ -0,0 +1,495 @@
+/*
+ * Copyright © 2019 Manuel Stoeckl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "main.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef HAS_IO_URING
+
+struct uring_poller *create_uring_poller(void)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+void destroy_uring_poller(struct uring_poller *p) { (void)p; }
+int uring_poll(struct uring_poller *p, struct pollfd *pfds, int nfds,
+		int timeout_ms, bool reset)
+{
+	(void)p;
+	(void)reset;
+	return poll(pfds, (nfds_t)nfds, timeout_ms);
+}
+
+#else /* HAS_IO_URING */
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/* The ring only needs to hold the requests made by a single call to
+ * uring_poll; if more are needed, they are submitted in batches. */
+#define URING_ENTRIES 256
+/* user_data for POLL_REMOVE requests, whose completions are ignored */
+#define URING_REMOVE_TAG UINT64_MAX
+
+struct uring_slot {
+	int fd;
+	short events;
+	short revents;
+	short want;
+	/* Distinguishes the current poll request for `fd` from any earlier
+	 * (cancelled) ones whose completions may still arrive */
+	uint32_t tag;
+	bool armed;
+	bool seen;
+};
+
+struct uring_poller {
+	int ring_fd;
+	void *ring;
+	size_t ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	uint32_t *sq_head, *sq_tail, *sq_array;
+	uint32_t sq_mask, sq_entries;
+	uint32_t *cq_head, *cq_tail;
+	uint32_t cq_mask;
+	struct io_uring_cqe *cqes;
+	/* number of sqes filled in but not yet submitted */
+	uint32_t sq_pending;
+	/* number of poll requests whose completion has not been read */
+	uint32_t polls_inflight;
+
+	struct uring_slot *slots;
+	int nslots, slots_size;
+	uint32_t next_tag;
+};
+
+static uint32_t ring_load(const uint32_t *ptr)
+{
+	return atomic_load_explicit(
+			(const _Atomic uint32_t *)ptr, memory_order_acquire);
+}
+static void ring_store(uint32_t *ptr, uint32_t value)
+{
+	atomic_store_explicit(
+			(_Atomic uint32_t *)ptr, value, memory_order_release);
+}
+
+struct uring_poller *create_uring_poller(void)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int ring_fd = (int)syscall(SYS_io_uring_setup, URING_ENTRIES, &params);
+	if (ring_fd == -1) {
+		return NULL;
+	}
+	uint32_t needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+			  IORING_FEAT_EXT_ARG;
+	if ((params.features & needed) != needed) {
+		wp_debug("io_uring lacks needed features: %x of %x",
+				params.features & needed, needed);
+		checked_close(ring_fd);
+		errno = ENOTSUP;
+		return NULL;
+	}
+
+	struct uring_poller *p = calloc(1, sizeof(struct uring_poller));
+	if (!p) {
+		checked_close(ring_fd);
+		errno = ENOMEM;
+		return NULL;
+	}
+	p->ring_fd = ring_fd;
+
+	size_t sq_size = params.sq_off.array +
+			 params.sq_entries * sizeof(uint32_t);
+	size_t cq_size = params.cq_off.cqes +
+			 params.cq_entries * sizeof(struct io_uring_cqe);
+	p->ring_size = sq_size > cq_size ? sq_size : cq_size;
+	p->ring = mmap(NULL, p->ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (p->ring == MAP_FAILED) {
+		goto fail_ring;
+	}
+	p->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	p->sqes = mmap(NULL, p->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if (p->sqes == MAP_FAILED) {
+		goto fail_sqes;
+	}
+
+	char *base = p->ring;
+	p->sq_head = (uint32_t *)(base + params.sq_off.head);
+	p->sq_tail = (uint32_t *)(base + params.sq_off.tail);
+	p->sq_array = (uint32_t *)(base + params.sq_off.array);
+	p->sq_mask = *(uint32_t *)(base + params.sq_off.ring_mask);
+	p->sq_entries = params.sq_entries;
+	p->cq_head = (uint32_t *)(base + params.cq_off.head);
+	p->cq_tail = (uint32_t *)(base + params.cq_off.tail);
+	p->cq_mask = *(uint32_t *)(base + params.cq_off.ring_mask);
+	p->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+	/* Use a fixed sqe for each sq ring slot */
+	for (uint32_t i = 0; i < p->sq_entries; i++) {
+		p->sq_array[i] = i;
+	}
+	return p;
+
+fail_sqes:
+	munmap(p->ring, p->ring_size);
+fail_ring:;
+	int err = errno;
+	checked_close(ring_fd);
+	free(p);
+	errno = err;
+	return NULL;
+}
+
+void destroy_uring_poller(struct uring_poller *p)
+{
+	if (!p) {
+		return;
+	}
+	/* Closing the ring cancels all outstanding requests */
+	munmap(p->sqes, p->sqes_size);
+	munmap(p->ring, p->ring_size);
+	checked_close(p->ring_fd);
+	free(p->slots);
+	free(p);
+}
+
+/* Submit all pending sqes, optionally waiting (with timeout, unless
+ * `timeout` is NULL) for at least one completion. Returns -1 on failure,
+ * in which case errno is set; ETIME indicates that the wait timed out. */
+static int ring_enter(struct uring_poller *p, bool wait,
+		const struct timespec *timeout)
+{
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	if (timeout) {
+		ts.tv_sec = timeout->tv_sec;
+		ts.tv_nsec = timeout->tv_nsec;
+		arg.ts = (uint64_t)(uintptr_t)&ts;
+	}
+	unsigned int flags = IORING_ENTER_EXT_ARG;
+	if (wait) {
+		flags |= IORING_ENTER_GETEVENTS;
+	}
+	while (true) {
+		int r = (int)syscall(SYS_io_uring_enter, p->ring_fd,
+				p->sq_pending, wait ? 1 : 0, flags, &arg,
+				sizeof(arg));
+		if (r == -1) {
+			return -1;
+		}
+		p->sq_pending -= (uint32_t)r;
+		if (p->sq_pending == 0) {
+			return 0;
+		}
+		/* Submission stopped early; retry for the rest */
+	}
+}
+
+static struct io_uring_sqe *get_sqe(struct uring_poller *p)
+{
+	uint32_t tail = *p->sq_tail;
+	if (tail - ring_load(p->sq_head) >= p->sq_entries) {
+		/* Ring full; flush it to make room */
+		if (ring_enter(p, false, NULL) == -1) {
+			return NULL;
+		}
+		if (tail - ring_load(p->sq_head) >= p->sq_entries) {
+			errno = EBUSY;
+			return NULL;
+		}
+	}
+	struct io_uring_sqe *sqe = &p->sqes[tail & p->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+static void push_sqe(struct uring_poller *p)
+{
+	ring_store(p->sq_tail, *p->sq_tail + 1);
+	p->sq_pending++;
+}
+
+static uint64_t slot_user_data(const struct uring_slot *slot)
+{
+	return ((uint64_t)slot->tag << 32) | (uint32_t)slot->fd;
+}
+
+static int arm_slot(struct uring_poller *p, struct uring_slot *slot)
+{
+	struct io_uring_sqe *sqe = get_sqe(p);
+	if (!sqe) {
+		return -1;
+	}
+	slot->tag = p->next_tag++;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = slot->fd;
+	/* Errors and hangups are always reported, as with poll() */
+	sqe->poll_events = (uint16_t)(slot->events | POLLERR | POLLHUP);
+	sqe->user_data = slot_user_data(slot);
+	push_sqe(p);
+	p->polls_inflight++;
+	slot->armed = true;
+	return 0;
+}
+static int disarm_slot(struct uring_poller *p, struct uring_slot *slot)
+{
+	if (!slot->armed) {
+		return 0;
+	}
+	struct io_uring_sqe *sqe = get_sqe(p);
+	if (!sqe) {
+		return -1;
+	}
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = slot_user_data(slot);
+	sqe->user_data = URING_REMOVE_TAG;
+	push_sqe(p);
+	slot->armed = false;
+	return 0;
+}
+
+static struct uring_slot *find_slot(
+		struct uring_poller *p, int fd, int hint)
+{
+	if (hint < p->nslots && p->slots[hint].fd == fd) {
+		return &p->slots[hint];
+	}
+	for (int i = 0; i < p->nslots; i++) {
+		if (p->slots[i].fd == fd) {
+			return &p->slots[i];
+		}
+	}
+	return NULL;
+}
+
+/* Read all available completions, returning the number of slots which
+ * became ready */
+static int reap_completions(struct uring_poller *p)
+{
+	int nready = 0;
+	uint32_t head = *p->cq_head;
+	uint32_t tail = ring_load(p->cq_tail);
+	for (; head != tail; head++) {
+		const struct io_uring_cqe *cqe = &p->cqes[head & p->cq_mask];
+		if (cqe->user_data == URING_REMOVE_TAG) {
+			continue;
+		}
+		p->polls_inflight--;
+		int fd = (int)(uint32_t)cqe->user_data;
+		uint32_t tag = (uint32_t)(cqe->user_data >> 32);
+		struct uring_slot *slot = find_slot(p, fd, 0);
+		if (!slot || !slot->armed || slot->tag != tag) {
+			/* A request that was replaced or cancelled */
+			continue;
+		}
+		slot->armed = false;
+		if (cqe->res == -ECANCELED) {
+			continue;
+		} else if (cqe->res < 0) {
+			slot->revents = cqe->res == -EBADF ? POLLNVAL : POLLERR;
+		} else {
+			slot->revents = (short)(cqe->res &
+						(slot->events | POLLERR |
+								POLLHUP));
+		}
+		if (slot->revents) {
+			nready++;
+		}
+	}
+	ring_store(p->cq_head, head);
+	return nready;
+}
+
+static void timespec_diff(struct timespec *out, const struct timespec *end,
+		const struct timespec *start)
+{
+	out->tv_sec = end->tv_sec - start->tv_sec;
+	out->tv_nsec = end->tv_nsec - start->tv_nsec;
+	if (out->tv_nsec < 0) {
+		out->tv_nsec += 1000000000L;
+		out->tv_sec--;
+	}
+	if (out->tv_sec < 0) {
+		out->tv_sec = 0;
+		out->tv_nsec = 0;
+	}
+}
+
+int uring_poll(struct uring_poller *p, struct pollfd *pfds, int nfds,
+		int timeout_ms, bool reset)
+{
+	if (reset) {
+		for (int i = 0; i < p->nslots; i++) {
+			if (disarm_slot(p, &p->slots[i]) == -1) {
+				return -1;
+			}
+		}
+		p->nslots = 0;
+		/* Pending poll requests hold references to the files they
+		 * poll, so e.g. closing a pipe's write end only produces a
+		 * hangup at the read end once the requests are gone */
+		while (p->polls_inflight > 0) {
+			if (ring_enter(p, true, NULL) == -1) {
+				return -1;
+			}
+			(void)reap_completions(p);
+		}
+	}
+	/* Old slots are dropped only after the new ones are added */
+	int needed = p->nslots + nfds;
+	if (needed > p->slots_size) {
+		int nsize = needed > 2 * p->slots_size ? needed
+						       : 2 * p->slots_size;
+		void *nslots = realloc(
+				p->slots, sizeof(struct uring_slot) *
+							  (size_t)nsize);
+		if (!nslots) {
+			errno = ENOMEM;
+			return -1;
+		}
+		p->slots = nslots;
+		p->slots_size = nsize;
+	}
+
+	/* Match the requested fds to slots; if an fd is listed more than
+	 * once, the union of its events is polled for */
+	for (int i = 0; i < p->nslots; i++) {
+		p->slots[i].want = 0;
+		p->slots[i].seen = false;
+	}
+	for (int i = 0; i < nfds; i++) {
+		pfds[i].revents = 0;
+		if (pfds[i].fd < 0) {
+			continue;
+		}
+		struct uring_slot *slot = find_slot(p, pfds[i].fd, i);
+		if (!slot) {
+			slot = &p->slots[p->nslots++];
+			slot->fd = pfds[i].fd;
+			slot->events = pfds[i].events;
+			slot->want = 0;
+			slot->armed = false;
+		}
+		slot->want |= pfds[i].events;
+		slot->seen = true;
+	}
+	/* Cancel requests for fds which are no longer of interest or whose
+	 * events have changed, and compact the list */
+	int nkeep = 0;
+	for (int i = 0; i < p->nslots; i++) {
+		struct uring_slot *slot = &p->slots[i];
+		if (!slot->seen || slot->want != slot->events) {
+			if (disarm_slot(p, slot) == -1) {
+				return -1;
+			}
+			if (!slot->seen) {
+				continue;
+			}
+			slot->events = slot->want;
+		}
+		p->slots[nkeep++] = *slot;
+	}
+	p->nslots = nkeep;
+
+	/* Conditions reported by the previous call are re-checked by new
+	 * poll requests, making the results level-triggered like poll() */
+	for (int i = 0; i < p->nslots; i++) {
+		p->slots[i].revents = 0;
+		if (!p->slots[i].armed && arm_slot(p, &p->slots[i]) == -1) {
+			return -1;
+		}
+	}
+
+	struct timespec start, deadline;
+	if (timeout_ms > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		deadline.tv_sec = start.tv_sec + timeout_ms / 1000;
+		deadline.tv_nsec = start.tv_nsec + (timeout_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_nsec -= 1000000000L;
+			deadline.tv_sec++;
+		}
+	}
+	int nready = 0;
+	bool wait = false;
+	while (true) {
+		struct timespec remaining;
+		const struct timespec *tsp = NULL;
+		if (wait && timeout_ms > 0) {
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			timespec_diff(&remaining, &deadline, &now);
+			tsp = &remaining;
+		}
+		bool timed_out = false;
+		if (ring_enter(p, wait, tsp) == -1) {
+			if (errno != ETIME) {
+				return -1;
+			}
+			timed_out = true;
+		}
+		nready += reap_completions(p);
+		if (nready > 0 || timeout_ms == 0 || timed_out) {
+			break;
+		}
+		if (tsp && tsp->tv_sec == 0 && tsp->tv_nsec == 0) {
+			break;
+		}
+		/* Only completions for cancelled requests arrived, or the
+		 * new requests were just submitted; wait for more */
+		wait = true;
+	}
+
+	int count = 0;
+	for (int i = 0; i < nfds; i++) {
+		if (pfds[i].fd < 0) {
+			continue;
+		}
+		struct uring_slot *slot = find_slot(p, pfds[i].fd, i);
+		pfds[i].revents = (short)(slot->revents & (pfds[i].events |
+								  POLLERR |
+								  POLLHUP |
+								  POLLNVAL));
+		if (pfds[i].revents) {
+			count++;
+		}
+	}
+	return count;
+}
+
+#endif /* HAS_IO_URING */
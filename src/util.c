@@ -172,7 +172,7 @@ bool is_utf8(const char *str)
 	return true;
 }
 
-bool shutdown_flag = false;
+atomic_bool shutdown_flag = false;
 uint64_t inherited_fds[4] = {0, 0, 0, 0};
 void handle_sigint(int sig)
 {
@@ -512,7 +512,9 @@ size_t print_wrapped_error(char *dest, size_t dest_space, const char *message)
 	return msg_len + 4;
 }
 
-int send_one_fd(int socket, int fd)
+/* The payload byte is 0 for a replacement channel connection, or the index
+ * of an extra channel connection */
+static int send_fd_with_tag(int socket, int fd, uint8_t tag)
 {
 	union {
 		char buf[CMSG_SPACE(sizeof(int))];
@@ -527,8 +529,7 @@ int send_one_fd(int socket, int fd)
 
 	struct iovec the_iovec;
 	the_iovec.iov_len = 1;
-	uint8_t dummy_data = 1;
-	the_iovec.iov_base = &dummy_data;
+	the_iovec.iov_base = &tag;
 	struct msghdr msg;
 	msg.msg_name = NULL;
 	msg.msg_namelen = 0;
@@ -541,6 +542,14 @@ int send_one_fd(int socket, int fd)
 	return (int)sendmsg(socket, &msg, 0);
 }
 
+int send_one_fd(int socket, int fd) { return send_fd_with_tag(socket, fd, 0); }
+
+int send_stripe_fd(int socket, int fd, int index, bool last_use)
+{
+	return send_fd_with_tag(socket, fd,
+			(uint8_t)(index | (last_use ? LINK_LAST_USE : 0)));
+}
+
 bool wait_for_pid_and_clean(pid_t *target_pid, int *status, int options,
 		struct conn_map *map)
 {
@@ -605,6 +614,13 @@ int buf_ensure_size(int count, size_t obj_size, int *space, void **data)
 	return 0;
 }
 
+uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000uLL + (uint64_t)ts.tv_nsec;
+}
+
 static const char *const wmsg_types[] = {
 		"WMSG_PROTOCOL",
 		"WMSG_INJECT_RIDS",
@@ -627,6 +643,9 @@ static const char *const wmsg_types[] = {
 		"WMSG_CLOSE",
 		"WMSG_OPEN_DMAVID_SRC_V2",
 		"WMSG_OPEN_DMAVID_DST_V2",
+		"WMSG_BUFFER_COPY",
+		"WMSG_COMPRESSION_DICT",
+		"WMSG_STRIPE",
 };
 const char *wmsg_type_to_str(enum wmsg_type tp)
 {
@@ -656,6 +675,21 @@ int transfer_ensure_size(struct transfer_queue *transfers, int count)
 	return 0;
 }
 
+static enum transfer_lane get_message_lane(const void *data)
+{
+	switch (transfer_type(*(const uint32_t *)data)) {
+	case WMSG_BUFFER_FILL:
+	case WMSG_BUFFER_DIFF:
+	case WMSG_BUFFER_COPY:
+	case WMSG_PIPE_TRANSFER:
+	case WMSG_SEND_DMAVID_PACKET:
+	case WMSG_COMPRESSION_DICT:
+		return LANE_BULK;
+	default:
+		return LANE_CONTROL;
+	}
+}
+
 int transfer_add(struct transfer_queue *w, size_t size, void *data)
 {
 	if (size == 0) {
@@ -668,42 +702,168 @@ int transfer_add(struct transfer_queue *w, size_t size, void *data)
 	w->vecs[w->end].iov_len = size;
 	w->vecs[w->end].iov_base = data;
 	w->meta[w->end].msgno = w->last_msgno;
+	w->meta[w->end].lane = get_message_lane(data);
 	w->meta[w->end].static_alloc = false;
+	w->meta[w->end].arena_alloc = false;
+	w->meta[w->end].zc_pending = false;
 	w->end++;
 	w->last_msgno++;
 	return 0;
 }
 
-void transfer_async_add(struct thread_msg_recv_buf *q, void *data, size_t sz)
+int transfer_add_arena(struct transfer_queue *w, size_t size, void *data)
 {
-	struct iovec vec;
-	vec.iov_len = sz;
-	vec.iov_base = data;
-	pthread_mutex_lock(&q->lock);
-	q->data[q->zone_end++] = vec;
-	pthread_mutex_unlock(&q->lock);
+	int end = w->end;
+	if (transfer_add(w, size, data) == -1) {
+		return -1;
+	}
+	if (w->end > end) {
+		w->meta[end].arena_alloc = true;
+	}
+	return 0;
 }
 
-int transfer_load_async(struct transfer_queue *w)
+void *transfer_block_alloc(struct transfer_queue *w, size_t size)
+{
+	if (!w->arena) {
+		w->arena = create_transfer_arena();
+		if (!w->arena) {
+			return NULL;
+		}
+	}
+	return arena_alloc(w->arena, size);
+}
+
+void transfer_block_free(struct transfer_queue *w, int i)
 {
-	pthread_mutex_lock(&w->async_recv_queue.lock);
-	int zstart = w->async_recv_queue.zone_start;
-	int zend = w->async_recv_queue.zone_end;
-	w->async_recv_queue.zone_start = zend;
-	pthread_mutex_unlock(&w->async_recv_queue.lock);
-
-	for (int i = zstart; i < zend; i++) {
-		struct iovec v = w->async_recv_queue.data[i];
-		memset(&w->async_recv_queue.data[i], 0, sizeof(struct iovec));
-		if (v.iov_len == 0 || v.iov_base == NULL) {
-			wp_error("Unexpected empty message");
+	if (w->meta[i].static_alloc) {
+		return;
+	}
+	if (w->meta[i].arena_alloc) {
+		arena_free(w->vecs[i].iov_base);
+	} else {
+		free(w->vecs[i].iov_base);
+	}
+}
+
+int transfer_add_priority(
+		struct transfer_queue *w, size_t size, void *data, bool arena)
+{
+	int end = w->end;
+	if (transfer_add(w, size, data) == -1) {
+		return -1;
+	}
+	if (w->end > end) {
+		w->meta[end].lane = LANE_PRIORITY;
+		w->meta[end].arena_alloc = arena;
+	}
+	return 0;
+}
+
+int transfer_reorder_lanes(struct transfer_queue *w)
+{
+	/* A message which has been partially written must be completed
+	 * before any other can be sent */
+	int first = w->partial_write_amt > 0 ? w->start + 1 : w->start;
+	int nmoved = 0;
+	for (int i = first + 1; i < w->end; i++) {
+		if (w->meta[i].lane != LANE_PRIORITY) {
 			continue;
 		}
+		int j = i;
+		while (j > first && w->meta[j - 1].lane == LANE_BULK) {
+			j--;
+		}
+		if (j == i) {
+			continue;
+		}
+		/* Messages in the bulk lane are always counted, so the
+		 * numbers of messages j..i are consecutive, and can be
+		 * reassigned in the new order */
+		uint32_t msgno = w->meta[j].msgno;
+		struct iovec vec = w->vecs[i];
+		struct transfer_block_meta meta = w->meta[i];
+		memmove(w->vecs + j + 1, w->vecs + j,
+				sizeof(w->vecs[0]) * (size_t)(i - j));
+		memmove(w->meta + j + 1, w->meta + j,
+				sizeof(w->meta[0]) * (size_t)(i - j));
+		w->vecs[j] = vec;
+		w->meta[j] = meta;
+		for (int k = j; k <= i; k++) {
+			w->meta[k].msgno = msgno++;
+		}
+		nmoved++;
+	}
+	return nmoved;
+}
+
+void transfer_async_add(struct thread_msg_recv_buf *q, void *data, size_t sz,
+		bool arena)
+{
+	int idx = atomic_fetch_add_explicit(
+			&q->zone_end, 1, memory_order_relaxed);
+	if (idx >= q->size) {
+		wp_error("Async message queue overflow, dropping message");
+		if (arena) {
+			arena_free(data);
+		} else {
+			free(data);
+		}
+		return;
+	}
+	q->slots[idx].size = sz;
+	q->slots[idx].arena = arena;
+	/* Publish the entry; pairs with the acquire in transfer_load_async */
+	atomic_store_explicit(&q->slots[idx].data, data, memory_order_release);
+}
+
+int transfer_async_prepare(struct thread_msg_recv_buf *q, int count)
+{
+	if (q->zone_start != atomic_load(&q->zone_end)) {
+		wp_error("Some async messages not yet sent");
+	}
+	q->zone_start = 0;
+	atomic_store(&q->zone_end, 0);
+	if (buf_ensure_size(count, sizeof(struct thread_msg_slot), &q->size,
+			    (void **)&q->slots) == -1) {
+		return -1;
+	}
+	/* Unfilled entries must read as empty */
+	if (count > 0) {
+		memset(q->slots, 0,
+				sizeof(struct thread_msg_slot) * (size_t)count);
+	}
+	return 0;
+}
+
+int transfer_load_async(struct transfer_queue *w)
+{
+	struct thread_msg_recv_buf *q = &w->async_recv_queue;
+	int zend = min(atomic_load_explicit(&q->zone_end, memory_order_relaxed),
+			q->size);
+	for (; q->zone_start < zend; q->zone_start++) {
+		struct thread_msg_slot *slot = &q->slots[q->zone_start];
+		void *data = atomic_load_explicit(
+				&slot->data, memory_order_acquire);
+		if (!data) {
+			/* Claimed but not yet filled; stop here to preserve the
+			 * claim order */
+			break;
+		}
+		atomic_store_explicit(&slot->data, NULL, memory_order_relaxed);
+
 		/* Only fill/diff messages are received async, so msgno
 		 * is always incremented */
-		if (transfer_add(w, v.iov_len, v.iov_base) == -1) {
+		int ret = slot->arena ? transfer_add_arena(w, slot->size, data)
+				      : transfer_add(w, slot->size, data);
+		if (ret == -1) {
 			wp_error("Failed to add message to transfer queue");
-			pthread_mutex_unlock(&w->async_recv_queue.lock);
+			if (slot->arena) {
+				arena_free(data);
+			} else {
+				free(data);
+			}
+			q->zone_start++;
 			return -1;
 		}
 	}
@@ -712,19 +872,23 @@ int transfer_load_async(struct transfer_queue *w)
 
 void cleanup_transfer_queue(struct transfer_queue *td)
 {
-	for (int i = td->async_recv_queue.zone_start;
-			i < td->async_recv_queue.zone_end; i++) {
-		free(td->async_recv_queue.data[i].iov_base);
+	struct thread_msg_recv_buf *q = &td->async_recv_queue;
+	int zend = min(atomic_load(&q->zone_end), q->size);
+	for (int i = q->zone_start; i < zend; i++) {
+		void *data = atomic_load(&q->slots[i].data);
+		if (q->slots[i].arena) {
+			arena_free(data);
+		} else {
+			free(data);
+		}
 	}
-	pthread_mutex_destroy(&td->async_recv_queue.lock);
-	free(td->async_recv_queue.data);
+	free(q->slots);
 	for (int i = 0; i < td->end; i++) {
-		if (!td->meta[i].static_alloc) {
-			free(td->vecs[i].iov_base);
-		}
+		transfer_block_free(td, i);
 	}
 	free(td->vecs);
 	free(td->meta);
+	release_transfer_arena(td->arena);
 }
 
 #ifdef HAS_VSOCK
@@ -27,6 +27,7 @@
 
 #include <assert.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -44,8 +45,9 @@
 #define DTRACE_PROBE3(provider, probe, parm1, parm2, parm3) (void)0
 #endif
 
-// On SIGINT, this is set to true. The main program should then cleanup ASAP
-extern bool shutdown_flag;
+// On SIGINT, this is set to true. The main program should then cleanup ASAP.
+// (Atomic, as connection threads read it while the main thread is signalled)
+extern atomic_bool shutdown_flag;
 extern uint64_t inherited_fds[4];
 
 void handle_sigint(int sig);
@@ -190,6 +192,18 @@ size_t print_wrapped_error(char *dest, size_t dest_space, const char *message);
  * depending on its flags and local capabilities. */
 #define CONN_NO_DMABUF_SUPPORT (0x1u << 2)
 
+/** This is set for the extra connections of a session which is striped over
+ * several channel connections; they share the key of the initial connection.
+ */
+#define CONN_STRIPE_BIT (0x1u << 3)
+/** In the initial connection token, the number of extra connections that the
+ * waypipe-server will open; in the token of an extra connection, its index
+ * (from 1) */
+#define CONN_STREAMS_SHIFT 4
+#define CONN_STREAMS_MASK (0x7u << CONN_STREAMS_SHIFT)
+/** Maximum total number of channel connections in a session */
+#define MAX_CHANNEL_STREAMS 8
+
 /** Indicate which compression format the waypipe-server can accept. For
  * backwards compatibility, if none of these flags is set, assume the server and
  * client match. */
@@ -218,6 +232,13 @@ struct conn_addr {
 	struct connection_token token;
 	pid_t pid;
 	int linkfd;
+	/* For a connection which is not reconnectable, the number of extra
+	 * channel connections still to be forwarded; once it is zero, the link
+	 * is closed */
+	int stripes_left;
+	/* If set, the connection is run by a thread of this process (with
+	 * `pid` zero), and the link is kept until it ends */
+	bool threaded;
 };
 struct conn_map {
 	struct conn_addr *data;
@@ -229,8 +250,17 @@ struct conn_map {
  * itself. If count < space, resize the list and update space. Returns -1 on
  * allocation failure */
 int buf_ensure_size(int count, size_t obj_size, int *space, void **data);
+
+/** The current time of the monotonic clock, in nanoseconds */
+uint64_t monotonic_ns(void);
 /** sendmsg a file descriptor over socket */
 int send_one_fd(int socket, int fd);
+/** Like send_one_fd, but for the extra channel connection with the given
+ * index, which is sent along with the fd. If `last_use`, the index is marked
+ * with LINK_LAST_USE, to indicate that nothing more will be sent and the link
+ * may be closed. */
+int send_stripe_fd(int socket, int fd, int index, bool last_use);
+#define LINK_LAST_USE 0x80
 
 enum log_level { WP_DEBUG = 0, WP_ERROR = 1 };
 typedef void (*log_handler_func_t)(const char *file, int line,
@@ -356,6 +386,16 @@ enum wmsg_type {
 	 * to produce/consume video frames. Format: \ref wmsg_open_dmavid */
 	WMSG_OPEN_DMAVID_SRC_V2,
 	WMSG_OPEN_DMAVID_DST_V2,
+	/** Copy regions of other files (as of the end of all preceding
+	 * updates) into the file. Format: \ref wmsg_buffer_copy */
+	WMSG_BUFFER_COPY,
+	/** Use the provided dictionary to decompress all following buffer
+	 * updates. Format: the header, followed by the dictionary */
+	WMSG_COMPRESSION_DICT,
+	/** Stands in for the next message sent over the given extra channel
+	 * connection, which should be handled in its place. Format: \ref
+	 * wmsg_stripe */
+	WMSG_STRIPE,
 };
 const char *wmsg_type_to_str(enum wmsg_type tp);
 bool wmsg_type_is_known(enum wmsg_type tp);
@@ -407,6 +447,20 @@ struct wmsg_buffer_diff {
 };
 static_assert(sizeof(struct wmsg_buffer_diff) == 16, "size check");
 
+struct wmsg_buffer_copy {
+	uint32_t size_and_type;
+	int32_t remote_id;
+	/* following this, a list of struct wmsg_copy_range */
+};
+static_assert(sizeof(struct wmsg_buffer_copy) == 8, "size check");
+struct wmsg_copy_range {
+	int32_t source_id; /**< remote id of the file to copy from */
+	uint32_t source_start;
+	uint32_t dest_start;
+	uint32_t length;
+};
+static_assert(sizeof(struct wmsg_copy_range) == 16, "size check");
+
 struct wmsg_basic {
 	uint32_t size_and_type;
 	int32_t remote_id;
@@ -422,6 +476,12 @@ struct wmsg_restart {
 	uint32_t last_ack_received;
 };
 static_assert(sizeof(struct wmsg_restart) == 8, "size check");
+struct wmsg_stripe {
+	uint32_t size_and_type;
+	/* Index of the extra connection, from 1 */
+	uint32_t stripe;
+};
+static_assert(sizeof(struct wmsg_stripe) == 8, "size check");
 
 /** size: the number of bytes in the message, /excluding/ trailing padding. */
 static inline uint32_t transfer_header(size_t size, enum wmsg_type type)
@@ -437,28 +497,94 @@ static inline enum wmsg_type transfer_type(uint32_t header)
 	return (enum wmsg_type)(header & ((1u << 5) - 1));
 }
 
+struct arena_chunk;
+/** Transfer blocks are carved in sequence from the chunks of an arena, which
+ * belongs to one thread. Blocks may be freed from any thread; once all the
+ * blocks of a chunk have been freed, it is returned to the arena to be
+ * reused, so that steady state traffic does not need to call malloc. */
+struct transfer_arena {
+	/** The chunk being filled, and unfilled chunks ready for reuse; only
+	 * used by the owning thread */
+	struct arena_chunk *current;
+	struct arena_chunk *spare;
+	int nspare;
+	/** Chunks whose blocks have all been freed, pushed by any thread */
+	struct arena_chunk *_Atomic returned;
+	/** Set once the owner has released the arena */
+	atomic_bool orphaned;
+	/** One reference for the owner, and one for each existing chunk */
+	atomic_int refs;
+	/** The number of chunks allocated over the arena's lifetime */
+	int chunks_made;
+};
+
+/** Create an arena, owned by the calling thread. Returns NULL on failure */
+struct transfer_arena *create_transfer_arena(void);
+/** Called by the owning thread when it will allocate no more blocks. The
+ * arena is freed when its last block is. */
+void release_transfer_arena(struct transfer_arena *arena);
+/** Allocate a block of `size` bytes, aligned to 16 bytes. Only the owning
+ * thread may call this. Returns NULL on failure. */
+void *arena_alloc(struct transfer_arena *arena, size_t size);
+/** Reduce the size of the block most recently allocated from the arena,
+ * so the space after it can be used for the next block */
+void arena_shrink(struct transfer_arena *arena, void *block, size_t size);
+/** Free a block allocated from any arena. This may be called from any
+ * thread. */
+void arena_free(void *block);
+
+/** An entry of a thread_msg_recv_buf. `data` is written last, and is nonnull
+ * iff the entry is ready to be read. If `arena`, the data was allocated
+ * using arena_alloc. */
+struct thread_msg_slot {
+	size_t size;
+	bool arena;
+	void *_Atomic data;
+};
 /** Worker tasks write their resulting messages to this receive buffer,
  * and the main thread periodically checks the messages and appends the results
- * to the main thread. */
+ * to the main thread. This is a lock-free bounded multi-producer, single
+ * consumer queue: producers claim slots by incrementing zone_end, and the
+ * consumer reads slots in claim order, stopping at the first one which has
+ * been claimed but not yet filled. */
 struct thread_msg_recv_buf {
-	// TODO: make this lock free, using the fact that valid iovecs have
-	// nonzero fields
-	struct iovec *data;
-	/** [zone_start, zone_end] contains the set of entries which might
-	 * contain data */
-	int zone_start, zone_end, size;
-	pthread_mutex_t lock;
+	struct thread_msg_slot *slots;
+	/** [zone_start, zone_end) contains the set of entries which have been
+	 * claimed but not yet read; zone_start is only used by the consumer */
+	int zone_start;
+	atomic_int zone_end;
+	int size;
 };
 static inline int msgno_gt(uint32_t a, uint32_t b)
 {
 	return !((a - b) & (1u << 31));
 }
 
+/** The lanes into which messages on the channel are sorted. Messages in the
+ * same lane are written in the order they were queued; see
+ * \ref transfer_reorder_lanes */
+enum transfer_lane {
+	/** Must follow every message queued before it */
+	LANE_CONTROL,
+	/** Buffer and pipe contents */
+	LANE_BULK,
+	/** May be written before any bulk messages queued before it, but not
+	 * before messages in the control lane */
+	LANE_PRIORITY,
+};
+
 struct transfer_block_meta {
 	/** Indicating to which message the corresponding data block belongs. */
 	uint32_t msgno;
+	enum transfer_lane lane;
 	/** If true, data is not heap allocated */
 	bool static_alloc;
+	/** If true, data was allocated with arena_alloc */
+	bool arena_alloc;
+	/** If true, the block was (partially) sent without copying, and must
+	 * not be freed until the zero-copy send numbered `zc_seq` completes */
+	bool zc_pending;
+	uint32_t zc_seq;
 };
 
 /** A queue of data blocks to be written to the channel. This should only
@@ -478,9 +604,23 @@ struct transfer_queue {
 	/** The most recent message number, to be incremented after almost all
 	 * message types */
 	uint32_t last_msgno;
+	/** If true, large blocks are written with zerocopy_writev. zc_sent
+	 * counts such writes on the current channel, and zc_completed is the
+	 * number which the kernel has reported complete */
+	bool zerocopy;
+	uint32_t zc_sent, zc_completed;
+	/** To estimate the channel bandwidth. A write is blocked when the
+	 * channel did not accept all the data offered; the amount accepted by
+	 * the next write, after blocked_since_ns, is added to blocked_bytes
+	 * and the time waited to blocked_ns. */
+	bool write_blocked;
+	uint64_t blocked_since_ns;
+	uint64_t blocked_ns, blocked_bytes;
 	/** Messages added from a worker thread are introduced here, and should
 	 * be periodically copied onto the main queue */
 	struct thread_msg_recv_buf async_recv_queue;
+	/** For messages made by the main thread; created when first needed */
+	struct transfer_arena *arena;
 };
 
 /** Ensure the queue has space for 'count' elements */
@@ -489,28 +629,88 @@ int transfer_ensure_size(struct transfer_queue *transfers, int count);
  * This increments the last_msgno, and thus should not be used
  * for WMSG_ACK_NBLOCKS messages. */
 int transfer_add(struct transfer_queue *transfers, size_t size, void *data);
+/** Like transfer_add, but places the message in the priority lane. It must
+ * not depend on any buffer or pipe contents queued before it. `arena` should
+ * be true iff the data was allocated using arena_alloc. */
+int transfer_add_priority(struct transfer_queue *transfers, size_t size,
+		void *data, bool arena);
+/** Move priority messages which have not yet been written ahead of any bulk
+ * messages directly before them, renumbering the messages moved so that
+ * message numbers still match the order of writing. Returns the number of
+ * messages moved. */
+int transfer_reorder_lanes(struct transfer_queue *transfers);
+/** Allocate a block for a message built by the main thread, which must be
+ * added to the queue using transfer_add_arena. Returns NULL on failure. */
+void *transfer_block_alloc(struct transfer_queue *transfers, size_t size);
+/** Like transfer_add, for blocks from transfer_block_alloc or arena_alloc */
+int transfer_add_arena(
+		struct transfer_queue *transfers, size_t size, void *data);
+/** Free the data of the ith block of the queue, unless it is static */
+void transfer_block_free(struct transfer_queue *transfers, int i);
 /** Destroy the transfer queue, deallocating all attached buffers */
 void cleanup_transfer_queue(struct transfer_queue *transfers);
 /** Move any asynchronously loaded messages to the queue */
 int transfer_load_async(struct transfer_queue *w);
-/** Add a message to the async queue */
-void transfer_async_add(struct thread_msg_recv_buf *q, void *data, size_t sz);
+/** Add a message to the async queue. This may be called from any thread. If
+ * the queue is full, the message is freed and dropped. `arena` should be true
+ * iff the data was allocated using arena_alloc. */
+void transfer_async_add(struct thread_msg_recv_buf *q, void *data, size_t sz,
+		bool arena);
+/** Reset the async queue to hold up to `count` messages. This may only be
+ * called when no producers are active and all messages have been loaded.
+ * Returns -1 on allocation failure. */
+int transfer_async_prepare(struct thread_msg_recv_buf *q, int count);
 
 /* Functions that are unsually platform specific */
 int create_anon_file(void);
 int get_hardware_thread_count(void);
 int get_iov_max(void);
 /** For large allocations only; functions providing aligned-and-zeroed
- * allocations. They return NULL on allocation failure.*/
+ * allocations. They return NULL on allocation failure. Allocations of more
+ * than a few hundred kilobytes get their own mapping, in which pages that are
+ * never written use no memory, and which can grow without copying. */
 void *zeroed_aligned_alloc(size_t bytes, size_t alignment, void **handle);
 void *zeroed_aligned_realloc(size_t old_size_bytes, size_t new_size_bytes,
 		size_t alignment, void *data, void **handle);
 void zeroed_aligned_free(void *data, void **handle);
+/** Whether allocations above a few megabytes should be made with their own
+ * mappings, aligned so that transparent huge pages can back them. Default
+ * true; only affects later allocations. */
+void set_huge_page_policy(bool enabled);
+/** Whether such allocations should first try the system's reserved huge
+ * pages, which are taken in full when mapped and cannot be resized without
+ * copying. Default false; only affects later allocations. */
+void set_reserved_huge_pages(bool enabled);
 /** Returns a file descriptor for the folder than can be fchdir'd to, or
  * -1 on failure, setting errno. If `name` is the empty string, opens the
  * current directory.
  */
 int open_folder(const char *name);
+/** Find the first hole (a range which has never been written, and reads as
+ * zero) in the file at or after `pos` and before `end`, and store its bounds
+ * in [*hole_start, *hole_end). Returns 1 if a hole was found, 0 if there is
+ * none, and -1 setting errno if holes cannot be found for this file. This
+ * changes the file offset. */
+int find_file_hole(int fd, size_t pos, size_t end, size_t *hole_start,
+		size_t *hole_end);
+/** Open the file that `fd` refers to again, read-only, with a file offset of
+ * its own. Returns -1 and sets errno on failure. */
+int reopen_file(int fd);
+/** Ask the kernel to let the pipe `fd` hold at least `size` bytes. Returns
+ * -1 and sets errno if `fd` is not a pipe or this is not supported. */
+int set_pipe_capacity(int fd, int size);
+/** Request that the kernel allow sends on the socket to use MSG_ZEROCOPY.
+ * Returns -1 and sets errno if this is not supported. */
+int enable_zerocopy(int sockfd);
+/** Like writev, but without copying the data; the data must remain unchanged
+ * until read_zerocopy_completions reports that the send has completed. The
+ * n'th successful call on a socket is numbered n-1. */
+ssize_t zerocopy_writev(int sockfd, const struct iovec *vecs, int count);
+/** Read all pending zero-copy send completions for the socket, setting
+ * *completed to one more than the number of the latest completed send,
+ * and *copied if the kernel reported making a copy anyway. Returns -1
+ * and sets errno on failure. */
+int read_zerocopy_completions(int sockfd, uint32_t *completed, bool *copied);
 
 #ifdef HAS_VSOCK
 int connect_to_vsock(uint32_t port, uint32_t cid, bool to_host, int *socket_fd);
@@ -44,6 +44,11 @@ bool video_supports_coding_format(enum video_coding_fmt fmt)
 	(void)fmt;
 	return false;
 }
+int init_hwcontext(struct render_data *rd)
+{
+	(void)rd;
+	return -1;
+}
 void cleanup_hwcontext(struct render_data *rd) { (void)rd; }
 void destroy_video_data(struct shadow_fd *sfd) { (void)sfd; }
 int setup_video_encode(
@@ -60,12 +65,18 @@ int setup_video_decode(struct shadow_fd *sfd, struct render_data *rd)
 	(void)rd;
 	return -1;
 }
-void collect_video_from_mirror(
+void collect_video_from_mirror(struct thread_pool *threads,
 		struct shadow_fd *sfd, struct transfer_queue *transfers)
 {
+	(void)threads;
 	(void)sfd;
 	(void)transfers;
 }
+void worker_run_video_task(struct task_data *task, struct thread_data *local)
+{
+	(void)task;
+	(void)local;
+}
 void apply_video_packet(struct shadow_fd *sfd, struct render_data *rd,
 		const struct bytebuf *data)
 {
@@ -76,6 +87,7 @@ void apply_video_packet(struct shadow_fd *sfd, struct render_data *rd,
 
 #else /* HAS_VIDEO */
 
+#include <inttypes.h>
 #include <libavcodec/avcodec.h>
 #include <libavutil/display.h>
 #include <libavutil/hwcontext_drm.h>
@@ -373,6 +385,8 @@ static uint32_t va_fourcc_to_rt(uint32_t va_fourcc)
 	switch (va_fourcc) {
 	case VA_FOURCC_BGRX:
 	case VA_FOURCC_RGBX:
+	case VA_FOURCC_XBGR:
+	case VA_FOURCC_XRGB:
 		return VA_RT_FORMAT_RGB32;
 	case VA_FOURCC_NV12:
 		return VA_RT_FORMAT_YUV420;
@@ -380,20 +394,63 @@ static uint32_t va_fourcc_to_rt(uint32_t va_fourcc)
 	return 0;
 }
 
-static int setup_vaapi_pipeline(struct shadow_fd *sfd, struct render_data *rd,
-		uint32_t width, uint32_t height)
+/* Import the DMABUF as a VA surface. The modifier is given through a
+ * DRM_PRIME_2 descriptor; if the driver does not accept that, and the
+ * buffer has no explicit tiling, the older descriptor is tried. */
+static int import_va_surface(struct shadow_fd *sfd, VADisplay vadisp,
+		uint32_t width, uint32_t height, VASurfaceID *surface)
 {
-	VADisplay vadisp = rd->av_vadisplay;
-
-	uintptr_t buffer_val = (uintptr_t)sfd->fd_local;
 	uint32_t va_fourcc = drm_to_va_fourcc(sfd->dmabuf_info.format);
-	if (va_fourcc == 0) {
+	uint32_t rt_format = va_fourcc_to_rt(va_fourcc);
+	if (va_fourcc == 0 || rt_format == 0) {
 		wp_error("Could not convert DRM format %x to VA fourcc",
 				sfd->dmabuf_info.format);
 		return -1;
 	}
-	uint32_t rt_format = va_fourcc_to_rt(va_fourcc);
 
+	VADRMPRIMESurfaceDescriptor desc;
+	memset(&desc, 0, sizeof(desc));
+	desc.fourcc = va_fourcc;
+	desc.width = width;
+	desc.height = height;
+	desc.num_objects = 1;
+	desc.objects[0].fd = sfd->fd_local;
+	desc.objects[0].size = (uint32_t)sfd->buffer_size;
+	desc.objects[0].drm_format_modifier = sfd->dmabuf_info.modifier;
+	desc.num_layers = 1;
+	desc.layers[0].drm_format = sfd->dmabuf_info.format;
+	desc.layers[0].num_planes = sfd->dmabuf_info.num_planes;
+	for (int i = 0; i < (int)sfd->dmabuf_info.num_planes; i++) {
+		desc.layers[0].object_index[i] = 0;
+		desc.layers[0].offset[i] = sfd->dmabuf_info.offsets[i];
+		desc.layers[0].pitch[i] = sfd->dmabuf_info.strides[i];
+	}
+
+	VASurfaceAttrib attribs[3];
+	attribs[0].type = VASurfaceAttribMemoryType;
+	attribs[0].flags = VA_SURFACE_ATTRIB_SETTABLE;
+	attribs[0].value.type = VAGenericValueTypeInteger;
+	attribs[0].value.value.i = VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2;
+	attribs[1].type = VASurfaceAttribExternalBufferDescriptor;
+	attribs[1].flags = VA_SURFACE_ATTRIB_SETTABLE;
+	attribs[1].value.type = VAGenericValueTypePointer;
+	attribs[1].value.value.p = &desc;
+
+	VAStatus stat = vaCreateSurfaces(
+			vadisp, rt_format, width, height, surface, 1, attribs, 2);
+	if (stat == VA_STATUS_SUCCESS) {
+		return 0;
+	}
+	if (sfd->dmabuf_info.modifier != DRM_FORMAT_MOD_LINEAR &&
+			sfd->dmabuf_info.modifier != DRM_FORMAT_MOD_INVALID) {
+		wp_debug("Could not import DMABUF with format %x modifier %" PRIx64
+			 " as VA surface: %s",
+				sfd->dmabuf_info.format,
+				sfd->dmabuf_info.modifier, vaErrorStr(stat));
+		return -1;
+	}
+
+	uintptr_t buffer_val = (uintptr_t)sfd->fd_local;
 	VASurfaceAttribExternalBuffers buffer_desc;
 	buffer_desc.num_buffers = 1;
 	buffer_desc.buffers = &buffer_val;
@@ -408,7 +465,6 @@ static int setup_vaapi_pipeline(struct shadow_fd *sfd, struct render_data *rd,
 		buffer_desc.pitches[i] = sfd->dmabuf_info.strides[i];
 	}
 
-	VASurfaceAttrib attribs[3];
 	attribs[0].type = VASurfaceAttribPixelFormat;
 	attribs[0].flags = VA_SURFACE_ATTRIB_SETTABLE;
 	attribs[0].value.type = VAGenericValueTypeInteger;
@@ -422,22 +478,33 @@ static int setup_vaapi_pipeline(struct shadow_fd *sfd, struct render_data *rd,
 	attribs[2].value.type = VAGenericValueTypePointer;
 	attribs[2].value.value.p = &buffer_desc;
 
+	stat = vaCreateSurfaces(
+			vadisp, rt_format, width, height, surface, 1, attribs, 3);
+	if (stat != VA_STATUS_SUCCESS) {
+		wp_error("Create surface failed: %s", vaErrorStr(stat));
+		return -1;
+	}
+	return 0;
+}
+
+static int setup_vaapi_pipeline(struct shadow_fd *sfd, struct render_data *rd,
+		uint32_t width, uint32_t height)
+{
+	VADisplay vadisp = rd->av_vadisplay;
+
 	sfd->video_va_surface = 0;
 	sfd->video_va_context = 0;
 	sfd->video_va_pipeline = 0;
 
-	VAStatus stat = vaCreateSurfaces(vadisp, rt_format, buffer_desc.width,
-			buffer_desc.height, &sfd->video_va_surface, 1, attribs,
-			3);
-	if (stat != VA_STATUS_SUCCESS) {
-		wp_error("Create surface failed: %s", vaErrorStr(stat));
+	if (import_va_surface(sfd, vadisp, width, height,
+			    &sfd->video_va_surface) == -1) {
 		sfd->video_va_surface = 0;
 		return -1;
 	}
 
-	stat = vaCreateContext(vadisp, rd->av_copy_config,
-			(int)buffer_desc.width, (int)buffer_desc.height, 0,
-			&sfd->video_va_surface, 1, &sfd->video_va_context);
+	VAStatus stat = vaCreateContext(vadisp, rd->av_copy_config, (int)width,
+			(int)height, 0, &sfd->video_va_surface, 1,
+			&sfd->video_va_context);
 	if (stat != VA_STATUS_SUCCESS) {
 		wp_error("Create context failed %s", vaErrorStr(stat));
 		vaDestroySurfaces(vadisp, &sfd->video_va_surface, 1);
@@ -463,22 +530,24 @@ static int setup_vaapi_pipeline(struct shadow_fd *sfd, struct render_data *rd,
 	return 0;
 }
 
-static void cleanup_vaapi_pipeline(struct shadow_fd *sfd)
+/* Decoders have a device context; encoders, only a frames context */
+static VADisplay get_va_display(struct AVCodecContext *ctx)
 {
-	if (!sfd->video_va_surface && !sfd->video_va_context &&
-			!sfd->video_va_pipeline) {
-		return;
+	AVHWDeviceContext *vwdc = NULL;
+	if (ctx->hw_device_ctx) {
+		vwdc = (AVHWDeviceContext *)ctx->hw_device_ctx->data;
+	} else if (ctx->hw_frames_ctx) {
+		vwdc = ((AVHWFramesContext *)ctx->hw_frames_ctx->data)
+					->device_ctx;
 	}
-
-	AVHWDeviceContext *vwdc =
-			(AVHWDeviceContext *)
-					sfd->video_context->hw_device_ctx->data;
-	if (vwdc->type != AV_HWDEVICE_TYPE_VAAPI) {
-		return;
+	if (!vwdc || vwdc->type != AV_HWDEVICE_TYPE_VAAPI) {
+		return NULL;
 	}
-	AVVAAPIDeviceContext *vdctx = (AVVAAPIDeviceContext *)vwdc->hwctx;
-	VADisplay vadisp = vdctx->display;
+	return ((AVVAAPIDeviceContext *)vwdc->hwctx)->display;
+}
 
+static void destroy_vaapi_objects(struct shadow_fd *sfd, VADisplay vadisp)
+{
 	if (sfd->video_va_surface) {
 		vaDestroySurfaces(vadisp, &sfd->video_va_surface, 1);
 		sfd->video_va_surface = 0;
@@ -493,19 +562,32 @@ static void cleanup_vaapi_pipeline(struct shadow_fd *sfd)
 	}
 }
 
-static void run_vaapi_conversion(struct shadow_fd *sfd, struct render_data *rd,
-		struct AVFrame *va_frame)
+static void cleanup_vaapi_pipeline(struct shadow_fd *sfd)
 {
-	VADisplay vadisp = rd->av_vadisplay;
+	if (!sfd->video_va_surface && !sfd->video_va_context &&
+			!sfd->video_va_pipeline) {
+		return;
+	}
 
-	if (va_frame->format != AV_PIX_FMT_VAAPI) {
-		wp_error("Non-vaapi pixel format: %s",
-				av_get_pix_fmt_name(va_frame->format));
+	VADisplay vadisp = get_va_display(sfd->video_context);
+	if (!vadisp) {
+		return;
 	}
-	VASurfaceID src_surf = (VASurfaceID)(ptrdiff_t)va_frame->data[3];
+	destroy_vaapi_objects(sfd, vadisp);
+}
 
-	int stat = vaBeginPicture(
-			vadisp, sfd->video_va_context, sfd->video_va_surface);
+/* Convert the source surface onto the target surface of the pipeline
+ * context, sfd->video_va_context. Only the top left corner of each surface,
+ * the size of the DMABUF, is used, since the other one may be padded. */
+static void run_vaapi_vpp(struct shadow_fd *sfd, VADisplay vadisp,
+		VASurfaceID src_surf, VASurfaceID dst_surf)
+{
+	VARectangle region = {.x = 0,
+			.y = 0,
+			.width = (uint16_t)sfd->dmabuf_info.width,
+			.height = (uint16_t)sfd->dmabuf_info.height};
+
+	int stat = vaBeginPicture(vadisp, sfd->video_va_context, dst_surf);
 	if (stat != VA_STATUS_SUCCESS) {
 		wp_error("Begin picture config failed: %s", vaErrorStr(stat));
 	}
@@ -518,8 +600,8 @@ static void run_vaapi_conversion(struct shadow_fd *sfd, struct render_data *rd,
 	}
 
 	pipeline_param->surface = src_surf;
-	pipeline_param->surface_region = NULL;
-	pipeline_param->output_region = NULL;
+	pipeline_param->surface_region = &region;
+	pipeline_param->output_region = &region;
 	pipeline_param->output_background_color = 0;
 	pipeline_param->filter_flags = VA_FILTER_SCALING_FAST;
 	pipeline_param->filters = NULL;
@@ -542,11 +624,133 @@ static void run_vaapi_conversion(struct shadow_fd *sfd, struct render_data *rd,
 		wp_error("End picture failed: %s", vaErrorStr(stat));
 	}
 
-	stat = vaSyncSurface(vadisp, sfd->video_va_surface);
+	stat = vaSyncSurface(vadisp, dst_surf);
 	if (stat != VA_STATUS_SUCCESS) {
 		wp_error("Sync surface failed: %s", vaErrorStr(stat));
 	}
 }
+
+static void run_vaapi_conversion(struct shadow_fd *sfd, struct render_data *rd,
+		struct AVFrame *va_frame)
+{
+	if (va_frame->format != AV_PIX_FMT_VAAPI) {
+		wp_error("Non-vaapi pixel format: %s",
+				av_get_pix_fmt_name(va_frame->format));
+	}
+	VASurfaceID src_surf = (VASurfaceID)(ptrdiff_t)va_frame->data[3];
+	run_vaapi_vpp(sfd, rd->av_vadisplay, src_surf, sfd->video_va_surface);
+}
+
+/* Import the DMABUF, with its modifier, as a VA surface, and set up a
+ * pipeline converting it into frames from the encoder's pool, so that frames
+ * can be encoded without ever being read by the CPU */
+static int setup_vaapi_encode_import(
+		struct shadow_fd *sfd, struct render_data *rd)
+{
+	VADisplay vadisp = rd->av_vadisplay;
+	uint32_t width = sfd->dmabuf_info.width;
+	uint32_t height = sfd->dmabuf_info.height;
+	sfd->video_va_surface = 0;
+	sfd->video_va_context = 0;
+	sfd->video_va_pipeline = 0;
+	if (!vadisp || import_va_surface(sfd, vadisp, width, height,
+				       &sfd->video_va_surface) == -1) {
+		sfd->video_va_surface = 0;
+		return -1;
+	}
+
+	/* Each frame uses a different surface of the pool, so none are given
+	 * as render targets */
+	VAStatus stat = vaCreateContext(vadisp, rd->av_copy_config, (int)width,
+			(int)height, VA_PROGRESSIVE, NULL, 0,
+			&sfd->video_va_context);
+	if (stat != VA_STATUS_SUCCESS) {
+		wp_error("Create context failed %s", vaErrorStr(stat));
+		goto fail;
+	}
+	stat = vaCreateBuffer(vadisp, sfd->video_va_context,
+			VAProcPipelineParameterBufferType,
+			sizeof(VAProcPipelineParameterBuffer), 1, NULL,
+			&sfd->video_va_pipeline);
+	if (stat != VA_STATUS_SUCCESS) {
+		wp_error("Failed to create pipeline buffer: %s",
+				vaErrorStr(stat));
+		goto fail;
+	}
+	wp_debug("Encoding DMABUF RID=%d (format %x, modifier %" PRIx64
+		 ") from the GPU",
+			sfd->remote_id, sfd->dmabuf_info.format,
+			sfd->dmabuf_info.modifier);
+	return 0;
+fail:
+	destroy_vaapi_objects(sfd, vadisp);
+	return -1;
+}
+
+/* Log which formats can be converted by the GPU for encoding, and which
+ * codecs can be encoded on it */
+static void probe_vaapi_encoding(struct render_data *rd)
+{
+	VADisplay vadisp = rd->av_vadisplay;
+	unsigned int nattribs = 0;
+	if (vaQuerySurfaceAttributes(vadisp, rd->av_copy_config, NULL,
+			    &nattribs) != VA_STATUS_SUCCESS) {
+		return;
+	}
+	VASurfaceAttrib *attribs = calloc(nattribs, sizeof(VASurfaceAttrib));
+	if (!attribs || vaQuerySurfaceAttributes(vadisp, rd->av_copy_config,
+					attribs, &nattribs) !=
+					VA_STATUS_SUCCESS) {
+		free(attribs);
+		return;
+	}
+	const uint32_t drm_formats[] = {DRM_FORMAT_XRGB8888,
+			DRM_FORMAT_XBGR8888, DRM_FORMAT_RGBX8888,
+			DRM_FORMAT_BGRX8888, DRM_FORMAT_NV12};
+	for (size_t k = 0; k < sizeof(drm_formats) / sizeof(drm_formats[0]);
+			k++) {
+		uint32_t va_fourcc = drm_to_va_fourcc(drm_formats[k]);
+		bool found = false;
+		for (unsigned int i = 0; i < nattribs; i++) {
+			found |= attribs[i].type == VASurfaceAttribPixelFormat &&
+				 (uint32_t)attribs[i].value.value.i ==
+						 va_fourcc;
+		}
+		wp_debug("GPU conversion for encoding %s DRM format %x",
+				found ? "supports" : "does not support",
+				drm_formats[k]);
+	}
+	free(attribs);
+
+	const struct {
+		VAProfile profile;
+		const char *name;
+	} profiles[] = {
+		{VAProfileH264ConstrainedBaseline, "H264 baseline"},
+		{VAProfileH264Main, "H264 main"},
+		{VAProfileVP9Profile0, "VP9 profile 0"},
+#if VA_CHECK_VERSION(1, 8, 0)
+		{VAProfileAV1Profile0, "AV1 profile 0"},
+#endif
+	};
+	for (size_t k = 0; k < sizeof(profiles) / sizeof(profiles[0]); k++) {
+		VAEntrypoint entrypoints[16];
+		int nentrypoints = 0;
+		if (vaMaxNumEntrypoints(vadisp) > 16 ||
+				vaQueryConfigEntrypoints(vadisp,
+						profiles[k].profile, entrypoints,
+						&nentrypoints) != VA_STATUS_SUCCESS) {
+			nentrypoints = 0;
+		}
+		bool can_encode = false;
+		for (int i = 0; i < nentrypoints; i++) {
+			can_encode |= entrypoints[i] == VAEntrypointEncSlice ||
+				      entrypoints[i] == VAEntrypointEncSliceLP;
+		}
+		wp_debug("Hardware encoding of %s is %savailable",
+				profiles[k].name, can_encode ? "" : "not ");
+	}
+}
 #endif
 
 void destroy_video_data(struct shadow_fd *sfd)
@@ -559,6 +763,10 @@ void destroy_video_data(struct shadow_fd *sfd)
 		 * frames/packets) first */
 		avcodec_free_context(&sfd->video_context);
 		sws_freeContext(sfd->video_color_context);
+		for (int i = 0; i < sfd->video_nslices; i++) {
+			sws_freeContext(sfd->video_slice_contexts[i]);
+		}
+		free(sfd->video_slice_contexts);
 		if (sfd->video_yuv_frame_data) {
 			av_freep(sfd->video_yuv_frame_data);
 		}
@@ -572,15 +780,18 @@ void destroy_video_data(struct shadow_fd *sfd)
 	}
 }
 
+/* Copy rows [row_start, row_end) of the image onto the frame */
 static void copy_onto_video_mirror(const char *buffer, uint32_t map_stride,
-		AVFrame *frame, const struct dmabuf_slice_data *info)
+		AVFrame *frame, const struct dmabuf_slice_data *info,
+		size_t row_start, size_t row_end)
 {
+	row_end = minu(row_end, info->height);
 	for (int i = 0; i < info->num_planes; i++) {
 		int j = i;
 		if (needs_vu_flip(info->format) && (i == 1 || i == 2)) {
 			j = 3 - i;
 		}
-		for (size_t r = 0; r < info->height; r++) {
+		for (size_t r = row_start; r < row_end; r++) {
 			uint8_t *dst = frame->data[j] +
 				       frame->linesize[j] * (int)r;
 			const char *src = buffer + (size_t)info->offsets[i] +
@@ -631,7 +842,7 @@ static bool pad_hardware_size(
 	return true;
 }
 
-static int init_hwcontext(struct render_data *rd)
+int init_hwcontext(struct render_data *rd)
 {
 	if (rd->av_disabled) {
 		return -1;
@@ -695,6 +906,7 @@ static int init_hwcontext(struct render_data *rd)
 		rd->av_disabled = true;
 		return -1;
 	}
+	probe_vaapi_encoding(rd);
 
 #endif
 
@@ -745,6 +957,13 @@ static void configure_low_latency_enc_context(struct AVCodecContext *ctx,
 					    0) != 0) {
 				wp_error("Failed to set x264 encode zerolatency");
 			}
+			/* Refresh the image by moving a column of intra coded
+			 * blocks across it, instead of with keyframes, which
+			 * would be many times larger than the other frames */
+			if (av_opt_set(ctx->priv_data, "intra-refresh", "1",
+					    0) != 0) {
+				wp_error("Failed to set x264 intra refresh");
+			}
 		} else if (fmt == VIDEO_VP9) {
 			if (av_opt_set(ctx->priv_data, "lag-in-frames", "0",
 					    0) != 0) {
@@ -757,6 +976,11 @@ static void configure_low_latency_enc_context(struct AVCodecContext *ctx,
 			if (av_opt_set(ctx->priv_data, "speed", "8", 0) != 0) {
 				wp_error("Failed to set vp9 speed");
 			}
+			/* cyclic refresh, in place of periodic keyframes */
+			if (av_opt_set_int(ctx->priv_data, "aq-mode", 3, 0) !=
+					0) {
+				wp_error("Failed to set vp9 cyclic refresh");
+			}
 		} else if (fmt == VIDEO_AV1) {
 			// AOM-AV1
 			if (av_opt_set(ctx->priv_data, "usage", "realtime",
@@ -771,6 +995,10 @@ static void configure_low_latency_enc_context(struct AVCodecContext *ctx,
 					0) {
 				wp_error("Failed to set av1 speed");
 			}
+			if (av_opt_set_int(ctx->priv_data, "aq-mode", 3, 0) !=
+					0) {
+				wp_error("Failed to set av1 cyclic refresh");
+			}
 			// Use multi-threaded encoding
 			ctx->thread_count = nthreads;
 		}
@@ -854,6 +1082,26 @@ static int setup_hwvideo_encode(
 		goto fail_codec_open;
 	}
 
+#ifdef HAS_VAAPI
+	/* Prefer converting the DMABUF into frames of the encoder's format;
+	 * not all drivers can encode RGB surfaces directly */
+	AVFrame *pool_frame = av_frame_alloc();
+	if (pool_frame && av_hwframe_get_buffer(frame_ref, pool_frame, 0) == 0 &&
+			setup_vaapi_encode_import(sfd, rd) == 0) {
+		struct AVPacket *pool_pkt = av_packet_alloc();
+		if (pool_pkt) {
+			av_buffer_unref(&frame_ref);
+			sfd->video_context = ctx;
+			sfd->video_local_frame = NULL;
+			sfd->video_yuv_frame = pool_frame;
+			sfd->video_packet = pool_pkt;
+			return 0;
+		}
+		destroy_vaapi_objects(sfd, rd->av_vadisplay);
+	}
+	av_frame_free(&pool_frame);
+#endif
+
 	/* Create a VAAPI frame linked to the sfd DMABUF */
 	struct AVDRMFrameDescriptor *framedesc =
 			av_mallocz(sizeof(struct AVDRMFrameDescriptor));
@@ -954,6 +1202,46 @@ fail_alignment:
 	return -1;
 }
 
+/* Split color conversion of frames for encoding into horizontal bands, so
+ * that these can be converted by different threads */
+static int setup_color_slices(struct shadow_fd *sfd, enum AVPixelFormat in_fmt,
+		enum AVPixelFormat out_fmt, int nthreads)
+{
+	/* Small enough bands would not be worth the per-task overhead; bands
+	 * start on rows that are a multiple of every chroma subsampling */
+	const int min_rows = 64, align = 16;
+	int height = sfd->video_local_frame->height;
+	int width = sfd->video_local_frame->width;
+	int nslices = min(nthreads, height / min_rows);
+	if (nslices <= 1) {
+		return 0;
+	}
+	int rows = align * ceildiv(ceildiv(height, nslices), align);
+	nslices = ceildiv(height, rows);
+
+	struct SwsContext **contexts = calloc(
+			(size_t)nslices, sizeof(struct SwsContext *));
+	if (!contexts) {
+		return -1;
+	}
+	for (int i = 0; i < nslices; i++) {
+		int h = min(rows, height - i * rows);
+		contexts[i] = sws_getContext(width, h, in_fmt, width, h,
+				out_fmt, SWS_BILINEAR, NULL, NULL, NULL);
+		if (!contexts[i]) {
+			for (int k = 0; k < i; k++) {
+				sws_freeContext(contexts[k]);
+			}
+			free(contexts);
+			return -1;
+		}
+	}
+	sfd->video_slice_contexts = contexts;
+	sfd->video_nslices = nslices;
+	sfd->video_slice_rows = rows;
+	return 0;
+}
+
 int setup_video_encode(
 		struct shadow_fd *sfd, struct render_data *rd, int nthreads)
 {
@@ -1055,6 +1343,9 @@ int setup_video_encode(
 	sfd->video_packet = pkt;
 	sfd->video_context = ctx;
 	sfd->video_color_context = sws;
+	if (setup_color_slices(sfd, avpixfmt, videofmt, nthreads) == -1) {
+		wp_error("Failed to set up sliced color conversion, converting on one thread");
+	}
 	return 0;
 }
 
@@ -1147,9 +1438,19 @@ int setup_video_decode(struct shadow_fd *sfd, struct render_data *rd)
 
 	if (ctx->hw_device_ctx) {
 #ifdef HAS_VAAPI
-		if (rd->av_vadisplay) {
-			setup_vaapi_pipeline(sfd, rd, (uint32_t)ctx->width,
-					(uint32_t)ctx->height);
+		/* Convert decoded frames directly into the DMABUF on the
+		 * GPU, instead of reading them back */
+		if (rd->av_vadisplay &&
+				setup_vaapi_pipeline(sfd, rd,
+						sfd->dmabuf_info.width,
+						sfd->dmabuf_info.height) == 0) {
+			wp_debug("Decoding video for RID=%d (format %x, modifier %" PRIx64
+				 ") into the DMABUF on the GPU",
+					sfd->remote_id, sfd->dmabuf_info.format,
+					sfd->dmabuf_info.modifier);
+		} else {
+			wp_debug("Decoding video for RID=%d through the CPU",
+					sfd->remote_id);
 		}
 #endif
 	}
@@ -1165,33 +1466,154 @@ int setup_video_decode(struct shadow_fd *sfd, struct render_data *rd)
 	return 0;
 }
 
-void collect_video_from_mirror(
+/* Regions beyond this many are merged into the last one */
+#define VIDEO_MAX_ROI 16
+
+/* Mark the damaged parts of the frame as regions of interest, so that the
+ * encoders which support this (x264, libvpx, VAAPI) bring them up to full
+ * quality sooner. Damage is in terms of the DMABUF as transferred. */
+static void set_damage_roi(struct shadow_fd *sfd)
+{
+	AVFrame *frame = sfd->video_yuv_frame;
+	av_frame_remove_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+	if (!sfd->damage.damage || sfd->damage.damage == DAMAGE_EVERYTHING) {
+		return;
+	}
+	size_t stride = sfd->dmabuf_info.strides[0];
+	int bpp = get_shm_bytes_per_pixel(sfd->dmabuf_info.format);
+	if (stride == 0 || bpp <= 0) {
+		return;
+	}
+	int width = (int)sfd->dmabuf_info.width;
+	int height = (int)sfd->dmabuf_info.height;
+	int n = min(sfd->damage.ndamage_intvs, VIDEO_MAX_ROI);
+	if (n == 0) {
+		return;
+	}
+	AVFrameSideData *sd = av_frame_new_side_data(frame,
+			AV_FRAME_DATA_REGIONS_OF_INTEREST,
+			n * (int)sizeof(AVRegionOfInterest));
+	if (!sd) {
+		wp_debug("Failed to allocate regions of interest");
+		return;
+	}
+	AVRegionOfInterest *rois = (AVRegionOfInterest *)sd->data;
+	for (int i = 0; i < n; i++) {
+		size_t start = (size_t)sfd->damage.damage[i].start;
+		size_t end = (size_t)sfd->damage.damage[i].end;
+		if (i == n - 1) {
+			end = (size_t)sfd->damage.damage[sfd->damage.ndamage_intvs -
+							 1]
+					      .end;
+		}
+		size_t top = start / stride;
+		size_t bottom = (end + stride - 1) / stride;
+		int left = 0, right = width;
+		if (bottom == top + 1) {
+			left = (int)((start % stride) / (size_t)bpp);
+			right = min(width, (int)((end - top * stride +
+							    (size_t)bpp - 1) /
+							   (size_t)bpp));
+		}
+		rois[i].self_size = sizeof(AVRegionOfInterest);
+		rois[i].top = min((int)top, height);
+		rois[i].bottom = min((int)bottom, height);
+		rois[i].left = min(left, width);
+		rois[i].right = right;
+		rois[i].qoffset = (AVRational){-1, 10};
+	}
+}
+
+#ifdef HAS_VAAPI
+/* The encoder may still be reading the surface given to it for the last
+ * frame, so take another from the pool, which only hands out surfaces it has
+ * released. Returns -1 if there is none. */
+static int next_pool_frame(struct shadow_fd *sfd)
+{
+	AVFrame *frame = sfd->video_yuv_frame;
+	av_frame_unref(frame);
+	int err = av_hwframe_get_buffer(
+			sfd->video_context->hw_frames_ctx, frame, 0);
+	if (err < 0) {
+		wp_error("Failed to get a frame for RID=%d from the pool: %s",
+				sfd->remote_id, av_err2str(err));
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+void collect_video_from_mirror(struct thread_pool *threads,
 		struct shadow_fd *sfd, struct transfer_queue *transfers)
 {
+#ifdef HAS_VAAPI
+	/* The DMABUF is converted onto a frame from the encoder's pool */
+	if (sfd->video_va_context && next_pool_frame(sfd) == -1) {
+		reset_damage(&sfd->damage);
+		return;
+	}
+#endif
+	set_damage_roi(sfd);
+	reset_damage(&sfd->damage);
 	if (sfd->video_color_context) {
-		/* If using software encoding, need to convert to YUV */
-		void *handle = NULL;
-		uint32_t map_stride = 0;
-		void *data = map_dmabuf(
-				sfd->dmabuf_bo, false, &handle, &map_stride);
-		if (!data) {
+		/* If using software encoding, need to convert to YUV; the
+		 * mapping is released by finish_update() */
+		sfd->mem_local = map_dmabuf(sfd->dmabuf_bo, false,
+				&sfd->dmabuf_map_handle, &sfd->dmabuf_map_stride);
+		if (!sfd->mem_local) {
 			return;
 		}
-		copy_onto_video_mirror(data, map_stride, sfd->video_local_frame,
-				&sfd->dmabuf_info);
-		unmap_dmabuf(sfd->dmabuf_bo, handle);
-
-		if (sws_scale(sfd->video_color_context,
-				    (const uint8_t *const *)sfd
-						    ->video_local_frame->data,
-				    sfd->video_local_frame->linesize, 0,
-				    sfd->video_local_frame->height,
-				    sfd->video_yuv_frame->data,
-				    sfd->video_yuv_frame->linesize) < 0) {
-			wp_error("Failed to perform color conversion");
+	}
+	/* Keep sfd alive at least until write to channel is done */
+	sfd->refcount.compute = true;
+
+	int ntasks = 1;
+	enum task_type type = TASK_ENCODE_VIDEO;
+	if (sfd->video_color_context) {
+		type = TASK_CONVERT_VIDEO;
+		ntasks = max(sfd->video_nslices, 1);
+	}
+	atomic_store(&sfd->video_slices_left, ntasks);
+
+	pthread_mutex_lock(&threads->work_mutex);
+	if (buf_ensure_size(threads->stack_count + ntasks,
+			    sizeof(struct task_data), &threads->stack_size,
+			    (void **)&threads->stack) == -1) {
+		wp_error("Allocation failed, dropping video frame for RID=%d",
+				sfd->remote_id);
+		pthread_mutex_unlock(&threads->work_mutex);
+		return;
+	}
+	for (int i = 0; i < ntasks; i++) {
+		struct task_data task;
+		memset(&task, 0, sizeof(task));
+		task.type = type;
+		task.sfd = sfd;
+		task.msg_queue = &transfers->async_recv_queue;
+		task.zone_start = i;
+		threads->stack[threads->stack_count++] = task;
+	}
+	pthread_mutex_unlock(&threads->work_mutex);
+}
+
+/* Make the data pointers of the frame start at the given row of the image */
+static void offset_frame_rows(const AVFrame *frame, int row, uint8_t *data[4])
+{
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+	for (int p = 0; p < 4; p++) {
+		data[p] = frame->data[p];
+		if (!data[p]) {
+			continue;
 		}
+		int shift = (p == 1 || p == 2) ? desc->log2_chroma_h : 0;
+		data[p] += (ptrdiff_t)frame->linesize[p] * (row >> shift);
 	}
+}
 
+static void encode_video_frame(struct shadow_fd *sfd,
+		struct thread_msg_recv_buf *msg_queue,
+		struct thread_data *local)
+{
 	sfd->video_yuv_frame->pts = sfd->video_frameno++;
 	int sendstat = avcodec_send_frame(
 			sfd->video_context, sfd->video_yuv_frame);
@@ -1199,21 +1621,39 @@ void collect_video_from_mirror(
 		wp_error("Failed to create frame: %s", av_err2str(sendstat));
 		return;
 	}
-	// assume 1-1 frames to packets, at the moment
-	int recvstat = avcodec_receive_packet(
-			sfd->video_context, sfd->video_packet);
-	if (recvstat == AVERROR(EINVAL)) {
-		wp_error("Failed to receive packet for RID=%d", sfd->remote_id);
-		return;
-	} else if (recvstat == AVERROR(EAGAIN)) {
-		wp_error("Packet for RID=%d needs more input", sfd->remote_id);
-	}
-	if (recvstat == 0) {
+	/* Low latency encoders should produce one packet per frame, but
+	 * send whatever is available */
+	for (int npackets = 0;; npackets++) {
+		int recvstat = avcodec_receive_packet(
+				sfd->video_context, sfd->video_packet);
+		if (recvstat == AVERROR(EAGAIN)) {
+			if (npackets == 0) {
+				wp_error("Packet for RID=%d needs more input",
+						sfd->remote_id);
+			}
+			return;
+		} else if (recvstat < 0) {
+			wp_error("Failed to receive packet for RID=%d: %s",
+					sfd->remote_id, av_err2str(recvstat));
+			return;
+		}
 		struct AVPacket *pkt = sfd->video_packet;
+		if (npackets >= VIDEO_MAX_PACKETS) {
+			wp_error("Dropping extra packet for RID=%d",
+					sfd->remote_id);
+			av_packet_unref(pkt);
+			continue;
+		}
 		size_t pktsz = (size_t)pkt->buf->size;
 		size_t msgsz = sizeof(struct wmsg_basic) + pktsz;
 
-		char *buf = malloc(alignz(msgsz, 4));
+		char *buf = alloc_msg_block(local, alignz(msgsz, 4));
+		if (!buf) {
+			wp_error("Allocation failed, dropping packet for RID=%d",
+					sfd->remote_id);
+			av_packet_unref(pkt);
+			continue;
+		}
 
 		struct wmsg_basic *header = (struct wmsg_basic *)buf;
 		header->size_and_type =
@@ -1223,12 +1663,57 @@ void collect_video_from_mirror(
 		memcpy(buf + sizeof(struct wmsg_basic), pkt->buf->data, pktsz);
 		memset(buf + msgsz, 0, alignz(msgsz, 4) - msgsz);
 
-		transfer_add(transfers, alignz(msgsz, 4), buf);
+		transfer_async_add(msg_queue, buf, alignz(msgsz, 4), true);
 
 		av_packet_unref(pkt);
 	}
 }
 
+void worker_run_video_task(struct task_data *task, struct thread_data *local)
+{
+	struct shadow_fd *sfd = task->sfd;
+	if (task->type == TASK_ENCODE_VIDEO) {
+#ifdef HAS_VAAPI
+		if (sfd->video_va_context) {
+			run_vaapi_vpp(sfd, get_va_display(sfd->video_context),
+					sfd->video_va_surface,
+					(VASurfaceID)(ptrdiff_t)sfd->video_yuv_frame
+							->data[3]);
+		}
+#endif
+		encode_video_frame(sfd, task->msg_queue, local);
+		return;
+	}
+
+	struct AVFrame *local_frame = sfd->video_local_frame;
+	struct AVFrame *yuv_frame = sfd->video_yuv_frame;
+	struct SwsContext *sws = sfd->video_color_context;
+	int row_start = 0, row_end = local_frame->height;
+	if (sfd->video_nslices > 1) {
+		sws = sfd->video_slice_contexts[task->zone_start];
+		row_start = task->zone_start * sfd->video_slice_rows;
+		row_end = min(row_end, row_start + sfd->video_slice_rows);
+	}
+	copy_onto_video_mirror(sfd->mem_local, sfd->dmabuf_map_stride,
+			local_frame, &sfd->dmabuf_info, (size_t)row_start,
+			(size_t)row_end);
+
+	uint8_t *src[4], *dst[4];
+	offset_frame_rows(local_frame, row_start, src);
+	offset_frame_rows(yuv_frame, row_start, dst);
+	if (sws_scale(sws, (const uint8_t *const *)src, local_frame->linesize,
+			    0, row_end - row_start, dst,
+			    yuv_frame->linesize) < 0) {
+		wp_error("Failed to perform color conversion");
+	}
+
+	/* The last slice to be converted starts the encode; the atomic
+	 * decrement orders the other slices' writes before it */
+	if (atomic_fetch_sub(&sfd->video_slices_left, 1) == 1) {
+		encode_video_frame(sfd, task->msg_queue, local);
+	}
+}
+
 static int setup_color_conv(struct shadow_fd *sfd, struct AVFrame *cpu_frame)
 {
 	struct AVCodecContext *ctx = sfd->video_context;
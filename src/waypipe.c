@@ -75,6 +75,7 @@ static const char usage_string[] =
 		"\n"
 		"Options:\n"
 		"  -c, --compress C     choose compression method: lz4[=#], zstd=[=#], none\n"
+		"                         auto, lz4=auto, zstd=auto adapt level to link speed\n"
 		"  -d, --debug          print debug messages\n"
 		"  -h, --help           display this help and exit\n"
 		"  -n, --no-gpu         disable protocols which would use GPU resources\n"
@@ -86,11 +87,25 @@ static const char usage_string[] =
 		"                         vsock: [[s]CID:]port\n"
 		"      --version        print waypipe version and exit\n"
 		"      --allow-tiled    allow gpu buffers (DMABUFs) with format modifiers\n"
+		"      --collapse-frames skip to the newest frame when frames are shown late\n"
+		"      --compress-dict  compress with a dictionary built from early frames\n"
 		"      --control C      server,ssh: set control pipe to reconnect server\n"
 		"      --display D      server,ssh: the Wayland display name or path\n"
+		"      --dedup          send repeated or scrolled content as references\n"
 		"      --drm-node R     set the local render node. default: /dev/dri/renderD128\n"
+		"      --evict-idle S   free copies of buffers unchanged for S seconds\n"
+		"      --hugetlb        back large buffer copies with reserved huge pages\n"
+		"      --io-uring       wait for events using io_uring instead of poll\n"
+		"      --max-inflight M limit data sent but not yet received to M MiB, by\n"
+		"                         delaying frame callbacks and merging updates\n"
+		"      --prewarm        prepare a process for the next connection in advance\n"
+		"      --record F       save messages received to F.<pid>, for bench --replay\n"
 		"      --remote-node R  ssh: set the remote render node path\n"
+		"      --replay F       bench: measure sending the buffer updates recorded in F\n"
 		"      --remote-bin R   ssh: set the remote waypipe binary. default: waypipe\n"
+		"      --shared-workers run all connections in one process, sharing threads\n"
+		"      --stats F        each second, append JSON statistics to file/socket F\n"
+		"      --streams N      server,ssh: spread buffer updates over N connections\n"
 		"      --login-shell    server: if server CMD is empty, run a login shell\n"
 		"      --threads T      set thread pool size, default=hardware threads/2\n"
 		"      --title-prefix P prepend P to all window titles\n"
@@ -222,8 +237,10 @@ static void fill_rand_token(char tok[static 8])
 
 /* Scan a suffix which is either empty or has the form =N, returning true
  * if it matches */
-static bool parse_level_choice(const char *str, int *dest, int defval)
+static bool parse_level_choice(
+		const char *str, int *dest, int defval, bool *is_auto)
 {
+	*is_auto = false;
 	if (str[0] == '\0') {
 		*dest = defval;
 		return true;
@@ -232,6 +249,12 @@ static bool parse_level_choice(const char *str, int *dest, int defval)
 		return false;
 	}
 	str++;
+	if (!strcmp(str, "auto")) {
+		/* Start from the default, and adjust from there */
+		*dest = defval;
+		*is_auto = true;
+		return true;
+	}
 	int sign = 1;
 	if (str[0] == '-') {
 		sign = -1;
@@ -406,6 +429,7 @@ static const char *feature_names[] = {
 		"dmabuf",
 		"video",
 		"vaapi",
+		"io_uring",
 };
 static const bool feature_flags[] = {
 #ifdef HAS_LZ4
@@ -433,6 +457,11 @@ static const bool feature_flags[] = {
 #else
 		false,
 #endif
+#ifdef HAS_IO_URING
+		true,
+#else
+		false,
+#endif
 };
 
 #define ARG_VERSION 1000
@@ -450,6 +479,19 @@ static const bool feature_flags[] = {
 #define ARG_BENCH_TEST_SIZE 1012
 #define ARG_VSOCK 1013
 #define ARG_TITLE_PREFIX 1014
+#define ARG_IO_URING 1015
+#define ARG_STATS 1016
+#define ARG_DEDUP 1017
+#define ARG_MAX_INFLIGHT 1018
+#define ARG_COMPRESS_DICT 1019
+#define ARG_RECORD 1020
+#define ARG_REPLAY 1021
+#define ARG_STREAMS 1022
+#define ARG_EVICT_IDLE 1023
+#define ARG_PREWARM 1024
+#define ARG_SHARED_WORKERS 1025
+#define ARG_COLLAPSE_FRAMES 1026
+#define ARG_HUGETLB 1027
 
 static const struct option options[] = {
 		{"compress", required_argument, NULL, 'c'},
@@ -473,6 +515,19 @@ static const struct option options[] = {
 		{"test-size", required_argument, NULL, ARG_BENCH_TEST_SIZE},
 		{"vsock", no_argument, NULL, ARG_VSOCK},
 		{"title-prefix", required_argument, NULL, ARG_TITLE_PREFIX},
+		{"io-uring", no_argument, NULL, ARG_IO_URING},
+		{"stats", required_argument, NULL, ARG_STATS},
+		{"dedup", no_argument, NULL, ARG_DEDUP},
+		{"max-inflight", required_argument, NULL, ARG_MAX_INFLIGHT},
+		{"compress-dict", no_argument, NULL, ARG_COMPRESS_DICT},
+		{"record", required_argument, NULL, ARG_RECORD},
+		{"replay", required_argument, NULL, ARG_REPLAY},
+		{"streams", required_argument, NULL, ARG_STREAMS},
+		{"evict-idle", required_argument, NULL, ARG_EVICT_IDLE},
+		{"prewarm", no_argument, NULL, ARG_PREWARM},
+		{"shared-workers", no_argument, NULL, ARG_SHARED_WORKERS},
+		{"collapse-frames", no_argument, NULL, ARG_COLLAPSE_FRAMES},
+		{"hugetlb", no_argument, NULL, ARG_HUGETLB},
 		{0, 0, NULL, 0}};
 struct arg_permissions {
 	int val;
@@ -480,7 +535,8 @@ struct arg_permissions {
 };
 #define ALL_MODES (uint32_t) - 1
 static const struct arg_permissions arg_permissions[] = {
-		{'c', MODE_SSH | MODE_CLIENT | MODE_SERVER}, {'d', ALL_MODES},
+		{'c', MODE_SSH | MODE_CLIENT | MODE_SERVER | MODE_BENCH},
+		{'d', ALL_MODES},
 		{'h', MODE_FAIL}, {'n', MODE_SSH | MODE_CLIENT | MODE_SERVER},
 		{'o', MODE_SSH | MODE_CLIENT | MODE_SERVER},
 		{'s', MODE_SSH | MODE_CLIENT | MODE_SERVER},
@@ -498,7 +554,20 @@ static const struct arg_permissions arg_permissions[] = {
 		{ARG_CONTROL, MODE_SSH | MODE_SERVER},
 		{ARG_BENCH_TEST_SIZE, MODE_BENCH},
 		{ARG_VSOCK, MODE_SSH | MODE_CLIENT | MODE_SERVER},
-		{ARG_TITLE_PREFIX, MODE_SSH | MODE_CLIENT | MODE_SERVER}};
+		{ARG_TITLE_PREFIX, MODE_SSH | MODE_CLIENT | MODE_SERVER},
+		{ARG_IO_URING, MODE_SSH | MODE_CLIENT | MODE_SERVER},
+		{ARG_STATS, MODE_SSH | MODE_CLIENT | MODE_SERVER},
+		{ARG_DEDUP, MODE_SSH | MODE_CLIENT | MODE_SERVER},
+		{ARG_MAX_INFLIGHT, MODE_SSH | MODE_CLIENT | MODE_SERVER},
+		{ARG_COMPRESS_DICT, MODE_SSH | MODE_CLIENT | MODE_SERVER},
+		{ARG_RECORD, MODE_SSH | MODE_CLIENT | MODE_SERVER},
+		{ARG_REPLAY, MODE_BENCH},
+		{ARG_STREAMS, MODE_SSH | MODE_SERVER},
+		{ARG_EVICT_IDLE, MODE_SSH | MODE_CLIENT | MODE_SERVER},
+		{ARG_PREWARM, MODE_SSH | MODE_CLIENT | MODE_SERVER},
+		{ARG_SHARED_WORKERS, MODE_SSH | MODE_CLIENT | MODE_SERVER},
+		{ARG_COLLAPSE_FRAMES, MODE_SSH | MODE_CLIENT | MODE_SERVER},
+		{ARG_HUGETLB, MODE_SSH | MODE_CLIENT | MODE_SERVER}};
 
 /* envp is nonstandard, so use environ */
 extern char **environ;
@@ -515,11 +584,15 @@ int main(int argc, char **argv)
 	char *remote_drm_node = NULL;
 	char *comp_string = NULL;
 	char *nthread_string = NULL;
+	char *max_inflight_string = NULL;
+	char *nstreams_string = NULL;
+	char *evict_idle_string = NULL;
 	char *wayland_display = NULL;
 	char *waypipe_binary = "waypipe";
 	char *control_path = NULL;
 	char *socketpath = NULL;
 	uint32_t bench_test_size = (1u << 22) + 13;
+	const char *replay_path = NULL;
 
 	struct main_config config = {
 			.n_worker_threads = 0,
@@ -530,6 +603,7 @@ int main(int argc, char **argv)
 			.compression = COMP_NONE,
 #endif
 			.compression_level = 0,
+			.compression_auto = false,
 			.no_gpu = false,
 			.only_linear_dmabuf = true,
 			.video_if_possible = false,
@@ -541,6 +615,18 @@ int main(int argc, char **argv)
 			.vsock_to_host = false, /* VMADDR_FLAG_TO_HOST */
 			.vsock_port = 0,
 			.title_prefix = NULL,
+			.io_uring = false,
+			.stats_path = NULL,
+			.dedup = false,
+			.max_inflight = 0,
+			.compress_dict = false,
+			.record_path = NULL,
+			.n_streams = 1,
+			.evict_idle_secs = 0,
+			.prewarm = false,
+			.shared_workers = false,
+			.collapse_frames = false,
+			.workers = NULL,
 	};
 
 	/* We do not parse any getopt arguments happening after the mode choice
@@ -599,13 +685,28 @@ int main(int argc, char **argv)
 
 		switch (opt) {
 		case 'c':
+			config.compression_auto = false;
 			if (!strcmp(optarg, "none")) {
 				config.compression = COMP_NONE;
 				config.compression_level = 0;
+			} else if (!strcmp(optarg, "auto")) {
+				/* Zstd has the widest range of levels */
+#if defined(HAS_ZSTD)
+				config.compression = COMP_ZSTD;
+				config.compression_level = 5;
+#elif defined(HAS_LZ4)
+				config.compression = COMP_LZ4;
+				config.compression_level = -1;
+#else
+				fprintf(stderr, "Compression method auto not available: this copy of Waypipe was not built with LZ4 or Zstd compression support.\n");
+				return EXIT_FAILURE;
+#endif
+				config.compression_auto = true;
 			} else if (!strncmp(optarg, "lz4", 3) &&
 					parse_level_choice(optarg + 3,
 							&config.compression_level,
-							-1)) {
+							-1,
+							&config.compression_auto)) {
 #ifdef HAS_LZ4
 				config.compression = COMP_LZ4;
 #else
@@ -615,7 +716,8 @@ int main(int argc, char **argv)
 			} else if (!strncmp(optarg, "zstd", 4) &&
 					parse_level_choice(optarg + 4,
 							&config.compression_level,
-							5)) {
+							5,
+							&config.compression_auto)) {
 #ifdef HAS_ZSTD
 				config.compression = COMP_ZSTD;
 #else
@@ -713,6 +815,71 @@ int main(int argc, char **argv)
 			fprintf(stderr, "Option --vsock not allowed: this copy of Waypipe was not built with support for Linux VM sockets.\n");
 			return EXIT_FAILURE;
 #endif
+		case ARG_IO_URING:
+#ifdef HAS_IO_URING
+			config.io_uring = true;
+			break;
+#else
+			fprintf(stderr, "Option --io-uring not allowed: this copy of Waypipe was not built with support for io_uring.\n");
+			return EXIT_FAILURE;
+#endif
+		case ARG_STATS:
+			config.stats_path = optarg;
+			break;
+		case ARG_DEDUP:
+			config.dedup = true;
+			break;
+		case ARG_PREWARM:
+			config.prewarm = true;
+			break;
+		case ARG_SHARED_WORKERS:
+			config.shared_workers = true;
+			break;
+		case ARG_COLLAPSE_FRAMES:
+			config.collapse_frames = true;
+			break;
+		case ARG_HUGETLB:
+			/* Reserved huge pages are set aside by the system's
+			 * administrator, so are only used on request */
+			set_reserved_huge_pages(true);
+			break;
+		case ARG_RECORD:
+			config.record_path = optarg;
+			break;
+		case ARG_REPLAY:
+			replay_path = optarg;
+			break;
+		case ARG_COMPRESS_DICT:
+			config.compress_dict = true;
+			break;
+		case ARG_STREAMS: {
+			uint32_t nstreams;
+			if (parse_uint32(optarg, &nstreams) == -1 ||
+					nstreams == 0 ||
+					nstreams > MAX_CHANNEL_STREAMS) {
+				fail = true;
+			}
+			config.n_streams = (int)nstreams;
+			nstreams_string = optarg;
+		} break;
+		case ARG_EVICT_IDLE: {
+			uint32_t secs;
+			if (parse_uint32(optarg, &secs) == -1 || secs == 0 ||
+					secs > 86400) {
+				fail = true;
+			}
+			config.evict_idle_secs = secs;
+			evict_idle_string = optarg;
+		} break;
+		case ARG_MAX_INFLIGHT: {
+			uint32_t mib;
+			if (parse_uint32(optarg, &mib) == -1 || mib == 0 ||
+					mib > (1u << 16)) {
+				fail = true;
+			}
+			config.max_inflight = (size_t)mib << 20;
+			max_inflight_string = optarg;
+		} break;
 		case ARG_TITLE_PREFIX:
 			if (!is_utf8(optarg)) {
 				fprintf(stderr, "Title prefix argument must be valid UTF-8.\n");
@@ -785,6 +952,12 @@ int main(int argc, char **argv)
 	if (config.video_bpf == 0) {
 		config.video_bpf = config.prefer_hwvideo ? 360000 : 120000;
 	}
+	if (config.prewarm && config.shared_workers) {
+		/* Prepared processes only make sense when connections are
+		 * handled by processes of their own */
+		fprintf(stderr, "The --prewarm and --shared-workers options can not be used together\n");
+		return EXIT_FAILURE;
+	}
 
 #ifdef HAS_VSOCK
 	if (config.vsock) {
@@ -848,7 +1021,12 @@ int main(int argc, char **argv)
 					argv[0]);
 			return EXIT_FAILURE;
 		}
-		ret = run_bench(bw, bench_test_size, config.n_worker_threads);
+		if (replay_path) {
+			ret = run_bench_replay(bw, replay_path, &config);
+		} else {
+			ret = run_bench(bw, bench_test_size,
+					config.n_worker_threads);
+		}
 	} else if (mode == MODE_CLIENT) {
 		struct sockaddr_un sockaddr;
 		memset(&sockaddr, 0, sizeof(sockaddr));
@@ -1040,7 +1218,16 @@ int main(int argc, char **argv)
 				     config.video_if_possible +
 				     !config.only_linear_dmabuf +
 				     2 * needs_login_shell +
-				     2 * (config.n_worker_threads != 0);
+				     2 * (config.n_worker_threads != 0) +
+				     config.io_uring +
+				     2 * (config.stats_path != NULL) +
+				     config.dedup + config.prewarm +
+				     config.shared_workers +
+				     config.collapse_frames +
+				     2 * (config.max_inflight != 0) +
+				     config.compress_dict +
+				     2 * (config.n_streams > 1) +
+				     2 * (config.evict_idle_secs != 0);
 			char **arglist = calloc((size_t)(argc + nextra),
 					sizeof(char *));
 
@@ -1149,6 +1336,47 @@ int main(int argc, char **argv)
 			if (config.vsock) {
 				arglist[dstidx + 1 + offset++] = "--vsock";
 			}
+			if (config.io_uring) {
+				arglist[dstidx + 1 + offset++] = "--io-uring";
+			}
+			if (config.dedup) {
+				arglist[dstidx + 1 + offset++] = "--dedup";
+			}
+			if (config.prewarm) {
+				arglist[dstidx + 1 + offset++] = "--prewarm";
+			}
+			if (config.shared_workers) {
+				arglist[dstidx + 1 + offset++] =
+						"--shared-workers";
+			}
+			if (config.compress_dict) {
+				arglist[dstidx + 1 + offset++] =
+						"--compress-dict";
+			}
+			if (config.collapse_frames) {
+				arglist[dstidx + 1 + offset++] =
+						"--collapse-frames";
+			}
+			if (config.max_inflight != 0) {
+				arglist[dstidx + 1 + offset++] = "--max-inflight";
+				arglist[dstidx + 1 + offset++] =
+						max_inflight_string;
+			}
+			if (config.n_streams > 1) {
+				arglist[dstidx + 1 + offset++] = "--streams";
+				arglist[dstidx + 1 + offset++] =
+						nstreams_string;
+			}
+			if (config.evict_idle_secs != 0) {
+				arglist[dstidx + 1 + offset++] = "--evict-idle";
+				arglist[dstidx + 1 + offset++] =
+						evict_idle_string;
+			}
+			if (config.stats_path) {
+				arglist[dstidx + 1 + offset++] = "--stats";
+				arglist[dstidx + 1 + offset++] =
+						(char *)config.stats_path;
+			}
 			arglist[dstidx + 1 + offset++] = "server";
 			for (int i = dstidx + 1; i < argc; i++) {
 				arglist[offset + i] = argv[i];
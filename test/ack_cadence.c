@@ -0,0 +1,104 @@
+/*
+ * Copyright © 2019 Manuel Stoeckl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "common.h"
+#include "main.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MS 1000000uLL
+
+static bool check_delay(const char *name, struct ack_cadence *a, uint64_t now,
+		int expected)
+{
+	int delay = ack_delay_ms(a, now);
+	printf("%s: delay %d ms, expected %d\n", name, delay, expected);
+	return delay == expected;
+}
+
+log_handler_func_t log_funcs[2] = {NULL, test_log_handler};
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+
+	struct ack_cadence a = {0};
+	bool pass = true;
+
+	/* Without a round trip estimate, wait the longest time */
+	ack_note_received(&a, 100);
+	pass &= check_delay("Unmeasured", &a, 1000 * MS, 20);
+	pass &= check_delay("Unmeasured, later", &a, 1015 * MS, 5);
+	pass &= check_delay("Unmeasured, due", &a, 1020 * MS, 0);
+	ack_note_sent(&a);
+
+	/* Only the first of several unacknowledged writes is timed */
+	ack_note_written(&a, 5, 2000 * MS);
+	ack_note_written(&a, 8, 2004 * MS);
+	if (ack_note_confirmed(&a, 4, 2010 * MS)) {
+		wp_error("Timed write confirmed early");
+		pass = false;
+	}
+	if (!ack_note_confirmed(&a, 6, 2008 * MS) || a.rtt_ns != 8 * MS) {
+		wp_error("Round trip time %llu, expected 8ms",
+				(unsigned long long)a.rtt_ns);
+		pass = false;
+	}
+	if (ack_note_confirmed(&a, 8, 2012 * MS)) {
+		wp_error("Round trip measured without a timed write");
+		pass = false;
+	}
+	ack_note_written(&a, 9, 3000 * MS);
+	(void)ack_note_confirmed(&a, 9, 3016 * MS);
+	/* (3 * 8 + 16) / 4 */
+	if (a.rtt_ns != 10 * MS) {
+		wp_error("Round trip time %llu, expected 10ms",
+				(unsigned long long)a.rtt_ns);
+		pass = false;
+	}
+
+	/* A quarter of the round trip, rounded up */
+	ack_note_received(&a, 100);
+	pass &= check_delay("Measured", &a, 4000 * MS, 3);
+	pass &= check_delay("Measured, due", &a, 4003 * MS, 0);
+	ack_note_sent(&a);
+
+	/* Very short round trips still wait a little */
+	a.rtt_ns = MS / 10;
+	ack_note_received(&a, 100);
+	pass &= check_delay("Fast link", &a, 5000 * MS, 1);
+	/* Enough data pending overrides the delay */
+	ack_note_received(&a, 1 << 20);
+	pass &= check_delay("Large backlog", &a, 5000 * MS, 0);
+	ack_note_sent(&a);
+	if (a.pending_bytes != 0 || a.pending_since_ns != 0) {
+		wp_error("Pending state not reset");
+		pass = false;
+	}
+
+	printf("%s\n", pass ? "pass" : "FAIL");
+	return pass ? EXIT_SUCCESS : EXIT_FAILURE;
+}
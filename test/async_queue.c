@@ -0,0 +1,264 @@
+/*
+ * Copyright © 2019 Manuel Stoeckl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "common.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct producer {
+	pthread_t thread;
+	struct thread_msg_recv_buf *queue;
+	uint32_t id;
+	int nmsgs;
+};
+
+static void *run_producer(void *arg)
+{
+	struct producer *p = arg;
+	for (int i = 0; i < p->nmsgs; i++) {
+		uint32_t *msg = malloc(2 * sizeof(uint32_t));
+		if (!msg) {
+			wp_error("Failed to allocate message");
+			continue;
+		}
+		msg[0] = p->id;
+		msg[1] = (uint32_t)i;
+		transfer_async_add(p->queue, msg, 2 * sizeof(uint32_t), false);
+	}
+	return NULL;
+}
+
+/* Run one batch of concurrent producers, consuming messages while they are
+ * being added, and verify that that every message arrives exactly once, in
+ * production order for each producer, with consecutive message numbers. */
+static bool test_batch(struct transfer_queue *transfers, int nproducers,
+		int nmsgs)
+{
+	int start = transfers->end;
+	uint32_t start_msgno = transfers->last_msgno;
+	int total = nproducers * nmsgs;
+	if (transfer_async_prepare(&transfers->async_recv_queue, total) ==
+			-1) {
+		wp_error("Failed to prepare queue");
+		return false;
+	}
+
+	struct producer *producers = calloc(
+			(size_t)nproducers, sizeof(struct producer));
+	if (!producers) {
+		return false;
+	}
+	for (int i = 0; i < nproducers; i++) {
+		producers[i].queue = &transfers->async_recv_queue;
+		producers[i].id = (uint32_t)i;
+		producers[i].nmsgs = nmsgs;
+		if (pthread_create(&producers[i].thread, NULL, run_producer,
+				    &producers[i]) != 0) {
+			wp_error("Failed to create producer thread");
+			free(producers);
+			return false;
+		}
+	}
+	while (transfers->end - start < total) {
+		if (transfer_load_async(transfers) == -1) {
+			break;
+		}
+	}
+	for (int i = 0; i < nproducers; i++) {
+		pthread_join(producers[i].thread, NULL);
+	}
+	free(producers);
+	/* Nothing further should appear */
+	(void)transfer_load_async(transfers);
+
+	bool pass = true;
+	if (transfers->end - start != total) {
+		wp_error("Received %d messages, expected %d",
+				transfers->end - start, total);
+		pass = false;
+	}
+	uint32_t *next_seqno = calloc((size_t)nproducers, sizeof(uint32_t));
+	if (!next_seqno) {
+		return false;
+	}
+	for (int i = start; i < transfers->end; i++) {
+		const uint32_t *msg = transfers->vecs[i].iov_base;
+		if (transfers->vecs[i].iov_len != 2 * sizeof(uint32_t) ||
+				msg[0] >= (uint32_t)nproducers) {
+			wp_error("Malformed message at index %d", i);
+			pass = false;
+			break;
+		}
+		if (msg[1] != next_seqno[msg[0]]) {
+			wp_error("Producer %u message %u arrived, expected %u",
+					msg[0], msg[1], next_seqno[msg[0]]);
+			pass = false;
+			break;
+		}
+		next_seqno[msg[0]]++;
+		if (transfers->meta[i].msgno !=
+				start_msgno + (uint32_t)(i - start)) {
+			wp_error("Message %d has msgno %u, expected %u", i,
+					transfers->meta[i].msgno,
+					start_msgno + (uint32_t)(i - start));
+			pass = false;
+			break;
+		}
+	}
+	free(next_seqno);
+	return pass;
+}
+
+/* Messages past the queue capacity should be dropped, not written out of
+ * bounds */
+static bool test_overflow(struct transfer_queue *transfers)
+{
+	int start = transfers->end;
+	if (transfer_async_prepare(&transfers->async_recv_queue, 1) == -1) {
+		return false;
+	}
+	for (int i = 0; i < 3; i++) {
+		uint32_t *msg = calloc(2, sizeof(uint32_t));
+		if (!msg) {
+			return false;
+		}
+		transfer_async_add(&transfers->async_recv_queue, msg,
+				2 * sizeof(uint32_t), false);
+	}
+	(void)transfer_load_async(transfers);
+	return transfers->end - start == 1;
+}
+
+static bool add_test_message(struct transfer_queue *transfers,
+		enum wmsg_type type, uint32_t id, bool priority)
+{
+	uint32_t *msg = malloc(2 * sizeof(uint32_t));
+	if (!msg) {
+		return false;
+	}
+	msg[0] = transfer_header(2 * sizeof(uint32_t), type);
+	msg[1] = id;
+	int r = priority ? transfer_add_priority(transfers,
+					   2 * sizeof(uint32_t), msg, false)
+			 : transfer_add(transfers, 2 * sizeof(uint32_t), msg);
+	if (r == -1) {
+		free(msg);
+		return false;
+	}
+	return true;
+}
+
+/* Priority messages should overtake the bulk messages before them, but not
+ * control messages, nor a partially written message, and message numbers
+ * should still follow the queue order */
+static bool test_lanes(struct transfer_queue *transfers)
+{
+	const struct {
+		enum wmsg_type type;
+		bool priority;
+	} queued[] = {
+			{WMSG_BUFFER_FILL, false},
+			{WMSG_BUFFER_DIFF, false},
+			{WMSG_OPEN_FILE, false},
+			{WMSG_BUFFER_FILL, false},
+			{WMSG_PIPE_TRANSFER, false},
+			{WMSG_PROTOCOL, true},
+			{WMSG_BUFFER_DIFF, false},
+			{WMSG_PROTOCOL, true},
+			{WMSG_PROTOCOL, false},
+	};
+	const uint32_t expected[] = {0, 1, 2, 5, 7, 3, 4, 6, 8};
+	int n = (int)(sizeof(queued) / sizeof(queued[0]));
+
+	int start = transfers->end;
+	uint32_t start_msgno = transfers->last_msgno;
+	for (int i = 0; i < n; i++) {
+		if (!add_test_message(transfers, queued[i].type, (uint32_t)i,
+				    queued[i].priority)) {
+			return false;
+		}
+	}
+	transfers->start = start;
+	transfers->partial_write_amt = 4;
+	int nmoved = transfer_reorder_lanes(transfers);
+	transfers->start = transfers->end;
+	transfers->partial_write_amt = 0;
+
+	bool pass = nmoved == 2;
+	for (int i = 0; i < n; i++) {
+		const uint32_t *msg = transfers->vecs[start + i].iov_base;
+		uint32_t msgno = transfers->meta[start + i].msgno;
+		if (msg[1] != expected[i] ||
+				msgno != start_msgno + (uint32_t)i) {
+			wp_error("Position %d has message %u, msgno %u; expected %u, %u",
+					i, msg[1], msgno, expected[i],
+					start_msgno + (uint32_t)i);
+			pass = false;
+		}
+	}
+	return pass;
+}
+
+log_handler_func_t log_funcs[2] = {NULL, test_atomic_log_handler};
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+
+	bool all_success = true;
+	const int producer_counts[] = {1, 2, 4, 8, 16};
+	for (size_t k = 0; k < sizeof(producer_counts) / sizeof(int); k++) {
+		struct transfer_queue transfers;
+		memset(&transfers, 0, sizeof(transfers));
+
+		bool pass = true;
+		for (int round = 0; round < 20 && pass; round++) {
+			pass = test_batch(&transfers, producer_counts[k],
+					20000 / producer_counts[k]);
+		}
+		printf("%2d producers, %s\n", producer_counts[k],
+				pass ? "pass" : "FAIL");
+		all_success &= pass;
+		cleanup_transfer_queue(&transfers);
+	}
+
+	struct transfer_queue transfers;
+	memset(&transfers, 0, sizeof(transfers));
+	bool pass = test_overflow(&transfers);
+	printf("overflow, %s\n", pass ? "pass" : "FAIL");
+	all_success &= pass;
+	cleanup_transfer_queue(&transfers);
+
+	memset(&transfers, 0, sizeof(transfers));
+	pass = test_lanes(&transfers);
+	printf("lanes, %s\n", pass ? "pass" : "FAIL");
+	all_success &= pass;
+	cleanup_transfer_queue(&transfers);
+
+	return all_success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
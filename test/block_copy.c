@@ -0,0 +1,200 @@
+/*
+ * Copyright © 2019 Manuel Stoeckl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "common.h"
+#include "shadow.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#define TEST_TILES 64
+#define TEST_SIZE (TEST_TILES * (int)BLOCK_CACHE_TILE_SIZE)
+
+struct test_file {
+	int fd;
+	char *data;
+	int rid;
+};
+
+static int open_test_file(struct test_file *f, struct fd_translation_map *map)
+{
+	f->fd = create_anon_file();
+	if (f->fd == -1 || ftruncate(f->fd, TEST_SIZE) == -1) {
+		wp_error("Failed to create test file: %s", strerror(errno));
+		return -1;
+	}
+	f->data = mmap(NULL, TEST_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+			f->fd, 0);
+	if (f->data == MAP_FAILED) {
+		return -1;
+	}
+	struct shadow_fd *sfd = translate_fd(map, NULL, NULL, f->fd, FDC_FILE,
+			TEST_SIZE, NULL, false);
+	if (!sfd) {
+		return -1;
+	}
+	f->rid = sfd->remote_id;
+	return 0;
+}
+
+static void fill_tile(struct test_file *f, int tile, uint32_t seed)
+{
+	for (size_t i = 0; i < BLOCK_CACHE_TILE_SIZE; i++) {
+		seed = seed * 1103515245u + 12345u;
+		f->data[(size_t)tile * BLOCK_CACHE_TILE_SIZE + i] =
+				(char)(seed >> 16);
+	}
+}
+
+/* Send the changes to the file, and check that the copy matches. Returns the
+ * number of bytes sent in messages other than WMSG_BUFFER_COPY, or -1 on
+ * failure */
+static int transfer(struct fd_translation_map *src_map,
+		struct fd_translation_map *dst_map, struct thread_pool *pool,
+		const struct test_file *f, int *ncopies)
+{
+	struct transfer_queue transfers;
+	memset(&transfers, 0, sizeof(transfers));
+
+	struct shadow_fd *src = get_shadow_for_rid(src_map, f->rid);
+	src->is_dirty = true;
+	damage_everything(&src->damage);
+	collect_sfd_update(pool, src, &transfers);
+	struct delivery_counts counts = {0};
+	if (deliver_updates(dst_map, pool, &transfers, &counts) < 0) {
+		return -1;
+	}
+	*ncopies += counts.ncopies;
+	int nbytes = (int)(counts.total_bytes - counts.copy_bytes);
+
+	struct shadow_fd *dst = get_shadow_for_rid(dst_map, f->rid);
+	if (!dst || memcmp(dst->mem_local, f->data, TEST_SIZE) != 0 ||
+			memcmp(src->mem_mirror, f->data, TEST_SIZE) != 0) {
+		wp_error("Copy of RID=%d does not match", f->rid);
+		return -1;
+	}
+	return nbytes;
+}
+
+log_handler_func_t log_funcs[2] = {NULL, test_log_handler};
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+
+	struct fd_translation_map src_map, dst_map;
+	setup_translation_map(&src_map, false);
+	setup_translation_map(&dst_map, true);
+	struct thread_pool src_pool, dst_pool;
+	if (setup_thread_pool(&src_pool, COMP_NONE, 0, 1) == -1 ||
+			setup_thread_pool(&dst_pool, COMP_NONE, 0, 1) == -1 ||
+			enable_block_cache(&src_map) == -1) {
+		return EXIT_FAILURE;
+	}
+
+	struct test_file a, b;
+	if (open_test_file(&a, &src_map) == -1 ||
+			open_test_file(&b, &src_map) == -1) {
+		return EXIT_FAILURE;
+	}
+
+	bool pass = true;
+	int ncopies = 0;
+	for (int t = 0; t < TEST_TILES; t++) {
+		fill_tile(&a, t, (uint32_t)t);
+	}
+	int sent = transfer(&src_map, &dst_map, &src_pool, &a, &ncopies);
+	pass &= sent >= TEST_SIZE && ncopies == 0;
+	printf("Initial send: %d bytes, %d copies\n", sent, ncopies);
+
+	/* A second buffer, mostly matching the first */
+	memcpy(b.data, a.data, TEST_SIZE);
+	fill_tile(&b, 5, 1000);
+	ncopies = 0;
+	sent = transfer(&src_map, &dst_map, &src_pool, &b, &ncopies);
+	pass &= sent >= 0 && sent < 4 * (int)BLOCK_CACHE_TILE_SIZE &&
+		ncopies == 1;
+	printf("Matching buffer: %d bytes, %d copies\n", sent, ncopies);
+
+	/* Scroll content within a buffer, both ways, plus some new content */
+	memmove(a.data, a.data + 3 * BLOCK_CACHE_TILE_SIZE,
+			TEST_SIZE - 3 * BLOCK_CACHE_TILE_SIZE);
+	fill_tile(&a, TEST_TILES - 1, 2000);
+	ncopies = 0;
+	sent = transfer(&src_map, &dst_map, &src_pool, &a, &ncopies);
+	pass &= sent >= 0 && sent < 4 * (int)BLOCK_CACHE_TILE_SIZE &&
+		ncopies == 1;
+	printf("Scrolled up: %d bytes, %d copies\n", sent, ncopies);
+
+	memmove(a.data + 2 * BLOCK_CACHE_TILE_SIZE, a.data,
+			TEST_SIZE - 2 * BLOCK_CACHE_TILE_SIZE);
+	ncopies = 0;
+	sent = transfer(&src_map, &dst_map, &src_pool, &a, &ncopies);
+	pass &= sent >= 0 && sent < 4 * (int)BLOCK_CACHE_TILE_SIZE &&
+		ncopies == 1;
+	printf("Scrolled down: %d bytes, %d copies\n", sent, ncopies);
+
+	/* Swap the buffers' contents */
+	char *tmp = malloc(TEST_SIZE);
+	memcpy(tmp, a.data, TEST_SIZE);
+	memcpy(a.data, b.data, TEST_SIZE);
+	memcpy(b.data, tmp, TEST_SIZE);
+	free(tmp);
+	ncopies = 0;
+	sent = transfer(&src_map, &dst_map, &src_pool, &a, &ncopies);
+	pass &= sent >= 0;
+	int sent_b = transfer(&src_map, &dst_map, &src_pool, &b, &ncopies);
+	pass &= sent_b >= 0 && ncopies == 2;
+	printf("Swapped: %d+%d bytes, %d copies\n", sent, sent_b, ncopies);
+
+	/* Scroll an image whose rows do not line up with the tiles */
+	const uint32_t stride = 1200, nrows = TEST_SIZE / 1200;
+	memmove(a.data, a.data + 5 * stride, (nrows - 5) * stride);
+	for (uint32_t i = (nrows - 5) * stride; i < nrows * stride; i++) {
+		a.data[i] = (char)(i * 7);
+	}
+	struct shadow_fd *sfd = get_shadow_for_rid(&src_map, a.rid);
+	note_row_layout(sfd, 0, stride, stride, nrows);
+	ncopies = 0;
+	sent = transfer(&src_map, &dst_map, &src_pool, &a, &ncopies);
+	pass &= sent >= 0 && sent < 8 * (int)stride && ncopies == 1;
+	printf("Scrolled image rows: %d bytes, %d copies\n", sent, ncopies);
+
+	printf("%s\n", pass ? "pass" : "FAIL");
+
+	cleanup_translation_map(&src_map);
+	cleanup_translation_map(&dst_map);
+	cleanup_thread_pool(&src_pool);
+	cleanup_thread_pool(&dst_pool);
+	munmap(a.data, TEST_SIZE);
+	munmap(b.data, TEST_SIZE);
+	return pass ? EXIT_SUCCESS : EXIT_FAILURE;
+}
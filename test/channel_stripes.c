@@ -0,0 +1,388 @@
+/*
+ * Copyright © 2019 Manuel Stoeckl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "common.h"
+#include "main.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define NMESSAGES 24
+#define NSTRIPES 3
+
+/* Make every third message a small protocol message, and the rest buffer
+ * updates of varying sizes */
+static void *make_message(int i, size_t *size)
+{
+	bool bulk = i % 3 != 0;
+	*size = bulk ? 20000 + 13000 * (size_t)(i % 7) : 16;
+	uint32_t *msg = malloc(*size);
+	if (!msg) {
+		return NULL;
+	}
+	msg[0] = transfer_header(
+			*size, bulk ? WMSG_BUFFER_FILL : WMSG_PROTOCOL);
+	for (size_t k = 1; k < *size / 4; k++) {
+		msg[k] = (uint32_t)i * 0x9e3779b9u + (uint32_t)k;
+	}
+	return msg;
+}
+
+static int fill_queue(struct transfer_queue *td, void *originals[],
+		size_t sizes[])
+{
+	memset(td, 0, sizeof(*td));
+	td->last_msgno = 1;
+	for (int i = 0; i < NMESSAGES; i++) {
+		void *msg = make_message(i, &sizes[i]);
+		originals[i] = malloc(sizes[i]);
+		if (!msg || !originals[i]) {
+			free(msg);
+			return -1;
+		}
+		memcpy(originals[i], msg, sizes[i]);
+		if (transfer_add(td, sizes[i], msg) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static bool queue_matches(const struct transfer_queue *td,
+		void *const originals[], const size_t sizes[])
+{
+	for (int i = 0; i < NMESSAGES; i++) {
+		bool bulk = i % 3 != 0;
+		if (td->vecs[i].iov_len != sizes[i] ||
+				memcmp(td->vecs[i].iov_base, originals[i],
+						sizes[i]) ||
+				td->meta[i].static_alloc ||
+				td->meta[i].lane !=
+						(bulk ? LANE_BULK
+						      : LANE_CONTROL)) {
+			wp_error("Queue entry %d was not restored", i);
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Write as much of the main channel queue as possible */
+static int write_main(int fd, struct transfer_queue *td)
+{
+	while (td->start < td->end) {
+		struct iovec v = td->vecs[td->start];
+		v.iov_base = (char *)v.iov_base + td->partial_write_amt;
+		v.iov_len -= td->partial_write_amt;
+		ssize_t wr = writev(fd, &v, 1);
+		if (wr == -1) {
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0
+									 : -1;
+		}
+		td->partial_write_amt += (size_t)wr;
+		if (td->partial_write_amt == td->vecs[td->start].iov_len) {
+			td->partial_write_amt = 0;
+			td->start++;
+		}
+	}
+	return 0;
+}
+
+struct receiver {
+	struct channel_stripes stripes;
+	char *buf;
+	size_t len, size;
+	int nreceived;
+	void *const *originals;
+	const size_t *sizes;
+	int nstriped;
+	bool failed;
+};
+
+/* Check the next message received against the one that was sent */
+static void check_message(struct receiver *r, const char *msg)
+{
+	size_t sz = transfer_size(*(const uint32_t *)msg);
+	int i = r->nreceived++;
+	if (i >= NMESSAGES || sz != r->sizes[i] ||
+			memcmp(msg, r->originals[i], sz)) {
+		wp_error("Message %d was received out of order or corrupted",
+				i);
+		r->failed = true;
+	}
+}
+
+/* Read from the main channel and the extra connections, handling messages in
+ * order. Returns -1 on failure */
+static int receive(struct receiver *r, int mainfd)
+{
+	struct pollfd pfds[NSTRIPES];
+	int npfds = fill_stripe_pollfds(&r->stripes, pfds);
+	for (int i = 0; i < npfds; i++) {
+		pfds[i].revents = pfds[i].events & POLLIN;
+	}
+	if (advance_stripes(&r->stripes, pfds, npfds) < 0) {
+		return -1;
+	}
+	ssize_t rd = read(mainfd, r->buf + r->len, r->size - r->len);
+	if (rd == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+		return -1;
+	} else if (rd > 0) {
+		r->len += (size_t)rd;
+	}
+
+	size_t pos = 0;
+	while (pos + sizeof(uint32_t) <= r->len) {
+		char *msg = r->buf + pos;
+		size_t sz = alignz(transfer_size(*(uint32_t *)msg), 4);
+		if (pos + sz > r->len) {
+			break;
+		}
+		if (transfer_type(*(uint32_t *)msg) == WMSG_STRIPE) {
+			int index = (int)((struct wmsg_stripe *)msg)->stripe;
+			bool closed = false;
+			char *smsg = peek_striped_message(
+					&r->stripes, index, &closed);
+			if (!smsg) {
+				if (closed) {
+					return -1;
+				}
+				break;
+			}
+			check_message(r, smsg);
+			pop_striped_message(&r->stripes, index);
+			r->nstriped++;
+		} else {
+			check_message(r, msg);
+		}
+		pos += sz;
+	}
+	memmove(r->buf, r->buf + pos, r->len - pos);
+	r->len -= pos;
+	return 0;
+}
+
+static bool test_striped_transfer(void)
+{
+	bool pass = true;
+	struct transfer_queue td;
+	void *originals[NMESSAGES] = {NULL};
+	size_t sizes[NMESSAGES];
+	struct channel_stripes sender;
+	struct receiver recv;
+	memset(&recv, 0, sizeof(recv));
+	setup_stripes(&sender);
+	setup_stripes(&recv.stripes);
+	recv.originals = originals;
+	recv.sizes = sizes;
+	recv.size = 1 << 18;
+	recv.buf = malloc(recv.size);
+
+	int main_sp[2] = {-1, -1};
+	if (fill_queue(&td, originals, sizes) == -1 || !recv.buf ||
+			socketpair(AF_UNIX, SOCK_STREAM, 0, main_sp) == -1 ||
+			set_nonblocking(main_sp[0]) == -1 ||
+			set_nonblocking(main_sp[1]) == -1) {
+		wp_error("Setup failed");
+		pass = false;
+		goto end;
+	}
+	for (int k = 1; k <= NSTRIPES; k++) {
+		int sp[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) == -1 ||
+				add_stripe(&sender, k, sp[0]) == -1 ||
+				add_stripe(&recv.stripes, k, sp[1]) == -1) {
+			wp_error("Failed to add extra connection %d", k);
+			pass = false;
+			goto end;
+		}
+	}
+	/* A connection cannot be replaced */
+	if (add_stripe(&sender, 1, dup(main_sp[0])) != -1) {
+		wp_error("Extra connection was replaced");
+		pass = false;
+	}
+
+	int nmoved = stripe_transfers(&sender, &td);
+	int nbulk = 0;
+	for (int i = 0; i < NMESSAGES; i++) {
+		nbulk += i % 3 != 0;
+	}
+	/* Only unwritten buffer updates may be moved */
+	if (nmoved <= 0 || nmoved > nbulk) {
+		wp_error("Moved %d of %d buffer updates", nmoved, nbulk);
+		pass = false;
+	}
+	if (stripe_transfers(&sender, &td) != 0) {
+		wp_error("Blocks were striped twice");
+		pass = false;
+	}
+
+	for (int iter = 0; iter < 100000 && recv.nreceived < NMESSAGES &&
+			   !recv.failed;
+			iter++) {
+		if (write_main(main_sp[0], &td) == -1 ||
+				write_stripes(&sender) < 0 ||
+				receive(&recv, main_sp[1]) == -1) {
+			wp_error("Transfer failed: %s", strerror(errno));
+			pass = false;
+			break;
+		}
+	}
+	if (recv.failed || recv.nreceived != NMESSAGES ||
+			recv.nstriped != nmoved) {
+		wp_error("Received %d messages, %d striped", recv.nreceived,
+				recv.nstriped);
+		pass = false;
+	}
+
+	/* Acknowledging everything except the last message puts back all but
+	 * the remaining striped block */
+	uint32_t last = td.meta[NMESSAGES - 1].msgno;
+	release_striped_blocks(&sender, &td, last - 1);
+	int nleft = 0;
+	for (int k = 0; k < NSTRIPES; k++) {
+		nleft += sender.s[k].nblocks;
+	}
+	if (nleft != (td.meta[NMESSAGES - 1].static_alloc ? 1 : 0)) {
+		wp_error("%d striped blocks remain after acknowledgement",
+				nleft);
+		pass = false;
+	}
+	release_striped_blocks(&sender, &td, last);
+	pass = pass && queue_matches(&td, originals, sizes);
+
+	printf("Sent %d messages, %d over %d extra connections: %s\n",
+			NMESSAGES, nmoved, NSTRIPES, pass ? "pass" : "FAIL");
+end:
+	reset_stripes(&sender, &td);
+	reset_stripes(&recv.stripes, &td);
+	cleanup_transfer_queue(&td);
+	for (int i = 0; i < NMESSAGES; i++) {
+		free(originals[i]);
+	}
+	free(recv.buf);
+	if (main_sp[0] != -1) {
+		checked_close(main_sp[0]);
+		checked_close(main_sp[1]);
+	}
+	return pass;
+}
+
+/* When the connection is reset, the blocks which were striped go back into
+ * the queue, to be resent over the main channel */
+static bool test_reset(void)
+{
+	bool pass = true;
+	struct transfer_queue td;
+	void *originals[NMESSAGES] = {NULL};
+	size_t sizes[NMESSAGES];
+	struct channel_stripes sender;
+	setup_stripes(&sender);
+	int sp[2] = {-1, -1};
+	if (fill_queue(&td, originals, sizes) == -1 ||
+			socketpair(AF_UNIX, SOCK_STREAM, 0, sp) == -1 ||
+			add_stripe(&sender, 2, sp[0]) == -1) {
+		wp_error("Setup failed");
+		pass = false;
+		goto end;
+	}
+	/* A partially written block stays in place */
+	td.start = 1;
+	td.partial_write_amt = 1;
+	int nmoved = stripe_transfers(&sender, &td);
+	td.start = 0;
+	td.partial_write_amt = 0;
+	if (nmoved <= 0 || td.meta[1].static_alloc) {
+		wp_error("Unexpected striping, %d moved", nmoved);
+		pass = false;
+	}
+	(void)write_stripes(&sender);
+	reset_stripes(&sender, &td);
+	pass = pass && sender.count == 0 && sender.s[1].fd == -1 &&
+	       queue_matches(&td, originals, sizes);
+	printf("Reset with %d striped blocks: %s\n", nmoved,
+			pass ? "pass" : "FAIL");
+end:
+	reset_stripes(&sender, &td);
+	cleanup_transfer_queue(&td);
+	for (int i = 0; i < NMESSAGES; i++) {
+		free(originals[i]);
+	}
+	if (sp[1] != -1) {
+		checked_close(sp[1]);
+	}
+	return pass;
+}
+
+/* A message on an extra connection is only waited for if the connection
+ * exists, or may still be handed over */
+static bool test_unconnected(void)
+{
+	struct channel_stripes st;
+	setup_stripes(&st);
+	st.max_index = 2;
+	int sp[2] = {-1, -1};
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) == -1 ||
+			add_stripe(&st, 1, sp[0]) == -1) {
+		wp_error("Setup failed");
+		return false;
+	}
+	bool pass = stripe_may_receive(&st, 1) &&
+		    stripe_may_receive(&st, 2) &&
+		    !stripe_may_receive(&st, 3) &&
+		    !stripe_may_receive(&st, 0) &&
+		    !stripe_may_receive(&st, -1);
+	/* Once the link is gone, only the connected one remains */
+	st.may_connect = false;
+	pass = pass && stripe_may_receive(&st, 1) &&
+	       !stripe_may_receive(&st, 2);
+	printf("Unconnected indices: %s\n", pass ? "pass" : "FAIL");
+
+	struct transfer_queue td;
+	memset(&td, 0, sizeof(td));
+	reset_stripes(&st, &td);
+	checked_close(sp[1]);
+	return pass;
+}
+
+log_handler_func_t log_funcs[2] = {NULL, test_log_handler};
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+
+	bool all_success = true;
+	all_success &= test_striped_transfer();
+	all_success &= test_reset();
+	all_success &= test_unconnected();
+	return all_success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
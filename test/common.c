@@ -125,18 +125,33 @@ void send_wayland_msg(struct test_state *src, const struct msg msg,
 		}
 	}
 
-	for (struct shadow_fd_link *lcur = src->glob.map.link.l_next,
-				   *lnxt = lcur->l_next;
-			lcur != &src->glob.map.link;
-			lcur = lnxt, lnxt = lcur->l_next) {
-		struct shadow_fd *cur = (struct shadow_fd *)lcur;
-		collect_update(&src->glob.threads, cur, transfers,
-				src->config.old_video_mode);
-		destroy_shadow_if_unreferenced(cur);
+	(void)collect_buffer_updates(&src->glob, transfers);
+
+	/* As in the main loop, hold the protocol data while the updates it
+	 * relies on are postponed */
+	int held = pacing_hold_protocol(&src->glob.pacing, proto_mid.data,
+			proto_mid.zone_end, fd_window.data,
+			fd_window.zone_start);
+	if (held == -1) {
+		src->failed = true;
+		goto cleanup;
+	} else if (held == 1) {
+		proto_mid.zone_end = 0;
+		fd_window.zone_start = 0;
+	} else {
+		decref_transferred_rids(&src->glob.map, fd_window.zone_start,
+				fd_window.data);
+	}
+	int released = release_held_protocol(
+			&src->glob.pacing, &proto_mid, &fd_window);
+	if (released == -1) {
+		src->failed = true;
+		goto cleanup;
+	} else if (released == 1) {
+		fd_window.zone_start = fd_window.zone_end;
+		decref_transferred_rids(&src->glob.map, fd_window.zone_start,
+				fd_window.data);
 	}
-
-	decref_transferred_rids(
-			&src->glob.map, fd_window.zone_start, fd_window.data);
 
 	{
 		start_parallel_work(&src->glob.threads,
@@ -145,7 +160,7 @@ void send_wayland_msg(struct test_state *src, const struct msg msg,
 		struct task_data task;
 		while (request_work_task(&src->glob.threads, &task, &is_done)) {
 			run_task(&task, &src->glob.threads.threads[0]);
-			src->glob.threads.tasks_in_progress--;
+			finish_work_task(&src->glob.threads);
 		}
 		(void)transfer_load_async(transfers);
 	}
@@ -255,6 +270,11 @@ void receive_wire(struct test_state *dst, struct transfer_queue *transfers)
 		}
 	}
 
+	if (wait_for_apply_tasks(&dst->glob.threads) < 0) {
+		wp_error("Applying updates failed");
+		goto cleanup;
+	}
+
 	/* Convert RIDs back to fds */
 	for (int i = fd_window.zone_start; i < fd_window.zone_end; i++) {
 		struct shadow_fd *sfd = get_shadow_for_rid(
@@ -317,7 +337,6 @@ void send_protocol_msg(struct test_state *src, struct test_state *dst,
 
 	struct transfer_queue transfers;
 	memset(&transfers, 0, sizeof(transfers));
-	pthread_mutex_init(&transfers.async_recv_queue.lock, NULL);
 
 	/* On destination side, a bit easier; process transfers, and
 	 * then deliver all messages */
@@ -344,6 +363,8 @@ int setup_state(struct test_state *s, bool display_side, bool has_gpu)
 			.old_video_mode = false};
 
 	s->glob.config = &s->config;
+	s->glob.stats.fd = -1;
+	s->glob.recorder.fd = -1;
 	s->glob.render = (struct render_data){
 			.drm_node_path = s->config.drm_node,
 			.drm_fd = -1,
@@ -383,6 +404,7 @@ void cleanup_state(struct test_state *s)
 	cleanup_render_data(&s->glob.render);
 	cleanup_hwcontext(&s->glob.render);
 	cleanup_thread_pool(&s->glob.threads);
+	cleanup_frame_pacing(&s->glob.pacing);
 
 	for (int i = 0; i < s->nrcvd; i++) {
 		free(s->rcvd[i].data);
@@ -426,3 +448,81 @@ void test_atomic_log_handler(const char *file, int line, enum log_level level,
 	(void)write(STDOUT_FILENO, msg, (size_t)nwri);
 	(void)level;
 }
+
+void run_all_tasks(struct thread_pool *pool)
+{
+	bool done = false;
+	while (!done) {
+		struct task_data task;
+		if (request_work_task(pool, &task, &done)) {
+			run_task(&task, &pool->threads[0]);
+			finish_work_task(pool);
+		}
+	}
+}
+
+void collect_sfd_update(struct thread_pool *pool, struct shadow_fd *sfd,
+		struct transfer_queue *transfers)
+{
+	collect_update(pool, sfd, transfers, false);
+	start_parallel_work(pool, &transfers->async_recv_queue);
+	run_all_tasks(pool);
+	finish_update(sfd);
+	transfer_load_async(transfers);
+}
+
+int deliver_updates(struct fd_translation_map *dst_map,
+		struct thread_pool *pool, struct transfer_queue *transfers,
+		struct delivery_counts *counts)
+{
+	struct delivery_counts c = {0};
+	int ret = 0;
+	for (int i = 0; i < transfers->end; i++) {
+		uint32_t header = *(uint32_t *)transfers->vecs[i].iov_base;
+		struct bytebuf msg = {.data = transfers->vecs[i].iov_base,
+				.size = transfer_size(header)};
+		enum wmsg_type type = transfer_type(header);
+		c.total_bytes += (int64_t)msg.size;
+		if (type == WMSG_PROTOCOL) {
+			c.nprotocol += msg.size > sizeof(uint32_t);
+			continue;
+		}
+		if (type == WMSG_BUFFER_FILL || type == WMSG_BUFFER_DIFF) {
+			c.update_bytes += (int64_t)msg.size;
+			c.nfills += type == WMSG_BUFFER_FILL;
+		} else {
+			/* Buffer updates may still be applied by the worker
+			 * threads, as in the main loop */
+			(void)wait_for_apply_tasks(pool);
+		}
+		if (type == WMSG_BUFFER_COPY) {
+			c.ncopies++;
+			c.copy_bytes += (int64_t)msg.size;
+		}
+		int r;
+		if (type == WMSG_COMPRESSION_DICT) {
+			r = apply_compression_dict(pool, &msg);
+		} else {
+			r = apply_update(dst_map, pool, NULL, type,
+					((int32_t *)msg.data)[1], &msg);
+		}
+		if (r < 0) {
+			wp_error("Failed to apply %s", wmsg_type_to_str(type));
+			ret = -1;
+		}
+	}
+	cleanup_transfer_queue(transfers);
+	memset(transfers, 0, sizeof(*transfers));
+	if (wait_for_apply_tasks(pool) < 0) {
+		ret = -1;
+	}
+	if (counts) {
+		counts->nfills += c.nfills;
+		counts->ncopies += c.ncopies;
+		counts->total_bytes += c.total_bytes;
+		counts->update_bytes += c.update_bytes;
+		counts->copy_bytes += c.copy_bytes;
+		counts->nprotocol += c.nprotocol;
+	}
+	return ret;
+}
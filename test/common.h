@@ -65,4 +65,25 @@ void send_protocol_msg(struct test_state *src, struct test_state *dst,
 int setup_state(struct test_state *s, bool display_side, bool has_gpu);
 void cleanup_state(struct test_state *s);
 
+/** Run all tasks that were started on the pool, on the calling thread */
+void run_all_tasks(struct thread_pool *pool);
+/** Collect the update for `sfd` (which should already be damaged), running
+ * the tasks this needs, and add its messages to `transfers` */
+void collect_sfd_update(struct thread_pool *pool, struct shadow_fd *sfd,
+		struct transfer_queue *transfers);
+struct delivery_counts {
+	int nfills, ncopies;
+	/* Total size of all messages, of WMSG_BUFFER_FILL and _DIFF messages,
+	 * and of WMSG_BUFFER_COPY messages */
+	int64_t total_bytes, update_bytes, copy_bytes;
+	/* Protocol messages with content (the tests send none) */
+	int nprotocol;
+};
+/** Apply the messages in `transfers` to `dst_map`, in the way the main loop
+ * would, and then clear the queue. Protocol messages are skipped. If `counts`
+ * is not NULL, add to it. Returns -1 on failure, 0 on success. */
+int deliver_updates(struct fd_translation_map *dst_map,
+		struct thread_pool *pool, struct transfer_queue *transfers,
+		struct delivery_counts *counts);
+
 #endif /* WAYPIPE_TESTCOMMON_H */
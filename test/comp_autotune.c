@@ -0,0 +1,133 @@
+/*
+ * Copyright © 2019 Manuel Stoeckl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "common.h"
+#include "shadow.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A model of compression, in which each level is 30% slower than the last,
+ * and produces 7% less output */
+static double power(double base, int exp)
+{
+	double v = 1.0;
+	for (int i = 0; i < abs(exp); i++) {
+		v *= base;
+	}
+	return exp < 0 ? 1.0 / v : v;
+}
+static double model_ns_per_byte(int level) { return 0.5 * power(1.3, level); }
+static double model_ratio(int level) { return 0.5 * power(0.93, level + 10); }
+
+static double model_cost(int level, double bandwidth, int nthreads)
+{
+	double compute = model_ns_per_byte(level) / nthreads;
+	double transfer = model_ratio(level) / bandwidth;
+	return compute > transfer ? compute : transfer;
+}
+
+/* Feed update_compression_level measurements from the model, with the given
+ * channel bandwidth (in bytes/nsec); check that it settles near the level
+ * that minimizes the modeled cost */
+static bool test_convergence(
+		enum compression_mode mode, double bandwidth, int start_level)
+{
+	struct thread_pool pool;
+	if (setup_thread_pool(&pool, mode, start_level, 1) == -1) {
+		return false;
+	}
+	bool pass = true;
+	if (enable_compression_autotune(&pool) == -1) {
+		pass = false;
+		goto end;
+	}
+	struct comp_autotune *at = &pool.autotune;
+	struct transfer_queue transfers;
+	memset(&transfers, 0, sizeof(transfers));
+
+	const uint64_t frame_size = 1 << 22;
+	int visited_min = pool.compression_level;
+	int visited_max = pool.compression_level;
+	for (int cycle = 0; cycle < 500; cycle++) {
+		int level = pool.compression_level;
+		double compute = (double)frame_size * model_ns_per_byte(level);
+		double out = (double)frame_size * model_ratio(level);
+		atomic_store(&at->comp_ns, (uint64_t)compute);
+		atomic_store(&at->comp_in_bytes, frame_size);
+		atomic_store(&at->comp_out_bytes, (uint64_t)out);
+		if (out / bandwidth > compute) {
+			/* The channel was the bottleneck */
+			transfers.blocked_bytes = (uint64_t)out;
+			transfers.blocked_ns = (uint64_t)(out / bandwidth);
+		}
+		update_compression_level(&pool, &transfers);
+		if (cycle >= 400) {
+			visited_min = min(visited_min, pool.compression_level);
+			visited_max = max(visited_max, pool.compression_level);
+		} else {
+			visited_min = visited_max = pool.compression_level;
+		}
+	}
+
+	int best = at->min_level;
+	for (int l = at->min_level; l <= at->max_level; l++) {
+		if (model_cost(l, bandwidth, pool.nthreads) <
+				model_cost(best, bandwidth, pool.nthreads)) {
+			best = l;
+		}
+	}
+	/* Periodic probes of neighboring levels are expected */
+	if (visited_min < best - 1 || visited_max > best + 1) {
+		wp_error("%s at %g MB/s: levels %d to %d used, best is %d",
+				compression_mode_to_str(mode), bandwidth * 1e3,
+				visited_min, visited_max, best);
+		pass = false;
+	}
+	printf("%s, %g MB/s, starting at %d: settled at %d..%d, best %d, %s\n",
+			compression_mode_to_str(mode), bandwidth * 1e3,
+			start_level, visited_min, visited_max, best,
+			pass ? "pass" : "FAIL");
+end:
+	cleanup_thread_pool(&pool);
+	return pass;
+}
+
+log_handler_func_t log_funcs[2] = {NULL, test_log_handler};
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+
+	bool all_success = true;
+	const double bandwidths[] = {1e-3, 1e-2, 1e-1, 1.0, 5.0};
+	for (size_t i = 0; i < sizeof(bandwidths) / sizeof(bandwidths[0]);
+			i++) {
+		all_success &= test_convergence(COMP_ZSTD, bandwidths[i], 5);
+		all_success &= test_convergence(COMP_LZ4, bandwidths[i], -1);
+	}
+	return all_success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -26,10 +26,14 @@
 #include "common.h"
 #include "shadow.h"
 
+#include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <time.h>
+#include <unistd.h>
 
 static int64_t rand_gap_fill(char *data, size_t size, int max_run)
 {
@@ -98,7 +102,7 @@ static const char *diff_names[5] = {
 static bool run_subtest(int i, const struct subtest test, char *diff,
 		char *source, char *mirror, char *target1, char *target2,
 		interval_diff_fn_t diff_fn, int alignment_bits,
-		const char *diff_name)
+		span_copy_fn_t copy_fn, const char *diff_name)
 {
 	uint64_t ns01 = 0, ns12 = 0;
 	int64_t nruns = 0;
@@ -142,8 +146,8 @@ static bool run_subtest(int i, const struct subtest test, char *diff,
 						diff + diffsize);
 			}
 			clock_gettime(CLOCK_MONOTONIC, &t1);
-			apply_diff(test.size, target1, target2, diffsize,
-					ntrailing, diff);
+			apply_diff(copy_fn, test.size, target1, target2,
+					diffsize, ntrailing, diff);
 			clock_gettime(CLOCK_MONOTONIC, &t2);
 			ns01 += (uint64_t)((t1.tv_sec - t0.tv_sec) *
 							   1000000000LL +
@@ -154,7 +158,8 @@ static bool run_subtest(int i, const struct subtest test, char *diff,
 			net_diffsize += diffsize + ntrailing;
 		}
 
-		if (memcmp(target1, source, test.size)) {
+		if (memcmp(target1, source, test.size) ||
+				memcmp(target2, source, test.size)) {
 			printf("Failed to synchronize\n");
 			int ndiff = 0;
 			for (size_t k = 0; k < test.size; k++) {
@@ -187,6 +192,264 @@ static bool run_subtest(int i, const struct subtest test, char *diff,
 	return all_success;
 }
 
+/* Apply the queued messages, and then clear the queue. Returns the total
+ * size of the buffer updates, or -1 on failure */
+static int64_t deliver(struct fd_translation_map *dst_map,
+		struct thread_pool *pool, struct transfer_queue *transfers)
+{
+	struct delivery_counts counts = {0};
+	if (deliver_updates(dst_map, pool, transfers, &counts) < 0) {
+		return -1;
+	}
+	return counts.update_bytes;
+}
+
+#define GLYPH_SIZE 16
+#define NGLYPHS 48
+#define IMAGE_WIDTH 256
+#define IMAGE_HEIGHT 512
+#define IMAGE_SIZE (4 * IMAGE_WIDTH * IMAGE_HEIGHT)
+
+/* Draw a line of text, with glyphs from a fixed set of random images */
+static void draw_line(uint32_t *image, const uint32_t *glyphs, int line,
+		uint32_t *seed)
+{
+	int y = line * GLYPH_SIZE;
+	for (int x = 0; x < IMAGE_WIDTH; x += GLYPH_SIZE) {
+		*seed = *seed * 1103515245u + 12345u;
+		const uint32_t *glyph = &glyphs[((*seed >> 16) % NGLYPHS) *
+						GLYPH_SIZE * GLYPH_SIZE];
+		for (int r = 0; r < GLYPH_SIZE; r++) {
+			memcpy(&image[(y + r) * IMAGE_WIDTH + x],
+					&glyph[r * GLYPH_SIZE],
+					GLYPH_SIZE * sizeof(uint32_t));
+		}
+	}
+}
+
+/* Replicate a series of frames, with or without a compression dictionary;
+ * sets *net_bytes to the size of the updates sent once the dictionary was in
+ * use (or, without one, after the 50th frame) */
+static bool run_dict_roundtrip(enum compression_mode mode, int level,
+		bool use_dict, bool stream_diffs, int64_t *net_bytes)
+{
+	struct fd_translation_map src_map, dst_map;
+	setup_translation_map(&src_map, false);
+	setup_translation_map(&dst_map, true);
+	struct thread_pool src_pool, dst_pool;
+	if (setup_thread_pool(&src_pool, mode, level, 1) == -1 ||
+			setup_thread_pool(&dst_pool, mode, level, 1) == -1) {
+		return false;
+	}
+	src_pool.stream_diffs = stream_diffs;
+	bool pass = true;
+	uint32_t *glyphs = malloc(NGLYPHS * GLYPH_SIZE * GLYPH_SIZE *
+				  sizeof(uint32_t));
+	int fd = create_anon_file();
+	uint32_t *image = MAP_FAILED;
+	if (use_dict && enable_compression_dict(&src_pool) == -1) {
+		pass = false;
+		goto end;
+	}
+	if (!glyphs || fd == -1 || ftruncate(fd, IMAGE_SIZE) == -1) {
+		wp_error("Failed to create test file: %s", strerror(errno));
+		pass = false;
+		goto end;
+	}
+	image = mmap(NULL, IMAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+			0);
+	if (image == MAP_FAILED) {
+		pass = false;
+		goto end;
+	}
+	uint32_t seed = 0x1234;
+	for (int i = 0; i < NGLYPHS * GLYPH_SIZE * GLYPH_SIZE; i++) {
+		seed = seed * 1103515245u + 12345u;
+		/* Glyphs: opaque gray pixels */
+		glyphs[i] = 0xff000000u | (0x010101u * ((seed >> 16) % 256));
+	}
+	struct shadow_fd *sfd = translate_fd(&src_map, NULL, NULL, fd,
+			FDC_FILE, IMAGE_SIZE, NULL, false);
+	if (!sfd) {
+		pass = false;
+		goto end;
+	}
+	int rid = sfd->remote_id;
+
+	*net_bytes = 0;
+	int frames_after_dict = 0;
+	struct transfer_queue transfers;
+	memset(&transfers, 0, sizeof(transfers));
+	const int nlines = IMAGE_HEIGHT / GLYPH_SIZE;
+	for (int line = 0; line < nlines; line++) {
+		draw_line(image, glyphs, line, &seed);
+	}
+	sfd->is_dirty = true;
+	damage_everything(&sfd->damage);
+	for (int frame = 0; frame < 200 && frames_after_dict < 20; frame++) {
+		if (frame > 0) {
+			/* Like typing, only one line of text changes */
+			seed = seed * 1103515245u + 12345u;
+			int line = (int)((seed >> 16) % (uint32_t)nlines);
+			draw_line(image, glyphs, line, &seed);
+			const int32_t stride = 4 * IMAGE_WIDTH;
+			struct ext_interval damage = {
+					.start = line * GLYPH_SIZE * stride,
+					.width = GLYPH_SIZE * stride,
+					.rep = 1,
+					.stride = 0,
+			};
+			sfd->is_dirty = true;
+			merge_damage_records(&sfd->damage, 1, &damage,
+					src_pool.diff_alignment_bits);
+		}
+		collect_sfd_update(&src_pool, sfd, &transfers);
+		int64_t sent = deliver(&dst_map, &dst_pool, &transfers);
+
+		struct shadow_fd *dst = get_shadow_for_rid(&dst_map, rid);
+		if (sent < 0 || !dst ||
+				memcmp(dst->mem_local, image, IMAGE_SIZE)) {
+			wp_error("Frame %d was not replicated", frame);
+			pass = false;
+			break;
+		}
+		if (dst_pool.dict.remote_size > 0 ||
+				(!use_dict && frame >= 50)) {
+			*net_bytes += sent;
+			frames_after_dict++;
+		}
+		/* A dictionary message, if queued, precedes the next updates */
+		update_compression_dict(&src_pool, &transfers);
+	}
+	if (frames_after_dict == 0) {
+		wp_error("The dictionary was never sent");
+		pass = false;
+	}
+	cleanup_transfer_queue(&transfers);
+
+end:
+	if (image != MAP_FAILED) {
+		munmap(image, IMAGE_SIZE);
+	}
+	free(glyphs);
+	cleanup_translation_map(&src_map);
+	cleanup_translation_map(&dst_map);
+	cleanup_thread_pool(&src_pool);
+	cleanup_thread_pool(&dst_pool);
+	return pass;
+}
+
+static bool test_dict_roundtrip(enum compression_mode mode, int level)
+{
+	int64_t plain_bytes = 0, dict_bytes = 0;
+	bool pass = run_dict_roundtrip(mode, level, false, true,
+			    &plain_bytes) &&
+		    run_dict_roundtrip(mode, level, true, true, &dict_bytes);
+	/* The text is made of the same glyphs in every frame, so the
+	 * dictionary should help */
+	pass = pass && dict_bytes < plain_bytes;
+	printf("%s level %d: %" PRId64 " bytes without dictionary, %" PRId64
+	       " bytes with, %s\n",
+			compression_mode_to_str(mode), level, plain_bytes,
+			dict_bytes, pass ? "pass" : "FAIL");
+	return pass;
+}
+
+/* Diffs which are compressed in pieces as they are made should replicate the
+ * same way, and be about as small */
+static bool test_stream_roundtrip(enum compression_mode mode, int level)
+{
+	int64_t split_bytes = 0, stream_bytes = 0;
+	bool pass = run_dict_roundtrip(mode, level, false, false,
+			    &split_bytes) &&
+		    run_dict_roundtrip(mode, level, false, true,
+				    &stream_bytes);
+	pass = pass && stream_bytes <= split_bytes + split_bytes / 10;
+	printf("%s level %d: %" PRId64 " bytes compressing whole diffs, %" PRId64
+	       " bytes compressing as they are made, %s\n",
+			compression_mode_to_str(mode), level, split_bytes,
+			stream_bytes, pass ? "pass" : "FAIL");
+	return pass;
+}
+
+#define COPY_AREA 20000
+
+/* Check that a copy kernel matches memcpy, for a variety of sizes and
+ * alignments, both alone and through stride_shifted_copy */
+static bool test_copy_kernel(span_copy_fn_t copy_fn, const char *name)
+{
+	char *src = malloc(COPY_AREA);
+	char *dest = malloc(COPY_AREA);
+	char *nt_dest = malloc(COPY_AREA);
+	char *ref = malloc(COPY_AREA);
+	char *nt_ref = malloc(COPY_AREA);
+	bool pass = src && dest && nt_dest && ref && nt_ref;
+	srand(0x25);
+	for (size_t k = 0; pass && k < COPY_AREA; k++) {
+		src[k] = (char)rand();
+	}
+	int nchecks = 0;
+	for (int trial = 0; pass && trial < 2000; trial++) {
+		memset(dest, 0x5a, COPY_AREA);
+		memset(ref, 0x5a, COPY_AREA);
+		memset(nt_dest, 0xa5, COPY_AREA);
+		memset(nt_ref, 0xa5, COPY_AREA);
+		size_t src_off = (size_t)(rand() % 64);
+		size_t dst_off = (size_t)(rand() % 64);
+		size_t nt_off = (size_t)(rand() % 64);
+		size_t size = trial < 200 ? (size_t)trial
+					  : (size_t)(rand() % 8192);
+		bool single = trial % 3 == 0;
+
+		(*copy_fn)(single ? NULL : dest + dst_off, nt_dest + nt_off,
+				src + src_off, size);
+		if (!single) {
+			memcpy(ref + dst_off, src + src_off, size);
+		}
+		memcpy(nt_ref + nt_off, src + src_off, size);
+		if (memcmp(dest, ref, COPY_AREA) ||
+				memcmp(nt_dest, nt_ref, COPY_AREA)) {
+			printf("%s copy of %zu bytes, offsets %zu,%zu,%zu, differs\n",
+					name, size, src_off, dst_off, nt_off);
+			pass = false;
+		}
+		nchecks++;
+
+		/* Copying rows between buffers with different strides */
+		size_t src_stride = 64 + (size_t)(rand() % 1500);
+		size_t dst_stride = 64 + (size_t)(rand() % 1500);
+		size_t row_length = 1 + (size_t)rand() %
+						    minu(src_stride, dst_stride);
+		size_t nrows = (COPY_AREA - 64) /
+			       maxu(src_stride, dst_stride);
+		size_t start = (size_t)rand() % (nrows * src_stride);
+		size_t length = (size_t)rand() % (nrows * src_stride - start);
+		memset(nt_dest, 0xa5, COPY_AREA);
+		memset(nt_ref, 0xa5, COPY_AREA);
+		stride_shifted_copy(copy_fn, nt_dest + nt_off, src + src_off,
+				start, length, row_length, src_stride,
+				dst_stride);
+		stride_shifted_copy(NULL, nt_ref + nt_off, src + src_off,
+				start, length, row_length, src_stride,
+				dst_stride);
+		if (memcmp(nt_dest, nt_ref, COPY_AREA)) {
+			printf("%s stride copy of [%zu,%zu) from stride %zu to %zu, rows %zu, differs\n",
+					name, start, start + length, src_stride,
+					dst_stride, row_length);
+			pass = false;
+		}
+		nchecks++;
+	}
+	printf("%s copy kernel: %d checks, %s\n", name, nchecks,
+			pass ? "pass" : "FAIL");
+	free(src);
+	free(dest);
+	free(nt_dest);
+	free(ref);
+	free(nt_ref);
+	return pass;
+}
+
 log_handler_func_t log_funcs[2] = {test_log_handler, test_log_handler};
 int main(int argc, char **argv)
 {
@@ -216,7 +479,9 @@ int main(int argc, char **argv)
 			}
 			all_success &= run_subtest(i, test, diff, source,
 					mirror, target1, target2, diff_fn,
-					alignment_bits, diff_names[a]);
+					alignment_bits,
+					get_copy_function(diff_types[a]),
+					diff_names[a]);
 		}
 		free(diff);
 		free(source);
@@ -225,5 +490,22 @@ int main(int argc, char **argv)
 		free(target2);
 	}
 
+	const int ntypes = sizeof(diff_types) / sizeof(diff_types[0]);
+	for (int a = 0; a < ntypes; a++) {
+		span_copy_fn_t copy_fn = get_copy_function(diff_types[a]);
+		if (copy_fn) {
+			all_success &= test_copy_kernel(copy_fn, diff_names[a]);
+		}
+	}
+
+#ifdef HAS_LZ4
+	all_success &= test_dict_roundtrip(COMP_LZ4, -1);
+	all_success &= test_dict_roundtrip(COMP_LZ4, 3);
+#endif
+#ifdef HAS_ZSTD
+	all_success &= test_dict_roundtrip(COMP_ZSTD, 5);
+	all_success &= test_stream_roundtrip(COMP_ZSTD, 1);
+#endif
+
 	return all_success ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -222,10 +222,7 @@ static void wait_for_thread_pool(struct thread_pool *pool)
 
 		if (has_task) {
 			run_task(&task, &pool->threads[0]);
-
-			pthread_mutex_lock(&pool->work_mutex);
-			pool->tasks_in_progress--;
-			pthread_mutex_unlock(&pool->work_mutex);
+			finish_work_task(pool);
 			/* To skip the next poll */
 		} else {
 			/* Wait a short amount */
@@ -244,7 +241,6 @@ static bool test_transfer(struct fd_translation_map *src_map,
 {
 	struct transfer_queue transfer_data;
 	memset(&transfer_data, 0, sizeof(struct transfer_queue));
-	pthread_mutex_init(&transfer_data.async_recv_queue.lock, NULL);
 
 	struct shadow_fd *src_shadow = get_shadow_for_rid(src_map, rid);
 	collect_update(src_pool, src_shadow, &transfer_data, false);
@@ -288,6 +284,10 @@ static bool test_transfer(struct fd_translation_map *src_map,
 		start += alignz(tmp.size, 4);
 	}
 	free(res.data);
+	if (wait_for_apply_tasks(dst_pool) < 0) {
+		wp_error("Applying updates failed");
+		return false;
+	}
 
 	/* first round, this only exists after the transfer */
 	struct shadow_fd *dst_shadow = get_shadow_for_rid(dst_map, rid);
@@ -52,7 +52,7 @@ struct copy_setup {
 static void *start_looper(void *data)
 {
 	struct copy_setup *setup = (struct copy_setup *)data;
-	main_interface_loop(setup->conn, setup->wayl, -1, setup->mc,
+	main_interface_loop(setup->conn, setup->wayl, -1, NULL, 0, setup->mc,
 			setup->is_display_side);
 	return NULL;
 }
@@ -0,0 +1,651 @@
+/*
+ * Copyright © 2019 Manuel Stoeckl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "common.h"
+#include "shadow.h"
+
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Each measurement is printed as one line of JSON, with the median and
+ * minimum time over a number of rounds, so that results can be compared
+ * between commits and machines */
+
+#define MAX_ROUNDS 32
+
+static const enum diff_type diff_types[5] = {
+		DIFF_AVX512F,
+		DIFF_AVX2,
+		DIFF_SSE3,
+		DIFF_NEON,
+		DIFF_C,
+};
+static const char *diff_names[5] = {
+		"avx512",
+		"avx2",
+		"sse3",
+		"neon",
+		"c",
+};
+
+struct bench_opts {
+	int nrounds;
+	const size_t *sizes;
+	int nsizes;
+	const int *thread_counts;
+	int nthread_counts;
+};
+
+static int64_t now_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (int64_t)t.tv_sec * 1000000000LL + (int64_t)t.tv_nsec;
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/* Finish a line of results with the median and minimum of the samples, and
+ * the throughput for `nbytes` at the median time */
+static void print_times(int64_t *samples, int n, size_t nbytes)
+{
+	qsort(samples, (size_t)n, sizeof(int64_t), compare_int64);
+	int64_t median = samples[n / 2];
+	printf(",\"median_ns\":%" PRId64 ",\"min_ns\":%" PRId64
+	       ",\"gb_per_s\":%.3f}\n",
+			median, samples[0],
+			(double)nbytes / (double)(median > 0 ? median : 1));
+	fflush(stdout);
+}
+
+static uint32_t next_random(uint32_t *state)
+{
+	/* xorshift32, for the same patterns on every platform */
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+static void fill_text_like(char *data, size_t size)
+{
+	for (size_t i = 0; i < size; i++) {
+		size_t step = i / 203 - i / 501;
+		bool on = step % 2 == 0;
+		data[i] = (char)(on ? ((step >> 1) & 0x2) + 0xfe : 0x00);
+	}
+}
+
+enum change_pattern {
+	/* One word in each 4 KiB changes; damage covers everything */
+	CHANGE_SPARSE,
+	/* A quarter of all words change; damage covers everything */
+	CHANGE_DENSE,
+	/* Everything in a 1 KiB column of each 4 KiB row changes, and only
+	 * that column is damaged, as for a window drawn on a larger screen */
+	CHANGE_COLUMN,
+};
+static const char *pattern_names[3] = {"sparse", "dense", "column"};
+
+#define COLUMN_ROW 4096
+#define COLUMN_WIDTH 1024
+
+/* Change `data` according to the pattern, and write the damage intervals to
+ * `intvs`; returns the number of intervals */
+static int make_changes(enum change_pattern pattern, uint32_t *data,
+		size_t size, uint32_t seed, struct interval *intvs)
+{
+	size_t nwords = size / 4;
+	switch (pattern) {
+	case CHANGE_SPARSE:
+		for (size_t i = seed % 1024; i < nwords; i += 1024) {
+			data[i] += seed;
+		}
+		break;
+	case CHANGE_DENSE:
+		for (size_t i = 0; i < nwords; i++) {
+			if ((next_random(&seed) & 3) == 0) {
+				data[i] ^= seed;
+			}
+		}
+		break;
+	case CHANGE_COLUMN: {
+		int n = 0;
+		for (size_t row = 0; row + COLUMN_ROW <= size;
+				row += COLUMN_ROW) {
+			size_t start = row + COLUMN_ROW / 2;
+			for (size_t i = start / 4;
+					i < (start + COLUMN_WIDTH) / 4; i++) {
+				data[i] += seed;
+			}
+			intvs[n].start = (int32_t)start;
+			intvs[n].end = (int32_t)(start + COLUMN_WIDTH);
+			n++;
+		}
+		return n;
+	}
+	}
+	intvs[0].start = 0;
+	intvs[0].end = (int32_t)size;
+	return 1;
+}
+
+/* Buffers for diffing an image and applying the diff */
+struct diff_buffers {
+	char *orig, *changed, *mirror, *target1, *target2, *diff;
+	struct interval *intvs;
+	int nintvs;
+};
+
+/* Time construct_diff_core with one kernel, and apply_diff with the copy
+ * kernel using the same instructions */
+static void time_diff_kernel(const struct bench_opts *opts,
+		struct diff_buffers *b, size_t size, int pattern, int type)
+{
+	int bits;
+	interval_diff_fn_t diff_fn = get_diff_function(diff_types[type], &bits);
+	span_copy_fn_t copy_fn = get_copy_function(diff_types[type]);
+	if (!diff_fn) {
+		return;
+	}
+	int64_t samples[MAX_ROUNDS];
+	size_t diffsize = 0;
+	for (int r = 0; r < opts->nrounds; r++) {
+		memcpy(b->mirror, b->orig, size);
+		int64_t t0 = now_ns();
+		diffsize = construct_diff_core(diff_fn, bits, b->intvs,
+				b->nintvs, b->mirror, b->changed, b->diff);
+		samples[r] = now_ns() - t0;
+	}
+	printf("{\"bench\":\"diff\",\"kernel\":\"%s\",\"alignment_bits\":%d,"
+	       "\"size\":%zu,\"pattern\":\"%s\",\"diff_bytes\":%zu",
+			diff_names[type], bits, size, pattern_names[pattern],
+			diffsize);
+	print_times(samples, opts->nrounds, size);
+	if (!copy_fn) {
+		return;
+	}
+
+	for (int r = 0; r < opts->nrounds; r++) {
+		memcpy(b->target1, b->orig, size);
+		memcpy(b->target2, b->orig, size);
+		int64_t t0 = now_ns();
+		apply_diff(copy_fn, size, b->target1, b->target2, diffsize, 0,
+				b->diff);
+		samples[r] = now_ns() - t0;
+	}
+	if (memcmp(b->target1, b->changed, size) ||
+			memcmp(b->target2, b->changed, size)) {
+		wp_error("Applying %s diff did not reproduce the change",
+				diff_names[type]);
+	}
+	printf("{\"bench\":\"apply\",\"kernel\":\"%s\",\"size\":%zu,"
+	       "\"pattern\":\"%s\",\"diff_bytes\":%zu",
+			diff_names[type], size, pattern_names[pattern],
+			diffsize);
+	print_times(samples, opts->nrounds, size);
+}
+
+/* Time construct_diff_core with each available kernel, and apply_diff for
+ * the diffs it makes */
+static bool run_diff_bench(const struct bench_opts *opts)
+{
+	bool pass = true;
+	for (int s = 0; s < opts->nsizes && pass; s++) {
+		size_t size = opts->sizes[s];
+		size_t max_intvs = size / COLUMN_ROW + 1;
+		struct diff_buffers b;
+		b.orig = aligned_alloc(64, size);
+		b.changed = aligned_alloc(64, size);
+		b.mirror = aligned_alloc(64, size);
+		b.target1 = aligned_alloc(64, size);
+		b.target2 = aligned_alloc(64, size);
+		b.diff = aligned_alloc(64, alignz(size + 8 * max_intvs, 64));
+		b.intvs = malloc(sizeof(struct interval) * max_intvs);
+		if (!b.orig || !b.changed || !b.mirror || !b.target1 ||
+				!b.target2 || !b.diff || !b.intvs) {
+			wp_error("Failed to allocate %zu byte buffers", size);
+			pass = false;
+		}
+		for (int p = 0; p < 3 && pass; p++) {
+			fill_text_like(b.orig, size);
+			memcpy(b.changed, b.orig, size);
+			b.nintvs = make_changes((enum change_pattern)p,
+					(uint32_t *)b.changed, size,
+					0x9e3779b9u, b.intvs);
+			for (int a = 0; a < 5; a++) {
+				time_diff_kernel(opts, &b, size, p, a);
+			}
+		}
+		free(b.orig);
+		free(b.changed);
+		free(b.mirror);
+		free(b.target1);
+		free(b.target2);
+		free(b.diff);
+		free(b.intvs);
+	}
+	return pass;
+}
+
+#define SCREEN_W 1920
+#define SCREEN_H 1080
+#define SCREEN_STRIDE (SCREEN_W * 4)
+
+/* Damage a rectangle of the screen, in pixels */
+static struct ext_interval screen_rect(int x, int y, int w, int h)
+{
+	x = x < SCREEN_W ? x : SCREEN_W - 1;
+	y = y < SCREEN_H ? y : SCREEN_H - 1;
+	w = x + w <= SCREEN_W ? w : SCREEN_W - x;
+	h = y + h <= SCREEN_H ? h : SCREEN_H - y;
+	struct ext_interval e = {.start = y * SCREEN_STRIDE + x * 4,
+			.width = w * 4,
+			.rep = h,
+			.stride = SCREEN_STRIDE};
+	return e;
+}
+
+/* Fill `list` with the rectangles of a typical frame's damage; returns the
+ * number made */
+static int make_damage(int kind, struct ext_interval *list, uint32_t seed)
+{
+	int n = 0;
+	switch (kind) {
+	case 0:
+		/* Glyphs typed or redrawn across a terminal */
+		for (; n < 400; n++) {
+			uint32_t v = next_random(&seed);
+			list[n] = screen_rect((int)(v % SCREEN_W),
+					(int)((v >> 11) % SCREEN_H), 8, 16);
+		}
+		break;
+	case 1:
+		/* Rows of a scrolled list */
+		for (; n < 24; n++) {
+			list[n] = screen_rect(0, n * 45, SCREEN_W, 20);
+		}
+		break;
+	default:
+		/* A few overlapping windows */
+		for (; n < 12; n++) {
+			uint32_t v = next_random(&seed);
+			list[n] = screen_rect((int)(v % SCREEN_W),
+					(int)((v >> 11) % SCREEN_H),
+					200 + (int)((v >> 3) % 600),
+					100 + (int)((v >> 7) % 500));
+		}
+		break;
+	}
+	return n;
+}
+static const char *damage_names[3] = {"glyphs", "rows", "windows"};
+
+/* Time merge_mergesort for different damage patterns, merge margins and
+ * alignments, and report how many intervals it made and how much they
+ * cover, since larger margins trade diffing work for fewer intervals */
+static bool run_merge_bench(const struct bench_opts *opts)
+{
+	const int margins[] = {0, 64, 256, 1024, 4096};
+	const int align_bits[] = {3, 5, 6};
+	struct ext_interval list[400];
+	for (int k = 0; k < 3; k++) {
+		int nlist = make_damage(k, list, 0x2545f491u);
+		size_t input_bytes = 0;
+		for (int i = 0; i < nlist; i++) {
+			input_bytes += (size_t)list[i].width *
+				       (size_t)list[i].rep;
+		}
+		for (int m = 0; m < 5; m++) {
+			for (int b = 0; b < 3; b++) {
+				int64_t samples[MAX_ROUNDS];
+				int count = 0;
+				size_t covered = 0;
+				for (int r = 0; r < opts->nrounds; r++) {
+					struct interval *out = NULL;
+					int64_t t0 = now_ns();
+					merge_mergesort(0, NULL, nlist, list,
+							&count, &out,
+							margins[m],
+							align_bits[b]);
+					samples[r] = now_ns() - t0;
+					covered = 0;
+					for (int i = 0; i < count; i++) {
+						int32_t w = out[i].end -
+							    out[i].start;
+						covered += (size_t)w;
+					}
+					free(out);
+				}
+				printf("{\"bench\":\"merge\",\"damage\":\"%s\","
+				       "\"rects\":%d,\"merge_margin\":%d,"
+				       "\"alignment_bits\":%d,"
+				       "\"intervals\":%d,\"input_bytes\":%zu,"
+				       "\"covered_bytes\":%zu",
+						damage_names[k], nlist,
+						margins[m], align_bits[b],
+						count, input_bytes, covered);
+				print_times(samples, opts->nrounds,
+						input_bytes);
+			}
+		}
+	}
+	return true;
+}
+
+struct comp_setting {
+	enum compression_mode mode;
+	int level;
+};
+
+/* Time compress_buffer and uncompress_buffer for one input; returns false if
+ * the input did not roundtrip */
+static bool time_compression(const struct bench_opts *opts,
+		struct thread_pool *pool, const char *content,
+		const char *input, size_t isize, char *comp, size_t space,
+		char *out)
+{
+	struct comp_ctx *ctx = &pool->threads[0].comp_ctx;
+	const char *method = compression_mode_to_str(pool->compression);
+	int64_t samples[MAX_ROUNDS];
+	struct bytebuf dst = {0};
+	for (int r = 0; r < opts->nrounds; r++) {
+		int64_t t0 = now_ns();
+		compress_buffer(pool, ctx, isize, input, space, comp, &dst);
+		samples[r] = now_ns() - t0;
+	}
+	printf("{\"bench\":\"compress\",\"method\":\"%s\",\"level\":%d,"
+	       "\"content\":\"%s\",\"size\":%zu,\"output_bytes\":%zu",
+			method, pool->compression_level, content, isize,
+			dst.size);
+	print_times(samples, opts->nrounds, isize);
+
+	bool pass = true;
+	for (int r = 0; r < opts->nrounds; r++) {
+		size_t wsize = 0;
+		const char *wbuf = NULL;
+		int64_t t0 = now_ns();
+		uncompress_buffer(pool, ctx, dst.size, dst.data, isize, out,
+				&wsize, &wbuf);
+		samples[r] = now_ns() - t0;
+		pass &= wsize == isize && !memcmp(wbuf, input, isize);
+	}
+	if (!pass) {
+		wp_error("%s %s did not roundtrip", method, content);
+	}
+	printf("{\"bench\":\"uncompress\",\"method\":\"%s\",\"level\":%d,"
+	       "\"content\":\"%s\",\"size\":%zu,\"input_bytes\":%zu",
+			method, pool->compression_level, content, isize,
+			dst.size);
+	print_times(samples, opts->nrounds, isize);
+	return pass;
+}
+
+/* Time compress_buffer and uncompress_buffer for each compression method,
+ * both on image-like content and on the diff of a dense change */
+static bool run_comp_bench(const struct bench_opts *opts)
+{
+	const struct comp_setting settings[] = {
+#ifdef HAS_LZ4
+			{COMP_LZ4, -1},
+			{COMP_LZ4, 3},
+#endif
+#ifdef HAS_ZSTD
+			{COMP_ZSTD, 1},
+			{COMP_ZSTD, 5},
+#endif
+			{COMP_NONE, 0},
+	};
+	const int nsettings = sizeof(settings) / sizeof(settings[0]);
+	bool pass = true;
+	for (int s = 0; s < opts->nsizes && pass; s++) {
+		size_t size = opts->sizes[s];
+		char *image = aligned_alloc(64, size);
+		char *diff = aligned_alloc(64, alignz(size + 8, 64));
+		char *mirror = aligned_alloc(64, size);
+		char *changed = aligned_alloc(64, size);
+		char *out = malloc(size + 8);
+		if (!image || !diff || !mirror || !changed || !out) {
+			wp_error("Failed to allocate %zu byte buffers", size);
+			pass = false;
+		}
+		size_t diffsize = 0;
+		if (pass) {
+			fill_text_like(image, size);
+			/* A diff, as compressed for real updates */
+			memcpy(mirror, image, size);
+			memcpy(changed, image, size);
+			struct interval all;
+			(void)make_changes(CHANGE_DENSE, (uint32_t *)changed,
+					size, 0x1234567u, &all);
+			int bits;
+			interval_diff_fn_t diff_fn =
+					get_diff_function(DIFF_FASTEST, &bits);
+			diffsize = construct_diff_core(diff_fn, bits, &all, 1,
+					mirror, changed, diff);
+		}
+		for (int c = 0; c < nsettings && pass; c++) {
+			struct thread_pool pool;
+			if (setup_thread_pool(&pool, settings[c].mode,
+					    settings[c].level, 1) == -1) {
+				pass = false;
+				break;
+			}
+			size_t space = compress_bufsize(&pool, size + 8);
+			char *comp = malloc(space > 0 ? space : 1);
+			if (!comp) {
+				pass = false;
+			} else {
+				pass &= time_compression(opts, &pool, "image",
+						image, size, comp, space, out);
+				pass &= time_compression(opts, &pool, "diff",
+						diff, diffsize, comp, space,
+						out);
+			}
+			free(comp);
+			cleanup_thread_pool(&pool);
+		}
+		free(image);
+		free(diff);
+		free(mirror);
+		free(changed);
+		free(out);
+	}
+	return pass;
+}
+
+/* Run all tasks of an update, on this thread and the pool's workers */
+static void run_update_tasks(struct thread_pool *pool)
+{
+	bool done = false;
+	while (!done) {
+		struct task_data task;
+		if (request_work_task(pool, &task, &done)) {
+			run_task(&task, &pool->threads[0]);
+			finish_work_task(pool);
+		} else if (!done) {
+			struct pollfd pfd = {.fd = pool->selfpipe_r,
+					.events = POLLIN};
+			(void)poll(&pfd, 1, 1);
+			uint8_t flush[64];
+			if (pfd.revents & POLLIN) {
+				(void)read(pool->selfpipe_r, flush,
+						sizeof(flush));
+			}
+		}
+	}
+}
+
+/* Time making and compressing the update for a changed file, as the main
+ * loop does, with different numbers of threads */
+static bool run_pipeline_bench(const struct bench_opts *opts)
+{
+	for (int s = 0; s < opts->nsizes; s++) {
+		size_t size = opts->sizes[s];
+		char *image = aligned_alloc(64, size);
+		if (!image) {
+			return false;
+		}
+		fill_text_like(image, size);
+		for (int t = 0; t < opts->nthread_counts; t++) {
+			int nthreads = opts->thread_counts[t];
+			struct thread_pool pool;
+			if (setup_thread_pool(&pool, COMP_LZ4, -1, nthreads) ==
+					-1) {
+				free(image);
+				return false;
+			}
+			struct fd_translation_map map;
+			setup_translation_map(&map, false);
+			struct render_data render;
+			memset(&render, 0, sizeof(render));
+			render.disabled = true;
+			render.drm_fd = 1;
+			render.av_disabled = true;
+
+			struct wmsg_open_file file_msg;
+			file_msg.remote_id = 0;
+			file_msg.file_size = (uint32_t)size;
+			file_msg.size_and_type = transfer_header(
+					sizeof(struct wmsg_open_file),
+					WMSG_OPEN_FILE);
+			struct bytebuf msg = {
+					.size = sizeof(struct wmsg_open_file),
+					.data = (char *)&file_msg};
+			(void)apply_update(&map, &pool, &render, WMSG_OPEN_FILE,
+					0, &msg);
+			struct shadow_fd *sfd = get_shadow_for_rid(&map, 0);
+			if (!sfd) {
+				cleanup_translation_map(&map);
+				cleanup_thread_pool(&pool);
+				free(image);
+				return false;
+			}
+
+			int64_t samples[MAX_ROUNDS];
+			size_t wire_bytes = 0;
+			struct interval all;
+			for (int r = 0; r < opts->nrounds; r++) {
+				memcpy(sfd->mem_local, image, size);
+				memcpy(sfd->mem_mirror, image, size);
+				(void)make_changes(CHANGE_DENSE,
+						(uint32_t *)sfd->mem_local,
+						size, 0x51ed2701u + (uint32_t)r,
+						&all);
+				sfd->is_dirty = true;
+				damage_everything(&sfd->damage);
+
+				struct transfer_queue transfers;
+				memset(&transfers, 0, sizeof(transfers));
+				int64_t t0 = now_ns();
+				collect_update(&pool, sfd, &transfers, false);
+				start_parallel_work(&pool,
+						&transfers.async_recv_queue);
+				run_update_tasks(&pool);
+				samples[r] = now_ns() - t0;
+				finish_update(sfd);
+				transfer_load_async(&transfers);
+				wire_bytes = 0;
+				for (int i = transfers.start; i < transfers.end;
+						i++) {
+					wire_bytes += transfers.vecs[i].iov_len;
+				}
+				cleanup_transfer_queue(&transfers);
+			}
+			printf("{\"bench\":\"pipeline\",\"method\":\"%s\","
+			       "\"level\":%d,\"threads\":%d,\"size\":%zu,"
+			       "\"wire_bytes\":%zu",
+					compression_mode_to_str(
+							pool.compression),
+					pool.compression_level,
+					pool_thread_count(&pool), size,
+					wire_bytes);
+			print_times(samples, opts->nrounds, size);
+			cleanup_translation_map(&map);
+			cleanup_thread_pool(&pool);
+		}
+		free(image);
+	}
+	return true;
+}
+
+log_handler_func_t log_funcs[2] = {NULL, test_log_handler};
+int main(int argc, char **argv)
+{
+	bool quick = argc > 1 && !strcmp(argv[1], "--quick");
+	if (argc > 2 || (argc == 2 && !quick)) {
+		fprintf(stderr, "Usage: %s [--quick]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	const size_t sizes[] = {(size_t)64 << 10, (size_t)1 << 20,
+			(size_t)16 << 20};
+	int thread_counts[] = {1, 2, 4, 8};
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int nthread_counts = 1;
+	while (nthread_counts < 4 &&
+			thread_counts[nthread_counts] <= (int)ncpus) {
+		nthread_counts++;
+	}
+	struct bench_opts opts = {.nrounds = 15,
+			.sizes = sizes,
+			.nsizes = 3,
+			.thread_counts = thread_counts,
+			.nthread_counts = nthread_counts};
+	/* The pipeline's tasks are split at 256 KiB */
+	const size_t pipeline_sizes[] = {(size_t)1 << 20, (size_t)16 << 20};
+	struct bench_opts pipeline_opts = opts;
+	pipeline_opts.sizes = pipeline_sizes;
+	pipeline_opts.nsizes = 2;
+	if (quick) {
+		opts.nrounds = 3;
+		opts.nsizes = 1;
+		pipeline_opts.nrounds = 3;
+		pipeline_opts.nsizes = 1;
+		/* still exercise the worker threads, even on one CPU */
+		pipeline_opts.nthread_counts = 2;
+	}
+
+	bool pass = run_diff_bench(&opts);
+	pass &= run_merge_bench(&opts);
+	pass &= run_comp_bench(&opts);
+	pass &= run_pipeline_bench(&pipeline_opts);
+	return pass ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,185 @@
+/*
+ * Copyright © 2019 Manuel Stoeckl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "common.h"
+#include "shadow.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#define TEST_PAGE 4096
+#define TEST_SIZE ((size_t)16 << 20)
+#define SLICE_SIZE ((size_t)64 << 10)
+
+/* Write to a slice of the file, and mark only that slice as damaged */
+static void draw_slice(struct shadow_fd *sfd, char *data, size_t start,
+		uint32_t seed, int alignment_bits)
+{
+	for (size_t i = 0; i < SLICE_SIZE; i++) {
+		seed = seed * 1103515245u + 12345u;
+		data[start + i] = (char)(seed >> 16);
+	}
+	struct ext_interval e = {.start = (int32_t)start,
+			.width = (int32_t)SLICE_SIZE,
+			.rep = 1,
+			.stride = 0};
+	sfd->is_dirty = true;
+	merge_damage_records(&sfd->damage, 1, &e, alignment_bits);
+}
+
+/* Count the pages of a mirror which use memory */
+static size_t count_resident_pages(const char *mirror)
+{
+	size_t npages = TEST_SIZE / TEST_PAGE;
+	unsigned char *vec = malloc(npages);
+	if (!vec || mincore((void *)mirror, TEST_SIZE, vec) == -1) {
+		free(vec);
+		return (size_t)-1;
+	}
+	size_t count = 0;
+	for (size_t i = 0; i < npages; i++) {
+		count += vec[i] & 1;
+	}
+	free(vec);
+	return count;
+}
+
+/* Send the update for the file, and check that the copy matches. (The
+ * source mirror is not read here, since reading it would map pages.) */
+static bool transfer(struct fd_translation_map *src_map,
+		struct fd_translation_map *dst_map, struct thread_pool *pool,
+		const char *data, int rid, int *nfills)
+{
+	struct transfer_queue transfers;
+	memset(&transfers, 0, sizeof(transfers));
+
+	struct shadow_fd *src = get_shadow_for_rid(src_map, rid);
+	collect_sfd_update(pool, src, &transfers);
+	struct delivery_counts counts = {0};
+	bool pass = deliver_updates(dst_map, pool, &transfers, &counts) == 0;
+	*nfills = counts.nfills;
+
+	struct shadow_fd *dst = get_shadow_for_rid(dst_map, rid);
+	if (!dst || memcmp(dst->mem_local, data, TEST_SIZE) != 0) {
+		wp_error("Copy of RID=%d does not match", rid);
+		pass = false;
+	}
+	return pass;
+}
+
+log_handler_func_t log_funcs[2] = {NULL, test_log_handler};
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+
+	/* Count residency in small pages */
+	set_huge_page_policy(false);
+
+	struct fd_translation_map src_map, dst_map;
+	setup_translation_map(&src_map, false);
+	setup_translation_map(&dst_map, true);
+	struct thread_pool pool;
+	if (setup_thread_pool(&pool, COMP_NONE, 0, 1) == -1) {
+		return EXIT_FAILURE;
+	}
+	int bits = pool.diff_alignment_bits;
+
+	int fd = create_anon_file();
+	if (fd == -1 || ftruncate(fd, (off_t)TEST_SIZE) == -1) {
+		wp_error("Failed to create test file: %s", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	char *data = mmap(NULL, TEST_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fd, 0);
+	if (data == MAP_FAILED) {
+		return EXIT_FAILURE;
+	}
+	struct shadow_fd *sfd = translate_fd(&src_map, NULL, NULL, fd, FDC_FILE,
+			TEST_SIZE, NULL, false);
+	if (!sfd) {
+		return EXIT_FAILURE;
+	}
+	/* As for a wl_shm_pool, whose buffers cover only part of it */
+	sfd->has_owner = true;
+	reset_damage(&sfd->damage);
+	int rid = sfd->remote_id;
+
+	bool pass = true;
+	int nfills = 0;
+	draw_slice(sfd, data, (size_t)1 << 20, 1, bits);
+	bool ok = transfer(&src_map, &dst_map, &pool, data, rid, &nfills);
+	struct shadow_fd *dst = get_shadow_for_rid(&dst_map, rid);
+	size_t src_pages = count_resident_pages(sfd->mem_mirror);
+	size_t dst_pages = dst ? count_resident_pages(dst->mem_mirror) : 0;
+	size_t max_pages = SLICE_SIZE / TEST_PAGE + 2;
+	printf("Initial send: mirrors use %zu and %zu pages, %s\n", src_pages,
+			dst_pages, ok ? "matches" : "MISMATCH");
+	pass &= ok && src_pages <= max_pages && dst_pages <= max_pages;
+
+	/* Mirrors are freed only once unused over a whole period */
+	int first = evict_idle_mirrors(&src_map, &pool) +
+		    evict_idle_mirrors(&dst_map, &pool);
+	int second = evict_idle_mirrors(&src_map, &pool) +
+		     evict_idle_mirrors(&dst_map, &pool);
+	dst = get_shadow_for_rid(&dst_map, rid);
+	printf("Evicted %d then %d mirrors\n", first, second);
+	pass &= first == 0 && second == 2 && !sfd->mem_mirror && dst &&
+		!dst->mem_mirror;
+
+	/* The next change resends the whole file */
+	draw_slice(sfd, data, (size_t)9 << 20, 2, bits);
+	ok = transfer(&src_map, &dst_map, &pool, data, rid, &nfills);
+	printf("After eviction: %d fills, %s\n", nfills,
+			ok ? "matches" : "MISMATCH");
+	pass &= ok && nfills > 0;
+
+	/* And later changes are diffs again */
+	draw_slice(sfd, data, (size_t)3 << 20, 3, bits);
+	ok = transfer(&src_map, &dst_map, &pool, data, rid, &nfills);
+	printf("Next change: %d fills, %s\n", nfills,
+			ok ? "matches" : "MISMATCH");
+	pass &= ok && nfills == 0;
+	if (!sfd->mem_mirror || memcmp(sfd->mem_mirror, data, TEST_SIZE)) {
+		wp_error("Source mirror does not match");
+		pass = false;
+	}
+
+	munmap(data, TEST_SIZE);
+	cleanup_translation_map(&src_map);
+	cleanup_translation_map(&dst_map);
+	cleanup_thread_pool(&pool);
+	printf("%s\n", pass ? "pass" : "FAIL");
+	return pass ? EXIT_SUCCESS : EXIT_FAILURE;
+}
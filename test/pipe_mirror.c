@@ -41,7 +41,6 @@ static int shadow_sync(struct fd_translation_map *src_map,
 {
 	struct transfer_queue queue;
 	memset(&queue, 0, sizeof(queue));
-	pthread_mutex_init(&queue.async_recv_queue.lock, NULL);
 
 	read_readable_pipes(src_map);
 
@@ -319,6 +318,120 @@ cleanup:
 	return success;
 }
 
+static char bulk_byte(size_t i) { return (char)((i * 2654435761u) >> 13); }
+
+/* Send a transfer much larger than a pipe buffer, with the receiving program
+ * reading at most `read_chunk` bytes between each synchronization */
+static bool test_bulk_transfer(size_t read_chunk)
+{
+	const size_t total = (size_t)24 << 20;
+	printf("\nTesting: bulk transfer, reading %zu bytes at a time\n",
+			read_chunk);
+	int pipe_fds[2];
+	if (pipe(pipe_fds) == -1) {
+		wp_error("Pipe failed");
+		return false;
+	}
+	int write_end = pipe_fds[1], anti_end = -1;
+
+	struct fd_translation_map src_map;
+	setup_translation_map(&src_map, false);
+	struct fd_translation_map dst_map;
+	setup_translation_map(&dst_map, true);
+
+	bool success = true;
+	char *chunk = malloc(total < read_chunk ? total : read_chunk);
+	struct shadow_fd *src_shadow = translate_fd(&src_map, NULL, NULL,
+			pipe_fds[0], FDC_PIPE, 0, NULL, false);
+	shadow_decref_transfer(src_shadow);
+	int rid = src_shadow->remote_id;
+	struct shadow_fd *dst_shadow = NULL;
+	if (!chunk || shadow_sync(&src_map, &dst_map) == -1 ||
+			!(dst_shadow = get_shadow_for_rid(&dst_map, rid))) {
+		wp_error("Failed to replicate pipe");
+		success = false;
+		goto cleanup;
+	}
+	anti_end = dup(dst_shadow->fd_local);
+	shadow_decref_transfer(dst_shadow);
+	if (set_nonblocking(anti_end) == -1 ||
+			set_nonblocking(write_end) == -1) {
+		wp_error("Failed to make user fds nonblocking");
+		success = false;
+		goto cleanup;
+	}
+
+	size_t nwritten = 0, nread = 0;
+	int nsyncs = 0;
+	while (nread < total && nsyncs < 100000) {
+		while (nwritten < total) {
+			char buf[16384];
+			size_t amt = total - nwritten < sizeof(buf)
+						     ? total - nwritten
+						     : sizeof(buf);
+			for (size_t i = 0; i < amt; i++) {
+				buf[i] = bulk_byte(nwritten + i);
+			}
+			ssize_t ret = write(write_end, buf, amt);
+			if (ret <= 0) {
+				break;
+			}
+			nwritten += (size_t)ret;
+		}
+		if (nwritten == total && write_end != -1) {
+			checked_close(write_end);
+			write_end = -1;
+		}
+
+		/* The shadows are destroyed once the pipe has been closed
+		 * and emptied */
+		src_shadow = get_shadow_for_rid(&src_map, rid);
+		dst_shadow = get_shadow_for_rid(&dst_map, rid);
+		if (src_shadow) {
+			src_shadow->pipe.readable = true;
+		}
+		if (dst_shadow) {
+			dst_shadow->pipe.writable = true;
+		}
+		if (shadow_sync(&src_map, &dst_map) == -1) {
+			success = false;
+			goto cleanup;
+		}
+		nsyncs++;
+
+		ssize_t rr = read(anti_end, chunk, read_chunk);
+		if (rr == -1 && errno != EAGAIN) {
+			wp_error("Read failed: %s", strerror(errno));
+			success = false;
+			break;
+		}
+		for (ssize_t i = 0; i < rr; i++) {
+			if (chunk[i] != bulk_byte(nread + (size_t)i)) {
+				wp_error("Mismatch at byte %zu",
+						nread + (size_t)i);
+				success = false;
+				goto cleanup;
+			}
+		}
+		nread += rr > 0 ? (size_t)rr : 0;
+	}
+	success = success && nread == total;
+	printf("Received %zu of %zu bytes after %d synchronizations\n", nread,
+			total, nsyncs);
+	printf("Test: %s\n", success ? "pass" : "FAIL");
+cleanup:
+	free(chunk);
+	if (anti_end != -1) {
+		checked_close(anti_end);
+	}
+	if (write_end != -1) {
+		checked_close(write_end);
+	}
+	cleanup_translation_map(&src_map);
+	cleanup_translation_map(&dst_map);
+	return success;
+}
+
 log_handler_func_t log_funcs[2] = {NULL, test_log_handler};
 int main(int argc, char **argv)
 {
@@ -341,6 +454,8 @@ int main(int argc, char **argv)
 				bits & 8, bits & 16);
 		all_success = all_success && pass;
 	}
+	all_success &= test_bulk_transfer(1 << 20);
+	all_success &= test_bulk_transfer(12345);
 	printf("\nSuccess: %c\n", all_success ? 'Y' : 'n');
 	return all_success ? EXIT_SUCCESS : EXIT_FAILURE;
 }
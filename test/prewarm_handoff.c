@@ -0,0 +1,190 @@
+/*
+ * Copyright © 2019 Manuel Stoeckl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "common.h"
+#include "main.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static const struct main_config config = {
+		.drm_node = NULL,
+		.n_worker_threads = 2,
+		.compression = COMP_NONE,
+		.compression_level = 0,
+		.no_gpu = true,
+		.only_linear_dmabuf = true,
+		.video_if_possible = false,
+		.prefer_hwvideo = false,
+		.prewarm = true,
+};
+
+static int start_warm(struct warm_process *warm)
+{
+	int sp[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) == -1) {
+		wp_error("Socketpair failed: %s", strerror(errno));
+		return -1;
+	}
+	/* so that the child does not print the buffered output again */
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0) {
+		checked_close(sp[0]);
+		exit(warm_interface_loop(sp[1], &config, false));
+	} else if (pid == -1) {
+		wp_error("Fork failed: %s", strerror(errno));
+		checked_close(sp[0]);
+		checked_close(sp[1]);
+		return -1;
+	}
+	checked_close(sp[1]);
+	warm->pid = pid;
+	warm->linkfd = sp[0];
+	return 0;
+}
+
+static bool exited_cleanly(pid_t pid)
+{
+	int status = 0;
+	if (waitpid(pid, &status, 0) != pid) {
+		wp_error("Failed to wait for %d: %s", (int)pid,
+				strerror(errno));
+		return false;
+	}
+	return WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+/* A prepared process which is never used should just exit */
+static bool test_unused(void)
+{
+	struct warm_process warm = {.pid = 0, .linkfd = -1};
+	if (start_warm(&warm) == -1) {
+		return false;
+	}
+	checked_close(warm.linkfd);
+	bool pass = exited_cleanly(warm.pid);
+	printf("Unused prepared process exits: %s\n", pass ? "pass" : "FAIL");
+	return pass;
+}
+
+/* Hand a connection to a prepared process, and check that a message from the
+ * application is forwarded over the channel */
+static bool test_handoff(void)
+{
+	struct warm_process warm = {.pid = 0, .linkfd = -1};
+	bool pass = true;
+	if (hand_off_connection(&warm, 0, -1, -1, -1, NULL, 0) != -1) {
+		wp_error("Handed off connection without a prepared process");
+		pass = false;
+	}
+	/* As in client and server modes, the connection only exists after the
+	 * process was prepared */
+	if (start_warm(&warm) == -1) {
+		return false;
+	}
+	int chan[2], prog[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, chan) == -1 ||
+			socketpair(AF_UNIX, SOCK_STREAM, 0, prog) == -1) {
+		wp_error("Socketpair failed: %s", strerror(errno));
+		checked_close(warm.linkfd);
+		return false;
+	}
+	pid_t warm_pid = warm.pid;
+	pid_t pid = hand_off_connection(
+			&warm, 0, chan[1], prog[1], -1, NULL, 0);
+	checked_close(chan[1]);
+	checked_close(prog[1]);
+	if (pid != warm_pid || warm.pid != 0 || warm.linkfd != -1) {
+		wp_error("Handoff returned %d, expected %d", (int)pid,
+				(int)warm_pid);
+		pass = false;
+	}
+
+	/* wl_display.sync(new_id 2) */
+	uint32_t sync_msg[3] = {1, (12u << 16) | 0u, 2};
+	if (write(prog[0], sync_msg, sizeof(sync_msg)) != sizeof(sync_msg)) {
+		wp_error("Failed to write to program socket");
+		pass = false;
+	}
+	char buf[4096];
+	size_t len = 0;
+	bool found = false;
+	while (!found && len < sizeof(buf)) {
+		struct pollfd pfd = {.fd = chan[0], .events = POLLIN};
+		if (poll(&pfd, 1, 2000) <= 0) {
+			break;
+		}
+		ssize_t r = read(chan[0], buf + len, sizeof(buf) - len);
+		if (r <= 0) {
+			break;
+		}
+		len += (size_t)r;
+		for (size_t i = 0; i + sizeof(sync_msg) <= len; i++) {
+			found |= !memcmp(buf + i, sync_msg, sizeof(sync_msg));
+		}
+	}
+	if (!found) {
+		wp_error("Message was not forwarded over the channel (%zu bytes read)",
+				len);
+		pass = false;
+	}
+
+	checked_close(prog[0]);
+	/* Drain the channel until the process closes it */
+	while (true) {
+		struct pollfd pfd = {.fd = chan[0], .events = POLLIN};
+		if (poll(&pfd, 1, 2000) <= 0 ||
+				read(chan[0], buf, sizeof(buf)) <= 0) {
+			break;
+		}
+	}
+	checked_close(chan[0]);
+	if (pid > 0 && !exited_cleanly(pid)) {
+		wp_error("Prepared process did not exit cleanly");
+		pass = false;
+	}
+	printf("Connection handed to prepared process: %s\n",
+			pass ? "pass" : "FAIL");
+	return pass;
+}
+
+log_handler_func_t log_funcs[2] = {NULL, test_log_handler};
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+
+	bool all_success = true;
+	all_success &= test_unused();
+	all_success &= test_handoff();
+	return all_success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -917,6 +917,445 @@ end:
 	return pass;
 }
 
+/* Check that frame callbacks are held back while the channel is congested,
+ * along with the deletion of their ids, and that other callbacks are not */
+static bool test_frame_pacing(void)
+{
+	fprintf(stdout, "\n  Frame pacing test\n");
+	struct transfer_states T;
+	if (setup_tstate(&T) == -1) {
+		wp_error("Test setup failed");
+		return true;
+	}
+	bool pass = true;
+
+	struct wp_objid display = {0x1}, registry = {0x2}, compositor = {0x3},
+			surface = {0x4}, frame_cb = {0x5}, sync_cb = {0x6};
+	send_wl_display_req_get_registry(&T, display, registry);
+	send_wl_registry_evt_global(&T, registry, 1, "wl_compositor", 1);
+	send_wl_registry_req_bind(
+			&T, registry, 1, "wl_compositor", 1, compositor);
+	send_wl_compositor_req_create_surface(&T, compositor, surface);
+	send_wl_surface_req_frame(&T, surface, frame_cb);
+	send_wl_surface_req_commit(&T, surface);
+	send_wl_display_req_sync(&T, display, sync_cb);
+
+	struct frame_pacing *pacing = &T.app->glob.pacing;
+	pacing->max_inflight = 1;
+	pacing->congested = true;
+	send_wl_callback_evt_done(&T, frame_cb, 100);
+	send_wl_display_evt_delete_id(&T, display, frame_cb.id);
+	send_wl_callback_evt_done(&T, sync_cb, 101);
+	send_wl_display_evt_delete_id(&T, display, sync_cb.id);
+
+	const struct msg *rcvd = &T.app->rcvd[T.app->nrcvd - 4];
+	if (rcvd[0].len != 0 || rcvd[1].len != 0) {
+		wp_error("Frame callback events were not held");
+		pass = false;
+	}
+	if (rcvd[2].len != 12 || rcvd[3].len != 12) {
+		wp_error("Sync callback events were held");
+		pass = false;
+	}
+
+	struct char_window released = {NULL, 0, 0, 0};
+	pacing->congested = false;
+	int len = release_held_events(pacing, &released);
+	const uint32_t *held = (const uint32_t *)released.data;
+	if (len != 24 || released.zone_start != 0 || released.zone_end != 24) {
+		wp_error("Released %d bytes, expected 24", len);
+		pass = false;
+	} else if (held[0] != frame_cb.id || held[2] != 100 ||
+			held[3] != display.id || held[5] != frame_cb.id) {
+		wp_error("Released messages do not match the held ones");
+		pass = false;
+	}
+	if (release_held_events(pacing, &released) != 0) {
+		wp_error("Held messages were released twice");
+		pass = false;
+	}
+	free(released.data);
+
+	cleanup_tstate(&T);
+
+	print_pass(pass);
+	return pass;
+}
+
+/* Check that buffer updates postponed while the channel is congested, or
+ * while frames are queued for presentation, are sent once this ends, even if
+ * the application does not commit again */
+static bool test_deferred_collect(bool behind)
+{
+	fprintf(stdout, "\n  Postponed update collection test (%s)\n",
+			behind ? "frames queued" : "congested");
+	struct transfer_states T;
+	if (setup_tstate(&T) == -1) {
+		wp_error("Test setup failed");
+		return true;
+	}
+	bool pass = true;
+
+	char *testpat = make_filled_pattern(16384, 0xFEDCBA98);
+	char *newpat = make_filled_pattern(16384, 0x13579BDF);
+	char *lastpat = make_filled_pattern(16384, 0x2468ACE0);
+	int fd = make_filled_file(16384, testpat);
+	int ret_fd = -1;
+
+	struct wp_objid display = {0x1}, registry = {0x2}, shm = {0x3},
+			compositor = {0x4}, pool = {0x5}, buffer = {0x6},
+			surface = {0x7};
+
+	send_wl_display_req_get_registry(&T, display, registry);
+	send_wl_registry_evt_global(&T, registry, 1, "wl_shm", 1);
+	send_wl_registry_evt_global(&T, registry, 2, "wl_compositor", 1);
+	send_wl_registry_req_bind(&T, registry, 1, "wl_shm", 1, shm);
+	send_wl_registry_req_bind(
+			&T, registry, 2, "wl_compositor", 1, compositor);
+	send_wl_shm_req_create_pool(&T, shm, pool, fd, 16384);
+	ret_fd = get_only_fd_from_msg(T.comp);
+	send_wl_shm_pool_req_create_buffer(
+			&T, pool, buffer, 0, 64, 64, 256, 0x30334258);
+	send_wl_compositor_req_create_surface(&T, compositor, surface);
+	send_wl_surface_req_attach(&T, surface, buffer, 0, 0);
+	send_wl_surface_req_damage(&T, surface, 0, 0, 64, 64);
+	send_wl_surface_req_commit(&T, surface);
+	if (!check_file_contents(ret_fd, 16384, testpat)) {
+		wp_error("Failed to transfer file");
+		pass = false;
+		goto end;
+	}
+
+	struct frame_pacing *pacing = &T.app->glob.pacing;
+	if (behind) {
+		/* An earlier commit is still to be presented */
+		pacing->collapse_frames = true;
+		pacing->behind = true;
+		pacing->nawaiting = 1;
+	} else {
+		pacing->max_inflight = 1;
+		pacing->congested = true;
+	}
+	/* Draw two frames; the commits must not reach the compositor ahead
+	 * of their content, nor the first commit with the second frame's */
+	int first_held = T.comp->nrcvd;
+	const char *frames[2] = {newpat, lastpat};
+	for (int i = 0; i < 2; i++) {
+		char *mem = mmap(NULL, 16384, PROT_READ | PROT_WRITE,
+				MAP_SHARED, fd, 0);
+		if (mem == MAP_FAILED) {
+			wp_error("Failed to map file");
+			pass = false;
+			goto end;
+		}
+		memcpy(mem, frames[i], 16384);
+		munmap(mem, 16384);
+		send_wl_surface_req_attach(&T, surface, buffer, 0, 0);
+		send_wl_surface_req_damage(&T, surface, 0, 0, 64, 64);
+		send_wl_surface_req_commit(&T, surface);
+	}
+	/* The first attach and damage need no new content */
+	const struct msg *rcvd = &T.comp->rcvd[first_held];
+	if (rcvd[0].len != 20 || rcvd[1].len != 24) {
+		wp_error("Requests before the first commit were held");
+		pass = false;
+	}
+	for (int i = 2; i < 6; i++) {
+		if (rcvd[i].len != 0) {
+			wp_error("Request %d after the first commit was sent ahead of the buffer update",
+					i);
+			pass = false;
+		}
+	}
+	if (!check_file_contents(ret_fd, 16384, testpat) ||
+			pacing_should_collect(pacing)) {
+		wp_error("Update was not postponed");
+		pass = false;
+	}
+
+	if (behind) {
+		pacing_note_discarded(pacing);
+	} else {
+		pacing->congested = false;
+	}
+	if (pacing->behind || !pacing_should_collect(pacing)) {
+		wp_error("Postponed update is not to be collected");
+		pass = false;
+	}
+	/* As the main loop does, collect without any new messages */
+	uint32_t empty = 0;
+	send_protocol_msg(T.app, T.comp, (struct msg){&empty, 0, NULL, 0});
+	const struct msg *last = &T.comp->rcvd[T.comp->nrcvd - 1];
+	if (!check_file_contents(ret_fd, 16384, lastpat) ||
+			pacing_should_collect(pacing)) {
+		wp_error("Postponed update was not sent");
+		pass = false;
+	} else if (last->len != 60 || last->data[0] != surface.id ||
+			(last->data[1] & 0xffff) != 6 ||
+			last->data[13] != surface.id ||
+			(last->data[14] & 0xffff) != 6) {
+		wp_error("Commits did not arrive with the last frame's content (%d bytes)",
+				last->len);
+		pass = false;
+	}
+	if (pacing_has_held_protocol(pacing)) {
+		wp_error("Protocol data is still held");
+		pass = false;
+	}
+end:
+	free(testpat);
+	free(newpat);
+	free(lastpat);
+	checked_close(fd);
+	cleanup_tstate(&T);
+
+	print_pass(pass);
+	return pass;
+}
+
+/* Check that commits held until their buffer updates are sent do not count
+ * as waiting to be presented, so that frames stop being queued once the
+ * commits already sent are shown */
+static bool test_held_feedback(void)
+{
+	fprintf(stdout, "\n  Held commit presentation test\n");
+	bool pass = true;
+	struct frame_pacing pacing;
+	memset(&pacing, 0, sizeof(pacing));
+	pacing.collapse_frames = true;
+	pacing.behind = true;
+	struct char_window proto = {NULL, 0, 0, 0};
+	struct int_window rids = {NULL, 0, 0, 0};
+
+	/* One commit is sent, and the next is read while its buffer update
+	 * is postponed */
+	pacing_note_feedback_commit(&pacing);
+	(void)release_held_protocol(&pacing, &proto, &rids);
+	pacing_note_feedback_commit(&pacing);
+	pacing.ndeferred = 1;
+	uint32_t commit[2] = {0x7, (8 << 16) | 6};
+	if (pacing_hold_protocol(&pacing, (const char *)commit, 8, NULL, 0) !=
+					1 ||
+			release_held_protocol(&pacing, &proto, &rids) != 0) {
+		wp_error("Commit was not held");
+		pass = false;
+	}
+	if (!pacing.behind) {
+		wp_error("Frames stopped being queued before the sent commit was shown");
+		pass = false;
+	}
+	pacing_note_discarded(&pacing);
+	if (pacing.behind) {
+		wp_error("Frames still queued when only held commits remain");
+		pass = false;
+	}
+
+	pacing.ndeferred = 0;
+	if (release_held_protocol(&pacing, &proto, &rids) != 1 ||
+			proto.zone_end != 8 || pacing.nawaiting != 1) {
+		wp_error("Released commit is not waiting to be presented (%d)",
+				pacing.nawaiting);
+		pass = false;
+	}
+	free(proto.data);
+	free(rids.data);
+	cleanup_frame_pacing(&pacing);
+
+	print_pass(pass);
+	return pass;
+}
+
+static void send_presented_after(struct transfer_states *T,
+		struct wp_objid feedback, uint64_t latency_ns)
+{
+	uint64_t t = time_value + T->comp->local_time_offset + latency_ns;
+	uint64_t sec = t / 1000000000uLL;
+	send_wp_presentation_feedback_evt_presented(T, feedback,
+			(uint32_t)(sec >> 32), (uint32_t)sec,
+			(uint32_t)(t % 1000000000uLL), 16666666, 0, 0, 0);
+}
+
+/* Check that, with collapse_frames, frame events are held once commits are
+ * presented more than a frame later than usual, and released once all
+ * earlier commits have been presented */
+static bool test_frame_collapse(void)
+{
+	fprintf(stdout, "\n  Frame collapse test\n");
+	struct transfer_states T;
+	if (setup_tstate(&T) == -1) {
+		wp_error("Test setup failed");
+		return true;
+	}
+	bool pass = true;
+
+	struct wp_objid display = {0x1}, registry = {0x2}, presentation = {0x3},
+			compositor = {0x4}, surface = {0x5}, frame_cb = {0x6};
+	/* The offset between the clocks should not matter */
+	T.app->local_time_offset = 500;
+	T.comp->local_time_offset = 70000000;
+
+	send_wl_display_req_get_registry(&T, display, registry);
+	send_wl_registry_evt_global(&T, registry, 1, "wp_presentation", 1);
+	send_wl_registry_evt_global(&T, registry, 2, "wl_compositor", 1);
+	send_wl_registry_req_bind(
+			&T, registry, 1, "wp_presentation", 1, presentation);
+	send_wp_presentation_evt_clock_id(&T, presentation, CLOCK_MONOTONIC);
+	send_wl_registry_req_bind(
+			&T, registry, 2, "wl_compositor", 1, compositor);
+	send_wl_compositor_req_create_surface(&T, compositor, surface);
+
+	struct frame_pacing *pacing = &T.app->glob.pacing;
+	pacing->collapse_frames = true;
+
+	uint32_t next_id = 0x10;
+	for (int i = 0; i < 8; i++) {
+		struct wp_objid feedback = {next_id++};
+		send_wp_presentation_req_feedback(
+				&T, presentation, surface, feedback);
+		send_wl_surface_req_commit(&T, surface);
+		send_presented_after(&T, feedback, 5000000);
+	}
+	if (pacing_is_holding(pacing)) {
+		wp_error("Frames held with a steady latency");
+		pass = false;
+	}
+
+	/* Three commits queue up, and the first is shown 80ms late */
+	struct wp_objid queued[3];
+	for (int i = 0; i < 3; i++) {
+		queued[i].id = next_id++;
+		send_wp_presentation_req_feedback(
+				&T, presentation, surface, queued[i]);
+		send_wl_surface_req_commit(&T, surface);
+	}
+	send_wl_surface_req_frame(&T, surface, frame_cb);
+	send_wl_surface_req_commit(&T, surface);
+	send_presented_after(&T, queued[0], 85000000);
+	if (!pacing->behind || !pacing_is_holding(pacing)) {
+		wp_error("Late presentation did not start holding frames");
+		pass = false;
+	}
+	send_wl_callback_evt_done(&T, frame_cb, 100);
+	if (T.app->rcvd[T.app->nrcvd - 1].len != 0) {
+		wp_error("Frame callback was not held");
+		pass = false;
+	}
+
+	send_presented_after(&T, queued[1], 85000000);
+	if (!pacing_is_holding(pacing)) {
+		wp_error("Frames released while commits are still queued");
+		pass = false;
+	}
+	send_presented_after(&T, queued[2], 85000000);
+	if (pacing_is_holding(pacing)) {
+		wp_error("Frames still held after all commits were presented");
+		pass = false;
+	}
+
+	struct char_window released = {NULL, 0, 0, 0};
+	int len = release_held_events(pacing, &released);
+	/* Three presented events of 9 words, one callback done of 3 */
+	if (len != 3 * 36 + 12) {
+		wp_error("Released %d bytes, expected %d", len, 3 * 36 + 12);
+		pass = false;
+	}
+	free(released.data);
+
+	cleanup_tstate(&T);
+
+	print_pass(pass);
+	return pass;
+}
+
+static uint32_t batch_space[256];
+static int batch_len;
+static void msg_batch_handler(struct transfer_states *ts,
+		struct test_state *src, struct test_state *dst)
+{
+	(void)src;
+	(void)dst;
+	memcpy(batch_space + batch_len, ts->msg_space,
+			sizeof(uint32_t) * ts->msg_size);
+	batch_len += (int)ts->msg_size;
+	memset(ts->msg_space, 0, sizeof(ts->msg_space));
+}
+
+/* Check that the messages of a batch before the commit that changes a buffer
+ * are reported as not depending on buffer updates */
+static bool test_independent_prefix(void)
+{
+	fprintf(stdout, "\n  Independent message prefix test\n");
+	struct transfer_states T;
+	if (setup_tstate(&T) == -1) {
+		wp_error("Test setup failed");
+		return true;
+	}
+	bool pass = true;
+
+	char *testpat = make_filled_pattern(16384, 0x01234567);
+	int fd = make_filled_file(16384, testpat);
+
+	struct wp_objid display = {0x1}, registry = {0x2}, shm = {0x3},
+			compositor = {0x4}, pool = {0x5}, buffer = {0x6},
+			surface = {0x7}, frame_cb = {0x8}, sync_cb = {0x9},
+			sync_cb2 = {0xa};
+	send_wl_display_req_get_registry(&T, display, registry);
+	send_wl_registry_evt_global(&T, registry, 1, "wl_shm", 1);
+	send_wl_registry_evt_global(&T, registry, 2, "wl_compositor", 1);
+	send_wl_registry_req_bind(&T, registry, 1, "wl_shm", 1, shm);
+	send_wl_registry_req_bind(
+			&T, registry, 2, "wl_compositor", 1, compositor);
+	send_wl_shm_req_create_pool(&T, shm, pool, fd, 16384);
+	send_wl_shm_pool_req_create_buffer(
+			&T, pool, buffer, 0, 64, 64, 256, 0x30334258);
+	send_wl_compositor_req_create_surface(&T, compositor, surface);
+
+	T.send = msg_batch_handler;
+	batch_len = 0;
+	send_wl_surface_req_frame(&T, surface, frame_cb);
+	send_wl_surface_req_attach(&T, surface, buffer, 0, 0);
+	send_wl_surface_req_damage(&T, surface, 0, 0, 64, 64);
+	int prefix_len = batch_len * (int)sizeof(uint32_t);
+	send_wl_surface_req_commit(&T, surface);
+	send_wl_display_req_sync(&T, display, sync_cb);
+
+	int total_len = batch_len * (int)sizeof(uint32_t);
+	struct char_window src = {(char *)batch_space, total_len, 0,
+			total_len};
+	struct char_window dst = {calloc(2048, 1), 2048, 0, 0};
+	struct int_window fds = {calloc(4, sizeof(int)), 4, 0, 0};
+	int nindependent = parse_and_prune_messages(&T.app->glob, false, true,
+			&src, &dst, &fds);
+	if (nindependent != prefix_len || dst.zone_end != total_len) {
+		wp_error("Independent prefix has %d of %d bytes, expected %d",
+				nindependent, dst.zone_end, prefix_len);
+		pass = false;
+	}
+
+	/* Without a commit, nothing depends on buffer updates */
+	batch_len = 0;
+	send_wl_display_req_sync(&T, display, sync_cb2);
+	src = (struct char_window){(char *)batch_space, 12, 0, 12};
+	dst.zone_start = 0;
+	dst.zone_end = 0;
+	nindependent = parse_and_prune_messages(&T.app->glob, false, true,
+			&src, &dst, &fds);
+	if (nindependent != 12) {
+		wp_error("Independent prefix has %d bytes, expected 12",
+				nindependent);
+		pass = false;
+	}
+	free(dst.data);
+	free(fds.data);
+
+	free(testpat);
+	checked_close(fd);
+	cleanup_tstate(&T);
+
+	print_pass(pass);
+	return pass;
+}
+
 /* Check whether the video encoding feature can replicate a uniform
  * color image */
 static bool test_fixed_video_color_copy(enum video_coding_fmt fmt, bool hw)
@@ -935,7 +1374,7 @@ int main(int argc, char **argv)
 
 	set_initial_fds();
 
-	int ntest = 21;
+	int ntest = 27;
 	int nsuccess = 0;
 	nsuccess += test_fixed_shm_buffer_copy();
 	nsuccess += test_fixed_shm_screencopy_copy();
@@ -954,6 +1393,12 @@ int main(int argc, char **argv)
 	nsuccess += test_data_source(DDT_WLR);
 	nsuccess += test_gamma_control();
 	nsuccess += test_presentation_time();
+	nsuccess += test_frame_pacing();
+	nsuccess += test_deferred_collect(false);
+	nsuccess += test_deferred_collect(true);
+	nsuccess += test_held_feedback();
+	nsuccess += test_frame_collapse();
+	nsuccess += test_independent_prefix();
 	nsuccess += test_fixed_video_color_copy(VIDEO_H264, false);
 	nsuccess += test_fixed_video_color_copy(VIDEO_H264, true);
 	nsuccess += test_fixed_video_color_copy(VIDEO_VP9, false);
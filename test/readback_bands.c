@@ -0,0 +1,114 @@
+/*
+ * Copyright © 2019 Manuel Stoeckl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "common.h"
+#include "shadow.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STRIDE 256
+#define NROWS 200
+#define ALIGN_BITS 6
+
+/* Damage rows [y, y + h), with the given width in bytes */
+static void add_rect(struct damage *damage, int y, int h, int width)
+{
+	struct ext_interval e = {.start = y * STRIDE + 32,
+			.width = width,
+			.rep = h,
+			.stride = STRIDE};
+	merge_damage_records(damage, 1, &e, ALIGN_BITS);
+}
+
+static bool check_bands(const char *name, const struct damage *damage,
+		size_t size, int max_bands, int exp_count,
+		const struct row_band *expected)
+{
+	struct row_band bands[8];
+	int n = plan_readback_bands(
+			damage, STRIDE, size, ALIGN_BITS, bands, max_bands);
+	bool ok = n == exp_count;
+	for (int i = 0; ok && i < n; i++) {
+		ok = bands[i].start == expected[i].start &&
+		     bands[i].end == expected[i].end;
+	}
+	printf("%s: %d bands", name, n);
+	for (int i = 0; i < n; i++) {
+		printf(" [%u,%u)", bands[i].start, bands[i].end);
+	}
+	printf(", %s\n", ok ? "pass" : "FAIL");
+	return ok;
+}
+
+log_handler_func_t log_funcs[2] = {NULL, test_log_handler};
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+
+	const size_t size = STRIDE * NROWS;
+	struct damage damage = {0};
+	bool pass = true;
+
+	pass &= check_bands("No damage", &damage, size, 8, 0, NULL);
+
+	/* Two cursor-sized changes far apart */
+	add_rect(&damage, 10, 4, 64);
+	add_rect(&damage, 150, 2, 64);
+	const struct row_band apart[] = {{10, 14}, {150, 152}};
+	pass &= check_bands("Distant", &damage, size, 8, 2, apart);
+
+	/* A change between them, near enough to the first to join it */
+	add_rect(&damage, 20, 1, 64);
+	const struct row_band near[] = {{10, 21}, {150, 152}};
+	pass &= check_bands("Nearby", &damage, size, 8, 2, near);
+	pass &= check_bands("Too many", &damage, size, 1, -1, NULL);
+	reset_damage(&damage);
+
+	/* Overlapping and unsorted intervals; alignment may extend one
+	 * into the next row */
+	struct interval intvs[] = {{100 * STRIDE, 101 * STRIDE + 64},
+			{40 * STRIDE + 192, 41 * STRIDE},
+			{100 * STRIDE + 64, 100 * STRIDE + 128}};
+	struct damage manual = {.damage = intvs, .ndamage_intvs = 3};
+	const struct row_band unsorted[] = {{40, 41}, {100, 102}};
+	pass &= check_bands("Unsorted", &manual, size, 8, 2, unsorted);
+
+	/* Damage reaching the unaligned tail includes all of it */
+	struct interval tail[] = {{0, 64}, {(NROWS - 3) * STRIDE, size + 64}};
+	manual.damage = tail;
+	manual.ndamage_intvs = 2;
+	const struct row_band with_tail[] = {{0, 1}, {NROWS - 3, NROWS + 1}};
+	pass &= check_bands("Tail", &manual, size + 40, 8, 2, with_tail);
+
+	damage_everything(&damage);
+	pass &= check_bands("Everything", &damage, size, 8, -1, NULL);
+	reset_damage(&damage);
+
+	printf("%s\n", pass ? "pass" : "FAIL");
+	return pass ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,184 @@
+/*
+ * Copyright © 2019 Manuel Stoeckl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "common.h"
+#include "shadow.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#define TEST_SIZE (1 << 18)
+
+/* Add the changes to the file to the queue */
+static void collect(struct thread_pool *pool, struct shadow_fd *sfd,
+		struct transfer_queue *transfers)
+{
+	sfd->is_dirty = true;
+	damage_everything(&sfd->damage);
+	collect_sfd_update(pool, sfd, transfers);
+}
+
+/* Apply the queued messages, which should include only empty protocol
+ * messages, and then clear the queue. Returns the number of bytes of file
+ * updates, or -1 on failure */
+static int deliver(struct fd_translation_map *dst_map,
+		struct thread_pool *pool, struct transfer_queue *transfers)
+{
+	struct delivery_counts counts = {0};
+	if (deliver_updates(dst_map, pool, transfers, &counts) < 0) {
+		return -1;
+	}
+	if (counts.nprotocol > 0) {
+		wp_error("Unexpected protocol message");
+		return -1;
+	}
+	return (int)counts.update_bytes;
+}
+
+static void fill_pattern(char *data, size_t start, size_t end, uint32_t seed)
+{
+	for (size_t i = start; i < end; i++) {
+		seed = seed * 1103515245u + 12345u;
+		data[i] = (char)(seed >> 16);
+	}
+}
+
+static bool check_copy(struct fd_translation_map *dst_map, int rid,
+		const char *data)
+{
+	struct shadow_fd *dst = get_shadow_for_rid(dst_map, rid);
+	if (!dst || memcmp(dst->mem_local, data, TEST_SIZE) != 0) {
+		wp_error("Copy of RID=%d does not match", rid);
+		return false;
+	}
+	return true;
+}
+
+log_handler_func_t log_funcs[2] = {NULL, test_log_handler};
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+
+	struct fd_translation_map src_map, dst_map;
+	setup_translation_map(&src_map, false);
+	setup_translation_map(&dst_map, true);
+	struct thread_pool src_pool, dst_pool;
+	if (setup_thread_pool(&src_pool, COMP_NONE, 0, 1) == -1 ||
+			setup_thread_pool(&dst_pool, COMP_NONE, 0, 1) == -1) {
+		return EXIT_FAILURE;
+	}
+
+	int fd = create_anon_file();
+	if (fd == -1 || ftruncate(fd, TEST_SIZE) == -1) {
+		wp_error("Failed to create test file: %s", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	char *data = mmap(NULL, TEST_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fd, 0);
+	if (data == MAP_FAILED) {
+		return EXIT_FAILURE;
+	}
+	struct shadow_fd *sfd = translate_fd(&src_map, NULL, NULL, fd, FDC_FILE,
+			TEST_SIZE, NULL, false);
+	if (!sfd) {
+		return EXIT_FAILURE;
+	}
+	int rid = sfd->remote_id;
+
+	bool pass = true;
+	struct transfer_queue transfers;
+	memset(&transfers, 0, sizeof(transfers));
+	fill_pattern(data, 0, TEST_SIZE, 1);
+	collect(&src_pool, sfd, &transfers);
+	pass &= deliver(&dst_map, &dst_pool, &transfers) >= TEST_SIZE;
+	pass &= check_copy(&dst_map, rid, data);
+
+	/* A small update, lost in transit, is resent as is */
+	fill_pattern(data, 1000, 2000, 2);
+	collect(&src_pool, sfd, &transfers);
+	size_t ndropped = drop_stale_file_updates(
+			&src_map, &src_pool, &transfers);
+	int sent = deliver(&dst_map, &dst_pool, &transfers);
+	pass &= ndropped == 0 && sent > 0 && sent < TEST_SIZE / 4;
+	pass &= check_copy(&dst_map, rid, data);
+	printf("Small update: %zu bytes dropped, %d bytes sent\n", ndropped,
+			sent);
+
+	/* Several large updates are replaced with one copy of the file, which
+	 * is sent even if the application does nothing more */
+	for (uint32_t k = 0; k < 4; k++) {
+		fill_pattern(data, 0, TEST_SIZE, 10 + k);
+		collect(&src_pool, sfd, &transfers);
+	}
+	int nqueued = transfers.end;
+	ndropped = drop_stale_file_updates(&src_map, &src_pool, &transfers);
+	/* The empty messages which replace the updates are still sent */
+	pass &= transfers.end == nqueued && ndropped >= 3 * TEST_SIZE;
+	sent = deliver(&dst_map, &dst_pool, &transfers);
+	pass &= sent >= TEST_SIZE && sent < 2 * TEST_SIZE;
+	pass &= !sfd->needs_resync;
+	pass &= check_copy(&dst_map, rid, data);
+	printf("Large updates: %zu bytes dropped, %d bytes sent\n", ndropped,
+			sent);
+
+	/* Changes not yet collected when the updates are dropped are sent
+	 * by the next update */
+	for (uint32_t k = 0; k < 4; k++) {
+		fill_pattern(data, 0, TEST_SIZE, 20 + k);
+		collect(&src_pool, sfd, &transfers);
+	}
+	fill_pattern(data, 7000, 8000, 4);
+	ndropped = drop_stale_file_updates(&src_map, &src_pool, &transfers);
+	sent = deliver(&dst_map, &dst_pool, &transfers);
+	pass &= ndropped >= 3 * TEST_SIZE && sent >= TEST_SIZE;
+	collect(&src_pool, sfd, &transfers);
+	int resent = deliver(&dst_map, &dst_pool, &transfers);
+	pass &= resent > 0 && resent < TEST_SIZE / 4;
+	pass &= check_copy(&dst_map, rid, data);
+	printf("Uncollected change: %d bytes sent after the resend\n", resent);
+
+	/* Later updates are diffs against the resent contents */
+	fill_pattern(data, 5000, 6000, 3);
+	collect(&src_pool, sfd, &transfers);
+	sent = deliver(&dst_map, &dst_pool, &transfers);
+	pass &= sent > 0 && sent < TEST_SIZE / 4;
+	pass &= check_copy(&dst_map, rid, data);
+	printf("Following update: %d bytes sent\n", sent);
+
+	printf("%s\n", pass ? "pass" : "FAIL");
+
+	cleanup_translation_map(&src_map);
+	cleanup_translation_map(&dst_map);
+	cleanup_thread_pool(&src_pool);
+	cleanup_thread_pool(&dst_pool);
+	munmap(data, TEST_SIZE);
+	return pass ? EXIT_SUCCESS : EXIT_FAILURE;
+}
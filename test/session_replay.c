@@ -0,0 +1,172 @@
+/*
+ * Copyright © 2019 Manuel Stoeckl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "common.h"
+#include "main.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define TEST_SIZE (1 << 18)
+#define NFRAMES 10
+
+/* Record the messages in the queue, as the receiving side would, followed
+ * by a message with protocol data, and then clear the queue */
+static void record_frame(struct session_recorder *rec,
+		struct transfer_queue *transfers)
+{
+	for (int i = 0; i < transfers->end; i++) {
+		const char *msg = transfers->vecs[i].iov_base;
+		record_message(rec, msg, transfer_size(*(const uint32_t *)msg));
+	}
+	cleanup_transfer_queue(transfers);
+	memset(transfers, 0, sizeof(*transfers));
+	uint32_t proto[3] = {transfer_header(sizeof(proto), WMSG_PROTOCOL),
+			0x1, 0x80000};
+	record_message(rec, (const char *)proto, sizeof(proto));
+}
+
+/* Record a session in which a file is changed in a few places each frame,
+ * written with the given compression mode */
+static int make_recording(const char *prefix, enum compression_mode mode)
+{
+	struct session_recorder rec;
+	if (setup_recorder(&rec, prefix, mode) == -1) {
+		return -1;
+	}
+	struct fd_translation_map map;
+	setup_translation_map(&map, false);
+	struct thread_pool pool;
+	if (setup_thread_pool(&pool, mode, mode == COMP_NONE ? 0 : 1, 1) ==
+			-1) {
+		cleanup_recorder(&rec);
+		return -1;
+	}
+	int ret = 0;
+	int fd = create_anon_file();
+	char *data = MAP_FAILED;
+	if (fd != -1 && ftruncate(fd, TEST_SIZE) != -1) {
+		data = mmap(NULL, TEST_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+				fd, 0);
+	}
+	struct shadow_fd *sfd = NULL;
+	if (data != MAP_FAILED) {
+		sfd = translate_fd(&map, NULL, NULL, fd, FDC_FILE, TEST_SIZE,
+				NULL, false);
+	}
+	if (!sfd) {
+		wp_error("Failed to create test file: %s", strerror(errno));
+		ret = -1;
+		goto end;
+	}
+
+	/* A message for a pipe, which is not replayed */
+	struct wmsg_basic pipe_msg = {
+			.size_and_type = transfer_header(
+					sizeof(pipe_msg), WMSG_OPEN_IR_PIPE),
+			.remote_id = 1000,
+	};
+	record_message(&rec, (const char *)&pipe_msg, sizeof(pipe_msg));
+
+	struct transfer_queue transfers;
+	memset(&transfers, 0, sizeof(transfers));
+	uint32_t seed = 1;
+	for (int frame = 0; frame < NFRAMES; frame++) {
+		for (int k = 0; k < 4; k++) {
+			seed = seed * 1103515245u + 12345u;
+			size_t pos = (seed >> 8) % (TEST_SIZE - 1000);
+			memset(data + pos, (int)(seed >> 24), 1000);
+		}
+		sfd->is_dirty = true;
+		damage_everything(&sfd->damage);
+		collect_sfd_update(&pool, sfd, &transfers);
+		record_frame(&rec, &transfers);
+	}
+
+end:
+	if (data != MAP_FAILED) {
+		munmap(data, TEST_SIZE);
+	}
+	cleanup_translation_map(&map);
+	cleanup_thread_pool(&pool);
+	cleanup_recorder(&rec);
+	return ret;
+}
+
+static bool test_replay(enum compression_mode rec_mode,
+		enum compression_mode mode, int level)
+{
+	char prefix[256], path[300];
+	snprintf(prefix, sizeof(prefix), "/tmp/waypipe-session-replay-%s",
+			compression_mode_to_str(rec_mode));
+	snprintf(path, sizeof(path), "%s.%d", prefix, (int)getpid());
+	if (make_recording(prefix, rec_mode) == -1) {
+		return false;
+	}
+
+	struct replay_stats st;
+	bool pass = replay_recording(path, mode, level, 2, &st) == 0;
+	pass = pass && st.nframes == NFRAMES && st.nmismatched == 0 &&
+	       st.nskipped == 1 && st.changed_bytes >= TEST_SIZE &&
+	       st.wire_bytes > 0;
+	printf("Recorded with %s, replayed with %s=%d: %d frames, %" PRIu64
+	       " bytes changed, %" PRIu64 " on wire, %s\n",
+			compression_mode_to_str(rec_mode),
+			compression_mode_to_str(mode), level, st.nframes,
+			st.changed_bytes, st.wire_bytes,
+			pass ? "pass" : "FAIL");
+
+	/* A recording cut short is rejected */
+	if (truncate(path, 4000) == -1 ||
+			replay_recording(path, mode, level, 1, &st) != -1) {
+		wp_error("Truncated recording was not rejected");
+		pass = false;
+	}
+	unlink(path);
+	return pass;
+}
+
+log_handler_func_t log_funcs[2] = {NULL, test_log_handler};
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+
+	bool all_success = true;
+	all_success &= test_replay(COMP_NONE, COMP_NONE, 0);
+#ifdef HAS_LZ4
+	all_success &= test_replay(COMP_LZ4, COMP_NONE, 0);
+	all_success &= test_replay(COMP_NONE, COMP_LZ4, 1);
+#endif
+#ifdef HAS_ZSTD
+	all_success &= test_replay(COMP_NONE, COMP_ZSTD, 5);
+#endif
+	return all_success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
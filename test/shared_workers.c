@@ -0,0 +1,211 @@
+/*
+ * Copyright © 2019 Manuel Stoeckl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "common.h"
+#include "shadow.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#define TEST_SIZE (1 << 20)
+#define NCONNECTIONS 3
+#define NROUNDS 20
+
+struct connection {
+	struct worker_group *group;
+	enum compression_mode mode;
+	int level;
+	uint32_t seed;
+	/* Compression tasks which the shared workers ran for the connection */
+	int ntasks;
+	bool pass;
+};
+
+/* Wait, without helping, for the shared workers to run all of the tasks
+ * that were started */
+static bool wait_for_workers(struct thread_pool *pool)
+{
+	while (atomic_load(&pool->tasks_queued) > 0 ||
+			atomic_load(&pool->tasks_in_progress) > 0) {
+		struct pollfd pfd = {.fd = pool->selfpipe_r, .events = POLLIN};
+		if (poll(&pfd, 1, 5000) <= 0) {
+			wp_error("Shared workers did not run the tasks");
+			return false;
+		}
+		char tmp[64];
+		while (read(pool->selfpipe_r, tmp, sizeof(tmp)) > 0) {
+		}
+	}
+	return true;
+}
+
+static void *run_connection(void *arg)
+{
+	struct connection *c = arg;
+	c->pass = false;
+
+	struct fd_translation_map src_map, dst_map;
+	setup_translation_map(&src_map, false);
+	setup_translation_map(&dst_map, true);
+	struct thread_pool src_pool, dst_pool;
+	if (setup_thread_pool(&src_pool, c->mode, c->level, 1) == -1 ||
+			setup_thread_pool(&dst_pool, c->mode, c->level, 1) ==
+					-1) {
+		return NULL;
+	}
+	if (join_worker_group(&src_pool, c->group) == -1 ||
+			join_worker_group(&dst_pool, c->group) == -1) {
+		goto cleanup_pools;
+	}
+	int fd = create_anon_file();
+	if (fd == -1 || ftruncate(fd, TEST_SIZE) == -1) {
+		wp_error("Failed to create test file: %s", strerror(errno));
+		goto cleanup_pools;
+	}
+	char *data = mmap(NULL, TEST_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fd, 0);
+	if (data == MAP_FAILED) {
+		checked_close(fd);
+		goto cleanup_pools;
+	}
+	struct shadow_fd *sfd = translate_fd(&src_map, NULL, &src_pool, fd,
+			FDC_FILE, TEST_SIZE, NULL, false);
+	if (!sfd) {
+		munmap(data, TEST_SIZE);
+		goto cleanup_pools;
+	}
+
+	bool pass = true;
+	uint32_t seed = c->seed;
+	struct transfer_queue transfers;
+	memset(&transfers, 0, sizeof(transfers));
+	for (int r = 0; r < NROUNDS && pass; r++) {
+		/* Change a different span of the file each round */
+		seed = seed * 1103515245u + 12345u;
+		size_t start = (seed >> 8) % TEST_SIZE;
+		size_t end = r == 0 ? TEST_SIZE
+				    : start + (TEST_SIZE - start) / 4 + 1;
+		for (size_t i = r == 0 ? 0 : start; i < end; i++) {
+			data[i] = (char)(seed + i * 31);
+		}
+
+		sfd->is_dirty = true;
+		damage_everything(&sfd->damage);
+		collect_update(&src_pool, sfd, &transfers, false);
+		c->ntasks += start_parallel_work(
+				&src_pool, &transfers.async_recv_queue);
+		pass &= wait_for_workers(&src_pool);
+		finish_update(sfd);
+		transfer_load_async(&transfers);
+
+		if (deliver_updates(&dst_map, &dst_pool, &transfers, NULL) ==
+				-1) {
+			pass = false;
+		}
+		struct shadow_fd *dst = get_shadow_for_rid(
+				&dst_map, sfd->remote_id);
+		if (!dst || memcmp(dst->mem_local, data, TEST_SIZE) != 0) {
+			wp_error("Copy does not match after round %d", r);
+			pass = false;
+		}
+	}
+	c->pass = pass;
+	cleanup_transfer_queue(&transfers);
+	munmap(data, TEST_SIZE);
+
+cleanup_pools:
+	cleanup_translation_map(&src_map);
+	cleanup_translation_map(&dst_map);
+	cleanup_thread_pool(&src_pool);
+	cleanup_thread_pool(&dst_pool);
+	return NULL;
+}
+
+static bool test_shared_workers(enum compression_mode mode, int level)
+{
+	struct worker_group group;
+	if (setup_worker_group(&group, mode, 4) == -1) {
+		return false;
+	}
+	struct connection conns[NCONNECTIONS];
+	pthread_t threads[NCONNECTIONS];
+	bool pass = group.nworkers == 3;
+	for (int i = 0; i < NCONNECTIONS; i++) {
+		conns[i] = (struct connection){.group = &group,
+				.mode = mode,
+				.level = level,
+				.seed = (uint32_t)i + 1,
+				.ntasks = 0,
+				.pass = false};
+		if (pthread_create(&threads[i], NULL, run_connection,
+				    &conns[i]) != 0) {
+			wp_error("Failed to create thread");
+			return false;
+		}
+	}
+	int ntasks = 0;
+	for (int i = 0; i < NCONNECTIONS; i++) {
+		pthread_join(threads[i], NULL);
+		pass &= conns[i].pass && conns[i].ntasks > 0;
+		ntasks += conns[i].ntasks;
+	}
+	/* No connection ran its own compression tasks */
+	uint64_t nrun = 0;
+	for (int i = 0; i < group.nworkers; i++) {
+		nrun += group.threads[i].tasks_run;
+	}
+	pass &= group.npools == 0 && nrun >= (uint64_t)ntasks;
+	printf("Shared workers with %s=%d: %d compression tasks, %" PRIu64
+	       " run by workers, %s\n",
+			compression_mode_to_str(mode), level, ntasks, nrun,
+			pass ? "pass" : "FAIL");
+	cleanup_worker_group(&group);
+	return pass;
+}
+
+log_handler_func_t log_funcs[2] = {NULL, test_atomic_log_handler};
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+
+	bool all_success = true;
+	all_success &= test_shared_workers(COMP_NONE, 0);
+#ifdef HAS_LZ4
+	all_success &= test_shared_workers(COMP_LZ4, 1);
+#endif
+#ifdef HAS_ZSTD
+	all_success &= test_shared_workers(COMP_ZSTD, 5);
+#endif
+	printf("%s\n", all_success ? "pass" : "FAIL");
+	return all_success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
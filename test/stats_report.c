@@ -0,0 +1,153 @@
+/*
+ * Copyright © 2019 Manuel Stoeckl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "common.h"
+#include "main.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Make the next stats_report call produce a report */
+static void end_period(struct wp_stats *stats)
+{
+	stats->period_start_ns -= 2000000000uLL;
+}
+
+log_handler_func_t log_funcs[2] = {NULL, test_log_handler};
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+
+	char path[] = "/tmp/waypipe-stats-XXXXXX";
+	int tmp_fd = mkstemp(path);
+	if (tmp_fd == -1) {
+		wp_error("Failed to create temporary file: %s",
+				strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	struct thread_pool pool;
+	if (setup_thread_pool(&pool, COMP_NONE, 0, 1) == -1) {
+		return EXIT_FAILURE;
+	}
+	struct wp_stats stats;
+	if (setup_stats(&stats, &pool, path, false) == -1) {
+		return EXIT_FAILURE;
+	}
+	bool pass = true;
+	if (stats_report(&stats, &pool) <= 0) {
+		wp_error("Report made before the period ended");
+		pass = false;
+	}
+
+	/* Two surfaces, with commits sent in messages 3 and 5; only the
+	 * first three commits are acknowledged */
+	stats_note_commit(&stats, 7);
+	stats_note_commit(&stats, 9);
+	stats_note_commits_queued(&stats, 3);
+	stats_note_commit(&stats, 7);
+	stats_note_commits_queued(&stats, 5);
+	stats_note_commit(&stats, 7);
+	stats_note_ack(&stats, 2);
+	stats_note_ack(&stats, 5);
+	stats_note_ack(&stats, 10);
+	if (stats.npending != 1) {
+		wp_error("Expected 1 pending commit, not %d", stats.npending);
+		pass = false;
+	}
+	atomic_store(&pool.stats.comp_in_bytes, 1000);
+	atomic_store(&pool.stats.comp_out_bytes, 250);
+	atomic_store(&pool.stats.warped_updates, 3);
+	atomic_store(&pool.stats.readback_bytes, 4096);
+	/* Two of three blocks written, and a part of the third */
+	struct transfer_queue td = {0};
+	char data[300] = {0};
+	for (int i = 0; i < 3; i++) {
+		if (transfer_add(&td, 100, data + 100 * i) == -1) {
+			return EXIT_FAILURE;
+		}
+		td.meta[i].static_alloc = true;
+	}
+	td.start = 2;
+	td.partial_write_amt = 30;
+	stats_note_retained(&stats, &td);
+	stats.standalone_acks = 2;
+	stats.ack_rtt_ns = 1500000;
+	end_period(&stats);
+	(void)stats_report(&stats, &pool);
+	/* Counters are reset after each report */
+	end_period(&stats);
+	(void)stats_report(&stats, &pool);
+
+	char buf[4096];
+	ssize_t len = pread(tmp_fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0) {
+		wp_error("Failed to read back report");
+		pass = false;
+		len = 0;
+	}
+	buf[len] = '\0';
+	char *second = strchr(buf, '\n');
+	if (!second || strchr(second + 1, '\n') != buf + len - 1) {
+		wp_error("Expected two lines, got: %s", buf);
+		pass = false;
+	} else {
+		*second++ = '\0';
+		const char *expected[] = {"\"side\":\"application\"",
+				"\"comp_in_bytes\":1000,\"comp_out_bytes\":250",
+				"\"warped_updates\":3,\"readback_bytes\":4096,",
+				"\"max_retained_bytes\":230,"
+				"\"standalone_acks\":2,\"ack_rtt_us\":1500,",
+				"{\"id\":7,\"commits\":2,",
+				"{\"id\":9,\"commits\":1,", NULL};
+		for (int i = 0; expected[i]; i++) {
+			if (!strstr(buf, expected[i])) {
+				wp_error("Missing '%s' in: %s", expected[i],
+						buf);
+				pass = false;
+			}
+		}
+		if (!strstr(second, "\"comp_in_bytes\":0,") ||
+				!strstr(second, "\"readback_bytes\":0,") ||
+				!strstr(second, "\"max_retained_bytes\":0,") ||
+				!strstr(second, "\"surfaces\":[]}")) {
+			wp_error("Counters not reset: %s", second);
+			pass = false;
+		}
+	}
+	printf("%s", pass ? "pass\n" : "FAIL\n");
+
+	cleanup_transfer_queue(&td);
+	cleanup_stats(&stats);
+	cleanup_thread_pool(&pool);
+	checked_close(tmp_fd);
+	unlink(path);
+	return pass ? EXIT_SUCCESS : EXIT_FAILURE;
+}
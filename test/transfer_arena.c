@@ -0,0 +1,248 @@
+/*
+ * Copyright © 2019 Manuel Stoeckl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "common.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NFRAMES 200
+#define FRAME_BLOCKS 12
+/* Blocks acknowledged this many frames after they were queued */
+#define ACK_DELAY 3
+
+static size_t block_size(int frame, int k)
+{
+	/* A mix of protocol-message-sized and buffer-update-sized blocks */
+	if (k % 4 == 0) {
+		return (size_t)(16 + (frame * 7 + k) % 300);
+	}
+	return (size_t)(1000 + (frame * 7919 + k * 104729) % 150000);
+}
+
+static void fill_block(uint8_t *block, size_t size, int frame, int k)
+{
+	for (size_t i = 0; i < size; i++) {
+		block[i] = (uint8_t)(frame * 31 + k * 7 + (int)i);
+	}
+}
+
+static bool check_block(const uint8_t *block, size_t size, int frame, int k)
+{
+	for (size_t i = 0; i < size; i++) {
+		if (block[i] != (uint8_t)(frame * 31 + k * 7 + (int)i)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Allocate blocks as for a stream of frames, freeing each frame's blocks a
+ * few frames later, and check that blocks do not overlap and that chunks are
+ * reused instead of allocating new ones */
+static bool test_steady_state(void)
+{
+	struct transfer_arena *arena = create_transfer_arena();
+	if (!arena) {
+		return false;
+	}
+	uint8_t *blocks[ACK_DELAY + 1][FRAME_BLOCKS];
+	memset(blocks, 0, sizeof(blocks));
+	bool pass = true;
+	int warm_chunks = 0;
+	for (int f = 0; f < NFRAMES + ACK_DELAY; f++) {
+		int old = f - ACK_DELAY;
+		uint8_t **done = blocks[(f + 1) % (ACK_DELAY + 1)];
+		for (int k = 0; old >= 0 && k < FRAME_BLOCKS; k++) {
+			if (!check_block(done[k], block_size(old, k), old, k)) {
+				wp_error("Block %d of frame %d was overwritten",
+						k, old);
+				pass = false;
+			}
+			arena_free(done[k]);
+			done[k] = NULL;
+		}
+		if (f >= NFRAMES) {
+			continue;
+		}
+		uint8_t **cur = blocks[f % (ACK_DELAY + 1)];
+		for (int k = 0; k < FRAME_BLOCKS; k++) {
+			size_t sz = block_size(f, k);
+			cur[k] = arena_alloc(arena, sz);
+			if (!cur[k] || ((uintptr_t)cur[k] % 16) != 0) {
+				wp_error("Bad allocation");
+				pass = false;
+				goto end;
+			}
+			fill_block(cur[k], sz, f, k);
+		}
+		if (f == NFRAMES / 4) {
+			warm_chunks = arena->chunks_made;
+		}
+	}
+	printf("Made %d chunks for %d frames, %d after warmup\n",
+			arena->chunks_made, NFRAMES, warm_chunks);
+	if (arena->chunks_made != warm_chunks) {
+		wp_error("Chunks were not reused");
+		pass = false;
+	}
+end:
+	for (int i = 0; i <= ACK_DELAY; i++) {
+		for (int k = 0; k < FRAME_BLOCKS; k++) {
+			arena_free(blocks[i][k]);
+		}
+	}
+	release_transfer_arena(arena);
+	return pass;
+}
+
+/* Shrinking the last block makes room for the next one, and large blocks
+ * get a chunk of their own */
+static bool test_shrink(void)
+{
+	struct transfer_arena *arena = create_transfer_arena();
+	if (!arena) {
+		return false;
+	}
+	bool pass = true;
+	char *a = arena_alloc(arena, 100000);
+	arena_shrink(arena, a, 1008);
+	char *b = arena_alloc(arena, 64);
+	/* Not the last block, so this must not change anything */
+	arena_shrink(arena, a, 10);
+	char *c = arena_alloc(arena, 64);
+	char *big = arena_alloc(arena, (size_t)3 << 20);
+	if (!a || !b || !c || !big || b - a != 1008 + 16 || c - b != 64 + 16) {
+		wp_error("Unexpected block placement");
+		pass = false;
+	}
+	if (big) {
+		memset(big, 1, (size_t)3 << 20);
+	}
+	printf("Shrink: %s\n", pass ? "pass" : "FAIL");
+	arena_free(a);
+	arena_free(b);
+	/* The arena is only freed once the last blocks are */
+	release_transfer_arena(arena);
+	arena_free(big);
+	arena_free(c);
+	return pass;
+}
+
+struct producer {
+	pthread_t thread;
+	struct thread_msg_recv_buf *queue;
+	int nmsgs;
+};
+
+static void *run_producer(void *arg)
+{
+	struct producer *p = arg;
+	struct transfer_arena *arena = create_transfer_arena();
+	if (!arena) {
+		return NULL;
+	}
+	for (int i = 0; i < p->nmsgs; i++) {
+		size_t sz = block_size(i, 1);
+		uint8_t *msg = arena_alloc(arena, sz);
+		if (!msg) {
+			wp_error("Failed to allocate message");
+			continue;
+		}
+		fill_block(msg, sz, i, 1);
+		transfer_async_add(p->queue, msg, sz, true);
+	}
+	/* The main thread may still be using some of the blocks */
+	release_transfer_arena(arena);
+	return NULL;
+}
+
+/* Blocks made on a worker thread are freed by the queue on the main thread,
+ * partly after the worker has stopped */
+static bool test_cross_thread(void)
+{
+	const int nmsgs = 2000;
+	struct transfer_queue td;
+	memset(&td, 0, sizeof(td));
+	if (transfer_async_prepare(&td.async_recv_queue, nmsgs) == -1) {
+		return false;
+	}
+	struct producer p = {.queue = &td.async_recv_queue, .nmsgs = nmsgs};
+	if (pthread_create(&p.thread, NULL, run_producer, &p) != 0) {
+		cleanup_transfer_queue(&td);
+		return false;
+	}
+	bool pass = true;
+	int nchecked = 0;
+	while (nchecked < nmsgs) {
+		if (transfer_load_async(&td) == -1) {
+			pass = false;
+			break;
+		}
+		for (int i = nchecked; i < td.end; i++) {
+			if (!td.meta[i].arena_alloc ||
+					!check_block(td.vecs[i].iov_base,
+							td.vecs[i].iov_len, i, 1)) {
+				wp_error("Message %d is corrupt", i);
+				pass = false;
+			}
+			/* As when acknowledged */
+			if (i % 2 == 0) {
+				transfer_block_free(&td, i);
+				td.vecs[i].iov_base = NULL;
+				td.meta[i].static_alloc = true;
+			}
+		}
+		nchecked = td.end;
+	}
+	pthread_join(p.thread, NULL);
+
+	/* Messages from the main thread use the queue's own arena */
+	void *msg = transfer_block_alloc(&td, 64);
+	if (!msg || transfer_add_arena(&td, 64, msg) == -1 ||
+			!td.meta[td.end - 1].arena_alloc) {
+		wp_error("Failed to queue message from main thread");
+		pass = false;
+	}
+	cleanup_transfer_queue(&td);
+	printf("Cross thread: %s\n", pass ? "pass" : "FAIL");
+	return pass;
+}
+
+log_handler_func_t log_funcs[2] = {NULL, test_log_handler};
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+
+	bool all_success = true;
+	all_success &= test_steady_state();
+	all_success &= test_shrink();
+	all_success &= test_cross_thread();
+	printf("%s\n", all_success ? "pass" : "FAIL");
+	return all_success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
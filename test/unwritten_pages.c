@@ -0,0 +1,195 @@
+/*
+ * Copyright © 2019 Manuel Stoeckl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "common.h"
+#include "shadow.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#define TEST_PAGE 4096
+#define TEST_PAGES 64
+#define TEST_SIZE (TEST_PAGES * TEST_PAGE)
+
+static void fill_page(char *data, int page, uint32_t seed)
+{
+	for (size_t i = 0; i < TEST_PAGE; i++) {
+		seed = seed * 1103515245u + 12345u;
+		data[(size_t)page * TEST_PAGE + i] = (char)(seed >> 16);
+	}
+}
+
+/* Count the pages of the file which are not holes, or return -1 if the file
+ * system cannot report holes */
+static int count_written_pages(int file)
+{
+	/* Leave the file offset of `file` as it is */
+	int fd = reopen_file(file);
+	if (fd == -1) {
+		return -1;
+	}
+	int nholes = 0;
+	size_t pos = 0;
+	while (pos < TEST_SIZE) {
+		size_t start, end;
+		int r = find_file_hole(fd, pos, TEST_SIZE, &start, &end);
+		if (r == -1) {
+			nholes = -1;
+			break;
+		} else if (r == 0) {
+			break;
+		}
+		nholes += (int)((end - start) / TEST_PAGE);
+		pos = end;
+	}
+	checked_close(fd);
+	return nholes == -1 ? -1 : TEST_PAGES - nholes;
+}
+
+/* Send the damaged parts of the file, and check that the copy matches. The
+ * file is read with pread, which does not fill in holes. */
+static bool transfer(struct fd_translation_map *src_map,
+		struct fd_translation_map *dst_map, struct thread_pool *pool,
+		int fd, int rid)
+{
+	struct transfer_queue transfers;
+	memset(&transfers, 0, sizeof(transfers));
+
+	struct shadow_fd *src = get_shadow_for_rid(src_map, rid);
+	src->is_dirty = true;
+	damage_everything(&src->damage);
+	collect_sfd_update(pool, src, &transfers);
+	bool pass = deliver_updates(dst_map, pool, &transfers, NULL) == 0;
+
+	char *contents = malloc(TEST_SIZE);
+	struct shadow_fd *dst = get_shadow_for_rid(dst_map, rid);
+	if (!contents || pread(fd, contents, TEST_SIZE, 0) != TEST_SIZE) {
+		wp_error("Failed to read test file");
+		pass = false;
+	} else if (!dst || memcmp(dst->mem_local, contents, TEST_SIZE) != 0 ||
+			memcmp(src->mem_mirror, contents, TEST_SIZE) != 0) {
+		wp_error("Copy of RID=%d does not match", rid);
+		pass = false;
+	}
+	free(contents);
+	return pass;
+}
+
+log_handler_func_t log_funcs[2] = {NULL, test_log_handler};
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+
+	struct fd_translation_map src_map, dst_map;
+	setup_translation_map(&src_map, false);
+	setup_translation_map(&dst_map, true);
+	struct thread_pool src_pool, dst_pool;
+	if (setup_thread_pool(&src_pool, COMP_NONE, 0, 1) == -1 ||
+			setup_thread_pool(&dst_pool, COMP_NONE, 0, 1) == -1) {
+		return EXIT_FAILURE;
+	}
+
+	int fd = create_anon_file();
+	if (fd == -1 || ftruncate(fd, TEST_SIZE) == -1) {
+		wp_error("Failed to create test file: %s", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if (count_written_pages(fd) == -1) {
+		printf("Holes in files cannot be detected, skipping\n");
+		return EXIT_SUCCESS;
+	}
+	char *data = mmap(NULL, TEST_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fd, 0);
+	if (data == MAP_FAILED) {
+		return EXIT_FAILURE;
+	}
+	struct shadow_fd *sfd = translate_fd(&src_map, NULL, NULL, fd, FDC_FILE,
+			TEST_SIZE, NULL, false);
+	if (!sfd) {
+		return EXIT_FAILURE;
+	}
+	/* As for a wl_shm_pool */
+	sfd->has_owner = true;
+	int rid = sfd->remote_id;
+
+	/* The program which sent the fd may be using its file offset */
+	bool pass = lseek(fd, 12345, SEEK_SET) == 12345;
+	fill_page(data, 3, 1);
+	fill_page(data, 40, 2);
+	bool ok = transfer(&src_map, &dst_map, &src_pool, fd, rid);
+	int written = count_written_pages(fd);
+	printf("Initial send: %d pages written, %s\n", written,
+			ok ? "matches" : "MISMATCH");
+	pass &= ok && written == 2;
+
+	fill_page(data, 10, 3);
+	data[TEST_SIZE - 1] = 1;
+	ok = transfer(&src_map, &dst_map, &src_pool, fd, rid);
+	written = count_written_pages(fd);
+	printf("New pages: %d pages written, %s\n", written,
+			ok ? "matches" : "MISMATCH");
+	pass &= ok && written == 4;
+
+	/* A page which becomes a hole again must be sent as zeros; reading
+	 * it to diff it fills the hole */
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			    3 * TEST_PAGE, TEST_PAGE) == 0) {
+		ok = transfer(&src_map, &dst_map, &src_pool, fd, rid);
+		printf("Punched hole: %s\n", ok ? "matches" : "MISMATCH");
+		pass &= ok;
+	}
+
+	ok = transfer(&src_map, &dst_map, &src_pool, fd, rid);
+	printf("Unchanged: %s\n", ok ? "matches" : "MISMATCH");
+	pass &= ok;
+
+	bool kept = lseek(fd, 0, SEEK_CUR) == 12345;
+	if (sfd->holes_fd >= 0) {
+		/* Holes are found with a separate file offset */
+		kept &= lseek(sfd->holes_fd, 777, SEEK_SET) == 777 &&
+			lseek(fd, 0, SEEK_CUR) == 12345;
+	}
+	printf("File offset: %s\n", kept ? "kept" : "MOVED");
+	pass &= kept;
+
+	munmap(data, TEST_SIZE);
+	cleanup_translation_map(&src_map);
+	cleanup_translation_map(&dst_map);
+	cleanup_thread_pool(&src_pool);
+	cleanup_thread_pool(&dst_pool);
+	printf("%s\n", pass ? "pass" : "FAIL");
+	return pass ? EXIT_SUCCESS : EXIT_FAILURE;
+}
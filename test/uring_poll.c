@@ -0,0 +1,221 @@
+/*
+ * Copyright © 2019 Manuel Stoeckl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "common.h"
+#include "main.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NPIPES 6
+
+struct test_pipe {
+	int fds[2];
+	short events[2];
+};
+
+static int open_test_pipe(struct test_pipe *p)
+{
+	if (pipe(p->fds) == -1) {
+		wp_error("Failed to create pipe: %s", strerror(errno));
+		return -1;
+	}
+	if (set_nonblocking(p->fds[0]) == -1 ||
+			set_nonblocking(p->fds[1]) == -1) {
+		wp_error("Failed to make pipe nonblocking");
+		return -1;
+	}
+	p->events[0] = POLLIN;
+	p->events[1] = 0;
+	return 0;
+}
+
+static void fill_pfds(struct pollfd *pfds, const struct test_pipe *pipes)
+{
+	for (int i = 0; i < NPIPES; i++) {
+		for (int k = 0; k < 2; k++) {
+			pfds[2 * i + k].fd = pipes[i].fds[k];
+			pfds[2 * i + k].events = pipes[i].events[k];
+			pfds[2 * i + k].revents = 0;
+		}
+	}
+}
+
+/* Apply a random sequence of operations to a set of pipes, and check that
+ * after each step uring_poll reports the same results as poll */
+static bool test_against_poll(struct uring_poller *poller)
+{
+	struct test_pipe pipes[NPIPES];
+	for (int i = 0; i < NPIPES; i++) {
+		if (open_test_pipe(&pipes[i]) == -1) {
+			return false;
+		}
+	}
+	struct pollfd ref[2 * NPIPES], test[2 * NPIPES];
+	char buf[4096];
+	memset(buf, 0x5a, sizeof(buf));
+
+	bool pass = true;
+	uint32_t seed = 1;
+	for (int step = 0; step < 5000 && pass; step++) {
+		seed = seed * 1103515245u + 12345u;
+		uint32_t r = seed >> 8;
+		struct test_pipe *p = &pipes[r % NPIPES];
+		bool reset = false;
+		switch ((r / NPIPES) % 8) {
+		case 0:
+		case 1:
+			(void)write(p->fds[1], buf, 1 + (r >> 16) % 64);
+			break;
+		case 2:
+			/* Fill the pipe, so that it is no longer writable */
+			while (write(p->fds[1], buf, sizeof(buf)) > 0) {
+			}
+			break;
+		case 3:
+		case 4:
+			(void)read(p->fds[0], buf, 1 + (r >> 16) % 8192);
+			break;
+		case 5:
+			p->events[0] = (r >> 16) & 1 ? POLLIN : 0;
+			p->events[1] = (r >> 17) & 1 ? POLLOUT : 0;
+			break;
+		case 6:
+			/* Close the write end, to produce POLLHUP */
+			if (p->fds[1] != -1) {
+				checked_close(p->fds[1]);
+				p->fds[1] = -1;
+				reset = true;
+			}
+			break;
+		case 7:
+			/* Replace the pipe; the new fds may reuse the old
+			 * numbers */
+			checked_close(p->fds[0]);
+			if (p->fds[1] != -1) {
+				checked_close(p->fds[1]);
+			}
+			if (open_test_pipe(p) == -1) {
+				return false;
+			}
+			reset = true;
+			break;
+		}
+
+		/* Poll requests hold references to closed fds' files until the
+		 * reset cancels them, so uring_poll must be called first */
+		fill_pfds(test, pipes);
+		int ntest = uring_poll(poller, test, 2 * NPIPES, 0, reset);
+		fill_pfds(ref, pipes);
+		int nref = poll(ref, 2 * NPIPES, 0);
+		if (nref != ntest) {
+			wp_error("Step %d: poll returned %d, uring_poll %d", step,
+					nref, ntest);
+			pass = false;
+		}
+		for (int i = 0; i < 2 * NPIPES; i++) {
+			if (ref[i].revents != test[i].revents) {
+				wp_error("Step %d: fd %d: poll revents %x, uring_poll %x",
+						step, ref[i].fd, ref[i].revents,
+						test[i].revents);
+				pass = false;
+			}
+		}
+	}
+	for (int i = 0; i < NPIPES; i++) {
+		checked_close(pipes[i].fds[0]);
+		if (pipes[i].fds[1] != -1) {
+			checked_close(pipes[i].fds[1]);
+		}
+	}
+	return pass;
+}
+
+static double elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)(now.tv_sec - start->tv_sec) * 1e3 +
+	       (double)(now.tv_nsec - start->tv_nsec) * 1e-6;
+}
+
+/* Check that the timeout is respected, and that a wait ends when an fd
+ * becomes ready */
+static bool test_timeout(struct uring_poller *poller)
+{
+	int fds[2];
+	if (pipe(fds) == -1) {
+		return false;
+	}
+	bool pass = true;
+	struct pollfd pfd = {.fd = fds[0], .events = POLLIN, .revents = 0};
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int n = uring_poll(poller, &pfd, 1, 50, true);
+	double t = elapsed_ms(&start);
+	if (n != 0 || t < 45.0) {
+		wp_error("Timed wait returned %d after %f ms", n, t);
+		pass = false;
+	}
+	(void)write(fds[1], "x", 1);
+	n = uring_poll(poller, &pfd, 1, -1, false);
+	if (n != 1 || pfd.revents != POLLIN) {
+		wp_error("Unbounded wait returned %d, revents %x", n,
+				pfd.revents);
+		pass = false;
+	}
+	checked_close(fds[0]);
+	checked_close(fds[1]);
+	return pass;
+}
+
+log_handler_func_t log_funcs[2] = {NULL, test_log_handler};
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+
+	struct uring_poller *poller = create_uring_poller();
+	if (!poller) {
+		printf("io_uring is not available (%s), skipping\n",
+				strerror(errno));
+		return EXIT_SUCCESS;
+	}
+	bool all_success = true;
+	bool pass = test_against_poll(poller);
+	printf("matches poll, %s\n", pass ? "pass" : "FAIL");
+	all_success &= pass;
+	pass = test_timeout(poller);
+	printf("timeouts, %s\n", pass ? "pass" : "FAIL");
+	all_success &= pass;
+	destroy_uring_poller(poller);
+
+	return all_success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
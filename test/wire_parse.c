@@ -89,6 +89,14 @@ void do_ytype_evt_red(struct context *ctx, struct wp_object *a, int32_t b,
 			strcmp(buf, "0 33330 8881 0 33331 33332 0 33333 44440 bcaba 8882 3 80|80|80 99990 (null) 992 8883 991") !=
 			0;
 }
+void do_ztype_req_orange(struct context *ctx, uint32_t a, struct wp_object *b,
+		int c, int32_t d)
+{
+	char buf[256];
+	sprintf(buf, "%u %u %d %d", a, b ? b->obj_id : 0, c, d);
+	printf("%s\n", buf);
+	ctx->drop_this_msg = strcmp(buf, "5551 0 7771 6661") != 0;
+}
 
 struct wire_test {
 	const struct wp_interface *intf;
@@ -112,6 +120,90 @@ static inline uint32_t pack_u32(uint8_t a0, uint8_t a1, uint8_t a2, uint8_t a3)
 	return u.v;
 }
 
+/* The precomputed message layouts should match the gap codes */
+static bool check_layout(const struct wp_interface *intf)
+{
+	bool pass = true;
+	for (int m = 0; m < intf->nreq + intf->nevt; m++) {
+		const struct msg_data *data = &intf->msgs[m];
+		int nwords = 0, nobjs = 0, id_pos = -1;
+		bool fixed = true;
+		for (const uint16_t *gaps = data->gaps;; gaps++) {
+			nwords += *gaps >> 2;
+			if ((*gaps & 0x3) == GAP_CODE_OBJ) {
+				if (fixed) {
+					id_pos = nwords - 1;
+				}
+				nobjs++;
+			} else if ((*gaps & 0x3) != GAP_CODE_END) {
+				fixed = false;
+			} else {
+				break;
+			}
+		}
+		int exp_fixed = fixed ? nwords : -1;
+		int exp_pos = nobjs == 1 ? id_pos : -1;
+		if (data->fixed_words != exp_fixed ||
+				data->new_id_pos != exp_pos) {
+			wp_error("Layout of %s.%s is (%d, %d), expected (%d, %d)",
+					intf->name,
+					get_nth_packed_string(intf->msg_names, m),
+					data->fixed_words, data->new_id_pos,
+					exp_fixed, exp_pos);
+			pass = false;
+		}
+	}
+	return pass;
+}
+
+/* Objects should be found by id whether they are in the flat tables or in
+ * the fallback tree */
+static bool test_object_table(void)
+{
+	const uint32_t ids[] = {2, 3, 255, 256, 257, 70000, 0xff000000,
+			0xff000001, 0xff0001ff, 0x00900000, 0xfe000000,
+			0xffffffff};
+	const int nids = (int)(sizeof(ids) / sizeof(ids[0]));
+	struct wp_object objs[sizeof(ids) / sizeof(ids[0])];
+	struct wp_object others[sizeof(ids) / sizeof(ids[0])];
+	struct message_tracker mt;
+	if (init_message_tracker(&mt) == -1) {
+		return false;
+	}
+	bool pass = true;
+	for (int i = 0; i < nids; i++) {
+		objs[i] = (struct wp_object){.type = &intf_xtype,
+				.obj_id = ids[i]};
+		others[i] = (struct wp_object){.type = &intf_ytype,
+				.obj_id = ids[i]};
+		tracker_insert(&mt, &objs[i]);
+	}
+	for (int i = 0; i < nids; i++) {
+		pass &= tracker_get(&mt, ids[i]) == &objs[i];
+		if (i > 0) {
+			pass &= tracker_get(&mt, ids[i] - 1) ==
+				(ids[i - 1] == ids[i] - 1 ? &objs[i - 1]
+							  : NULL);
+		}
+	}
+	pass &= tracker_get(&mt, 1) && tracker_get(&mt, 1)->obj_id == 1;
+	pass &= tracker_get(&mt, 0) == NULL && tracker_get(&mt, 4) == NULL;
+	for (int i = 0; i < nids; i += 2) {
+		tracker_replace_existing(&mt, &others[i]);
+	}
+	for (int i = 0; i < nids; i++) {
+		pass &= tracker_get(&mt, ids[i]) ==
+			(i % 2 == 0 ? &others[i] : &objs[i]);
+	}
+	for (int i = 0; i < nids; i++) {
+		tracker_remove(&mt, i % 2 == 0 ? &others[i] : &objs[i]);
+		pass &= tracker_get(&mt, ids[i]) == NULL;
+	}
+	cleanup_message_tracker(&mt);
+	printf("Object table lookups: %s\n", pass ? "pass" : "FAIL");
+	return pass;
+}
+
 log_handler_func_t log_funcs[2] = {test_log_handler, test_log_handler};
 int main(int argc, char **argv)
 {
@@ -179,7 +271,8 @@ int main(int argc, char **argv)
 									0x11),
 							99990, 0, yobj.obj_id,
 							xobj.obj_id},
-					3, 17}};
+					3, 17},
+			{&intf_ztype, 0, {7771}, {5551, 993, 6661}, 1, 3}};
 
 	bool all_success = true;
 	for (size_t t = 0; t < sizeof(tests) / sizeof(tests[0]); t++) {
@@ -231,6 +324,10 @@ int main(int argc, char **argv)
 	tracker_remove(&mt, &yobj);
 	cleanup_message_tracker(&mt);
 
+	all_success &= test_object_table();
+	all_success &= check_layout(&intf_xtype) && check_layout(&intf_ytype) &&
+		       check_layout(&intf_ztype);
+
 	printf("Net result: %s\n", all_success ? "pass" : "FAIL");
 	return all_success ? EXIT_SUCCESS : EXIT_FAILURE;
 }